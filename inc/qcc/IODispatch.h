@@ -24,14 +24,20 @@
 
 #include <qcc/platform.h>
 
+#include <qcc/Event.h>
 #include <qcc/Stream.h>
 #include <qcc/Timer.h>
 #include <Status.h>
+#include <deque>
+#include <functional>
 #include <map>
+#include <queue>
+#include <vector>
 namespace qcc {
 
 /* Forward References */
 class IODispatch;
+struct IODispatchEntry;
 
 /* Different types of callbacks possible:
  * IO_READ: A source event has occured indicating that data is available.
@@ -110,34 +116,61 @@ class IOExitListener {
 
 };
 
+/**
+ * An IO Watermark listener is told when the write queue of a stream fills up and drains.
+ */
+class IOWatermarkListener {
+  public:
+    virtual ~IOWatermarkListener() { };
+    /**
+     * Watermark callback for the stream.
+     * @param sink               The stream that this entry is associated with.
+     * @param aboveHighWatermark true - the queued bytes reached the high watermark, further QueueWrite calls will
+     *                                  fail until this is called again.
+     *                           false - the queued bytes drained to the low watermark.
+     */
+    virtual void WatermarkCallback(Sink& sink, bool aboveHighWatermark) = 0;
+};
+
 /**
  * The context that will be passed into the AlarmTriggered callback
  */
 struct CallbackContext {
     Stream* stream;
     CallbackType type;
-    CallbackContext() : stream(NULL), type(IO_INVALID) { }
-    CallbackContext(Stream* stream, CallbackType type) : stream(stream), type(type) { }
+    IODispatchEntry* entry;     /* The dispatch entry that this context is embedded in */
+    CallbackContext() : stream(NULL), type(IO_INVALID), entry(NULL) { }
+    CallbackContext(Stream* stream, CallbackType type, IODispatchEntry* entry) : stream(stream), type(type), entry(entry) { }
 };
 
 
 struct IODispatchEntry {
-    /* Contexts for different callbacks associated with this stream
+    /* The stream this entry is associated with or NULL if the entry is free */
+    Stream* stream;
+
+    /* Contexts for different callbacks associated with this stream.
+     * They are embedded so that an entry is a single allocation and so that the
+     * entry can be found directly from a context handed back by the timer or event set.
      */
-    CallbackContext* readCtxt;
-    CallbackContext* writeCtxt;
-    CallbackContext* readTimeoutCtxt;
-    CallbackContext* writeTimeoutCtxt;
-    CallbackContext* exitCtxt;
+    CallbackContext readCtxt;
+    CallbackContext writeCtxt;
+    CallbackContext readTimeoutCtxt;
+    CallbackContext writeTimeoutCtxt;
+    CallbackContext exitCtxt;
 
     /* Alarms associated with this stream
      * Note: Since the exit alarm is never removed explicitly,
      * it is not a part of this data structure
      */
     Alarm readAlarm;
-    Alarm linkTimeoutAlarm;
     Alarm writeAlarm;
 
+    /* Time (GetTimestamp64) at which a read timeout callback is due or 0 if there is none.
+     * Read timeouts are not timer alarms; the main thread handles them as they come due.
+     */
+    uint64_t readDeadline;
+    uint64_t readDeadlineQueued;    /* Time under which this entry is queued in readDeadlines or 0 if it is not queued */
+
     /* Listeners for this stream */
     IOReadListener* readListener;
     IOWriteListener* writeListener;
@@ -147,22 +180,65 @@ struct IODispatchEntry {
     bool writeEnable;       /* Whether write is currently enabled for this stream */
     bool readInProgress;    /* Whether read is currently in progress for this stream */
     bool writeInProgress;   /* Whether write is currently in progress for this stream */
+    bool readRegistered;    /* Whether the source event is currently registered with the IODispatch event set */
+    bool writeRegistered;   /* Whether the sink event is currently registered with the IODispatch event set */
+    bool inlineCallbacks;   /* Whether read/write callbacks are made directly from the IODispatch main thread */
+    bool readDeferred;      /* Whether a read callback is waiting for the next round because the budget was used up */
+    bool writeDeferred;     /* Whether a write callback is waiting for the next round because the budget was used up */
+
+    /* Budget of this stream per round of the main thread (0 means unlimited) and what has been used of it */
+    uint32_t maxCallbacks;
+    uint32_t maxBytes;
+    uint32_t budgetRound;   /* Round that roundCallbacks and roundBytes were counted in */
+    uint32_t roundCallbacks;
+    uint32_t roundBytes;
+
+    /* Bytes queued with QueueWrite.  The main thread writes them out when the sink is writable */
+    std::deque<std::vector<uint8_t> > writeQueue;
+    size_t writeQueueOffset;                /* Bytes at the front of writeQueue that have already been written */
+    size_t queuedBytes;                     /* Bytes in writeQueue that have not been written yet */
+    size_t highWatermark;                   /* QueueWrite refuses bytes once queuedBytes reaches this, 0 for no limit */
+    size_t lowWatermark;
+    IOWatermarkListener* watermarkListener;
+    bool aboveHighWatermark;                /* Whether queuedBytes has reached highWatermark and not yet drained to lowWatermark */
+    bool watermarkReported;                 /* Value of aboveHighWatermark last passed to the watermark listener */
+    bool watermarkNotifying;                /* Whether a thread is currently calling the watermark listener */
+    QStatus writeQueueStatus;               /* Error that caused the write queue to be discarded or ER_OK */
     StoppingState stopping_state;          /* Whether this stream is in the process of being stopped*/
+    IODispatchEntry* next;                 /* Next entry in the same dispatchEntries bucket, or on the free list if this entry is free */
 
     /**
      * Default Unusable entry
      *
      */
-    IODispatchEntry() : readCtxt(NULL),
-        writeCtxt(NULL),
-        readTimeoutCtxt(NULL),
-        writeTimeoutCtxt(NULL),
-        exitCtxt(NULL),
+    IODispatchEntry() : stream(NULL),
+        readDeadline(0),
+        readDeadlineQueued(0),
         readEnable(false),
         writeEnable(false),
         readInProgress(false),
         writeInProgress(false),
-        stopping_state(IO_RUNNING) { }
+        readRegistered(false),
+        writeRegistered(false),
+        inlineCallbacks(false),
+        readDeferred(false),
+        writeDeferred(false),
+        maxCallbacks(0),
+        maxBytes(0),
+        budgetRound(0),
+        roundCallbacks(0),
+        roundBytes(0),
+        writeQueueOffset(0),
+        queuedBytes(0),
+        highWatermark(0),
+        lowWatermark(0),
+        watermarkListener(NULL),
+        aboveHighWatermark(false),
+        watermarkReported(false),
+        watermarkNotifying(false),
+        writeQueueStatus(ER_OK),
+        stopping_state(IO_RUNNING),
+        next(NULL) { }
 
     /**
      * Constructor
@@ -178,6 +254,9 @@ struct IODispatchEntry {
     IODispatchEntry(Stream* stream, IOReadListener* readListener, IOWriteListener* writeListener, IOExitListener* exitListener,
                     bool readEnable = true, bool writeEnable = true,
                     bool readInProgress = false, bool writeInProgress = false) :
+        stream(stream),
+        readDeadline(0),
+        readDeadlineQueued(0),
         readListener(readListener),
         writeListener(writeListener),
         exitListener(exitListener),
@@ -185,13 +264,43 @@ struct IODispatchEntry {
         writeEnable(writeEnable),
         readInProgress(readInProgress),
         writeInProgress(writeInProgress),
-        stopping_state(IO_RUNNING)
+        readRegistered(false),
+        writeRegistered(false),
+        inlineCallbacks(false),
+        readDeferred(false),
+        writeDeferred(false),
+        maxCallbacks(0),
+        maxBytes(0),
+        budgetRound(0),
+        roundCallbacks(0),
+        roundBytes(0),
+        writeQueueOffset(0),
+        queuedBytes(0),
+        highWatermark(0),
+        lowWatermark(0),
+        watermarkListener(NULL),
+        aboveHighWatermark(false),
+        watermarkReported(false),
+        watermarkNotifying(false),
+        writeQueueStatus(ER_OK),
+        stopping_state(IO_RUNNING),
+        next(NULL)
     { }
 };
 
 class IODispatch : public Thread, public AlarmListener {
   public:
-    IODispatch(const char* name, uint32_t concurrency);
+    /**
+     * Constructor
+     *
+     * @param name          Name used for the timer(s) that make the callbacks.
+     * @param concurrency   Total number of threads available to make callbacks.
+     * @param numReactors   Number of event loop threads. Each stream is serviced by exactly one of
+     *                      them, chosen by hashing the stream or explicitly with StartStream.
+     *                      Each event loop has its own lock, stream table and timer with a share
+     *                      of concurrency.
+     */
+    IODispatch(const char* name, uint32_t concurrency, uint32_t numReactors = 1);
     ~IODispatch();
 
     /**
@@ -228,6 +337,29 @@ class IODispatch : public Thread, public AlarmListener {
      */
     QStatus StartStream(Stream* stream, IOReadListener* readListener, IOWriteListener* writeListener, IOExitListener* exitListener, bool readEnable = true, bool writeEnable = true);
 
+    /**
+     * Start a stream on a specific event loop of this IODispatch.
+     * Streams that share state can be pinned to the same event loop so that their callbacks are
+     * serviced by the same thread.
+     *
+     * @param stream           The stream on which to wait for IO events.
+     * @param readListener     The object to call in case of a read event.
+     * @param writeListener    The object to call in case of a write event.
+     * @param exitListener     The object to call in case of a exit event.
+     * @param readEnable       Whether to enable read for this stream.
+     * @param writeEnable      Whether to enable write for this stream.
+     * @param affinity         Index of the event loop (modulo GetNumReactors()) to service this stream.
+     * @return ER_OK if successful.
+     */
+    QStatus StartStream(Stream* stream, IOReadListener* readListener, IOWriteListener* writeListener, IOExitListener* exitListener, bool readEnable, bool writeEnable, uint32_t affinity);
+
+    /**
+     * Get the number of event loop threads used by this IODispatch.
+     *
+     * @return The number of event loops.
+     */
+    uint32_t GetNumReactors() const { return static_cast<uint32_t>(reactors.size()) + 1; }
+
     /**
      * Stop a stream previously started with this IODispatch.
      * @param stream           The stream on which to wait for IO events.
@@ -249,7 +381,10 @@ class IODispatch : public Thread, public AlarmListener {
      *                         0 indicates no timeout. i.e. read callback will happen
      *                         only when there is a source event.
      *                         non-zero: timeout after which a readCallback must happen
-     *                         in the absence of a source event.
+     *                         in the absence of a source event.  The main thread wakes up
+     *                         for the earliest timeout, so the callback is only late if
+     *                         the callback timer is full, in which case it is retried
+     *                         every 100ms.
      * @return ER_OK if successful.
      */
     QStatus EnableReadCallback(const Source* source, uint32_t timeout = 0);
@@ -289,6 +424,45 @@ class IODispatch : public Thread, public AlarmListener {
      */
     QStatus DisableWriteCallback(const Sink* sink);
 
+    /**
+     * Queue bytes to be written to a sink.
+     * The bytes are copied and written out by the IODispatch main thread once the sink is writable,
+     * gathering everything that is queued for the sink into a single write where the sink supports it.
+     * Bytes that are still queued when the stream is stopped are discarded.
+     * The main thread calls the sink's PushBytesV, so it must not block.  The default
+     * Sink::PushBytesV calls PushBytes once per buffer and only suits sinks whose PushBytes
+     * returns ER_WOULDBLOCK rather than waiting; SocketStream overrides it with a non-blocking
+     * gathered write.
+     *
+     * @param sink      The stream to write to.
+     * @param buf       The bytes to write.
+     * @param numBytes  Number of bytes to write.
+     * @return ER_OK if the bytes were queued.
+     *         ER_WOULDBLOCK if the queue has reached its high watermark.  The watermark listener is
+     *         called once it has drained to the low watermark.
+     *         The error that made a previous write fail, in which case the queued bytes were discarded.
+     */
+    QStatus QueueWrite(Sink* sink, const void* buf, size_t numBytes);
+
+    /**
+     * Limit the number of bytes that can be queued for a sink with QueueWrite.
+     *
+     * @param sink           The stream whose write queue is limited.
+     * @param highWatermark  QueueWrite refuses bytes once this many are queued, 0 for no limit.
+     * @param lowWatermark   Queued bytes at which the watermark listener is told the queue has drained.
+     * @param listener       Listener told when the queue crosses the watermarks or NULL.
+     * @return ER_OK if successful.
+     */
+    QStatus SetWriteWatermarks(const Sink* sink, size_t highWatermark, size_t lowWatermark, IOWatermarkListener* listener);
+
+    /**
+     * Get the number of bytes queued for a sink with QueueWrite that have not been written yet.
+     *
+     * @param sink  The stream to look up.
+     * @return The number of queued bytes, 0 if the stream is not known.
+     */
+    size_t GetQueuedBytes(const Sink* sink);
+
     /**
      * Enable link timeout callbacks to be triggered for a particular source.
      * @param stream           The stream for which callbacks are to be enabled.
@@ -301,6 +475,52 @@ class IODispatch : public Thread, public AlarmListener {
      */
     QStatus EnableTimeoutCallback(const Source* source, uint32_t linkTimeout = 0);
 
+    /**
+     * Make read and write callbacks for a stream directly from the IODispatch main thread
+     * rather than handing each one to the timer.  This avoids an alarm allocation and a thread
+     * switch per callback, but the main thread services no other stream while a callback is
+     * running.  Only use this for listeners whose callbacks never block; in particular they must
+     * not call JoinStream.  Timeout and exit callbacks are always made by the timer.
+     *
+     * @param stream           The stream whose callbacks are to be made inline.
+     * @param inlineCallbacks  true to make callbacks inline, false to make them from the timer.
+     * @return ER_OK if successful.
+     */
+    QStatus SetInlineCallbacks(const Stream* stream, bool inlineCallbacks = true);
+
+    /**
+     * Limit how much of the main thread's attention a stream gets before other streams are serviced.
+     *
+     * Ready streams are serviced in rounds.  A round ends once every stream that became ready during
+     * it has had a callback.  A stream that has used up its budget in the current round is not given
+     * further read or write callbacks until the next round, so a busy stream cannot starve the others.
+     * Callbacks are counted by IODispatch; bytes are counted by the listeners with ChargeBudget.
+     *
+     * @param stream        The stream whose budget is set.
+     * @param maxCallbacks  Read and write callbacks allowed per round or 0 for no limit.
+     * @param maxBytes      Bytes allowed per round or 0 for no limit.
+     * @return ER_OK if successful.
+     */
+    QStatus SetStreamBudget(const Stream* stream, uint32_t maxCallbacks, uint32_t maxBytes);
+
+    /**
+     * Charge bytes transferred by a read or write callback to the budget of its stream.
+     * A callback that moves a lot of data should stop, after re-enabling itself, once this returns false.
+     *
+     * @param stream  The stream that the bytes were read from or written to.
+     * @param bytes   Number of bytes transferred.
+     * @return true if the stream has budget left in the current round.
+     */
+    bool ChargeBudget(const Stream* stream, size_t bytes);
+
+    /**
+     * Get the number of times a stream was held back until the next round, summed over all event loops.
+     *
+     * @param callbackBudgetExhausted  Returns the number of times because of the callback budget.
+     * @param byteBudgetExhausted      Returns the number of times because of the byte budget.
+     */
+    void GetBudgetStats(uint64_t& callbackBudgetExhausted, uint64_t& byteBudgetExhausted);
+
     /**
      * Process a read/write/timeout/exit callback.
      */
@@ -312,17 +532,141 @@ class IODispatch : public Thread, public AlarmListener {
     virtual ThreadReturn STDCALL Run(void* arg);
 
   private:
+    /**
+     * Bring the event set registrations of a stream in line with its entry.
+     * The source event is registered while the stream is running, read is enabled and no read
+     * is in progress; likewise for the sink event.  Must be called with lock held whenever any
+     * of those flags change.
+     *
+     * @param stream  The stream that the entry is associated with.
+     * @param entry   The dispatch entry of the stream.
+     */
+    void UpdateEventSet(Stream* stream, IODispatchEntry& entry);
+
+    /**
+     * Get the event loop that services a stream.
+     * This IODispatch is event loop 0, additional event loops are in reactors.
+     *
+     * @param stream  The stream to look up.
+     * @return The IODispatch whose main thread services the stream.
+     */
+    IODispatch* GetReactor(const Stream* stream);
+
+    /**
+     * Get the event loop a stream hashes to.  This is the loop that services the stream unless
+     * it was started with an explicit affinity, in which case the loop it hashes to keeps a
+     * redirect to the one that services it.
+     *
+     * @param stream  The stream to look up.
+     * @return The IODispatch the stream hashes to.
+     */
+    IODispatch* HashReactor(const Stream* stream);
+
+    /**
+     * Forget the event loop a stream was started on with an explicit affinity, if any.
+     *
+     * @param stream  The stream that has been joined.
+     */
+    void RemoveRedirect(const Stream* stream);
+
+    /**
+     * Take an entry from the entry slabs, growing them if there is no free entry, and add it to
+     * dispatchEntries.  Must be called with lock held and the stream must not have an entry.
+     *
+     * @param entry  Initial contents of the new entry.  Its callback contexts are filled in here.
+     * @return The new entry.  Its address is stable until it is freed.
+     */
+    IODispatchEntry* AllocateEntry(const IODispatchEntry& entry);
+
+    /**
+     * Remove an entry from dispatchEntries and return it to the free list.
+     * Must be called with lock held.
+     *
+     * @param entry  The entry to free.
+     */
+    void FreeEntry(IODispatchEntry* entry);
+
+    /**
+     * Set or clear the read timeout of a stream.  Must be called with lock held.
+     *
+     * @param entry    The dispatch entry of the stream.
+     * @param timeout  Seconds from now until a read timeout callback is due or 0 for none.
+     */
+    void SetReadDeadline(IODispatchEntry& entry, uint32_t timeout);
+
+    /**
+     * Queue an entry to be looked at by SweepReadDeadlines at time due.  Must be called with lock held.
+     *
+     * @param entry  The dispatch entry of the stream.
+     * @param due    Time (GetTimestamp64) at which to look at the entry.
+     */
+    void QueueReadDeadline(IODispatchEntry& entry, uint64_t due);
+
+    /**
+     * Add read timeout alarms for streams whose read deadline has passed.  Only queued deadlines
+     * that have come due are visited.  Called by the main thread with lock held.
+     */
+    void SweepReadDeadlines();
+
+    /**
+     * Count a callback against the budget of a stream.  Must be called with lock held.
+     *
+     * @param entry  The dispatch entry of the stream.
+     * @return true if the callback may be made, false if it must wait for the next round.
+     */
+    bool ChargeCallback(IODispatchEntry& entry);
+
+    /**
+     * Write as much of the write queue of a stream as the sink accepts.  Called by the main thread
+     * with lock held, which is released while writing and while calling the watermark listener.
+     *
+     * @param stream  The stream whose write queue is flushed.
+     * @param entry   The dispatch entry of the stream.
+     * @return true if the queue is empty and the stream is still running.
+     */
+    bool FlushWriteQueue(Stream* stream, IODispatchEntry& entry);
+
+    /**
+     * Tell the watermark listener of a stream about the watermark last crossed unless it already
+     * knows or another thread is telling it.  Called with lock held, which is released during the callback.
+     *
+     * @param stream  The stream whose write queue crossed a watermark.
+     */
+    void NotifyWatermark(Stream* stream);
+
+    /**
+     * Find the entry of a stream.  Must be called with lock held.
+     *
+     * @param stream  The stream to look up.
+     * @return The entry of the stream or NULL if the stream has not been started.
+     */
+    IODispatchEntry* FindEntry(const Stream* stream);
+
     Timer timer;                                /* The timer used to add and process callbacks */
     Mutex lock;                                 /* Lock for mutual exclusion of dispatchEntries */
-    std::map<Stream*, IODispatchEntry> dispatchEntries; /* map holding details of various streams registered with this IODispatch */
-    bool reload;                                /* Flag used for synchronization of various methods with the Run thread */
+    std::vector<IODispatchEntry*> entrySlabs;   /* Arrays of entries.  Entries never move, so the timer and event set can hold their contexts */
+    IODispatchEntry* freeEntries;               /* Entries in entrySlabs that are not in use */
+    std::vector<IODispatchEntry*> dispatchEntries; /* Hash table of the entries of the streams registered with this IODispatch */
+    size_t numEntries;                          /* Number of entries in dispatchEntries */
+    /* Source and sink events the main thread waits on.  Registrations persist across
+     * iterations of the main loop and are updated as streams change state.
+     */
+    EventSet eventSet;
+    std::vector<Stream*> stoppingStreams;       /* Streams waiting for the main thread to add their exit alarm */
+    /* Queued read deadlines, earliest first.  Entries whose deadline moved or was cleared are requeued or skipped lazily */
+    std::priority_queue<std::pair<uint64_t, IODispatchEntry*>, std::vector<std::pair<uint64_t, IODispatchEntry*> >,
+                        std::greater<std::pair<uint64_t, IODispatchEntry*> > > readDeadlines;
+    uint64_t nextDeadlineSweep;                 /* When the main thread next sweeps for expired read deadlines or 0 if none are queued */
+    std::vector<CallbackContext*> deferredContexts; /* Contexts of streams that used up their budget, serviced next round */
+    uint32_t budgetRound;                       /* Current round of the main thread */
+    uint64_t callbackBudgetExhausted;           /* Number of times a stream was deferred because of its callback budget */
+    uint64_t byteBudgetExhausted;               /* Number of times a stream was deferred because of its byte budget */
     bool isRunning;                             /* Whether the run thread is still running. */
     int32_t numAlarmsInProgress;                /* Number of alarms currently in progress. */
-    /* Whether the main loop is in an event wait.
-     * This is used to ensure that a source/sink event is not deleted while the main thread
-     * is waiting on it.
-     */
-    bool crit;
+
+    std::vector<IODispatch*> reactors;          /* Event loops 1..numReactors-1, each with its own lock and stream table */
+    std::map<const Stream*, IODispatch*> redirects; /* Streams hashed to this event loop but started on another one with an explicit affinity, protected by lock */
+    volatile int32_t numRedirects;              /* Size of redirects, read without lock so that routing to a loop with none takes no lock */
 };
 
 
@@ -273,6 +273,21 @@ QStatus RecvWithFds(SocketFd sockfd, void* buf, size_t len, size_t& received, So
  */
 QStatus SendWithFds(SocketFd sockfd, const void* buf, size_t len, size_t& sent, SocketFd* fdList, size_t numFds, uint32_t pid);
 
+/**
+ * Send the contents of a list of buffers on a socket with a single system call where the
+ * platform supports it.  The call does not wait for the socket to become writable.
+ *
+ * @param sockfd    Socket descriptor.
+ * @param iov       Array of buffers to send in order.
+ * @param numIov    Number of entries in iov.
+ * @param sent      [OUT] Number of octets sent.
+ *
+ * @return  ER_OK if some octets were sent
+ *          ER_WOULDBLOCK if the socket cannot accept any data at this time
+ *          ER_OS_ERROR if the send failed
+ */
+QStatus SendV(SocketFd sockfd, const IOVec* iov, size_t numIov, size_t& sent);
+
 /**
  * Set a socket to blocking or not blocking.
  *
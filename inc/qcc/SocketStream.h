@@ -143,6 +143,17 @@ class SocketStream : public Stream {
      */
     QStatus PushBytesAndFds(const void* buf, size_t numBytes, size_t& numSent, SocketFd* fdList, size_t numFds, uint32_t pid = -1);
 
+    /**
+     * Push the contents of a list of buffers into the sink with a single send.
+     * Unlike PushBytes this does not wait for the socket to become writable.
+     *
+     * @param iov       Array of buffers to push in order.
+     * @param numIov    Number of entries in iov.
+     * @param numSent   [OUT] Number of bytes actually consumed by sink.
+     * @return   ER_OK if any bytes were consumed, ER_WOULDBLOCK if the socket cannot accept bytes right now.
+     */
+    QStatus PushBytesV(const IOVec* iov, size_t numIov, size_t& numSent);
+
     /**
      * Get the Event indicating that data is available.
      *
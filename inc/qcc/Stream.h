@@ -147,6 +147,19 @@ class Sink {
      */
     virtual QStatus PushBytesAndFds(const void* buf, size_t numBytes, size_t& numSent, SocketFd* fdList, size_t numFds, uint32_t pid = -1) { return ER_NOT_IMPLEMENTED; }
 
+    /**
+     * Push the contents of a list of buffers into the sink.
+     * Sinks that can gather the buffers into a single write, such as sockets, do so without waiting
+     * for the sink to become writable. The default implementation pushes the buffers one at a time
+     * and blocks wherever PushBytes blocks.
+     *
+     * @param iov       Array of buffers to push in order.
+     * @param numIov    Number of entries in iov.
+     * @param numSent   [OUT] Number of bytes actually consumed by sink.
+     * @return   ER_OK if any bytes were consumed, ER_WOULDBLOCK if the sink cannot accept bytes right now.
+     */
+    virtual QStatus PushBytesV(const IOVec* iov, size_t numIov, size_t& numSent);
+
     /**
      * Get the Event that indicates when data can be pushed to sink.
      *
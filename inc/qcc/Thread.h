@@ -53,6 +53,14 @@ typedef void* ThreadReturn;
  */
 QStatus Sleep(uint32_t ms);
 
+/**
+ * Put current thread to sleep until GetTimeNowNs() reaches a deadline.  The sleep has
+ * sub-millisecond resolution where the platform supports it and is not ended by Thread::Alert().
+ *
+ * @param deadline  Time in nanoseconds, on the time base of GetTimeNowNs(), to sleep until.
+ */
+QStatus SleepUntilNs(uint64_t deadline);
+
 /** @internal */
 class Thread;
 
@@ -1,7 +1,7 @@
 /**
  * @file
  *
- * Simple ThreadPool using Timers and Alarms
+ * Work-stealing ThreadPool
  */
 
 /******************************************************************************
@@ -23,15 +23,19 @@
 #ifndef _QCC_THREADPOOL_H
 #define _QCC_THREADPOOL_H
 
-#include <map>
+#include <deque>
+#include <vector>
 
-#include <qcc/Timer.h>
 #include <qcc/Event.h>
+#include <qcc/Mutex.h>
 #include <qcc/Ptr.h>
+#include <qcc/Thread.h>
+#include <qcc/time.h>
 
 namespace qcc {
 
 class ThreadPool;
+class ThreadPoolWorker;
 
 /**
  * A class in the spirit of the Java Runnable object that is used to define an
@@ -52,19 +56,48 @@ class ThreadPool;
  * the single parameter constructor and explicit call to the destructor of the
  * enclosed type.  Since we need the cast behavior, we use the Ptr intrusive
  * smart pointer class to manage our runnable closures.
+ *
+ * A Runnable may be given a priority and a deadline before it is executed.
+ * The thread pool runs queued Runnables of higher priority before those of
+ * lower priority, and calls Expired() instead of Run() for a Runnable whose
+ * deadline passed before a thread got to it.
+ *
+ * The Ptr that executed a Runnable also serves as the handle to its completion:
+ * Wait() blocks until the thread pool is done with the Runnable, after which
+ * any results the Run() method left in the closure can be read.
  */
-class Runnable : public qcc::RefCountBase, public qcc::AlarmListener {
+class Runnable : public qcc::RefCountBase {
   public:
 
+    /**
+     * Priority classes of Runnables.
+     */
+    enum Priority {
+        PRIORITY_LOW = 0,       /**< Bulk work that only cares about throughput */
+        PRIORITY_NORMAL = 1,    /**< The default */
+        PRIORITY_HIGH = 2       /**< Latency sensitive work such as session setup and key exchange */
+    };
+
+    /**
+     * Where a Runnable is in its life with a thread pool.
+     */
+    enum State {
+        STATE_NEW = 0,          /**< Not accepted by a thread pool (yet) */
+        STATE_QUEUED = 1,       /**< Accepted by a thread pool, waiting for or in Run() */
+        STATE_RUN = 2,          /**< Run() has returned */
+        STATE_EXPIRED = 3,      /**< Expired() was called instead of Run() */
+        STATE_CANCELLED = 4     /**< The thread pool stopped before a thread got to it */
+    };
+
     /**
      * Construct a Runnable object suitable for use by a ThreadPool
      */
-    Runnable() : m_threadpool(NULL) { }
+    Runnable() : m_threadpool(NULL), m_priority(PRIORITY_NORMAL), m_state(STATE_NEW), m_doneEvent(NULL), m_queuedNs(0) { }
 
     /**
      * Destroy a Runnable object.
      */
-    virtual ~Runnable() { m_threadpool = NULL; }
+    virtual ~Runnable() { m_threadpool = NULL; delete m_doneEvent; }
 
     /**
      * This method is called by the ThreadPool when the Runnable object is
@@ -74,28 +107,81 @@ class Runnable : public qcc::RefCountBase, public qcc::AlarmListener {
      */
     virtual void Run(void) { };
 
+    /**
+     * This method is called by the ThreadPool instead of Run() when the
+     * deadline of the Runnable passed before a thread was available to run
+     * it.  The default does nothing, which drops the Runnable.
+     */
+    virtual void Expired(void) { };
+
+    /**
+     * Set the priority of this Runnable.  Must be called before the Runnable
+     * is executed.
+     *
+     * @param priority  The priority class of the Runnable.
+     */
+    void SetPriority(Priority priority) { m_priority = priority; }
+
+    /**
+     * Get the priority of this Runnable.
+     *
+     * @return The priority class of the Runnable.
+     */
+    Priority GetPriority(void) const { return m_priority; }
+
+    /**
+     * Set the time by which this Runnable must have started running.  Must be
+     * called before the Runnable is executed.
+     *
+     * @param deadline  Absolute time as returned by GetTimeNow(), for
+     *                  example Timespec(ms, TIME_RELATIVE), or Timespec::Zero
+     *                  for no deadline.
+     */
+    void SetDeadline(const Timespec& deadline) { m_deadline = deadline; }
+
+    /**
+     * Get the deadline of this Runnable.
+     *
+     * @return The deadline, Timespec::Zero if there is none.
+     */
+    const Timespec& GetDeadline(void) const { return m_deadline; }
+
+    /**
+     * Get where this Runnable is in its life with a thread pool.
+     *
+     * @return The state of the Runnable.
+     */
+    State GetState(void) const { return static_cast<State>(m_state); }
+
+    /**
+     * Wait until the thread pool this Runnable was executed on is done with
+     * it, which GetState() then tells how.
+     *
+     * @param timeout  Max number of milliseconds to wait or Event::WAIT_FOREVER.
+     *
+     * @return
+     *      - #ER_OK if the thread pool is done with the Runnable.
+     *      - #ER_TIMEOUT if it isn't done within timeout milliseconds.
+     *      - #ER_FAIL if the Runnable was never accepted by a thread pool.
+     *      - Another error if the calling thread was stopped or alerted while waiting.
+     */
+    QStatus Wait(uint32_t timeout = Event::WAIT_FOREVER);
+
   private:
     /**
-     * ThreadPool must be a friend in order to make AlarmTriggered an accessible
-     * base class method of a user's Runnable, and to allow the ThreadPool to
-     * set a pointer to itself here to allow for notifications.
+     * ThreadPool must be a friend in order to set a pointer to itself here
+     * when the Runnable is submitted.
      */
     friend class ThreadPool;
 
     /**
-     * AlarmTriggered is the method that is called to dispatch an alarm.
-     * Our Run() methods are driven by alarm expirations that happen to
-     * always occur immediately.
-     *
-     * Note that the enclosing runnable object is automatically deleted
-     * afte the Run method is executed.
+     * The threads of the ThreadPool time how long the Runnable was queued.
      */
-    virtual void AlarmTriggered(const Alarm& alarm, QStatus reason);
+    friend class ThreadPoolWorker;
 
     /**
-     * Private method used by the thread pool to tell this object how to contact
-     * the thread pool when the reference to the runnable closure is no longer
-     * needed.
+     * Private method used by the thread pool to tell this object which thread
+     * pool it has been submitted to.
      */
     void SetThreadPool(ThreadPool* threadpool)
     {
@@ -103,12 +189,96 @@ class Runnable : public qcc::RefCountBase, public qcc::AlarmListener {
     }
 
     /**
-     * A reference back to the thread pool that causes the run method to be
-     * called.  We need this reference so the thread pool can hook a "done"
-     * event since it would otherwise be unaware of the execution of the
-     * runderlying timer alarm callback that it arranged to be called.
+     * A reference back to the thread pool that will call the run method.
      */
     ThreadPool* m_threadpool;
+
+    /**
+     * The priority class of the Runnable.
+     */
+    Priority m_priority;
+
+    /**
+     * The time by which the Runnable must have started, zero if none.
+     */
+    Timespec m_deadline;
+
+    /**
+     * The State of the Runnable.
+     */
+    volatile int32_t m_state;
+
+    /**
+     * Event set when the thread pool is done with the Runnable, only created
+     * once somebody waits for that.
+     */
+    Event* volatile m_doneEvent;
+
+    /**
+     * When the Runnable was queued, as returned by GetTimeNowNs().
+     */
+    uint64_t m_queuedNs;
+};
+
+/**
+ * The body of a loop that ThreadPool::ParallelFor() runs on the threads of a
+ * pool.
+ */
+class ParallelForBody {
+  public:
+
+    /**
+     * Virtual destructor for derivable class.
+     */
+    virtual ~ParallelForBody() { }
+
+    /**
+     * Run the loop body for a part of the range of the loop.  This is called
+     * concurrently for different parts of the range.
+     *
+     * @param begin  The first index of the part.
+     * @param end    One past the last index of the part.
+     */
+    virtual void Run(size_t begin, size_t end) = 0;
+};
+
+/**
+ * Statistics of a ThreadPool, see ThreadPool::GetStats.
+ */
+struct ThreadPoolStats {
+    uint32_t threads;           /**< Number of threads running */
+    uint32_t peakThreads;       /**< Highest number of threads running */
+    uint32_t idleThreads;       /**< Number of threads waiting for work */
+    uint32_t queueDepth;        /**< Number of Runnables queued that no thread has taken yet */
+    uint64_t executed;          /**< Number of Runnables the threads have taken and finished */
+    uint64_t expired;           /**< Number of those that missed their deadline */
+    uint64_t waitUs;            /**< Total time Runnables were queued before a thread took them, in microseconds */
+    uint64_t maxWaitUs;         /**< Longest time a Runnable was queued, in microseconds */
+    uint64_t runUs;             /**< Total time spent in Run() and Expired(), in microseconds */
+    uint64_t maxRunUs;          /**< Longest Run() or Expired(), in microseconds */
+    uint64_t threadStarts;      /**< Number of times a thread was started */
+    uint64_t threadStops;       /**< Number of times a thread stopped after being idle */
+    uint64_t elapsedMs;         /**< Time over which the counters were collected */
+
+    ThreadPoolStats() { Reset(); }
+
+    /** Clear all counters */
+    void Reset()
+    {
+        threads = 0;
+        peakThreads = 0;
+        idleThreads = 0;
+        queueDepth = 0;
+        executed = 0;
+        expired = 0;
+        waitUs = 0;
+        maxWaitUs = 0;
+        runUs = 0;
+        maxRunUs = 0;
+        threadStarts = 0;
+        threadStops = 0;
+        elapsedMs = 0;
+    }
 };
 
 /**
@@ -118,16 +288,42 @@ class Runnable : public qcc::RefCountBase, public qcc::AlarmListener {
  *
  * In order to ask a ThreadPool to execute a task, one must inherit from the
  * Runnable class and provide a Run() method.
+ *
+ * Each thread of the pool has its own deque of Runnables.  A Runnable that is
+ * executed from one of the pool's own threads (a task fanning out work) goes on
+ * the back of that thread's deque and the thread runs its deque newest first,
+ * while the data the Runnable works on is likely still in its cache.  Runnables
+ * executed from other threads go on a shared injection queue.  A thread that
+ * runs out of work takes from the injection queue and then steals the oldest
+ * Runnable from the deque of another thread.  All of these queues are kept per
+ * priority and a thread takes the highest priority Runnable it can find by
+ * these rules before one of a lower priority.
+ *
+ * The pool accepts up to its number of threads plus a configurable number of
+ * queued Runnables.  When that bound is reached Execute() either fails at once,
+ * or puts the caller to sleep until a Runnable completes or a timeout expires.
+ * Sleeping callers are served highest priority first, then in the order they
+ * arrived, and each completion hands its place to exactly one of them.
+ *
+ * By default all of the threads run for the life of the pool.  A pool given a
+ * smaller minimum number of threads with SetMinThreads() adapts to its load: a
+ * thread above the minimum that has had no work for the idle timeout stops,
+ * and a thread is started again, up to the pool size, when a Runnable has
+ * been queued for longer than the grow threshold and no thread is idle.
  */
 class ThreadPool {
   public:
     /**
      * Construct a thread pool with a given name and pool size.
      *
-     * @param name     The name of the thread pool (used in logging).
-     * @param poolsize The number of threads available in the pool.
+     * @param name      The name of the thread pool (used in logging).
+     * @param poolsize  The number of threads available in the pool.
+     * @param maxQueued The number of Runnables that may wait for a thread
+     *                  when all of the threads are busy.  With the default of
+     *                  zero the pool accepts no more Runnables than it has
+     *                  threads.
      */
-    ThreadPool(const char* name, uint32_t poolsize);
+    ThreadPool(const char* name, uint32_t poolsize, uint32_t maxQueued = 0);
 
     /**
      * Destroy a thread pool.
@@ -147,6 +343,49 @@ class ThreadPool {
      */
     QStatus Join();
 
+    /**
+     * Set the number of threads that keep running when there is no work.
+     * Threads are started right away to make up the number and the threads
+     * above it stop after the idle timeout.
+     *
+     * @param minThreads  The minimum number of threads, the pool size (the
+     *                    default) to keep all of the threads running.
+     */
+    void SetMinThreads(uint32_t minThreads);
+
+    /**
+     * Set how long a Runnable may be queued with no thread idle before the
+     * pool starts another thread.  A Runnable queued while the pool has no
+     * thread running always starts one.
+     *
+     * @param ms  The threshold in milliseconds, 0 (the default) to start a
+     *            thread as soon as a Runnable is queued with no thread idle.
+     */
+    void SetGrowThreshold(uint32_t ms);
+
+    /**
+     * Set how long a thread above the minimum number waits for work before it
+     * stops.
+     *
+     * @param ms  The idle timeout in milliseconds, 30 seconds by default.
+     */
+    void SetIdleTimeout(uint32_t ms);
+
+    /**
+     * Get the statistics of this thread pool.  The statistics are always
+     * collected, so they can be read at any time to see whether the pool has
+     * enough threads.
+     *
+     * @param stats  [OUT] The statistics.
+     */
+    void GetStats(ThreadPoolStats& stats);
+
+    /**
+     * Clear the statistics of this thread pool.  The peak thread count
+     * restarts from the current count.
+     */
+    void ResetStats();
+
     /**
      * Determine the underlying concurrency of the thread pool.
      *
@@ -188,15 +427,62 @@ class ThreadPool {
      *
      * Each call to Execute must provide a pointer to a unique Runnable
      *
+     * If the pool already holds as many Runnables as it has threads plus
+     * queue entries, the timeout says what to do: fail at once (0), sleep
+     * until there is room (Event::WAIT_FOREVER) or sleep for at most timeout
+     * milliseconds.  A Runnable that sleeps on the pool from one of the pool's
+     * own threads holds that thread, so only do so with a finite timeout.
+     *
      * @param runnable A Ptr (smart pointer) to a Runnable Object providing the
      *                 Run() method which one of the threads in this thread pool
      *                 will execute.
+     * @param timeout  Max number of milliseconds to wait for room in the pool.
      *
      * @return
      *      - #ER_OK if the execute request was successful
-     *      - #ER_THREADPOOL_EXHAUSTED if the thread pool has previously reached its specified concurrency.
+     *      - #ER_THREADPOOL_EXHAUSTED if the pool was full for the whole timeout.
+     *      - #ER_THREADPOOL_STOPPING if the pool is stopping.
+     *      - Another error if the calling thread was stopped or alerted while waiting.
+     */
+    QStatus Execute(Ptr<Runnable> runnable, uint32_t timeout = 0);
+
+    /**
+     * Execute a number of Runnable tasks on the threads of the thread pool.
+     *
+     * This is the same as calling Execute() for each of the Runnables, except
+     * that all the Runnables there is room for are queued at once and idle
+     * threads are woken for them at once.  The Runnables that there is no room
+     * for within the timeout are left in Runnable::STATE_NEW.
+     *
+     * @param runnables An array of Ptrs to the Runnables to execute.
+     * @param count     The number of Runnables in the array.
+     * @param timeout   Max number of milliseconds to wait for room in the pool
+     *                  for each Runnable that doesn't fit right away.
+     *
+     * @return
+     *      - #ER_OK if all of the Runnables were accepted.
+     *      - The error of Execute() for the first Runnable that wasn't.
      */
-    QStatus Execute(Ptr<Runnable> runnable);
+    QStatus ExecuteBatch(Ptr<Runnable>* runnables, size_t count, uint32_t timeout = 0);
+
+    /**
+     * Run a loop body over a range of indexes in parallel on the threads of
+     * the thread pool and the calling thread.
+     *
+     * The range is split into parts of grain indexes.  The calling thread
+     * executes one helper Runnable per free thread of the pool, then runs parts
+     * of the range itself alongside the helpers until every part has been
+     * taken, and finally waits for the parts the helpers took.  The whole
+     * range has been run when this returns, even if the pool is full or
+     * stopping, and it may be called from one of the pool's own threads.
+     *
+     * @param begin  The first index of the range.
+     * @param end    One past the last index of the range.
+     * @param grain  The number of indexes in each part, or 0 to have the range
+     *               split into a few parts per thread.
+     * @param body   The loop body.
+     */
+    void ParallelFor(size_t begin, size_t end, size_t grain, ParallelForBody& body);
 
     /**
      * Wait for a thread to become available for use.
@@ -214,18 +500,19 @@ class ThreadPool {
      * sender which will rate limit the system.  This prevents unbounded resource
      * allocation of corresponding threads and memory.
      *
-     * @return ER_OK when a thread becomes available, or a general error if one happens.
+     * Execute() with a timeout does the same wait and also keeps the room it
+     * found for its Runnable, so it should be preferred to this method.
+     *
+     * @return ER_OK when there is room in the pool, or a general error if one happens.
      */
     QStatus WaitForAvailableThread(void);
 
   private:
     /**
-     * Runnable must be a friend in order to call back and tell us that it has
-     * finished executing.  Since this affects the memory management contract
-     * between the Runnable and ThreadPool objects, we don't let anyone else
-     * but Runnable make this call.
+     * The worker threads take Runnables from the queues of the pool and tell it
+     * when they have finished executing one.
      */
-    friend class Runnable;
+    friend class ThreadPoolWorker;
 
     /**
      * Assignment operator is private - ThreadPools cannot be assigned.
@@ -237,53 +524,241 @@ class ThreadPool {
      */
     ThreadPool(const ThreadPool& other);
 
+    /**
+     * Find the thread of this pool that is the calling thread.
+     *
+     * @return The worker or NULL if the caller is not one of the threads of this pool.
+     */
+    ThreadPoolWorker* GetCurrentWorker(void);
+
+    /**
+     * Take the next Runnable for a worker to execute from the highest
+     * priority that has any queued.
+     *
+     * @return The Runnable or NULL if there is no work.
+     */
+    Runnable* NextRunnable(ThreadPoolWorker* worker);
+
+    /**
+     * Take a Runnable of the given priority for a worker to execute: the newest
+     * one on its own deque, else the oldest one on the injection queue, else
+     * the oldest one on the deque of another worker.
+     *
+     * @return The Runnable or NULL if there is none of this priority.
+     */
+    Runnable* NextRunnable(ThreadPoolWorker* worker, uint32_t priority);
+
+    /**
+     * Alert one idle worker, if there is one, that there is work.  The worker
+     * with the lowest index is picked so that the workers with the highest
+     * indexes are the ones left idle long enough to stop.  Must be called with
+     * m_lock taken.
+     */
+    void WakeWorker(void);
+
+    /**
+     * Start another worker if the pool isn't at its size yet.  Must be called
+     * with m_lock taken.
+     */
+    void Grow(void);
+
+    /**
+     * Called by a worker that has taken a Runnable which was queued for
+     * waitedNs nanoseconds, to grow the pool if the Runnable waited too long
+     * and there is more work that no thread is idle for.
+     */
+    void GrowIfBacklogged(uint64_t waitedNs);
+
+    /**
+     * When a worker has finished executing a Runnable it calls back here so we
+     * can give its place in the pool back, record how it finished and release
+     * our reference to the Runnable, which may delete it.
+     *
+     * @param runnable  The Runnable.
+     * @param state     How the pool is done with it.
+     */
+    void Release(Runnable* runnable, Runnable::State state);
+
+    /**
+     * A caller sleeping until there is room in the pool.
+     */
+    struct Waiter {
+        Event* event;         /**< Set to wake the caller */
+        bool granted;         /**< True if a completing Runnable handed its place to the caller */
+        uint32_t priority;    /**< Priority of the Runnable the caller wants to execute */
+    };
+
+    /**
+     * Take places for Runnables in the pool, as many of those asked for as
+     * are free.
+     *
+     * @param count  The number of places wanted.
+     *
+     * @return The number of places taken.
+     */
+    size_t TryAcquireSlots(size_t count);
+
+    /**
+     * Queue Runnables that places in the pool have been taken for and wake
+     * idle workers for them.
+     *
+     * @param runnables An array of Ptrs to the Runnables to queue.
+     * @param count     The number of Runnables in the array.
+     */
+    void Enqueue(Ptr<Runnable>* runnables, size_t count);
+
+    /**
+     * Record that the pool is done with a Runnable and wake anybody waiting
+     * for that.
+     *
+     * @param runnable  The Runnable.
+     * @param state     How the pool is done with it.
+     */
+    void Complete(Runnable* runnable, Runnable::State state);
+
+    /**
+     * Take a place for a Runnable in the pool, sleeping for up to timeout
+     * milliseconds behind the callers already waiting for one with the same
+     * or a higher priority.
+     *
+     * @param timeout   Max number of milliseconds to wait.
+     * @param priority  Priority of the Runnable.
+     *
+     * @return ER_OK if a place was taken, otherwise the reason it wasn't.
+     */
+    QStatus AcquireSlot(uint32_t timeout, uint32_t priority);
+
+    /**
+     * Give a place in the pool back, handing it straight to the caller that
+     * has waited longest for one if there is such a caller.
+     */
+    void ReleaseSlot(void);
+
+    /**
+     * Hand a place in the pool to the caller that has waited longest for one.
+     * Must be called with m_lock taken and m_waitQueue not empty.
+     */
+    void GrantSlot(void);
+
+    /**
+     * The number of Runnable priority classes.
+     */
+    static const uint32_t NUM_PRIORITIES = Runnable::PRIORITY_HIGH + 1;
+
     /**
      * A flag to remind if the thread pool is stopping or stopped.
      */
     bool m_stopping;
 
     /**
-     * A mutex to protect the underlying data structures.
+     * A mutex to protect the injection queue, the list of idle workers and the
+     * callers waiting for room in the pool.
      */
     qcc::Mutex m_lock;
 
     /**
-     * An event to allow callers to wait until a thread becomes available
-     * in the pool.
+     * The maximum number of concurrent threads executing in this thread pool.
      */
-    qcc::Event m_event;
+    uint32_t m_poolsize;
 
     /**
-     * The maximum number of concurrent threads executing in this thread pool.
+     * The maximum number of Runnables queued or executing, the number of
+     * threads plus the number of Runnables that may wait for one.
      */
-    uint32_t m_poolsize;
+    uint32_t m_capacity;
+
+    /**
+     * The threads of the pool, one for each thread the pool may run.  The
+     * first m_active of them are running.
+     */
+    std::vector<ThreadPoolWorker*> m_workers;
+
+    /**
+     * Number of workers running.  It is changed with m_lock taken but read
+     * without so workers only try to steal from workers that are running.
+     */
+    volatile int32_t m_active;
+
+    /**
+     * Number of workers that keep running when there is no work.
+     */
+    uint32_t m_minThreads;
+
+    /**
+     * How long a Runnable may wait with no worker idle before the pool grows,
+     * in nanoseconds.
+     */
+    uint64_t m_growThresholdNs;
+
+    /**
+     * How long a worker above m_minThreads waits for work before it stops.
+     */
+    uint32_t m_idleTimeoutMs;
+
+    /**
+     * Statistics of the pool as a whole, protected by m_lock.  The statistics
+     * of the Runnables are kept by each worker.
+     */
+    ThreadPoolStats m_stats;
+
+    /**
+     * When the statistics were last reset, as returned by GetTimestamp64().
+     */
+    uint64_t m_statsSince;
+
+    /**
+     * Runnables executed from threads that are not part of the pool, per
+     * priority and taken oldest first.  The pool holds a reference to each
+     * Runnable from the time it is queued until it has run.
+     */
+    std::deque<Runnable*> m_injection[NUM_PRIORITIES];
+
+    /**
+     * Number of Runnables on each injection queue.  It is changed with m_lock
+     * taken but read without so workers don't take the lock just to find the
+     * queue empty.
+     */
+    volatile int32_t m_injected[NUM_PRIORITIES];
+
+    /**
+     * Number of Runnables of each priority queued anywhere in the pool, so
+     * workers can skip the priorities that have none without taking locks.
+     */
+    volatile int32_t m_queued[NUM_PRIORITIES];
+
+    /**
+     * Workers that are waiting for work.
+     */
+    std::vector<ThreadPoolWorker*> m_idle;
+
+    /**
+     * Number of workers in m_idle, read without the lock to skip waking a
+     * worker when none is idle.
+     */
+    volatile int32_t m_idleCount;
+
+    /**
+     * Number of Runnables queued or executing, plus places that have been
+     * handed to waiting callers that have not queued their Runnable yet.
+     */
+    volatile int32_t m_pending;
 
     /**
-     * We need to hold a reference to an underlying Runnable object while we
-     * wait for its Run() method to be executed.  The Runnable object acts as a
-     * closure that a user will use to keep required variables.  When the Run()
-     * method is done executing, we release the reference to the runnable managed
-     * object by deleting the corresponding entry in the closure map.
+     * Callers waiting for room in the pool, longest waiting first.
      */
-    typedef std::map<Runnable*, Ptr<Runnable> > RunnableEntry;
-    RunnableEntry m_closures;
+    std::deque<Waiter*> m_waitQueue;
 
     /**
-     * When the AlarmTriggered callback of the AlarmListener base class of the
-     * Runnable is called by the Timer, it will call the user's Run() function
-     * and then call back here to let us know that it has finished executing.
-     * That tells us that we can clean up any resources we may be holding.  That
-     * just means releasing our reference to the Ptr that holds the ulitmate
-     * reference to the runnable.  If we can't find a closure, we have screwed
-     * up massively and we should just die.
+     * Events of callers that have finished waiting, kept for the next ones.
      */
-    void Release(Runnable* runnable);
+    std::vector<Event*> m_waitEvents;
 
     /**
-     * The timer that actually does all of the work of dispatching threads and
-     * essentially doing all of the work of the thread pool.
+     * Number of callers trying for a place with m_lock taken or waiting in
+     * m_waitQueue, so that a completing Runnable only has to take the lock
+     * when somebody is waiting for its place.
      */
-    qcc::Timer m_dispatcher;
+    volatile int32_t m_waiters;
 };
 
 } // namespace qcc
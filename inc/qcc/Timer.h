@@ -25,7 +25,9 @@
 #include <qcc/platform.h>
 #include <qcc/Debug.h>
 #include <qcc/atomic.h>
+#include <map>
 #include <set>
+#include <vector>
 
 #include <qcc/Mutex.h>
 #include <qcc/Thread.h>
@@ -48,6 +50,28 @@ namespace qcc {
 class Timer;
 class _Alarm;
 class TimerThread;
+class AlarmWheel;
+
+/**
+ * Links that let an alarm sit in an AlarmWheel, or in the intake of alarms added to a Timer,
+ * without a separate allocation.  Copying an alarm never copies its membership of either.
+ */
+struct AlarmWheelLink {
+    _Alarm* prev;         /**< Previous alarm in the same wheel list */
+    _Alarm* next;         /**< Next alarm in the same wheel list */
+    const AlarmWheel* wheel;  /**< Wheel that the alarm is in or NULL */
+    uint32_t list;        /**< Index of the wheel list that the alarm is in */
+    uint64_t when;        /**< Time in milliseconds the alarm is due in the wheel, including slack */
+    uint32_t whenNs;      /**< Nanoseconds within the millisecond the alarm is due */
+    _Alarm* listenerPrev; /**< Previous alarm in the wheel with the same listener */
+    _Alarm* listenerNext; /**< Next alarm in the wheel with the same listener */
+    _Alarm* intakeNext;   /**< Next alarm in a Timer's intake */
+    volatile int32_t inIntake;  /**< 1 while the alarm is in a Timer's intake */
+
+    AlarmWheelLink() : prev(NULL), next(NULL), wheel(NULL), list(0), when(0), whenNs(0), listenerPrev(NULL), listenerNext(NULL), intakeNext(NULL), inIntake(0) { }
+    AlarmWheelLink(const AlarmWheelLink& other) : prev(NULL), next(NULL), wheel(NULL), list(0), when(0), whenNs(0), listenerPrev(NULL), listenerNext(NULL), intakeNext(NULL), inIntake(0) { }
+    AlarmWheelLink& operator=(const AlarmWheelLink& other) { return *this; }
+};
 
 /**
  * An alarm listener is capable of receiving alarm callbacks
@@ -56,8 +80,18 @@ class AlarmListener {
     friend class Timer;
     friend class TimerThread;
     friend class OSTimer;
+    friend class AlarmWheel;
 
   public:
+    /** Constructor */
+    AlarmListener() : wheelId(0), wheelAlarms(NULL) { }
+
+    /** Copy constructor, the copy has no alarms */
+    AlarmListener(const AlarmListener& other) : wheelId(0), wheelAlarms(NULL) { }
+
+    /** Assignment operator, alarms stay with the listener they were added for */
+    AlarmListener& operator=(const AlarmListener& other) { return *this; }
+
     /**
      * Virtual destructor for derivable class.
      */
@@ -65,6 +99,9 @@ class AlarmListener {
 
   private:
 
+    volatile int32_t wheelId;   /**< Id of the AlarmWheel whose alarms for this listener start at wheelAlarms or 0 */
+    _Alarm* wheelAlarms;        /**< First alarm for this listener in that wheel */
+
     /**
      * @param alarm  The alarm that was triggered.
      * @param status The reason the alarm was triggered. This will be either:
@@ -79,6 +116,7 @@ class _Alarm : public OSAlarm {
     friend class TimerThread;
     friend class OSTimer;
     friend class CompareAlarm;
+    friend class AlarmWheel;
 
   public:
 
@@ -136,6 +174,34 @@ class _Alarm : public OSAlarm {
      */
     uint64_t GetAlarmTime() const;
 
+    /**
+     * Allow the alarm to go off up to slackMs after its alarm time.  A Timer uses the slack to
+     * fire alarms whose windows overlap in a single wakeup and to run them back to back on one
+     * thread.  Must be set before the alarm is added to a Timer.
+     *
+     * @param slackMs  Number of ms the alarm may be late or 0 (the default) for no slack.
+     */
+    void SetSlack(uint32_t slackMs);
+
+    /**
+     * Get the slack of the alarm in milliseconds.
+     */
+    uint32_t GetSlack() const;
+
+    /**
+     * Set the key that AlarmTriggered calls are serialized on when the Timer prevents reentrancy
+     * per listener (REENTRANCY_LISTENER).  Callbacks of alarms with the same key never run at the
+     * same time.  Must be set before the alarm is added to a Timer.
+     *
+     * @param key  Serialization key or NULL (the default) to use the alarm's listener.
+     */
+    void SetSerializationKey(const void* key);
+
+    /**
+     * Get the serialization key of the alarm, which is its listener unless one was set.
+     */
+    const void* GetSerializationKey() const;
+
     /**
      * Return true if this Alarm's time is less than the passed in alarm's time
      */
@@ -152,8 +218,11 @@ class _Alarm : public OSAlarm {
     Timespec alarmTime;
     AlarmListener* listener;
     uint32_t periodMs;
+    uint32_t slackMs;
+    const void* serializationKey;
     mutable void* context;
     int32_t id;
+    AlarmWheelLink wheelLink;
 };
 
 /**
@@ -161,6 +230,294 @@ class _Alarm : public OSAlarm {
  */
 typedef qcc::ManagedObj<_Alarm> Alarm;
 
+/**
+ * Hierarchical timing wheel holding the pending alarms of a Timer.
+ *
+ * Level 0 has one list per millisecond for the next 256ms; each higher level has 64 lists that
+ * each cover 64 times the span of a list one level down.  Alarms further out than the top level
+ * (about 49 days) are kept in an overflow list.  Adding and removing an alarm is O(1) and needs
+ * no allocation.  As time advances, the lists of higher levels are cascaded into lower ones, and
+ * alarms that are due are kept in a list ordered by time and id.  So due alarms come out in the
+ * same order as they would from a std::set<Alarm>.
+ *
+ * An alarm with slack is put in the wheel at a time within its slack window that is rounded to a
+ * power of two, so alarms with overlapping windows become due together.
+ *
+ * The alarms of each listener are also linked together so removing the alarms of a listener does
+ * not depend on the total number of alarms.  The head of that list is kept in the listener, so
+ * this needs no lookup or allocation either, unless the listener has alarms in several wheels at
+ * once; the wheels other than the first then keep the heads in a map.
+ *
+ * An alarm can be in one wheel at a time.  AlarmWheel is not thread safe, Timer serializes access.
+ */
+class AlarmWheel {
+  public:
+
+    /** Create an empty wheel */
+    AlarmWheel();
+
+    /** Destructor, releases any alarms still in the wheel */
+    ~AlarmWheel();
+
+    /**
+     * Return true if there are no alarms in the wheel.
+     */
+    bool IsEmpty() const { return count == 0; }
+
+    /**
+     * Return the number of alarms in the wheel.
+     */
+    size_t Size() const { return count; }
+
+    /**
+     * Add an alarm.  Adding an alarm that is already in the wheel has no effect.
+     *
+     * @param alarm  Alarm to add.
+     * @return true if the alarm is due before the time last returned by GetNextAlarm, in which
+     *         case a thread waiting for that time needs to be woken up.
+     */
+    bool Add(const Alarm& alarm);
+
+    /**
+     * Move an alarm to a new time without removing it from the wheel.  An alarm that is not in
+     * the wheel is given the new time and added.
+     *
+     * @param alarm      Alarm to move.
+     * @param alarmTime  New absolute time for the alarm.
+     * @return true if the alarm is now due before the time last returned by GetNextAlarm.
+     */
+    bool Rearm(const Alarm& alarm, const Timespec& alarmTime);
+
+    /**
+     * Remove an alarm.
+     *
+     * @param alarm  Alarm to remove.
+     * @return true if the alarm was in the wheel.
+     */
+    bool Remove(const Alarm& alarm);
+
+    /**
+     * Return true if an alarm is in the wheel.
+     */
+    bool Contains(const Alarm& alarm) const { return alarm->wheelLink.wheel == this; }
+
+    /**
+     * Return true if an alarm is in a different wheel.  An alarm can only be in one wheel at a time.
+     */
+    bool InOtherWheel(const Alarm& alarm) const { return alarm->wheelLink.wheel && (alarm->wheelLink.wheel != this); }
+
+    /**
+     * Remove an alarm for a given listener.  The cost does not depend on the number of alarms of
+     * other listeners.
+     *
+     * @param listener  Listener whose alarm is removed.
+     * @param alarm     [OUT] The alarm that was removed.
+     * @return true if an alarm was removed.
+     */
+    bool RemoveListener(const AlarmListener* listener, Alarm& alarm);
+
+    /**
+     * Advance the wheel to the current time and find out when the next alarm is due.
+     *
+     * @param now    The current time.
+     * @return The time the first alarm is due if it is due.  Otherwise a time that is not later than
+     *         the first alarm; waking up then is either in time for it or early enough to look again.
+     *         END_OF_TIME if the wheel is empty.
+     */
+    Timespec GetNextAlarm(const Timespec& now);
+
+    /**
+     * Set aside a due alarm that cannot run yet because its serialization key is in use.  The
+     * alarm stays in the wheel but is not due again until Unpark is called for its key.
+     *
+     * @param alarm  Due alarm to set aside.
+     */
+    void Park(const Alarm& alarm);
+
+    /**
+     * Make the alarms set aside for a serialization key due again.
+     *
+     * @param key  Serialization key that is no longer in use.
+     * @return true if any alarms were made due.
+     */
+    bool Unpark(const void* key);
+
+    /**
+     * Get the first alarm that is due.  Only valid after GetNextAlarm returned a time that is
+     * not later than the time passed to it, and while that alarm is still in the wheel.
+     *
+     * @return The first due alarm.
+     */
+    Alarm GetDueAlarm() const;
+
+    /**
+     * Get all alarms in the wheel in the order they are due without removing them.
+     *
+     * @param alarms  [OUT] The alarms.
+     */
+    void GetAlarms(std::vector<Alarm>& alarms) const;
+
+  private:
+
+    enum {
+        LEVEL0_SLOTS = 256,                 /**< Number of 1ms lists in level 0 */
+        LEVEL_SLOTS = 64,                   /**< Number of lists in each higher level */
+        NUM_LEVELS = 5,                     /**< Number of levels including level 0 */
+        OVERFLOW_LIST = LEVEL0_SLOTS + (NUM_LEVELS - 1) * LEVEL_SLOTS,  /**< Alarms beyond the top level */
+        DUE_LIST,                           /**< Alarms that are due, ordered */
+        PARKED_LIST,                        /**< Due alarms waiting for their serialization key */
+        NUM_LISTS
+    };
+
+    /** Copy constructor is private - AlarmWheels cannot be copied */
+    AlarmWheel(const AlarmWheel& other);
+
+    /** Assignment operator is private - AlarmWheels cannot be assigned */
+    AlarmWheel& operator=(const AlarmWheel& other);
+
+    uint32_t ListFor(uint64_t when) const;
+    void Link(_Alarm* alarm, uint32_t list);
+    void Unlink(_Alarm* alarm);
+    _Alarm** ListenerHead(const AlarmListener* listener, bool create);
+    void LinkListener(_Alarm* alarm);
+    bool Place(_Alarm* alarm);
+    void UnlinkListener(_Alarm* alarm);
+    void Cascade(uint32_t list);
+    uint64_t NextChange() const;
+    void Advance(uint64_t now);
+
+    _Alarm* lists[NUM_LISTS];               /**< Head of each list */
+    _Alarm* dueTail;                        /**< Last alarm in the due list */
+    uint64_t occupied[8];                   /**< Bit per non-empty list: 4 words for level 0, then one word per level */
+    uint64_t clock;                         /**< Alarms at or before this time (ms) are in the due list */
+    uint64_t wakeTime;                      /**< Time last returned by GetNextAlarm */
+    size_t count;                           /**< Number of alarms in the wheel */
+    int32_t id;                             /**< Unique id, never 0, that listeners use to tell wheels apart */
+    std::map<const AlarmListener*, _Alarm*> listenerAlarms;  /**< First alarm of listeners whose head is kept by another wheel */
+};
+
+/**
+ * Time spent in the AlarmTriggered callbacks of one listener, see TimerStats.
+ */
+struct TimerListenerStats {
+    uint64_t alarms;        /**< Number of callbacks */
+    uint64_t totalMs;       /**< Total time spent in the callbacks */
+    uint64_t maxMs;         /**< Longest callback */
+
+    TimerListenerStats() : alarms(0), totalMs(0), maxMs(0) { }
+};
+
+/**
+ * Statistics of a Timer, see Timer::GetStats.  All times are in milliseconds.
+ */
+struct TimerStats {
+    enum {
+        LATENESS_BUCKETS = 12           /**< Number of buckets in the lateness histogram */
+    };
+
+    /**
+     * Histogram of how late alarms went off (time AlarmTriggered is called minus alarm time).
+     * Bucket 0 counts alarms that were less than 1ms late, bucket i > 0 alarms that were
+     * [2^(i-1), 2^i) ms late and the last bucket all later ones.
+     */
+    uint64_t lateness[LATENESS_BUCKETS];
+    uint64_t maxLatenessMs;             /**< Latest an alarm went off */
+    uint64_t alarmsTriggered;           /**< Number of alarms that went off */
+    uint64_t callbackMs;                /**< Total time spent in AlarmTriggered callbacks */
+    size_t currentAlarms;               /**< Number of pending alarms */
+    size_t peakAlarms;                  /**< Highest number of pending alarms */
+    uint64_t maxAlarmsRejected;         /**< Number of AddAlarmNonBlocking calls that failed with ER_TIMER_FULL */
+    uint64_t maxAlarmsBlocked;          /**< Number of AddAlarm calls that blocked on maxAlarms */
+    uint64_t threadStarts;              /**< Number of times a worker thread was started */
+    uint64_t threadStops;               /**< Number of times a worker thread stopped for lack of work */
+    uint64_t threadStartsThrottled;     /**< Number of times a worker was not started because of the start rate cap */
+    uint64_t peakThreadStartsPerSecond; /**< Most worker threads started within one second */
+    uint64_t elapsedMs;                 /**< Time over which the statistics were collected, threadStarts * 1000 / elapsedMs is the average start rate */
+    uint64_t idleMs;                    /**< Total time timer threads spent waiting for alarms */
+    std::map<const AlarmListener*, TimerListenerStats> listeners;  /**< Callback times per listener, see Timer::SetListenerStats */
+
+    TimerStats() { Reset(); }
+
+    /** Clear all counters */
+    void Reset()
+    {
+        for (size_t i = 0; i < LATENESS_BUCKETS; ++i) {
+            lateness[i] = 0;
+        }
+        maxLatenessMs = 0;
+        alarmsTriggered = 0;
+        callbackMs = 0;
+        currentAlarms = 0;
+        peakAlarms = 0;
+        maxAlarmsRejected = 0;
+        maxAlarmsBlocked = 0;
+        threadStarts = 0;
+        threadStops = 0;
+        threadStartsThrottled = 0;
+        peakThreadStartsPerSecond = 0;
+        elapsedMs = 0;
+        idleMs = 0;
+        listeners.clear();
+    }
+};
+
+/**
+ * How a Timer that prevents reentrancy serializes AlarmTriggered calls.
+ */
+typedef enum {
+    REENTRANCY_TIMER,       /**< One callback at a time for the whole Timer */
+    REENTRANCY_LISTENER     /**< One callback at a time per serialization key, by default the alarm's listener */
+} ReentrancyScope;
+
+/**
+ * Clock of a Timer that runs on virtual time.  The time only moves when the timer is advanced, so
+ * a test can go through hours of alarms without sleeping and always in the same order.
+ */
+class VirtualClock {
+    friend class Timer;
+
+  public:
+
+    /**
+     * Construct a virtual clock that starts at the current time.
+     */
+    VirtualClock() { qcc::GetTimeNow(&now); }
+
+    /**
+     * Construct a virtual clock that starts at a given time.
+     *
+     * @param start  Initial time of the clock.
+     */
+    VirtualClock(const Timespec& start) : now(start) { }
+
+    /**
+     * Get the time of the clock.
+     *
+     * @param ts  [OUT] The current virtual time.
+     */
+    void GetTimeNow(Timespec* ts) const
+    {
+        lock.Lock();
+        *ts = now;
+        lock.Unlock();
+    }
+
+  private:
+
+    /** Move the clock forward, it never goes back */
+    void Set(const Timespec& ts)
+    {
+        lock.Lock();
+        if (now < ts) {
+            now = ts;
+        }
+        lock.Unlock();
+    }
+
+    mutable Mutex lock;
+    Timespec now;
+};
+
 class Timer : public OSTimer, public ThreadListener {
     friend class TimerThread;
     friend class OSTimer;
@@ -175,8 +532,27 @@ class Timer : public OSTimer, public ThreadListener {
      * @param concurency         Dispatch up to this number of alarms concurently (using multiple threads).
      * @param prevenReentrancy   Prevent re-entrant call of AlarmTriggered.
      * @param maxAlarms          Maximum number of outstanding alarms allowed before blocking calls to AddAlarm or 0 for infinite.
+     * @param highResolution     Trigger alarms at their exact time rather than on a millisecond tick.  The timer
+     *                           wakes up a millisecond early and sleeps for the remainder with GetTimeNowNs()
+     *                           resolution, so alarms can be scheduled at sub-millisecond times with
+     *                           Timespec::AddNanos().
+     * @param reentrancyScope    With preventReentrancy, whether callbacks are serialized across the whole timer
+     *                           or only for alarms with the same serialization key (see _Alarm::SetSerializationKey).
      */
-    Timer(const char* name, bool expireOnExit = false, uint32_t concurency = 1, bool preventReentrancy = false, uint32_t maxAlarms = 0);
+    Timer(const char* name, bool expireOnExit = false, uint32_t concurency = 1, bool preventReentrancy = false, uint32_t maxAlarms = 0,
+          bool highResolution = false, ReentrancyScope reentrancyScope = REENTRANCY_TIMER);
+
+    /**
+     * Construct a timer that runs on virtual time.  The timer has no threads of its own, alarms go off
+     * on the thread that calls Advance() or AdvanceTo().  Alarms must be given absolute times taken
+     * from GetClockTime() since an alarm constructed with a relative time is relative to the real clock.
+     * Virtual timers are not supported on WinRT.
+     *
+     * @param name       Name of the timer.
+     * @param clock      Clock that the timer runs on.  It must outlive the timer.
+     * @param maxAlarms  Maximum number of outstanding alarms allowed before blocking calls to AddAlarm or 0 for infinite.
+     */
+    Timer(const char* name, VirtualClock& clock, uint32_t maxAlarms = 0);
 
     /**
      * Destructor.
@@ -218,6 +594,7 @@ class Timer : public OSTimer, public ThreadListener {
      * @param alarm     Alarm to add.
      * @return ER_OK if alarm was added
      *         ER_TIMER_EXITING if timer is exiting
+     *         ER_INVALID_DATA if the alarm is pending on another timer
      */
     QStatus AddAlarm(const Alarm& alarm);
 
@@ -229,6 +606,7 @@ class Timer : public OSTimer, public ThreadListener {
      * @return ER_OK if alarm was added
      *         ER_TIMER_FULL if timer has maximum allowed alarms
      *         ER_TIMER_EXITING if timer is exiting
+     *         ER_INVALID_DATA if the alarm is pending on another timer
      */
     QStatus AddAlarmNonBlocking(const Alarm& alarm);
 
@@ -269,6 +647,58 @@ class Timer : public OSTimer, public ThreadListener {
      */
     QStatus ReplaceAlarm(const Alarm& origAlarm, const Alarm& newAlarm, bool blockIfTriggered = true);
 
+    /**
+     * Move an alarm to a new time.  A pending alarm is moved in place.  An alarm that is not pending
+     * (it was triggered, removed or never added) is added with the new time.  Unlike ReplaceAlarm
+     * no new Alarm is needed so a timeout that is pushed back over and over does not allocate.
+     * This call never blocks.
+     *
+     * @param alarm      Alarm to re-arm.
+     * @param alarmTime  New absolute time for the alarm.
+     *
+     * @return  ER_OK if the alarm is pending at the new time.
+     *          ER_TIMER_FULL if the alarm was not pending and the timer already has maxAlarms alarms.
+     *          ER_TIMER_EXITING if the timer is not running.
+     *          ER_INVALID_DATA if the alarm is pending on another timer.
+     */
+    QStatus Rearm(const Alarm& alarm, const Timespec& alarmTime);
+
+    /**
+     * Move an alarm to a time relative to now.  See Rearm(const Alarm&, const Timespec&).
+     *
+     * @param alarm         Alarm to re-arm.
+     * @param relativeTime  Number of ms from now that the alarm will trigger or WAIT_FOREVER.
+     */
+    QStatus Rearm(const Alarm& alarm, uint32_t relativeTime);
+
+    /**
+     * Move the clock of a virtual timer forward, calling AlarmTriggered for the alarms that fall due
+     * on the calling thread and in order.  The clock is set to the time of each alarm before its
+     * callback is called, so alarms the callbacks add are run too if they are due by then.
+     *
+     * @param ms  Number of ms to move the clock forward.
+     *
+     * @return  ER_OK if successful.
+     *          ER_TIMER_EXITING if the timer is not running.
+     *          ER_FAIL if this timer does not run on a VirtualClock.
+     */
+    QStatus Advance(uint32_t ms);
+
+    /**
+     * Move the clock of a virtual timer forward to a given time.  See Advance(uint32_t).
+     *
+     * @param until  Time to move the clock to.
+     */
+    QStatus AdvanceTo(const Timespec& until);
+
+    /**
+     * Get the current time on the clock of this timer, which is the real time unless the timer runs
+     * on a VirtualClock.
+     *
+     * @param now  [OUT] The current time.
+     */
+    void GetClockTime(Timespec* now) const;
+
     /**
      * Remove all pending alarms with a given alarm listener.
      *
@@ -287,6 +717,7 @@ class Timer : public OSTimer, public ThreadListener {
 
     /**
      * Allow the currently executing AlarmTriggered callback to be reentered if another alarm is triggered.
+     * With REENTRANCY_LISTENER only alarms with the same serialization key are let in.
      * Calling this method has no effect if timer was created with preventReentrancy == false;
      * Calling this method can only be made from within the AlarmTriggered timer callback.
      */
@@ -299,6 +730,50 @@ class Timer : public OSTimer, public ThreadListener {
      */
     bool ThreadHoldsLock();
 
+    /**
+     * Keep a number of worker threads running while they are idle rather than stopping them after
+     * a short idle time.  Bursts of alarms are then handed to warm threads instead of paying for
+     * thread creation.  Warm workers are started by Start(), or when they are first needed if the
+     * timer is already running.  Ignored on WinRT where alarms run on the system thread pool.
+     *
+     * @param minWorkers  Number of workers to keep, at most concurency - 1.  The default is 0.
+     */
+    void SetMinWorkers(uint32_t minWorkers);
+
+    /**
+     * Limit how often worker threads are started.  When the limit is reached an alarm is run by the
+     * thread that found it due, without starting another thread to take over the controller role.
+     * Ignored on WinRT.
+     *
+     * @param startsPerSecond  Maximum number of worker threads started per second or 0 (the default) for no limit.
+     */
+    void SetMaxThreadStartRate(uint32_t startsPerSecond);
+
+    /**
+     * Collect the time spent in the callbacks of each listener in TimerStats::listeners.  This costs
+     * a map lookup under the timer lock for every alarm, so it is off by default.  A listener stays
+     * in the statistics until RemoveAlarmsWithListener is called for it or the statistics are reset,
+     * so a listener freed without removing its alarms leaves its numbers to any listener that is
+     * later allocated at the same address.
+     *
+     * @param enable  true to collect per listener statistics, false (the default) to stop and drop them.
+     */
+    void SetListenerStats(bool enable);
+
+    /**
+     * Get the statistics of this timer.  The statistics are always collected, so they can be read
+     * at any time to see how late alarms go off and whether the timer has enough threads.
+     * Per listener statistics are only collected after SetListenerStats(true).
+     *
+     * @param timerStats  [OUT] The statistics.
+     */
+    void GetStats(TimerStats& timerStats);
+
+    /**
+     * Clear the statistics of this timer.  The peak alarm count restarts from the current count.
+     */
+    void ResetStats();
+
     /**
      * Get the name of the Timer thread pool
      *
@@ -327,8 +802,92 @@ class Timer : public OSTimer, public ThreadListener {
 
   protected:
 
+#if !defined(QCC_OS_GROUP_WINRT)
+    /**
+     * Push an alarm on the intake without taking the lock, alerting the controller thread only if
+     * the alarm may be due before it wakes up.
+     */
+    QStatus PushAlarm(const Alarm& alarm);
+
+    /**
+     * Take one of the maxAlarms places for an alarm that is about to be added without taking the
+     * lock.  The place is given back when the alarm is drained into the wheel, which then counts it.
+     *
+     * @return false if the timer already has maxAlarms alarms.
+     */
+    bool ReserveAlarm();
+
+    /**
+     * Move the alarms in the intake into the alarm wheel and alert the controller thread if one
+     * of them is due before it wakes up.  Must be called with the lock held.
+     */
+    void DrainAlarmIntake();
+
+    /**
+     * Tell threads adding alarms when the controller thread wakes up next.  Must be called with the
+     * lock held by the controller thread before it sleeps.
+     *
+     * @param wakeTime  Time the controller wakes up or END_OF_TIME.
+     * @param now       The current time.
+     * @return false if alarms arrived in the intake so the controller must not sleep.
+     */
+    bool ArmAlarmIntake(const Timespec& wakeTime, const Timespec& now);
+
+    /**
+     * Tell threads adding alarms that the controller thread is awake and drains the intake before
+     * it next sleeps.
+     */
+    void DisarmAlarmIntake();
+
+    /**
+     * Check whether a timer thread other than tt is running a callback with the serialization key
+     * of an alarm.  Always false unless reentrancy is prevented per listener.  Must be called with
+     * the lock held.
+     */
+    bool SerializationKeyInUse(const TimerThread* tt, const Alarm& alarm) const;
+
+    /**
+     * Take the serialization key of an alarm for timer thread tt if reentrancy is prevented per
+     * listener.  Must be called with the lock held.
+     *
+     * @return false if another timer thread holds the key.
+     */
+    bool AcquireSerializationKey(TimerThread* tt, const Alarm& alarm);
+
+    /**
+     * Release the reentrancy lock or serialization key held by timer thread tt, making alarms
+     * that were waiting for the key due again.  Must be called with the lock held.
+     */
+    void ReleaseReentrancy(TimerThread* tt);
+
+    /**
+     * Check whether the idle worker tt is one of the minWorkers threads kept warm.  Must be called
+     * with the lock held.
+     */
+    bool KeepWorker(const TimerThread* tt) const;
+
+    /**
+     * Account for a worker thread about to be started.  Must be called with the lock held.
+     *
+     * @return false if the thread must not be started because of the start rate cap.
+     */
+    bool AllowThreadStart();
+#endif
+
+    /**
+     * Add an alarm that went off to the statistics.  Must be called with the lock held.
+     */
+    void RecordAlarm(const Alarm& alarm, int64_t latenessMs, int64_t callbackMs);
+
     Mutex lock;
+#if defined(QCC_OS_GROUP_WINRT)
     std::set<Alarm, std::less<Alarm> >  alarms;
+#else
+    AlarmWheel alarms;
+    _Alarm* volatile alarmIntake;   /**< Alarms added without taking the lock and not yet in alarms */
+    volatile int32_t intakeWake;    /**< When the controller wakes up, as set by ArmAlarmIntake */
+    volatile int32_t alarmReservations;  /**< Alarms counted against maxAlarms that alarms does not count yet */
+#endif
     Alarm* currentAlarm;
     bool expireOnExit;
     std::vector<TimerThread*> timerThreads;
@@ -339,6 +898,16 @@ class Timer : public OSTimer, public ThreadListener {
     Mutex reentrancyLock;
     qcc::String nameStr;
     const uint32_t maxAlarms;
+    const bool highResolution;
+    const ReentrancyScope reentrancyScope;
+    uint32_t minWorkers;
+    uint32_t maxThreadStartRate;
+    uint64_t threadStartWindow;     /**< Start of the second threadStartsInWindow counts starts for */
+    uint32_t threadStartsInWindow;
+    TimerStats stats;
+    bool listenerStats;             /**< Whether stats.listeners is collected */
+    uint64_t statsSince;            /**< When stats were last reset */
+    VirtualClock* virtualClock;     /**< Clock of a virtual timer or NULL */
 };
 
 }
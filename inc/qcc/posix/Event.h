@@ -27,6 +27,7 @@
 
 #include <qcc/platform.h>
 
+#include <map>
 #include <vector>
 
 #include <qcc/atomic.h>
@@ -40,11 +41,15 @@ namespace qcc {
 
 /** @internal Forward Reference */
 class Source;
+class EventSet;
+struct EventSetRing;
 
 /**
  * Events are used to send signals between threads.
  */
 class Event {
+    friend class EventSet;
+
   public:
 
     /** Cause Wait to have no timeout */
@@ -58,7 +63,7 @@ class Event {
 
     /** Type of event */
     typedef enum {
-        GEN_PURPOSE,     /**< General purpose pipe backed event */
+        GEN_PURPOSE,     /**< General purpose event (eventfd backed on Linux, pipe backed elsewhere) */
         IO_READ,         /**< IO Read event */
         IO_WRITE,        /**< IO Write event */
         TIMED            /**< Event fires automatically when limit time is reached */
@@ -192,12 +197,14 @@ class Event {
   private:
 
     int fd;                 /**< File descriptor linked to general purpose event or -1 */
-    int signalFd;           /**< File descriptor used by GEN_PURPOSE events to manually set/reset event */
+    int signalFd;           /**< File descriptor used by GEN_PURPOSE events to manually set/reset event (same as fd for eventfd) */
     int ioFd;               /**< I/O File descriptor associated with event or -1 */
     EventType eventType;    /**< Indicates type of event */
     uint32_t timestamp;     /**< time for next triggering of TIMED Event */
     uint32_t period;        /**< Number of milliseconds between periodic timed events */
     int32_t numThreads;     /**< Number of threads currently waiting on this event */
+    volatile int32_t signaled;  /**< 1 while an eventfd backed event is set, lets SetEvent skip the syscall */
+    volatile int32_t writeAbandoned;  /**< Set by SetEvent when its eventfd write failed after a ResetEvent claimed it */
 
     /**
      * Protected copy constructor.
@@ -215,6 +222,122 @@ class Event {
      */
     void DecrementNumThreads() { DecrementAndFetch(&numThreads); }
 
+    /**
+     * select() based implementation of the multi-event Wait.
+     * Used on platforms other than Linux and by EventSet if an epoll instance cannot be created.
+     */
+    static QStatus SelectWait(const std::vector<Event*>& checkEvents,
+                              std::vector<Event*>& signaledEvents,
+                              uint32_t maxMs);
+
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    /**
+     * poll based implementation of the multi-event Wait.
+     */
+    static QStatus PollWait(const std::vector<Event*>& checkEvents,
+                            std::vector<Event*>& signaledEvents,
+                            uint32_t maxMs);
+#endif
+
+};
+
+/**
+ * A persistent set of events that can be waited on repeatedly.
+ *
+ * Unlike Event::Wait(checkEvents, signaledEvents), which registers every event on every call,
+ * events are added to an EventSet once and stay registered until they are removed.  On Linux the
+ * set is backed by an epoll instance so adding, removing and waiting cost is independent of the
+ * number of registered events.  When built with QCC_USE_IO_URING and the kernel supports it, an
+ * io_uring instance is used instead so that re-arming descriptors is batched with the wait.
+ * Events may be added and removed while another thread is blocked in Wait, but only one thread
+ * may call Wait at a time.
+ */
+class EventSet {
+  public:
+
+    /** Construct an empty event set. */
+    EventSet();
+
+    /** Destructor */
+    ~EventSet();
+
+    /**
+     * Add an event to the set.
+     * The same event may be added more than once with different contexts.
+     *
+     * @param event    Event to wait on.
+     * @param context  Opaque value reported by Wait when the event is signaled.
+     * @return ER_OK if successful.
+     */
+    QStatus AddEvent(Event& event, void* context);
+
+    /**
+     * Remove an event previously added with the same context.
+     * Once this call returns, subsequent calls to Wait will not report the context.
+     *
+     * @param event    Event to remove.
+     * @param context  Context the event was added with.
+     * @return ER_OK if successful.
+     */
+    QStatus RemoveEvent(Event& event, void* context);
+
+    /**
+     * Wait for any of the events in the set to be signaled.
+     *
+     * @param signaledContexts  Contexts of the registrations whose events are signaled.
+     * @param maxMs             Max number of milliseconds to wait or WAIT_FOREVER to wait forever.
+     * @return ER_OK if at least one event is signaled, ER_TIMEOUT if none were signaled in time.
+     */
+    QStatus Wait(std::vector<void*>& signaledContexts, uint32_t maxMs = Event::WAIT_FOREVER);
+
+  private:
+
+    /** Copy constructor is private - EventSets cannot be copied */
+    EventSet(const EventSet& other);
+
+    /** Assignment operator is private - EventSets cannot be assigned */
+    EventSet& operator=(const EventSet& other);
+
+    /**
+     * Wait once for the events in the set.  May return ER_TIMEOUT early when the registrations change.
+     */
+    QStatus WaitOnce(std::vector<void*>& signaledContexts, uint32_t maxMs);
+
+    /**
+     * select() based Wait that rebuilds the set of check events on every call.
+     */
+    QStatus SelectWait(std::vector<void*>& signaledContexts, uint32_t maxMs);
+
+    Mutex lock;                                   /**< Protects the registrations */
+    std::multimap<Event*, void*> registrations;   /**< All registered events and their contexts */
+    Event changeEvent;                            /**< Wakes up a blocked Wait when the registrations change */
+    bool inSelectWait;                            /**< true while a select fallback Wait is blocked */
+    std::vector<Event*> removeWaiters;            /**< Set when the blocked select fallback Wait completes */
+
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    /**
+     * Recompute the epoll interest mask for a descriptor after its registrations have changed.
+     */
+    QStatus UpdateInterest(int fd);
+
+#if defined(QCC_USE_IO_URING)
+    /**
+     * io_uring counterpart of UpdateInterest: arm, keep or cancel the poll for a descriptor.
+     */
+    QStatus UpdateRingInterest(int fd);
+
+    /**
+     * io_uring based Wait.  Submits queued polls, waits for completions and translates them into
+     * contexts.  TIMED and other unpolled events are handled by the caller.
+     */
+    QStatus RingWait(std::vector<void*>& signaledContexts, uint32_t maxMs);
+#endif
+
+    int epFd;                                     /**< epoll instance or -1 if io_uring or the select fallback is in use */
+    EventSetRing* ring;                           /**< io_uring instance or NULL if epoll or the select fallback is in use */
+    std::map<int, std::vector<std::pair<Event*, void*> > > fdRegistrations;  /**< Registrations keyed by descriptor */
+    std::multimap<Event*, void*> unpolledRegistrations;  /**< TIMED (and other non-pollable) events checked on every Wait */
+#endif
 };
 
 }  /* namespace */
@@ -72,6 +72,33 @@ inline int32_t DecrementAndFetch(volatile int32_t* mem)
     return __atomic_dec(mem) - 1;
 }
 
+/**
+ * Atomically set an int32_t to a new value if it currently holds an expected value.
+ *
+ * @param mem            Pointer to int32_t to be updated.
+ * @param expectedValue  Value *mem must hold for the update to take place.
+ * @param newValue       Value to store in *mem.
+ * @return  true if *mem held expectedValue and was updated.
+ */
+inline bool CompareAndExchange(volatile int32_t* mem, int32_t expectedValue, int32_t newValue)
+{
+    /* Androids built in __atomic_cmpxchg operation returns 0 if the exchange took place */
+    return __atomic_cmpxchg(expectedValue, newValue, mem) == 0;
+}
+
+/**
+ * Atomically set a pointer to a new value if it currently holds an expected value.
+ *
+ * @param mem            Pointer to the pointer to be updated.
+ * @param expectedValue  Value *mem must hold for the update to take place.
+ * @param newValue       Value to store in *mem.
+ * @return  true if *mem held expectedValue and was updated.
+ */
+inline bool CompareAndExchangePointer(void* volatile* mem, void* expectedValue, void* newValue)
+{
+    return __sync_bool_compare_and_swap(mem, expectedValue, newValue);
+}
+
 #elif defined(QCC_OS_LINUX)
 
 /**
@@ -94,6 +121,30 @@ inline int32_t DecrementAndFetch(volatile int32_t* mem) {
     return __sync_sub_and_fetch(mem, 1);
 }
 
+/**
+ * Atomically set an int32_t to a new value if it currently holds an expected value.
+ *
+ * @param mem            Pointer to int32_t to be updated.
+ * @param expectedValue  Value *mem must hold for the update to take place.
+ * @param newValue       Value to store in *mem.
+ * @return  true if *mem held expectedValue and was updated.
+ */
+inline bool CompareAndExchange(volatile int32_t* mem, int32_t expectedValue, int32_t newValue) {
+    return __sync_bool_compare_and_swap(mem, expectedValue, newValue);
+}
+
+/**
+ * Atomically set a pointer to a new value if it currently holds an expected value.
+ *
+ * @param mem            Pointer to the pointer to be updated.
+ * @param expectedValue  Value *mem must hold for the update to take place.
+ * @param newValue       Value to store in *mem.
+ * @return  true if *mem held expectedValue and was updated.
+ */
+inline bool CompareAndExchangePointer(void* volatile* mem, void* expectedValue, void* newValue) {
+    return __sync_bool_compare_and_swap(mem, expectedValue, newValue);
+}
+
 #elif defined(QCC_OS_DARWIN)
 
 /**
@@ -116,6 +167,30 @@ inline int32_t DecrementAndFetch(volatile int32_t* mem) {
     return OSAtomicDecrement32(mem);
 }
 
+/**
+ * Atomically set an int32_t to a new value if it currently holds an expected value.
+ *
+ * @param mem            Pointer to int32_t to be updated.
+ * @param expectedValue  Value *mem must hold for the update to take place.
+ * @param newValue       Value to store in *mem.
+ * @return  true if *mem held expectedValue and was updated.
+ */
+inline bool CompareAndExchange(volatile int32_t* mem, int32_t expectedValue, int32_t newValue) {
+    return OSAtomicCompareAndSwap32Barrier(expectedValue, newValue, mem);
+}
+
+/**
+ * Atomically set a pointer to a new value if it currently holds an expected value.
+ *
+ * @param mem            Pointer to the pointer to be updated.
+ * @param expectedValue  Value *mem must hold for the update to take place.
+ * @param newValue       Value to store in *mem.
+ * @return  true if *mem held expectedValue and was updated.
+ */
+inline bool CompareAndExchangePointer(void* volatile* mem, void* expectedValue, void* newValue) {
+    return OSAtomicCompareAndSwapPtrBarrier(expectedValue, newValue, mem);
+}
+
 #else
 
 /**
@@ -134,6 +209,26 @@ int32_t IncrementAndFetch(volatile int32_t* mem);
  */
 int32_t DecrementAndFetch(volatile int32_t* mem);
 
+/**
+ * Atomically set an int32_t to a new value if it currently holds an expected value.
+ *
+ * @param mem            Pointer to int32_t to be updated.
+ * @param expectedValue  Value *mem must hold for the update to take place.
+ * @param newValue       Value to store in *mem.
+ * @return  true if *mem held expectedValue and was updated.
+ */
+bool CompareAndExchange(volatile int32_t* mem, int32_t expectedValue, int32_t newValue);
+
+/**
+ * Atomically set a pointer to a new value if it currently holds an expected value.
+ *
+ * @param mem            Pointer to the pointer to be updated.
+ * @param expectedValue  Value *mem must hold for the update to take place.
+ * @param newValue       Value to store in *mem.
+ * @return  true if *mem held expectedValue and was updated.
+ */
+bool CompareAndExchangePointer(void* volatile* mem, void* expectedValue, void* newValue);
+
 #endif
 
 }
@@ -49,6 +49,14 @@ struct Timespec;
  */
 void GetTimeNow(Timespec* ts);
 
+/**
+ * Get the current time in nanoseconds.  The time base is the same as for GetTimeNow() but the
+ * resolution is as fine as the platform clock allows.
+ *
+ * @return  Current time in nanoseconds.
+ */
+uint64_t GetTimeNowNs(void);
+
 /** Timespec */
 struct Timespec {
 
@@ -56,8 +64,9 @@ struct Timespec {
 
     uint64_t seconds;       /**< Number of seconds since EPOCH */
     uint16_t mseconds;      /**< Milliseconds in EPOCH */
+    uint32_t nseconds;      /**< Nanoseconds within the millisecond */
 
-    Timespec() : seconds(0), mseconds(0) { }
+    Timespec() : seconds(0), mseconds(0), nseconds(0) { }
 
     /**
      * Construct a Timespec that refers to an absolute (EPOCH based) time expressed in milliseconds
@@ -70,6 +79,7 @@ struct Timespec {
         if (base == TIME_ABSOLUTE) {
             seconds = millis / 1000;
             mseconds = (uint16_t)(millis % 1000);
+            nseconds = 0;
         } else {
             GetTimeNow(this);
             seconds += (millis + mseconds) / 1000;
@@ -78,8 +88,11 @@ struct Timespec {
     }
 
     Timespec& operator+=(const Timespec& other) {
-        seconds += other.seconds + (mseconds + other.mseconds) / 1000;
-        mseconds = ((mseconds + other.mseconds) % 1000);
+        uint32_t ns = nseconds + other.nseconds;
+        uint32_t ms = mseconds + other.mseconds + ns / 1000000;
+        seconds += other.seconds + ms / 1000;
+        mseconds = (uint16_t)(ms % 1000);
+        nseconds = ns % 1000000;
         return *this;
     }
 
@@ -89,16 +102,30 @@ struct Timespec {
         return *this;
     }
 
+    /**
+     * Add a number of nanoseconds.
+     *
+     * @param ns  Nanoseconds to add.
+     */
+    Timespec& AddNanos(uint64_t ns) {
+        ns += nseconds;
+        uint64_t ms = mseconds + ns / 1000000;
+        seconds += ms / 1000;
+        mseconds = (uint16_t)(ms % 1000);
+        nseconds = (uint32_t)(ns % 1000000);
+        return *this;
+    }
+
     bool operator<(const Timespec& other) const {
-        return (seconds < other.seconds) || ((seconds == other.seconds) && (mseconds < other.mseconds));
+        return (seconds < other.seconds) || ((seconds == other.seconds) && ((mseconds < other.mseconds) || ((mseconds == other.mseconds) && (nseconds < other.nseconds))));
     }
 
     bool operator<=(const Timespec& other) const {
-        return (seconds < other.seconds) || ((seconds == other.seconds) && (mseconds <= other.mseconds));
+        return !(other < *this);
     }
 
     bool operator==(const Timespec& other) const {
-        return (seconds == other.seconds) && (mseconds == other.mseconds);
+        return (seconds == other.seconds) && (mseconds == other.mseconds) && (nseconds == other.nseconds);
     }
 
     bool operator!=(const Timespec& other) const {
@@ -107,6 +134,8 @@ struct Timespec {
 
     uint64_t GetAbsoluteMillis() const { return (seconds * 1000) + (uint64_t)mseconds; }
 
+    uint64_t GetAbsoluteNanos() const { return (GetAbsoluteMillis() * 1000000) + (uint64_t)nseconds; }
+
 };
 
 /**
@@ -124,9 +153,8 @@ uint64_t GetTimestamp64(void);
 
 inline Timespec operator+(const Timespec& tsa, const Timespec& tsb)
 {
-    Timespec ret;
-    ret.seconds = tsa.seconds + tsb.seconds + (tsa.mseconds + tsb.mseconds) / 1000;
-    ret.mseconds = (tsa.mseconds + tsb.mseconds) % 1000;
+    Timespec ret = tsa;
+    ret += tsb;
     return ret;
 }
 
@@ -135,6 +163,7 @@ inline Timespec operator+(const Timespec& ts, uint32_t ms)
     Timespec ret;
     ret.seconds = ts.seconds + (ts.mseconds + ms) / 1000;
     ret.mseconds = (uint16_t)((ts.mseconds + ms) % 1000);
+    ret.nseconds = ts.nseconds;
     return ret;
 }
 
@@ -29,6 +29,7 @@
 
 #include <winsock2.h>
 #include <windows.h>
+#include <map>
 #include <vector>
 
 #include <qcc/atomic.h>
@@ -253,6 +254,70 @@ class Event {
 
 };
 
+/**
+ * A persistent set of events that can be waited on repeatedly.
+ *
+ * Events are added to an EventSet once and stay registered until they are removed.  Events may be
+ * added and removed while another thread is blocked in Wait.
+ */
+class EventSet {
+  public:
+
+    /** Construct an empty event set. */
+    EventSet();
+
+    /** Destructor */
+    ~EventSet();
+
+    /**
+     * Add an event to the set.
+     * The same event may be added more than once with different contexts.
+     *
+     * @param event    Event to wait on.
+     * @param context  Opaque value reported by Wait when the event is signaled.
+     * @return ER_OK if successful.
+     */
+    QStatus AddEvent(Event& event, void* context);
+
+    /**
+     * Remove an event previously added with the same context.
+     * Once this call returns, subsequent calls to Wait will not report the context.
+     *
+     * @param event    Event to remove.
+     * @param context  Context the event was added with.
+     * @return ER_OK if successful.
+     */
+    QStatus RemoveEvent(Event& event, void* context);
+
+    /**
+     * Wait for any of the events in the set to be signaled.
+     *
+     * @param signaledContexts  Contexts of the registrations whose events are signaled.
+     * @param maxMs             Max number of milliseconds to wait or WAIT_FOREVER to wait forever.
+     * @return ER_OK if at least one event is signaled, ER_TIMEOUT if none were signaled in time.
+     */
+    QStatus Wait(std::vector<void*>& signaledContexts, uint32_t maxMs = Event::WAIT_FOREVER);
+
+  private:
+
+    /** Copy constructor is private - EventSets cannot be copied */
+    EventSet(const EventSet& other);
+
+    /** Assignment operator is private - EventSets cannot be assigned */
+    EventSet& operator=(const EventSet& other);
+
+    /**
+     * Wait once for the events in the set.  May return ER_TIMEOUT early when the registrations change.
+     */
+    QStatus WaitOnce(std::vector<void*>& signaledContexts, uint32_t maxMs);
+
+    Mutex lock;                                   /**< Protects the registrations */
+    std::multimap<Event*, void*> registrations;   /**< All registered events and their contexts */
+    Event changeEvent;                            /**< Wakes up a blocked Wait when the registrations change */
+    bool inWait;                                  /**< true while a Wait is blocked */
+    std::vector<Event*> removeWaiters;            /**< Set when the blocked Wait completes */
+};
+
 static class Event::Initializer {
   public:
     Initializer();
@@ -27,14 +27,33 @@
 #include <pthread.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <map>
 #include <vector>
 
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#if defined(QCC_OS_LINUX) && defined(QCC_USE_IO_URING)
+#include <endian.h>
+#include <string.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #include <qcc/Debug.h>
 #include <qcc/Event.h>
 #include <qcc/Mutex.h>
 #include <qcc/Stream.h>
 #include <qcc/Thread.h>
 #include <qcc/time.h>
+#include <qcc/Util.h>
 
 using namespace std;
 using namespace qcc;
@@ -42,14 +61,98 @@ using namespace qcc;
 /** @internal */
 #define QCC_MODULE "EVENT"
 
+#if !defined(QCC_OS_LINUX) && !defined(QCC_OS_ANDROID)
 static Mutex* pipeLock = NULL;
 static vector<pair<int, int> >* freePipeList;
 static vector<pair<int, int> >* usedPipeList;
+#endif
+
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+/** Size hint passed to epoll_create (ignored by modern kernels but must be positive) */
+#define EPOLL_SIZE_HINT 64
+
+/** Maximum number of ready descriptors collected by a single EventSet::Wait */
+#define EPOLL_MAX_EVENTS 128
+
+/** Number of times ResetEvent yields waiting for an in flight SetEvent write before it blocks in poll */
+#define RESET_SPIN_COUNT 16
+#endif
 
 Event Event::alwaysSet(0, 0);
 
 Event Event::neverSet(WAIT_FOREVER, 0);
 
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+QStatus Event::Wait(Event& evt, uint32_t maxWaitMs)
+{
+    /* poll() is used rather than select() so that descriptors above FD_SETSIZE can be waited on */
+    struct pollfd fds[3];
+    nfds_t numFds = 0;
+    int stopIdx = -1;
+    uint32_t timeoutMs = maxWaitMs;
+
+    Thread* thread = Thread::GetThread();
+
+    if (evt.eventType == TIMED) {
+        uint32_t now = GetTimestamp();
+        if (evt.timestamp <= now) {
+            if (0 < evt.period) {
+                evt.timestamp += (((now - evt.timestamp) / evt.period) + 1) * evt.period;
+            }
+            return ER_OK;
+        } else if ((timeoutMs == WAIT_FOREVER) || ((evt.timestamp - now) < timeoutMs)) {
+            timeoutMs = evt.timestamp - now;
+        }
+    } else {
+        short mask = (evt.eventType == IO_WRITE) ? POLLOUT : POLLIN;
+        if (0 <= evt.fd) {
+            fds[numFds].fd = evt.fd;
+            fds[numFds++].events = mask;
+        }
+        if (0 <= evt.ioFd) {
+            fds[numFds].fd = evt.ioFd;
+            fds[numFds++].events = mask;
+        }
+    }
+
+    if (thread) {
+        stopIdx = numFds;
+        fds[numFds].fd = thread->GetStopEvent().fd;
+        fds[numFds++].events = POLLIN;
+    }
+
+    for (nfds_t i = 0; i < numFds; ++i) {
+        fds[i].revents = 0;
+    }
+
+    evt.IncrementNumThreads();
+
+    int timeout = (timeoutMs == WAIT_FOREVER) ? -1 : static_cast<int>(min(timeoutMs, static_cast<uint32_t>(INT_MAX)));
+    int ret = poll(fds, numFds, timeout);
+
+    evt.DecrementNumThreads();
+
+    if ((0 < ret) && (0 <= stopIdx) && fds[stopIdx].revents) {
+        return thread->IsStopping() ? ER_STOPPING_THREAD : ER_ALERTED_THREAD;
+    } else if (evt.eventType == TIMED) {
+        uint32_t now = GetTimestamp();
+        if (now >= evt.timestamp) {
+            if (0 < evt.period) {
+                evt.timestamp += (((now - evt.timestamp) / evt.period) + 1) * evt.period;
+            }
+            return ER_OK;
+        } else {
+            return ER_TIMEOUT;
+        }
+    } else if (0 < ret) {
+        return ER_OK;
+    } else if (0 == ret) {
+        return ER_TIMEOUT;
+    } else {
+        return ER_FAIL;
+    }
+}
+#else
 QStatus Event::Wait(Event& evt, uint32_t maxWaitMs)
 {
     fd_set set;
@@ -134,7 +237,106 @@ QStatus Event::Wait(Event& evt, uint32_t maxWaitMs)
     }
 }
 
+#endif
+
 QStatus Event::Wait(const vector<Event*>& checkEvents, vector<Event*>& signaledEvents, uint32_t maxWaitMs)
+{
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    return PollWait(checkEvents, signaledEvents, maxWaitMs);
+#else
+    return SelectWait(checkEvents, signaledEvents, maxWaitMs);
+#endif
+}
+
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+
+QStatus Event::PollWait(const vector<Event*>& checkEvents, vector<Event*>& signaledEvents, uint32_t maxWaitMs)
+{
+    /*
+     * A one-shot wait is a single poll() call.  Unlike an epoll instance this
+     * needs no setup syscalls per descriptor, and unlike select() it is not
+     * limited to descriptors below FD_SETSIZE.  A descriptor shared by several
+     * events (e.g. the source and sink events of a socket stream) simply
+     * appears once per event.
+     */
+    vector<struct pollfd> fds;
+    vector<Event*> fdEvents;
+    uint32_t timeoutMs = maxWaitMs;
+
+    fds.reserve(2 * checkEvents.size());
+    fdEvents.reserve(2 * checkEvents.size());
+
+    vector<Event*>::const_iterator it;
+    for (it = checkEvents.begin(); it != checkEvents.end(); ++it) {
+        Event* evt = *it;
+        evt->IncrementNumThreads();
+        if ((evt->eventType == IO_READ) || (evt->eventType == GEN_PURPOSE) || (evt->eventType == IO_WRITE)) {
+            struct pollfd pfd;
+            pfd.events = (evt->eventType == IO_WRITE) ? POLLOUT : POLLIN;
+            pfd.revents = 0;
+            if (0 <= evt->fd) {
+                pfd.fd = evt->fd;
+                fds.push_back(pfd);
+                fdEvents.push_back(evt);
+            }
+            if (0 <= evt->ioFd) {
+                pfd.fd = evt->ioFd;
+                fds.push_back(pfd);
+                fdEvents.push_back(evt);
+            }
+        } else if (evt->eventType == TIMED) {
+            uint32_t now = GetTimestamp();
+            if (evt->timestamp <= now) {
+                timeoutMs = 0;
+            } else if ((timeoutMs == WAIT_FOREVER) || ((evt->timestamp - now) < timeoutMs)) {
+                timeoutMs = evt->timestamp - now;
+            }
+        }
+    }
+
+    int timeout = (timeoutMs == WAIT_FOREVER) ? -1 : static_cast<int>(min(timeoutMs, static_cast<uint32_t>(INT_MAX)));
+    int ret = poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout);
+
+    for (it = checkEvents.begin(); it != checkEvents.end(); ++it) {
+        (*it)->DecrementNumThreads();
+    }
+
+    if (ret < 0) {
+        QCC_LogError(ER_FAIL, ("poll failed with %d (%s)", errno, strerror(errno)));
+        return ER_FAIL;
+    }
+
+    if (0 < ret) {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            /* As with select(), errors and hangups make a descriptor both readable and writable */
+            if (fds[i].revents & (fds[i].events | POLLERR | POLLHUP | POLLNVAL)) {
+                Event* evt = fdEvents[i];
+                /* An event with both an fd and an ioFd can be reported twice */
+                if (signaledEvents.empty() || (signaledEvents.back() != evt)) {
+                    signaledEvents.push_back(evt);
+                }
+            }
+        }
+    }
+
+    for (it = checkEvents.begin(); it != checkEvents.end(); ++it) {
+        Event* evt = *it;
+        if (evt->eventType == TIMED) {
+            uint32_t now = GetTimestamp();
+            if (evt->timestamp <= now) {
+                signaledEvents.push_back(evt);
+                if (0 < evt->period) {
+                    evt->timestamp += (((now - evt->timestamp) / evt->period) + 1) * evt->period;
+                }
+            }
+        }
+    }
+    return signaledEvents.empty() ? ER_TIMEOUT : ER_OK;
+}
+
+#endif
+
+QStatus Event::SelectWait(const vector<Event*>& checkEvents, vector<Event*>& signaledEvents, uint32_t maxWaitMs)
 {
     fd_set rdset;
     fd_set wrset;
@@ -227,6 +429,30 @@ QStatus Event::Wait(const vector<Event*>& checkEvents, vector<Event*>& signaledE
     }
 }
 
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+/*
+ * On Linux general purpose events are backed by an eventfd.  A single descriptor is used for both
+ * setting and waiting so there is no need for the shared pipe pool (or its lock).  The eventfd is
+ * a semaphore so each read consumes exactly one SetEvent write; a ResetEvent racing with a
+ * SetEvent then cannot drain the write that goes with the signaled flag the SetEvent just set.
+ */
+static void createPipe(int* rdFd, int* wrFd)
+{
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (0 > efd) {
+        QCC_LogError(ER_FAIL, ("Failed to create eventfd. (%d) %s", errno, strerror(errno)));
+    }
+    *rdFd = efd;
+    *wrFd = efd;
+}
+
+static void destroyPipe(int rdFd, int wrFd)
+{
+    if (0 <= rdFd) {
+        close(rdFd);
+    }
+}
+#else
 static void createPipe(int* rdFd, int* wrFd)
 {
 #ifdef DEBUG_EVENT_LEAKS
@@ -331,14 +557,15 @@ static void destroyPipe(int rdFd, int wrFd)
     }
 #endif
 }
+#endif
 
-Event::Event() : fd(-1), signalFd(-1), ioFd(-1), eventType(GEN_PURPOSE), numThreads(0)
+Event::Event() : fd(-1), signalFd(-1), ioFd(-1), eventType(GEN_PURPOSE), numThreads(0), signaled(0), writeAbandoned(0)
 {
     createPipe(&fd, &signalFd);
 }
 
 Event::Event(int ioFd, EventType eventType, bool genPurpose)
-    : fd(-1), signalFd(-1), ioFd(ioFd), eventType(eventType), timestamp(0), period(0), numThreads(0)
+    : fd(-1), signalFd(-1), ioFd(ioFd), eventType(eventType), timestamp(0), period(0), numThreads(0), signaled(0), writeAbandoned(0)
 {
     if (genPurpose) {
         createPipe(&fd, &signalFd);
@@ -346,7 +573,7 @@ Event::Event(int ioFd, EventType eventType, bool genPurpose)
 }
 
 Event::Event(Event& event, EventType eventType, bool genPurpose)
-    : fd(-1), signalFd(-1), ioFd(event.ioFd), eventType(eventType), timestamp(0), period(0), numThreads(0)
+    : fd(-1), signalFd(-1), ioFd(event.ioFd), eventType(eventType), timestamp(0), period(0), numThreads(0), signaled(0), writeAbandoned(0)
 {
     if (genPurpose) {
         createPipe(&fd, &signalFd);
@@ -360,7 +587,9 @@ Event::Event(uint32_t timestamp, uint32_t period)
     eventType(TIMED),
     timestamp(WAIT_FOREVER == timestamp ? WAIT_FOREVER : GetTimestamp() + timestamp),
     period(period),
-    numThreads(0)
+    numThreads(0),
+    signaled(0),
+    writeAbandoned(0)
 {
 }
 
@@ -371,8 +600,8 @@ Event::~Event()
         SetEvent();
     }
 
-    /* Destroy eventfd if one was created */
-    if (GEN_PURPOSE == eventType) {
+    /* Destroy eventfd (or pipe) if one was created */
+    if (0 <= fd) {
         destroyPipe(fd, signalFd);
     }
 }
@@ -382,6 +611,25 @@ QStatus Event::SetEvent()
     QStatus status;
 
     if (GEN_PURPOSE == eventType) {
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+        /*
+         * Only the thread that moves signaled from 0 to 1 writes to the eventfd. Setting an event
+         * that is already set costs no system calls.
+         */
+        if (!CompareAndExchange(&signaled, 0, 1)) {
+            return ER_OK;
+        }
+        uint64_t val = 1;
+        int ret = write(signalFd, &val, sizeof(val));
+        status = (ret == sizeof(val)) ? ER_OK : ER_FAIL;
+        if (ER_OK != status) {
+            QCC_LogError(status, ("eventfd write failed with %d (%s)", errno, strerror(errno)));
+            if (!CompareAndExchange(&signaled, 1, 0)) {
+                /* A ResetEvent already cleared signaled and is waiting for this write */
+                writeAbandoned = 1;
+            }
+        }
+#else
         char val = 's';
         fd_set rdSet;
         struct timeval tv;
@@ -393,6 +641,7 @@ QStatus Event::SetEvent()
             ret = write(signalFd, &val, sizeof(val));
         }
         status = (ret == 1) ? ER_OK : ER_FAIL;
+#endif
     } else if (TIMED == eventType) {
         uint32_t now = GetTimestamp();
         if (now < timestamp) {
@@ -416,6 +665,39 @@ QStatus Event::ResetEvent()
     QStatus status = ER_OK;
 
     if (GEN_PURPOSE == eventType) {
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+        /*
+         * The thread that moves signaled from 1 to 0 consumes the write made by the thread that
+         * moved it from 0 to 1.  That write may still be in flight, in which case the read is
+         * retried until it (or a later one) lands, or SetEvent reports that it failed, so that
+         * the eventfd count always ends up matching signaled.  A short spin covers the usual
+         * case; after that the thread blocks in poll rather than burning CPU.
+         */
+        if (CompareAndExchange(&signaled, 1, 0)) {
+            uint64_t val;
+            int ret;
+            uint32_t spins = 0;
+            while (((ret = read(fd, &val, sizeof(val))) < 0) && ((EAGAIN == errno) || (EINTR == errno))) {
+                if (CompareAndExchange(&writeAbandoned, 1, 0)) {
+                    return ER_OK;
+                }
+                if (spins < RESET_SPIN_COUNT) {
+                    ++spins;
+                    sched_yield();
+                } else {
+                    struct pollfd pfd;
+                    pfd.fd = fd;
+                    pfd.events = POLLIN;
+                    pfd.revents = 0;
+                    poll(&pfd, 1, 1);
+                }
+            }
+            if (ret != sizeof(val)) {
+                status = ER_FAIL;
+                QCC_LogError(status, ("eventfd read failed with %d (%s)", errno, strerror(errno)));
+            }
+        }
+#else
         char buf[32];
         int ret = sizeof(buf);
         while (sizeof(buf) == ret) {
@@ -425,6 +707,7 @@ QStatus Event::ResetEvent()
         if (ER_OK != status) {
             QCC_LogError(status, ("pipe read failed with %d (%s)", errno, strerror(errno)));
         }
+#endif
     } else if (TIMED == eventType) {
         if (0 < period) {
             uint32_t now = GetTimestamp();
@@ -444,6 +727,11 @@ QStatus Event::ResetEvent()
 
 bool Event::IsSet()
 {
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    if ((GEN_PURPOSE == eventType) && signaled) {
+        return true;
+    }
+#endif
     QStatus status(Wait(*this, 0));
     return (status == ER_OK || status == ER_ALERTED_THREAD);
 }
@@ -457,3 +745,609 @@ void Event::ResetTime(uint32_t delay, uint32_t period)
     }
     this->period = period;
 }
+
+#if defined(QCC_OS_LINUX) && defined(QCC_USE_IO_URING)
+
+namespace qcc {
+
+/**
+ * Memory mapped io_uring submission and completion queues used by EventSet.
+ *
+ * Each descriptor with registrations has at most one single-shot IORING_OP_POLL_ADD armed.
+ * Polls are queued on the submission ring and submitted together with the next wait, or
+ * immediately if another thread is already blocked waiting, so a descriptor that is re-armed
+ * by the waiting thread (e.g. by an inline IODispatch callback) costs no system call.
+ */
+struct EventSetRing {
+    int fd;                               /**< io_uring instance */
+    uint32_t sqEntries;                   /**< Size of the submission ring */
+    void* ringMap;                        /**< Mapping holding the submission and completion rings */
+    size_t ringMapSize;                   /**< Size of ringMap */
+    struct io_uring_sqe* sqes;            /**< Submission queue entries */
+    size_t sqesSize;                      /**< Size of sqes mapping */
+    volatile uint32_t* sqHead;            /**< Submission ring head (advanced by the kernel) */
+    volatile uint32_t* sqTail;            /**< Submission ring tail */
+    uint32_t sqMask;                      /**< Submission ring index mask */
+    volatile uint32_t* sqArray;           /**< Submission ring slots */
+    volatile uint32_t* cqHead;            /**< Completion ring head */
+    volatile uint32_t* cqTail;            /**< Completion ring tail (advanced by the kernel) */
+    uint32_t cqMask;                      /**< Completion ring index mask */
+    struct io_uring_cqe* cqes;            /**< Completion queue entries */
+    uint64_t nextTag;                     /**< user_data of the next poll */
+    std::map<int, std::pair<uint32_t, uint64_t> > polls;  /**< Armed poll mask and tag keyed by descriptor */
+    std::map<uint64_t, int> tags;         /**< Descriptor of each armed poll keyed by tag */
+    std::vector<int> rearm;               /**< Descriptors whose poll completed and may need to be re-armed */
+    bool inWait;                          /**< true while a thread is blocked in io_uring_enter */
+};
+
+}
+
+/** Number of submission queue entries of an EventSet ring */
+#define IO_URING_ENTRIES 256
+
+/** user_data of submissions whose completion is of no interest */
+#define IO_URING_IGNORE_TAG 0
+
+static int IoUringEnter(int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags, void* arg, size_t argSize)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static void RingDestroy(EventSetRing* ring)
+{
+    if (ring->sqes && (ring->sqes != MAP_FAILED)) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->ringMap && (ring->ringMap != MAP_FAILED)) {
+        munmap(ring->ringMap, ring->ringMapSize);
+    }
+    if (0 <= ring->fd) {
+        close(ring->fd);
+    }
+    delete ring;
+}
+
+static EventSetRing* RingCreate()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+    if (0 > fd) {
+        QCC_DbgPrintf(("io_uring_setup failed with %d (%s), using epoll", errno, strerror(errno)));
+        return NULL;
+    }
+
+    EventSetRing* ring = new EventSetRing();
+    ring->fd = fd;
+    ring->ringMap = NULL;
+    ring->sqes = NULL;
+    ring->nextTag = IO_URING_IGNORE_TAG;
+    ring->inWait = false;
+
+    /* A single mapping for both rings and timeouts passed to io_uring_enter are required */
+    uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        QCC_DbgPrintf(("io_uring lacks required features (0x%x), using epoll", params.features));
+        RingDestroy(ring);
+        return NULL;
+    }
+
+    ring->sqEntries = params.sq_entries;
+    ring->ringMapSize = max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                            params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->ringMap = mmap(NULL, ring->ringMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = static_cast<struct io_uring_sqe*>(mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if ((ring->ringMap == MAP_FAILED) || (ring->sqes == MAP_FAILED)) {
+        QCC_LogError(ER_OS_ERROR, ("io_uring mmap failed with %d (%s), using epoll", errno, strerror(errno)));
+        RingDestroy(ring);
+        return NULL;
+    }
+
+    uint8_t* base = static_cast<uint8_t*>(ring->ringMap);
+    ring->sqHead = reinterpret_cast<volatile uint32_t*>(base + params.sq_off.head);
+    ring->sqTail = reinterpret_cast<volatile uint32_t*>(base + params.sq_off.tail);
+    ring->sqMask = *reinterpret_cast<uint32_t*>(base + params.sq_off.ring_mask);
+    ring->sqArray = reinterpret_cast<volatile uint32_t*>(base + params.sq_off.array);
+    ring->cqHead = reinterpret_cast<volatile uint32_t*>(base + params.cq_off.head);
+    ring->cqTail = reinterpret_cast<volatile uint32_t*>(base + params.cq_off.tail);
+    ring->cqMask = *reinterpret_cast<uint32_t*>(base + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+    return ring;
+}
+
+/** Number of queued submissions the kernel has not consumed yet */
+static uint32_t RingPending(EventSetRing* ring)
+{
+    __sync_synchronize();
+    return *ring->sqTail - *ring->sqHead;
+}
+
+/** Submit all queued submissions without waiting for completions */
+static void RingSubmit(EventSetRing* ring)
+{
+    uint32_t pending = RingPending(ring);
+    while (pending) {
+        int ret = IoUringEnter(ring->fd, pending, 0, 0, NULL, 0);
+        if ((0 > ret) && (EINTR != errno) && (EAGAIN != errno) && (EBUSY != errno)) {
+            QCC_LogError(ER_OS_ERROR, ("io_uring_enter failed with %d (%s)", errno, strerror(errno)));
+            break;
+        }
+        pending = RingPending(ring);
+    }
+}
+
+/** Queue a submission, submitting what is already queued if the ring is full */
+static void RingQueue(EventSetRing* ring, uint8_t opcode, int fd, uint32_t pollMask, uint64_t addr, uint64_t userData)
+{
+    if (RingPending(ring) >= ring->sqEntries) {
+        RingSubmit(ring);
+    }
+    uint32_t tail = *ring->sqTail;
+    uint32_t index = tail & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    sqe->poll32_events = (pollMask << 16) | (pollMask >> 16);
+#else
+    sqe->poll32_events = pollMask;
+#endif
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+    __sync_synchronize();
+    *ring->sqTail = tail + 1;
+}
+
+QStatus EventSet::UpdateRingInterest(int fd)
+{
+    uint32_t wanted = (fd == changeEvent.fd) ? POLLIN : 0;
+    map<int, vector<pair<Event*, void*> > >::iterator it = fdRegistrations.find(fd);
+    if (it != fdRegistrations.end()) {
+        for (vector<pair<Event*, void*> >::iterator r = it->second.begin(); r != it->second.end(); ++r) {
+            wanted |= (r->first->eventType == Event::IO_WRITE) ? POLLOUT : POLLIN;
+        }
+        if (it->second.empty()) {
+            fdRegistrations.erase(it);
+        }
+    }
+
+    pair<uint32_t, uint64_t> armed(0, IO_URING_IGNORE_TAG);
+    map<int, pair<uint32_t, uint64_t> >::iterator pit = ring->polls.find(fd);
+    if (pit != ring->polls.end()) {
+        armed = pit->second;
+    }
+
+    /*
+     * A completion reports readiness as of the time the poll fired, which may be before a
+     * registration was removed and the descriptor drained by its owner.  So any change to the
+     * wanted mask cancels the armed poll, whose completion is then ignored, and arms a new one.
+     */
+    bool cancel = armed.first && (wanted != armed.first);
+    if (cancel) {
+        RingQueue(ring, IORING_OP_POLL_REMOVE, -1, 0, armed.second, IO_URING_IGNORE_TAG);
+        ring->tags.erase(armed.second);
+        ring->polls.erase(fd);
+        armed.first = 0;
+    }
+    if (wanted && !armed.first) {
+        uint64_t tag = ++ring->nextTag;
+        RingQueue(ring, IORING_OP_POLL_ADD, fd, wanted, 0, tag);
+        ring->tags[tag] = fd;
+        ring->polls[fd] = pair<uint32_t, uint64_t>(wanted, tag);
+    }
+    if (cancel || ring->inWait) {
+        RingSubmit(ring);
+    }
+    return ER_OK;
+}
+
+QStatus EventSet::RingWait(vector<void*>& signaledContexts, uint32_t maxWaitMs)
+{
+    lock.Lock();
+    /* Re-arm descriptors whose poll completed in the previous Wait and are still wanted */
+    vector<int> rearm;
+    rearm.swap(ring->rearm);
+    for (vector<int>::iterator it = rearm.begin(); it != rearm.end(); ++it) {
+        if (ring->polls.find(*it) == ring->polls.end()) {
+            UpdateRingInterest(*it);
+        }
+    }
+    uint32_t toSubmit = RingPending(ring);
+    ring->inWait = true;
+    lock.Unlock();
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (maxWaitMs != Event::WAIT_FOREVER) {
+        ts.tv_sec = maxWaitMs / 1000;
+        ts.tv_nsec = (maxWaitMs % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uintptr_t>(&ts);
+    }
+    int ret = IoUringEnter(ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if ((0 > ret) && (EINTR != errno) && (ETIME != errno) && (EAGAIN != errno) && (EBUSY != errno)) {
+        QCC_LogError(ER_FAIL, ("io_uring_enter failed with %d (%s)", errno, strerror(errno)));
+        lock.Lock();
+        ring->inWait = false;
+        lock.Unlock();
+        return ER_FAIL;
+    }
+
+    /*
+     * Translate completions into contexts while holding the lock so that registrations
+     * removed since the polls were armed are not reported.
+     */
+    lock.Lock();
+    ring->inWait = false;
+    uint32_t head = *ring->cqHead;
+    __sync_synchronize();
+    uint32_t tail = *ring->cqTail;
+    __sync_synchronize();
+    for (; head != tail; ++head) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+        map<uint64_t, int>::iterator tit = ring->tags.find(cqe->user_data);
+        if (tit == ring->tags.end()) {
+            /* Cancelled or superseded poll */
+            continue;
+        }
+        int fd = tit->second;
+        ring->tags.erase(tit);
+        ring->polls.erase(fd);
+        ring->rearm.push_back(fd);
+
+        if (fd == changeEvent.fd) {
+            changeEvent.ResetEvent();
+            continue;
+        }
+        uint32_t revents = (0 > cqe->res) ? (POLLIN | POLLOUT) : static_cast<uint32_t>(cqe->res);
+        if (revents & (POLLERR | POLLHUP)) {
+            revents |= POLLIN | POLLOUT;
+        }
+        map<int, vector<pair<Event*, void*> > >::iterator fit = fdRegistrations.find(fd);
+        if (fit == fdRegistrations.end()) {
+            continue;
+        }
+        for (vector<pair<Event*, void*> >::iterator r = fit->second.begin(); r != fit->second.end(); ++r) {
+            Event* evt = r->first;
+            if (revents & ((evt->eventType == Event::IO_WRITE) ? POLLOUT : POLLIN)) {
+                /* An event with both an fd and an ioFd can be reported twice */
+                if ((0 > evt->fd) || (0 > evt->ioFd) || (find(signaledContexts.begin(), signaledContexts.end(), r->second) == signaledContexts.end())) {
+                    signaledContexts.push_back(r->second);
+                }
+            }
+        }
+    }
+    __sync_synchronize();
+    *ring->cqHead = head;
+    lock.Unlock();
+    return ER_OK;
+}
+
+#endif
+
+EventSet::EventSet() : inSelectWait(false)
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    , epFd(-1), ring(NULL)
+#endif
+{
+#if defined(QCC_OS_LINUX) && defined(QCC_USE_IO_URING)
+    ring = RingCreate();
+    if (ring) {
+        lock.Lock();
+        UpdateRingInterest(changeEvent.fd);
+        lock.Unlock();
+        return;
+    }
+#endif
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    epFd = epoll_create(EPOLL_SIZE_HINT);
+    if (0 <= epFd) {
+        fcntl(epFd, F_SETFD, FD_CLOEXEC);
+        /* The change event wakes up Wait when TIMED events are added */
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = changeEvent.fd;
+        if (epoll_ctl(epFd, EPOLL_CTL_ADD, changeEvent.fd, &ev) != 0) {
+            QCC_LogError(ER_OS_ERROR, ("epoll_ctl failed with %d (%s), falling back to select", errno, strerror(errno)));
+            close(epFd);
+            epFd = -1;
+        }
+    } else {
+        QCC_LogError(ER_OS_ERROR, ("epoll_create failed with %d (%s), falling back to select", errno, strerror(errno)));
+    }
+#endif
+}
+
+EventSet::~EventSet()
+{
+#if defined(QCC_OS_LINUX) && defined(QCC_USE_IO_URING)
+    if (ring) {
+        RingDestroy(ring);
+    }
+#endif
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    if (0 <= epFd) {
+        close(epFd);
+    }
+#endif
+}
+
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+QStatus EventSet::UpdateInterest(int fd)
+{
+#if defined(QCC_OS_LINUX) && defined(QCC_USE_IO_URING)
+    if (ring) {
+        return UpdateRingInterest(fd);
+    }
+#endif
+    map<int, vector<pair<Event*, void*> > >::iterator it = fdRegistrations.find(fd);
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    ev.events = 0;
+    if (it != fdRegistrations.end()) {
+        for (vector<pair<Event*, void*> >::iterator r = it->second.begin(); r != it->second.end(); ++r) {
+            ev.events |= (r->first->eventType == Event::IO_WRITE) ? EPOLLOUT : EPOLLIN;
+        }
+    }
+
+    int ret;
+    if (ev.events == 0) {
+        ret = epoll_ctl(epFd, EPOLL_CTL_DEL, fd, &ev);
+        if (it != fdRegistrations.end()) {
+            fdRegistrations.erase(it);
+        }
+    } else {
+        ret = epoll_ctl(epFd, EPOLL_CTL_MOD, fd, &ev);
+        if ((ret != 0) && (errno == ENOENT)) {
+            ret = epoll_ctl(epFd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+    if (ret != 0) {
+        QCC_LogError(ER_OS_ERROR, ("epoll_ctl(%d) failed with %d (%s)", fd, errno, strerror(errno)));
+        return ER_OS_ERROR;
+    }
+    return ER_OK;
+}
+#endif
+
+QStatus EventSet::AddEvent(Event& event, void* context)
+{
+    QStatus status = ER_OK;
+    lock.Lock();
+    registrations.insert(pair<Event*, void*>(&event, context));
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    if ((0 <= epFd) || ring) {
+        bool polled = false;
+        int fds[2] = { event.fd, event.ioFd };
+        if (event.eventType != Event::TIMED) {
+            for (size_t i = 0; i < ArraySize(fds); ++i) {
+                if (0 <= fds[i]) {
+                    fdRegistrations[fds[i]].push_back(pair<Event*, void*>(&event, context));
+                    if (UpdateInterest(fds[i]) == ER_OK) {
+                        polled = true;
+                    } else {
+                        fdRegistrations[fds[i]].pop_back();
+                        UpdateInterest(fds[i]);
+                    }
+                }
+            }
+        }
+        if (!polled) {
+            /* TIMED events and descriptors that epoll refuses (e.g. regular files) are checked on every Wait */
+            unpolledRegistrations.insert(pair<Event*, void*>(&event, context));
+            changeEvent.SetEvent();
+        }
+        lock.Unlock();
+        return status;
+    }
+#endif
+    changeEvent.SetEvent();
+    lock.Unlock();
+    return status;
+}
+
+/** Erase a single event/context pair from a registration multimap */
+static bool EraseRegistration(multimap<Event*, void*>& regs, Event* event, void* context)
+{
+    pair<multimap<Event*, void*>::iterator, multimap<Event*, void*>::iterator> range = regs.equal_range(event);
+    for (multimap<Event*, void*>::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == context) {
+            regs.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+QStatus EventSet::RemoveEvent(Event& event, void* context)
+{
+    lock.Lock();
+    if (!EraseRegistration(registrations, &event, context)) {
+        lock.Unlock();
+        return ER_FAIL;
+    }
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    if ((0 <= epFd) || ring) {
+        if (!EraseRegistration(unpolledRegistrations, &event, context)) {
+            int fds[2] = { event.fd, event.ioFd };
+            for (size_t i = 0; i < ArraySize(fds); ++i) {
+                map<int, vector<pair<Event*, void*> > >::iterator it = (0 <= fds[i]) ? fdRegistrations.find(fds[i]) : fdRegistrations.end();
+                if (it != fdRegistrations.end()) {
+                    for (vector<pair<Event*, void*> >::iterator r = it->second.begin(); r != it->second.end(); ++r) {
+                        if ((r->first == &event) && (r->second == context)) {
+                            it->second.erase(r);
+                            break;
+                        }
+                    }
+                    UpdateInterest(fds[i]);
+                }
+            }
+        }
+        lock.Unlock();
+        return ER_OK;
+    }
+#endif
+    /*
+     * A select based Wait may be blocked on the event being removed.  Wait for it to rebuild its
+     * set of check events so the caller is free to destroy the event once we return.
+     */
+    if (inSelectWait) {
+        Event waitDone;
+        removeWaiters.push_back(&waitDone);
+        changeEvent.SetEvent();
+        Event::Wait(waitDone, lock);
+    } else {
+        lock.Unlock();
+    }
+    return ER_OK;
+}
+
+QStatus EventSet::SelectWait(vector<void*>& signaledContexts, uint32_t maxWaitMs)
+{
+    vector<Event*> checkEvents;
+    vector<Event*> signaledEvents;
+
+    lock.Lock();
+    checkEvents.push_back(&changeEvent);
+    multimap<Event*, void*>::iterator it = registrations.begin();
+    while (it != registrations.end()) {
+        checkEvents.push_back(it->first);
+        it = registrations.upper_bound(it->first);
+    }
+    inSelectWait = true;
+    lock.Unlock();
+
+    QStatus status = Event::SelectWait(checkEvents, signaledEvents, maxWaitMs);
+
+    lock.Lock();
+    inSelectWait = false;
+    for (vector<Event*>::iterator w = removeWaiters.begin(); w != removeWaiters.end(); ++w) {
+        (*w)->SetEvent();
+    }
+    removeWaiters.clear();
+    for (vector<Event*>::iterator i = signaledEvents.begin(); i != signaledEvents.end(); ++i) {
+        if (*i == &changeEvent) {
+            changeEvent.ResetEvent();
+            continue;
+        }
+        pair<multimap<Event*, void*>::iterator, multimap<Event*, void*>::iterator> range = registrations.equal_range(*i);
+        for (it = range.first; it != range.second; ++it) {
+            signaledContexts.push_back(it->second);
+        }
+    }
+    lock.Unlock();
+
+    if ((status == ER_OK) || (status == ER_TIMEOUT)) {
+        status = signaledContexts.empty() ? ER_TIMEOUT : ER_OK;
+    }
+    return status;
+}
+
+QStatus EventSet::Wait(vector<void*>& signaledContexts, uint32_t maxWaitMs)
+{
+    /* A change to the registrations wakes the wait without a context to report, so wait out the remaining time */
+    uint64_t start = GetTimestamp64();
+    for (;;) {
+        uint32_t timeoutMs = maxWaitMs;
+        if (maxWaitMs != Event::WAIT_FOREVER) {
+            uint64_t elapsed = GetTimestamp64() - start;
+            timeoutMs = (elapsed < maxWaitMs) ? static_cast<uint32_t>(maxWaitMs - elapsed) : 0;
+        }
+        QStatus status = WaitOnce(signaledContexts, timeoutMs);
+        if ((status != ER_TIMEOUT) || (timeoutMs == 0)) {
+            return status;
+        }
+        if ((maxWaitMs != Event::WAIT_FOREVER) && ((GetTimestamp64() - start) >= maxWaitMs)) {
+            return status;
+        }
+    }
+}
+
+QStatus EventSet::WaitOnce(vector<void*>& signaledContexts, uint32_t maxWaitMs)
+{
+#if defined(QCC_OS_LINUX) || defined(QCC_OS_ANDROID)
+    if ((0 <= epFd) || ring) {
+        uint32_t timeoutMs = maxWaitMs;
+        multimap<Event*, void*>::iterator it;
+
+        lock.Lock();
+        for (it = unpolledRegistrations.begin(); it != unpolledRegistrations.end(); ++it) {
+            Event* evt = it->first;
+            uint32_t now = GetTimestamp();
+            if ((evt->eventType != Event::TIMED) || (evt->timestamp <= now)) {
+                timeoutMs = 0;
+            } else if ((timeoutMs == Event::WAIT_FOREVER) || ((evt->timestamp - now) < timeoutMs)) {
+                timeoutMs = evt->timestamp - now;
+            }
+        }
+        lock.Unlock();
+
+#if defined(QCC_OS_LINUX) && defined(QCC_USE_IO_URING)
+        if (ring) {
+            QStatus status = RingWait(signaledContexts, timeoutMs);
+            if (status != ER_OK) {
+                return status;
+            }
+            lock.Lock();
+        } else
+#endif
+        {
+            struct epoll_event epEvents[EPOLL_MAX_EVENTS];
+            int timeout = (timeoutMs == Event::WAIT_FOREVER) ? -1 : static_cast<int>(min(timeoutMs, static_cast<uint32_t>(INT_MAX)));
+            int ret = epoll_wait(epFd, epEvents, EPOLL_MAX_EVENTS, timeout);
+            if ((ret < 0) && (errno != EINTR)) {
+                QCC_LogError(ER_FAIL, ("epoll_wait failed with %d (%s)", errno, strerror(errno)));
+                return ER_FAIL;
+            }
+
+            /*
+             * Translate ready descriptors into contexts while holding the lock so that registrations
+             * removed since epoll_wait returned are not reported.
+             */
+            lock.Lock();
+            for (int i = 0; i < ret; ++i) {
+                int fd = epEvents[i].data.fd;
+                if (fd == changeEvent.fd) {
+                    changeEvent.ResetEvent();
+                    continue;
+                }
+                uint32_t revents = epEvents[i].events;
+                if (revents & (EPOLLERR | EPOLLHUP)) {
+                    revents |= EPOLLIN | EPOLLOUT;
+                }
+                map<int, vector<pair<Event*, void*> > >::iterator fit = fdRegistrations.find(fd);
+                if (fit == fdRegistrations.end()) {
+                    continue;
+                }
+                for (vector<pair<Event*, void*> >::iterator r = fit->second.begin(); r != fit->second.end(); ++r) {
+                    Event* evt = r->first;
+                    if (revents & ((evt->eventType == Event::IO_WRITE) ? EPOLLOUT : EPOLLIN)) {
+                        /* An event with both an fd and an ioFd can be reported twice */
+                        if ((0 > evt->fd) || (0 > evt->ioFd) || (find(signaledContexts.begin(), signaledContexts.end(), r->second) == signaledContexts.end())) {
+                            signaledContexts.push_back(r->second);
+                        }
+                    }
+                }
+            }
+        }
+        for (it = unpolledRegistrations.begin(); it != unpolledRegistrations.end(); ++it) {
+            Event* evt = it->first;
+            uint32_t now = GetTimestamp();
+            if (evt->eventType != Event::TIMED) {
+                signaledContexts.push_back(it->second);
+            } else if (evt->timestamp <= now) {
+                signaledContexts.push_back(it->second);
+                if (0 < evt->period) {
+                    evt->timestamp += (((now - evt->timestamp) / evt->period) + 1) * evt->period;
+                }
+            }
+        }
+        lock.Unlock();
+        return signaledContexts.empty() ? ER_TIMEOUT : ER_OK;
+    }
+#endif
+    return SelectWait(signaledContexts, maxWaitMs);
+}
@@ -487,6 +487,35 @@ QStatus Send(SocketFd sockfd, const void* buf, size_t len, size_t& sent)
 }
 
 
+QStatus SendV(SocketFd sockfd, const IOVec* iov, size_t numIov, size_t& sent)
+{
+    QStatus status = ER_OK;
+    struct msghdr msg;
+    ssize_t ret;
+
+    QCC_DbgTrace(("SendV(sockfd = %d, iov = <>, numIov = %lu, sent = <>)", sockfd, numIov));
+    assert(iov != NULL);
+
+    /* IOVec matches struct iovec so the list is passed straight through */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = reinterpret_cast<struct iovec*>(const_cast<IOVec*>(iov));
+    msg.msg_iovlen = std::min(numIov, static_cast<size_t>(QCC_MAX_SG_ENTRIES));
+
+    ret = sendmsg(static_cast<int>(sockfd), &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (ret == -1) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            status = ER_WOULDBLOCK;
+        } else {
+            status = ER_OS_ERROR;
+            QCC_DbgHLPrintf(("SendV (sockfd = %u): %d - %s", sockfd, errno, strerror(errno)));
+        }
+    } else {
+        sent = static_cast<size_t>(ret);
+    }
+    return status;
+}
+
+
 QStatus SendTo(SocketFd sockfd, IPAddress& remoteAddr, uint16_t remotePort,
                const void* buf, size_t len, size_t& sent)
 {
@@ -35,6 +35,7 @@
 #include <qcc/String.h>
 #include <qcc/Mutex.h>
 #include <qcc/Thread.h>
+#include <qcc/time.h>
 
 #include <Status.h>
 
@@ -77,6 +78,26 @@ QStatus Sleep(uint32_t ms) {
     return ER_OK;
 }
 
+QStatus SleepUntilNs(uint64_t deadline) {
+#if defined(QCC_OS_DARWIN)
+    /* No clock_nanosleep() so sleep relative to the current time until the deadline passes */
+    for (uint64_t now = GetTimeNowNs(); now < deadline; now = GetTimeNowNs()) {
+        struct timespec ts;
+        ts.tv_sec = (deadline - now) / 1000000000;
+        ts.tv_nsec = (deadline - now) % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+#else
+    /* GetTimeNowNs() is CLOCK_MONOTONIC so the deadline can be used as an absolute time */
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+#endif
+    return ER_OK;
+}
+
 Thread* Thread::GetThread()
 {
     Thread* ret = NULL;
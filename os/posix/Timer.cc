@@ -22,6 +22,8 @@
 
 #include <qcc/platform.h>
 
+#include <algorithm>
+
 #include <qcc/Debug.h>
 #include <qcc/Timer.h>
 #include <Status.h>
@@ -30,6 +32,17 @@
 
 #define WORKER_IDLE_TIMEOUT_MS  20
 #define FALLBEHIND_WARNING_MS   500
+#define MAX_ALARM_BATCH         64
+#define HIGH_RESOLUTION_LEAD_MS 1
+
+/*
+ * Values of Timer::intakeWake.  Otherwise it holds the low 32 bits of the time the controller wakes up,
+ * rounded up to an odd number, which is compared with serial number arithmetic.  So it is only used
+ * for times within INTAKE_WAKE_RANGE_MS of now.
+ */
+#define INTAKE_CONTROLLER_AWAKE 0
+#define INTAKE_ALWAYS_ALERT     2
+#define INTAKE_WAKE_RANGE_MS    (static_cast<int64_t>(1) << 30)
 
 using namespace std;
 using namespace qcc;
@@ -53,14 +66,17 @@ class TimerThread : public Thread {
         Thread(name),
         state(STOPPED),
         hasTimerLock(false),
+        serializationKey(NULL),
         index(index),
         timer(timer),
-        currentAlarm(NULL)
+        currentAlarm(NULL),
+        idleSince(0)
     { }
 
     virtual ~TimerThread() { }
 
     bool hasTimerLock;
+    const void* serializationKey;   /**< Key of the alarm this thread is serializing on, if any */
 
     QStatus Start(void* arg, ThreadListener* listener);
 
@@ -69,6 +85,9 @@ class TimerThread : public Thread {
 
     int GetIndex() const { return index; }
 
+    /* Enter the IDLE state, the time until the thread runs again is counted as idle time */
+    void SetIdle() { state = IDLE; idleSince = GetTimestamp64(); }
+
   protected:
     virtual ThreadReturn STDCALL Run(void* arg);
 
@@ -76,21 +95,22 @@ class TimerThread : public Thread {
     const int index;
     Timer* timer;
     const Alarm* currentAlarm;
+    uint64_t idleSince;
 };
 
 }
 
-_Alarm::_Alarm() : listener(NULL), periodMs(0), context(NULL), id(IncrementAndFetch(&nextId))
+_Alarm::_Alarm() : listener(NULL), periodMs(0), slackMs(0), serializationKey(NULL), context(NULL), id(IncrementAndFetch(&nextId))
 {
 }
 
 _Alarm::_Alarm(Timespec absoluteTime, AlarmListener* listener, void* context, uint32_t periodMs)
-    : alarmTime(absoluteTime), listener(listener), periodMs(periodMs), context(context), id(IncrementAndFetch(&nextId))
+    : alarmTime(absoluteTime), listener(listener), periodMs(periodMs), slackMs(0), serializationKey(NULL), context(context), id(IncrementAndFetch(&nextId))
 {
 }
 
 _Alarm::_Alarm(uint32_t relativeTime, AlarmListener* listener, void* context, uint32_t periodMs)
-    : alarmTime(), listener(listener), periodMs(periodMs), context(context), id(IncrementAndFetch(&nextId))
+    : alarmTime(), listener(listener), periodMs(periodMs), slackMs(0), serializationKey(NULL), context(context), id(IncrementAndFetch(&nextId))
 {
     if (relativeTime == WAIT_FOREVER) {
         alarmTime = END_OF_TIME;
@@ -101,7 +121,7 @@ _Alarm::_Alarm(uint32_t relativeTime, AlarmListener* listener, void* context, ui
 }
 
 _Alarm::_Alarm(AlarmListener* listener, void* context)
-    : alarmTime(0, TIME_RELATIVE), listener(listener), periodMs(0), context(context), id(IncrementAndFetch(&nextId))
+    : alarmTime(0, TIME_RELATIVE), listener(listener), periodMs(0), slackMs(0), serializationKey(NULL), context(context), id(IncrementAndFetch(&nextId))
 {
 }
 
@@ -120,6 +140,26 @@ uint64_t _Alarm::GetAlarmTime() const
     return alarmTime.GetAbsoluteMillis();
 }
 
+void _Alarm::SetSlack(uint32_t slackMs)
+{
+    this->slackMs = slackMs;
+}
+
+uint32_t _Alarm::GetSlack() const
+{
+    return slackMs;
+}
+
+void _Alarm::SetSerializationKey(const void* key)
+{
+    serializationKey = key;
+}
+
+const void* _Alarm::GetSerializationKey() const
+{
+    return serializationKey ? serializationKey : listener;
+}
+
 bool _Alarm::operator<(const _Alarm& other) const
 {
     return (alarmTime < other.alarmTime) || ((alarmTime == other.alarmTime) && (id < other.id));
@@ -130,8 +170,11 @@ bool _Alarm::operator==(const _Alarm& other) const
     return (alarmTime == other.alarmTime) && (id == other.id);
 }
 
-Timer::Timer(const char* name, bool expireOnExit, uint32_t concurency, bool preventReentrancy, uint32_t maxAlarms) :
+Timer::Timer(const char* name, bool expireOnExit, uint32_t concurency, bool preventReentrancy, uint32_t maxAlarms, bool highResolution, ReentrancyScope reentrancyScope) :
     OSTimer(this),
+    alarmIntake(NULL),
+    intakeWake(INTAKE_CONTROLLER_AWAKE),
+    alarmReservations(0),
     currentAlarm(NULL),
     expireOnExit(expireOnExit),
     timerThreads(concurency),
@@ -139,15 +182,54 @@ Timer::Timer(const char* name, bool expireOnExit, uint32_t concurency, bool prev
     controllerIdx(0),
     preventReentrancy(preventReentrancy),
     nameStr(name),
-    maxAlarms(maxAlarms)
+    maxAlarms(maxAlarms),
+    highResolution(highResolution),
+    reentrancyScope(reentrancyScope),
+    minWorkers(0),
+    maxThreadStartRate(0),
+    threadStartWindow(0),
+    threadStartsInWindow(0),
+    listenerStats(false),
+    statsSince(GetTimestamp64()),
+    virtualClock(NULL)
 {
     /* Timer thread objects will be created when required */
 }
 
+Timer::Timer(const char* name, VirtualClock& clock, uint32_t maxAlarms) :
+    OSTimer(this),
+    alarmIntake(NULL),
+    intakeWake(INTAKE_CONTROLLER_AWAKE),
+    alarmReservations(0),
+    currentAlarm(NULL),
+    expireOnExit(false),
+    timerThreads(1),
+    isRunning(false),
+    controllerIdx(-1),
+    preventReentrancy(false),
+    nameStr(name),
+    maxAlarms(maxAlarms),
+    highResolution(false),
+    reentrancyScope(REENTRANCY_TIMER),
+    minWorkers(0),
+    maxThreadStartRate(0),
+    threadStartWindow(0),
+    threadStartsInWindow(0),
+    listenerStats(false),
+    statsSince(GetTimestamp64()),
+    virtualClock(&clock)
+{
+    /* Alarms run on the thread that advances the clock so no timer thread is ever created */
+}
+
 Timer::~Timer()
 {
     Stop();
     Join();
+    /* Alarms still in the intake are released along with the wheel */
+    lock.Lock();
+    DrainAlarmIntake();
+    lock.Unlock();
     for (uint32_t i = 0; i < timerThreads.size(); ++i) {
         if (timerThreads[i] != NULL) {
             delete timerThreads[i];
@@ -160,7 +242,11 @@ QStatus Timer::Start()
 {
     QStatus status = ER_OK;
     lock.Lock();
-    if (!isRunning) {
+    if (!isRunning && virtualClock) {
+        /* There is no controller thread to alert, alarms are picked up when the clock is advanced */
+        controllerIdx = -1;
+        isRunning = true;
+    } else if (!isRunning) {
         controllerIdx = 0;
         isRunning = true;
         if (timerThreads[0] == NULL) {
@@ -182,6 +268,18 @@ QStatus Timer::Start()
             }
         }
         isRunning = (status == ER_OK);
+
+        /* Start the warm workers now so the first burst of alarms does not have to wait for them */
+        for (uint32_t i = 1; isRunning && (i <= minWorkers) && (i < timerThreads.size()); ++i) {
+            if (timerThreads[i] == NULL) {
+                timerThreads[i] = new TimerThread(nameStr, i, this);
+            }
+            if ((timerThreads[i]->state == TimerThread::STOPPED) && !timerThreads[i]->IsRunning() && AllowThreadStart()) {
+                if (timerThreads[i]->Start(NULL, this) == ER_OK) {
+                    ++stats.threadStarts;
+                }
+            }
+        }
     }
     lock.Unlock();
     return status;
@@ -223,92 +321,186 @@ QStatus Timer::Join()
     return status;
 }
 
-QStatus Timer::AddAlarm(const Alarm& alarm)
+QStatus Timer::PushAlarm(const Alarm& alarm)
 {
-    QStatus status = ER_OK;
+    _Alarm* a = const_cast<_Alarm*>(alarm.operator->());
+    if (!CompareAndExchange(&a->wheelLink.inIntake, 0, 1)) {
+        /* Already on its way in, like adding an alarm twice to the wheel this has no effect */
+        if (maxAlarms) {
+            DecrementAndFetch(&alarmReservations);
+        }
+        return ER_OK;
+    }
+    const_cast<Alarm&>(alarm).IncRef();
+    void* head;
+    do {
+        head = alarmIntake;
+        a->wheelLink.intakeNext = static_cast<_Alarm*>(head);
+    } while (!CompareAndExchangePointer(reinterpret_cast<void* volatile*>(&alarmIntake), head, a));
+
+    /*
+     * The controller drains the intake before it sleeps, so it only has to be alerted if it is already
+     * sleeping and the alarm may be due before it wakes up.
+     */
+    int32_t wake = intakeWake;
+    if (wake == INTAKE_CONTROLLER_AWAKE) {
+        return ER_OK;
+    }
+    if (wake != INTAKE_ALWAYS_ALERT) {
+        Timespec now;
+        GetTimeNow(&now);
+        int64_t ahead = a->alarmTime - now;
+        uint32_t when = static_cast<uint32_t>(a->alarmTime.GetAbsoluteMillis());
+        if ((ahead > -INTAKE_WAKE_RANGE_MS) && (ahead < INTAKE_WAKE_RANGE_MS) && (static_cast<int32_t>(when - static_cast<uint32_t>(wake)) >= 0)) {
+            return ER_OK;
+        }
+    }
     lock.Lock();
-    if (isRunning) {
-        /* Don't allow an infinite number of alarms to exist on this timer */
-        while (maxAlarms && (alarms.size() >= maxAlarms) && isRunning) {
-            lock.Unlock();
-            qcc::Sleep(2);
-            lock.Lock();
+    DrainAlarmIntake();
+    lock.Unlock();
+    return ER_OK;
+}
+
+void Timer::DrainAlarmIntake()
+{
+    if (!alarmIntake) {
+        return;
+    }
+    void* head;
+    do {
+        head = alarmIntake;
+    } while (!CompareAndExchangePointer(reinterpret_cast<void* volatile*>(&alarmIntake), head, NULL));
+
+    bool alertThread = false;
+    _Alarm* a = static_cast<_Alarm*>(head);
+    while (a) {
+        _Alarm* next = a->wheelLink.intakeNext;
+        Alarm alarm = Alarm::wrap(a);
+        a->wheelLink.intakeNext = NULL;
+        a->wheelLink.inIntake = 0;
+        if (alarms.InOtherWheel(alarm)) {
+            /* Added to another timer while it was on its way in */
+            QCC_LogError(ER_INVALID_DATA, ("Alarm is already pending on another timer"));
+        } else if (alarms.Add(alarm)) {
+            alertThread = true;
         }
-        /* Ensure timer is still running */
-        if (isRunning) {
-            /* Insert the alarm and alert the Timer thread if necessary */
-            bool alertThread = alarms.empty() || (alarm < *alarms.begin());
-            alarms.insert(alarm);
-
-            if (alertThread && (controllerIdx >= 0)) {
-                TimerThread* tt = timerThreads[controllerIdx];
-                if (tt->state == TimerThread::IDLE) {
-                    status = tt->Alert();
-                }
+        /* Drop the reference taken by PushAlarm, and the place taken by ReserveAlarm now that the wheel counts the alarm */
+        alarm.DecRef();
+        if (maxAlarms) {
+            DecrementAndFetch(&alarmReservations);
+        }
+        a = next;
+    }
+    if (alarms.Size() > stats.peakAlarms) {
+        stats.peakAlarms = alarms.Size();
+    }
+
+    if (alertThread && (controllerIdx >= 0)) {
+        TimerThread* tt = timerThreads[controllerIdx];
+        if (tt && (tt->state == TimerThread::IDLE)) {
+            QStatus status = tt->Alert();
+            if (status != ER_OK) {
+                QCC_LogError(status, ("Error alerting timer thread %s", tt->GetName()));
             }
-        } else {
-            status = ER_TIMER_EXITING;
         }
+    }
+}
 
-    } else {
-        status = ER_TIMER_EXITING;
+bool Timer::ArmAlarmIntake(const Timespec& wakeTime, const Timespec& now)
+{
+    int32_t wake = INTAKE_ALWAYS_ALERT;
+    if ((wakeTime.GetAbsoluteMillis() != END_OF_TIME) && ((wakeTime - now) < INTAKE_WAKE_RANGE_MS)) {
+        wake = static_cast<int32_t>(static_cast<uint32_t>(wakeTime.GetAbsoluteMillis()) | 1);
     }
+    /* The exchange is a full barrier so threads that push after it see the wake time, or are seen below */
+    int32_t old;
+    do {
+        old = intakeWake;
+    } while (!CompareAndExchange(&intakeWake, old, wake));
+    return alarmIntake == NULL;
+}
 
-    lock.Unlock();
-    return status;
+void Timer::DisarmAlarmIntake()
+{
+    int32_t old;
+    do {
+        old = intakeWake;
+    } while (!CompareAndExchange(&intakeWake, old, INTAKE_CONTROLLER_AWAKE));
 }
 
-QStatus Timer::AddAlarmNonBlocking(const Alarm& alarm)
+bool Timer::ReserveAlarm()
 {
-    QStatus status = ER_OK;
-    lock.Lock();
-    if (isRunning) {
-        /* Don't allow an infinite number of alarms to exist on this timer */
-        if (maxAlarms && (alarms.size() >= maxAlarms)) {
-            lock.Unlock();
-            return ER_TIMER_FULL;
-        }
+    /*
+     * The wheel size is read without the lock.  Alarms only enter the wheel while holding a place
+     * (or, for periodic alarms, in the place they just left) and give it back afterwards, so the
+     * size read here plus the places taken never undercounts the alarms.
+     */
+    int32_t reserved = IncrementAndFetch(&alarmReservations);
+    if ((alarms.Size() + reserved) > maxAlarms) {
+        DecrementAndFetch(&alarmReservations);
+        return false;
+    }
+    return true;
+}
 
-        /* Insert the alarm and alert the Timer thread if necessary */
-        bool alertThread = alarms.empty() || (alarm < *alarms.begin());
-        alarms.insert(alarm);
+QStatus Timer::AddAlarm(const Alarm& alarm)
+{
+    if (alarms.InOtherWheel(alarm)) {
+        QCC_LogError(ER_INVALID_DATA, ("Alarm is already pending on another timer"));
+        return ER_INVALID_DATA;
+    }
+    if (!isRunning) {
+        return ER_TIMER_EXITING;
+    }
 
-        if (alertThread && (controllerIdx >= 0)) {
-            TimerThread* tt = timerThreads[controllerIdx];
-            if (tt->state == TimerThread::IDLE) {
-                status = tt->Alert();
+    /* Don't allow an infinite number of alarms to exist on this timer */
+    if (maxAlarms && !ReserveAlarm()) {
+        lock.Lock();
+        ++stats.maxAlarmsBlocked;
+        lock.Unlock();
+        while (!ReserveAlarm()) {
+            if (!isRunning) {
+                return ER_TIMER_EXITING;
             }
+            qcc::Sleep(2);
         }
-    } else {
-        status = ER_TIMER_EXITING;
     }
+    if (!isRunning) {
+        if (maxAlarms) {
+            DecrementAndFetch(&alarmReservations);
+        }
+        return ER_TIMER_EXITING;
+    }
+    return PushAlarm(alarm);
+}
 
-    lock.Unlock();
-    return status;
+QStatus Timer::AddAlarmNonBlocking(const Alarm& alarm)
+{
+    if (alarms.InOtherWheel(alarm)) {
+        QCC_LogError(ER_INVALID_DATA, ("Alarm is already pending on another timer"));
+        return ER_INVALID_DATA;
+    }
+    if (!isRunning) {
+        return ER_TIMER_EXITING;
+    }
+
+    /* Don't allow an infinite number of alarms to exist on this timer */
+    if (maxAlarms && !ReserveAlarm()) {
+        lock.Lock();
+        ++stats.maxAlarmsRejected;
+        lock.Unlock();
+        return ER_TIMER_FULL;
+    }
+    return PushAlarm(alarm);
 }
 
 bool Timer::RemoveAlarm(const Alarm& alarm, bool blockIfTriggered)
 {
     bool foundAlarm = false;
     lock.Lock();
+    DrainAlarmIntake();
     if (isRunning || expireOnExit) {
-        if (alarm->periodMs) {
-            set<Alarm>::iterator it = alarms.begin();
-            while (it != alarms.end()) {
-                if ((*it)->id == alarm->id) {
-                    foundAlarm = true;
-                    alarms.erase(it);
-                    break;
-                }
-                ++it;
-            }
-        } else {
-            set<Alarm>::iterator it = alarms.find(alarm);
-            if (it != alarms.end()) {
-                foundAlarm = true;
-                alarms.erase(it);
-            }
-        }
+        foundAlarm = alarms.Remove(alarm);
         if (blockIfTriggered && !foundAlarm) {
             /*
              * There might be a call in progress to the alarm that is being removed.
@@ -339,10 +531,9 @@ QStatus Timer::ReplaceAlarm(const Alarm& origAlarm, const Alarm& newAlarm, bool
 {
     QStatus status = ER_NO_SUCH_ALARM;
     lock.Lock();
+    DrainAlarmIntake();
     if (isRunning) {
-        set<Alarm>::iterator it = alarms.find(origAlarm);
-        if (it != alarms.end()) {
-            alarms.erase(it);
+        if (alarms.Remove(origAlarm)) {
             status = AddAlarm(newAlarm);
         } else if (blockIfTriggered) {
             /*
@@ -370,18 +561,58 @@ QStatus Timer::ReplaceAlarm(const Alarm& origAlarm, const Alarm& newAlarm, bool
     return status;
 }
 
+QStatus Timer::Rearm(const Alarm& alarm, const Timespec& alarmTime)
+{
+    QStatus status = ER_OK;
+    lock.Lock();
+    DrainAlarmIntake();
+    if (!isRunning) {
+        status = ER_TIMER_EXITING;
+    } else if (alarms.InOtherWheel(alarm)) {
+        QCC_LogError(ER_INVALID_DATA, ("Alarm is already pending on another timer"));
+        status = ER_INVALID_DATA;
+    } else if (maxAlarms && !alarms.Contains(alarm) && !ReserveAlarm()) {
+        ++stats.maxAlarmsRejected;
+        status = ER_TIMER_FULL;
+    } else {
+        /* A place taken above is given back as soon as the wheel counts the alarm */
+        bool reserved = maxAlarms && !alarms.Contains(alarm);
+        bool alertThread = alarms.Rearm(alarm, alarmTime);
+        if (reserved) {
+            DecrementAndFetch(&alarmReservations);
+        }
+        if (alarms.Size() > stats.peakAlarms) {
+            stats.peakAlarms = alarms.Size();
+        }
+
+        if (alertThread && (controllerIdx >= 0)) {
+            TimerThread* tt = timerThreads[controllerIdx];
+            if (tt->state == TimerThread::IDLE) {
+                status = tt->Alert();
+            }
+        }
+    }
+    lock.Unlock();
+    return status;
+}
+
+QStatus Timer::Rearm(const Alarm& alarm, uint32_t relativeTime)
+{
+    Timespec alarmTime(END_OF_TIME);
+    if (relativeTime != _Alarm::WAIT_FOREVER) {
+        GetClockTime(&alarmTime);
+        alarmTime += relativeTime;
+    }
+    return Rearm(alarm, alarmTime);
+}
+
 bool Timer::RemoveAlarm(const AlarmListener& listener, Alarm& alarm)
 {
     bool removedOne = false;
     lock.Lock();
+    DrainAlarmIntake();
     if (isRunning) {
-        for (set<Alarm>::iterator it = alarms.begin(); it != alarms.end(); ++it) {
-            if ((*it)->listener == &listener) {
-                alarms.erase(it);
-                removedOne = true;
-                break;
-            }
-        }
+        removedOne = alarms.RemoveListener(&listener, alarm);
         /*
          * This function is most likely being called because the listener is about to be freed. If there
          * are no alarms remaining check that we are not currently servicing an alarm for this listener.
@@ -409,19 +640,237 @@ bool Timer::RemoveAlarm(const AlarmListener& listener, Alarm& alarm)
     return removedOne;
 }
 
+QStatus Timer::Advance(uint32_t ms)
+{
+    if (!virtualClock) {
+        return ER_FAIL;
+    }
+    Timespec until;
+    virtualClock->GetTimeNow(&until);
+    until += ms;
+    return AdvanceTo(until);
+}
+
+QStatus Timer::AdvanceTo(const Timespec& until)
+{
+    if (!virtualClock) {
+        return ER_FAIL;
+    }
+    lock.Lock();
+    while (isRunning) {
+        DrainAlarmIntake();
+        Timespec now;
+        virtualClock->GetTimeNow(&now);
+        Timespec next = alarms.GetNextAlarm(now);
+        if (now < next) {
+            if (!(now < until)) {
+                break;
+            }
+            /* Jump to the next alarm, or to where the wheel has to look again, but not past until */
+            virtualClock->Set((next < until) ? next : until);
+            continue;
+        }
+
+        Alarm top = alarms.GetDueAlarm();
+        alarms.Remove(top);
+        lock.Unlock();
+        uint64_t callbackStart = GetTimestamp64();
+        (top->listener->AlarmTriggered)(top, ER_OK);
+        uint64_t callbackEnd = GetTimestamp64();
+        lock.Lock();
+        /* Callbacks take no virtual time so only their real run time is of interest */
+        RecordAlarm(top, now - top->alarmTime, callbackEnd - callbackStart);
+
+        if ((0 != top->periodMs) && isRunning && !alarms.Contains(top)) {
+            Timespec next = top->alarmTime + top->periodMs;
+            if (next < now) {
+                next = now;
+            }
+            alarms.Rearm(top, next);
+            if (alarms.Size() > stats.peakAlarms) {
+                stats.peakAlarms = alarms.Size();
+            }
+        }
+    }
+    QStatus status = isRunning ? ER_OK : ER_TIMER_EXITING;
+    lock.Unlock();
+    return status;
+}
+
+void Timer::GetClockTime(Timespec* now) const
+{
+    if (virtualClock) {
+        virtualClock->GetTimeNow(now);
+    } else {
+        GetTimeNow(now);
+    }
+}
+
 void Timer::RemoveAlarmsWithListener(const AlarmListener& listener)
 {
     Alarm a;
     while (RemoveAlarm(listener, a)) {
     }
+    lock.Lock();
+    stats.listeners.erase(&listener);
+    lock.Unlock();
+}
+
+void Timer::RecordAlarm(const Alarm& alarm, int64_t latenessMs, int64_t callbackMs)
+{
+    uint64_t late = (latenessMs > 0) ? latenessMs : 0;
+    size_t bucket = 0;
+    while ((bucket < (TimerStats::LATENESS_BUCKETS - 1)) && (late >= (static_cast<uint64_t>(1) << bucket))) {
+        ++bucket;
+    }
+    ++stats.lateness[bucket];
+    stats.maxLatenessMs = max(stats.maxLatenessMs, late);
+    ++stats.alarmsTriggered;
+
+    uint64_t callback = (callbackMs > 0) ? callbackMs : 0;
+    stats.callbackMs += callback;
+    if (listenerStats) {
+        TimerListenerStats& times = stats.listeners[alarm->listener];
+        ++times.alarms;
+        times.totalMs += callback;
+        times.maxMs = max(times.maxMs, callback);
+    }
+}
+
+void Timer::SetMinWorkers(uint32_t minWorkers)
+{
+    lock.Lock();
+    this->minWorkers = minWorkers;
+    /* Idle workers that are no longer kept warm have to notice and stop */
+    for (size_t i = 0; i < timerThreads.size(); ++i) {
+        if (timerThreads[i] && (static_cast<int32_t>(i) != controllerIdx) && (timerThreads[i]->state == TimerThread::IDLE)) {
+            timerThreads[i]->Alert();
+        }
+    }
+    lock.Unlock();
+}
+
+void Timer::SetMaxThreadStartRate(uint32_t startsPerSecond)
+{
+    lock.Lock();
+    maxThreadStartRate = startsPerSecond;
+    lock.Unlock();
+}
+
+void Timer::SetListenerStats(bool enable)
+{
+    lock.Lock();
+    listenerStats = enable;
+    if (!enable) {
+        stats.listeners.clear();
+    }
+    lock.Unlock();
+}
+
+bool Timer::KeepWorker(const TimerThread* tt) const
+{
+    /* The warm workers are the running workers with the lowest indices so the same threads are kept */
+    uint32_t lower = 0;
+    for (int32_t i = 0; (i < tt->GetIndex()) && (lower < minWorkers); ++i) {
+        const TimerThread* other = timerThreads[i];
+        if (other && (i != controllerIdx) && (other->state != TimerThread::STOPPED) && (other->state != TimerThread::STOPPING)) {
+            ++lower;
+        }
+    }
+    return lower < minWorkers;
+}
+
+bool Timer::AllowThreadStart()
+{
+    uint64_t now = GetTimestamp64();
+    if ((now - threadStartWindow) >= 1000) {
+        threadStartWindow = now;
+        threadStartsInWindow = 0;
+    }
+    if (maxThreadStartRate && (threadStartsInWindow >= maxThreadStartRate)) {
+        ++stats.threadStartsThrottled;
+        return false;
+    }
+    ++threadStartsInWindow;
+    stats.peakThreadStartsPerSecond = max(stats.peakThreadStartsPerSecond, static_cast<uint64_t>(threadStartsInWindow));
+    return true;
+}
+
+void Timer::GetStats(TimerStats& timerStats)
+{
+    lock.Lock();
+    DrainAlarmIntake();
+    stats.currentAlarms = alarms.Size();
+    stats.elapsedMs = GetTimestamp64() - statsSince;
+    timerStats = stats;
+    lock.Unlock();
+}
+
+void Timer::ResetStats()
+{
+    lock.Lock();
+    DrainAlarmIntake();
+    stats.Reset();
+    stats.peakAlarms = alarms.Size();
+    statsSince = GetTimestamp64();
+    lock.Unlock();
+}
+
+bool Timer::SerializationKeyInUse(const TimerThread* tt, const Alarm& alarm) const
+{
+    if (!preventReentrancy || (reentrancyScope != REENTRANCY_LISTENER)) {
+        return false;
+    }
+    const void* key = alarm->GetSerializationKey();
+    for (size_t i = 0; i < timerThreads.size(); ++i) {
+        if (timerThreads[i] && (timerThreads[i] != tt) && (timerThreads[i]->serializationKey == key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Timer::AcquireSerializationKey(TimerThread* tt, const Alarm& alarm)
+{
+    if (!preventReentrancy || (reentrancyScope != REENTRANCY_LISTENER)) {
+        return true;
+    }
+    if (SerializationKeyInUse(tt, alarm)) {
+        return false;
+    }
+    tt->serializationKey = alarm->GetSerializationKey();
+    tt->hasTimerLock = true;
+    return true;
+}
+
+void Timer::ReleaseReentrancy(TimerThread* tt)
+{
+    if (!tt->hasTimerLock) {
+        return;
+    }
+    tt->hasTimerLock = false;
+    if (tt->serializationKey) {
+        const void* key = tt->serializationKey;
+        tt->serializationKey = NULL;
+        /* Alarms that were held back while the key was in use are due now */
+        if (alarms.Unpark(key) && (controllerIdx >= 0)) {
+            TimerThread* controller = timerThreads[controllerIdx];
+            if (controller && (controller->state == TimerThread::IDLE)) {
+                controller->Alert();
+            }
+        }
+    } else {
+        reentrancyLock.Unlock();
+    }
 }
 
 bool Timer::HasAlarm(const Alarm& alarm)
 {
     bool ret = false;
     lock.Lock();
+    DrainAlarmIntake();
     if (isRunning) {
-        ret = alarms.count(alarm) != 0;
+        ret = alarms.Contains(alarm);
     }
     lock.Unlock();
     return ret;
@@ -461,6 +910,11 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
         Timespec now;
         GetTimeNow(&now);
         bool isController = (timer->controllerIdx == index);
+        if (state == IDLE) {
+            uint64_t nowMs = GetTimestamp64();
+            timer->stats.idleMs += nowMs - idleSince;
+            idleSince = nowMs;
+        }
 
         QCC_DbgPrintf(("TimerThread::Run(): isController == %d", isController));
         QCC_DbgPrintf(("TimerThread::Run(): controllerIdx == %d", timer->controllerIdx));
@@ -483,10 +937,20 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
          * Check for something to do, either now or at some (alarm) time in the
          * future.
          */
-        if (!timer->alarms.empty()) {
+        if (isController) {
+            timer->DisarmAlarmIntake();
+        }
+        timer->DrainAlarmIntake();
+        /* A high resolution timer treats alarms as due a little early and then sleeps precisely */
+        Timespec horizon = now;
+        if (timer->highResolution) {
+            horizon += HIGH_RESOLUTION_LEAD_MS;
+        }
+        Timespec nextAlarmTime = timer->alarms.GetNextAlarm(horizon);
+        /* Parked alarms are not counted as pending, releasing their key makes them due again */
+        if (!timer->alarms.IsEmpty() && (nextAlarmTime.GetAbsoluteMillis() != END_OF_TIME)) {
             QCC_DbgPrintf(("TimerThread::Run(): Alarms pending"));
-            const Alarm topAlarm = *(timer->alarms.begin());
-            int64_t delay = topAlarm->alarmTime - now;
+            int64_t delay = nextAlarmTime - horizon;
 
             /*
              * There is an alarm waiting to go off, but there is some delay
@@ -498,9 +962,13 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
              */
             if ((delay > 0) && (isController || (delay < WORKER_IDLE_TIMEOUT_MS))) {
                 QCC_DbgPrintf(("TimerThread::Run(): Next alarm delay == %d", delay));
-                state = IDLE;
+                SetIdle();
 
                 QStatus status = ER_TIMEOUT;
+                if (isController && !timer->ArmAlarmIntake(nextAlarmTime, now)) {
+                    /* Alarms were added since the intake was drained so go round again */
+                    status = ER_ALERTED_THREAD;
+                }
                 if (isController) {
                     /* Since there is delay for the alarm, the controller will first wait for the other
                      * threads to exit and delete their objects.
@@ -510,12 +978,12 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
                     for (size_t i = 0; i < timer->timerThreads.size(); ++i) {
                         if (i != static_cast<size_t>(index) && timer->timerThreads[i] != NULL) {
 
-                            while ((timer->timerThreads[i]->state != TimerThread::STOPPED || timer->timerThreads[i]->IsRunning()) && timer->isRunning && status == ER_TIMEOUT && delay > WORKER_IDLE_TIMEOUT_MS) {
+                            while ((timer->timerThreads[i]->state != TimerThread::STOPPED || timer->timerThreads[i]->IsRunning()) && !timer->KeepWorker(timer->timerThreads[i]) && timer->isRunning && status == ER_TIMEOUT && delay > WORKER_IDLE_TIMEOUT_MS) {
                                 timer->lock.Unlock();
                                 status = Event::Wait(Event::neverSet, WORKER_IDLE_TIMEOUT_MS);
                                 timer->lock.Lock();
                                 GetTimeNow(&now);
-                                delay = topAlarm->alarmTime - now;
+                                delay = nextAlarmTime - now;
                             }
 
                             if (status == ER_ALERTED_THREAD || status == ER_STOPPING_THREAD || !timer->isRunning || delay <= WORKER_IDLE_TIMEOUT_MS) {
@@ -539,6 +1007,22 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
                 stopEvent.ResetEvent();
             } else if (isController || (delay <= 0)) {
                 QCC_DbgPrintf(("TimerThread::Run(): Next alarm is due now"));
+                const Alarm topAlarm = timer->alarms.GetDueAlarm();
+                if (timer->highResolution && !topAlarm->slackMs) {
+                    uint64_t deadline = topAlarm->alarmTime.GetAbsoluteNanos();
+                    if (GetTimeNowNs() < deadline) {
+                        /* At most HIGH_RESOLUTION_LEAD_MS to go so sleep it off and look again */
+                        timer->lock.Unlock();
+                        SleepUntilNs(deadline);
+                        timer->lock.Lock();
+                        continue;
+                    }
+                }
+                if (timer->SerializationKeyInUse(this, topAlarm)) {
+                    /* Another thread is running an alarm with the same key, hold this one until it is done */
+                    timer->alarms.Park(topAlarm);
+                    continue;
+                }
                 /*
                  * There is an alarm waiting to go off.  We are either the
                  * controller or the alarm is past due.  If the alarm is past
@@ -626,6 +1110,11 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
                         timer->lock.Lock();
                     }
 
+                    if ((tt ? (tt->state == TimerThread::STOPPED) : (nullIdx != -1)) && timer->isRunning && !timer->AllowThreadStart()) {
+                        /* Too many threads were started lately, run the alarm without a thread to take over */
+                        tt = NULL;
+                        nullIdx = -1;
+                    }
 
                     if (timer->isRunning) {
                         if (!tt && nullIdx != -1) {
@@ -654,7 +1143,9 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
                             } else if (tt->state == TimerThread::STOPPED) {
                                 QCC_DbgPrintf(("TimerThread::Run(): Start()ing stopped timer thread (tt)"));
                                 QStatus status = tt->Start(NULL, timer);
-                                if (status != ER_OK) {
+                                if (status == ER_OK) {
+                                    ++timer->stats.threadStarts;
+                                } else {
                                     QCC_LogError(status, ("Error starting timer thread %s", tt->GetName()));
                                 }
                             }
@@ -677,12 +1168,17 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
 
                 state = RUNNING;
                 stopEvent.ResetEvent();
-                timer->lock.Unlock();
 
-                /* Get the reentrancy lock if necessary */
-                hasTimerLock = timer->preventReentrancy;
+                /*
+                 * Get the reentrancy lock if necessary.  Otherwise the lock is
+                 * held until the alarm is removed so the thread that was just
+                 * woken up to take over does not see it as due as well.
+                 */
+                hasTimerLock = timer->preventReentrancy && (timer->reentrancyScope == REENTRANCY_TIMER);
                 if (hasTimerLock) {
+                    timer->lock.Unlock();
                     timer->reentrancyLock.Lock();
+                    timer->lock.Lock();
                 }
 
                 /*
@@ -691,38 +1187,81 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
                  * either case, we are going to handle the alarm at the head of
                  * the list.
                  */
-                timer->lock.Lock();
                 /* Make sure the alarm has not been serviced yet.
                  * If it has already been serviced by another thread, just ignore
                  * and go back to the top of the loop.
                  */
-                set<Alarm>::iterator it = timer->alarms.find(topAlarm);
-                if (it != timer->alarms.end()) {
-                    Alarm top = *it;
-                    timer->alarms.erase(it);
-                    currentAlarm = &top;
-                    timer->lock.Unlock();
-
-                    QCC_DbgPrintf(("TimerThread::Run(): ******** AlarmTriggered()"));
-                    (top->listener->AlarmTriggered)(top, ER_OK);
-                    if (hasTimerLock) {
-                        timer->reentrancyLock.Unlock();
+                if (!timer->AcquireSerializationKey(this, topAlarm)) {
+                    /* Another thread took the key while the lock was released */
+                    if (timer->alarms.Contains(topAlarm)) {
+                        timer->alarms.Park(topAlarm);
                     }
-                    timer->lock.Lock();
-                    currentAlarm = NULL;
+                } else if (timer->alarms.Remove(topAlarm)) {
+                    Alarm top = topAlarm;
+                    uint32_t batched = 0;
+                    while (true) {
+                        currentAlarm = &top;
+                        timer->lock.Unlock();
 
-                    if (0 != top->periodMs) {
-                        top->alarmTime += top->periodMs;
-                        if (top->alarmTime < now) {
-                            top->alarmTime = now;
+                        QCC_DbgPrintf(("TimerThread::Run(): ******** AlarmTriggered()"));
+                        Timespec callbackStart;
+                        GetTimeNow(&callbackStart);
+                        (top->listener->AlarmTriggered)(top, ER_OK);
+                        Timespec callbackEnd;
+                        GetTimeNow(&callbackEnd);
+                        timer->lock.Lock();
+                        timer->ReleaseReentrancy(this);
+                        currentAlarm = NULL;
+                        timer->RecordAlarm(top, callbackStart - top->alarmTime, callbackEnd - callbackStart);
+
+                        /* A periodic alarm its callback re-armed is left where the callback put it */
+                        if ((0 != top->periodMs) && timer->isRunning && !timer->alarms.Contains(top)) {
+                            Timespec next = top->alarmTime + top->periodMs;
+                            if (next < now) {
+                                next = now;
+                            }
+                            QCC_DbgPrintf(("TimerThread::Run(): Adding back periodic alarm"));
+                            bool alertThread = timer->alarms.Rearm(top, next);
+                            if (timer->alarms.Size() > timer->stats.peakAlarms) {
+                                timer->stats.peakAlarms = timer->alarms.Size();
+                            }
+                            if (alertThread && (timer->controllerIdx >= 0)) {
+                                TimerThread* tt = timer->timerThreads[timer->controllerIdx];
+                                if (tt->state == TimerThread::IDLE) {
+                                    tt->Alert();
+                                }
+                            }
+                        }
+
+                        /*
+                         * Alarms with slack that are due together are run back to back by this
+                         * thread rather than each being handed off through the controller.
+                         */
+                        if (!top->slackMs || (++batched >= MAX_ALARM_BATCH) || !timer->isRunning) {
+                            break;
                         }
-                        QCC_DbgPrintf(("TimerThread::Run(): Adding back periodic alarm"));
-                        timer->AddAlarm(top);
+                        GetTimeNow(&now);
+                        if ((now < timer->alarms.GetNextAlarm(now)) || !timer->alarms.GetDueAlarm()->slackMs) {
+                            break;
+                        }
+                        top = timer->alarms.GetDueAlarm();
+                        hasTimerLock = timer->preventReentrancy && (timer->reentrancyScope == REENTRANCY_TIMER);
+                        if (hasTimerLock) {
+                            timer->lock.Unlock();
+                            timer->reentrancyLock.Lock();
+                            timer->lock.Lock();
+                        }
+                        if (!timer->AcquireSerializationKey(this, top)) {
+                            break;
+                        }
+                        if (!timer->alarms.Remove(top)) {
+                            timer->ReleaseReentrancy(this);
+                            break;
+                        }
+                        QCC_DbgPrintf(("TimerThread::Run(): Running coalesced alarm %u", batched));
                     }
                 } else {
-                    if (hasTimerLock) {
-                        timer->reentrancyLock.Unlock();
-                    }
+                    timer->ReleaseReentrancy(this);
                 }
             } else {
                 /*
@@ -730,13 +1269,17 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
                  * immediately, so we idle for WORKER_IDLE_TIMEOUT_MS and then
                  * stop it until we have a need for it to be consuming resources.
                  */
-                state = IDLE;
+                SetIdle();
                 QCC_DbgPrintf(("TimerThread::Run(): Worker with nothing to do"));
+                /* A warm worker waits until it is needed rather than stopping */
+                uint32_t idleTimeout = timer->KeepWorker(this) ? Event::WAIT_FOREVER : WORKER_IDLE_TIMEOUT_MS;
                 timer->lock.Unlock();
-                QStatus status = Event::Wait(Event::neverSet, WORKER_IDLE_TIMEOUT_MS);
+                QStatus status = Event::Wait(Event::neverSet, idleTimeout);
                 timer->lock.Lock();
-                if (status == ER_TIMEOUT && timer->controllerIdx != -1) {
+                if (status == ER_TIMEOUT && timer->controllerIdx != -1 && !timer->KeepWorker(this)) {
                     QCC_DbgPrintf(("TimerThread::Run(): Worker with nothing to do stopping"));
+                    timer->stats.idleMs += GetTimestamp64() - idleSince;
+                    ++timer->stats.threadStops;
                     state = STOPPING;
                     break;
                 }
@@ -757,12 +1300,16 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
                  * If a new alarm is added, the controller thread will be alerted and the status
                  * from Event::Wait will be ER_ALERTED_THREAD, causing the loop to be exited.
                  */
-                state = IDLE;
+                SetIdle();
                 QStatus status = ER_TIMEOUT;
+                if (!timer->ArmAlarmIntake(nextAlarmTime, now)) {
+                    /* Alarms were added since the intake was drained so go round again */
+                    status = ER_ALERTED_THREAD;
+                }
                 for (size_t i = 0; i < timer->timerThreads.size(); ++i) {
                     if (i != static_cast<size_t>(index) && timer->timerThreads[i] != NULL) {
 
-                        while ((timer->timerThreads[i]->state != TimerThread::STOPPED || timer->timerThreads[i]->IsRunning()) && timer->isRunning && status == ER_TIMEOUT) {
+                        while ((timer->timerThreads[i]->state != TimerThread::STOPPED || timer->timerThreads[i]->IsRunning()) && !timer->KeepWorker(timer->timerThreads[i]) && timer->isRunning && status == ER_TIMEOUT) {
                             timer->lock.Unlock();
                             status = Event::Wait(Event::neverSet, WORKER_IDLE_TIMEOUT_MS);
                             timer->lock.Lock();
@@ -791,12 +1338,15 @@ ThreadReturn STDCALL TimerThread::Run(void* arg)
                 stopEvent.ResetEvent();
             } else {
                 QCC_DbgPrintf(("TimerThread::Run(): non-Controller idling"));
-                state = IDLE;
+                SetIdle();
+                uint32_t idleTimeout = timer->KeepWorker(this) ? Event::WAIT_FOREVER : WORKER_IDLE_TIMEOUT_MS;
                 timer->lock.Unlock();
-                QStatus status = Event::Wait(Event::neverSet, WORKER_IDLE_TIMEOUT_MS);
+                QStatus status = Event::Wait(Event::neverSet, idleTimeout);
                 timer->lock.Lock();
-                if (status == ER_TIMEOUT && timer->controllerIdx != -1) {
+                if (status == ER_TIMEOUT && timer->controllerIdx != -1 && !timer->KeepWorker(this)) {
                     QCC_DbgPrintf(("TimerThread::Run(): non-Controller stopping"));
+                    timer->stats.idleMs += GetTimestamp64() - idleSince;
+                    ++timer->stats.threadStops;
                     state = STOPPING;
                     break;
                 }
@@ -818,25 +1368,32 @@ void Timer::ThreadExit(Thread* thread)
     TimerThread* tt = static_cast<TimerThread*>(thread);
     lock.Lock();
     if ((!isRunning) && expireOnExit) {
+        DrainAlarmIntake();
         /* Call all alarms */
-        while (!alarms.empty()) {
+        std::vector<Alarm> expiring;
+        alarms.GetAlarms(expiring);
+        for (size_t i = 0; i < expiring.size(); ++i) {
             /*
              * Note it is possible that the callback will call RemoveAlarm()
              */
-            set<Alarm>::iterator it = alarms.begin();
-            Alarm alarm = *it;
-            alarms.erase(it);
+            Alarm& alarm = expiring[i];
+            if (!alarms.Remove(alarm)) {
+                continue;
+            }
+            while (!AcquireSerializationKey(tt, alarm)) {
+                lock.Unlock();
+                qcc::Sleep(2);
+                lock.Lock();
+            }
             tt->SetCurrentAlarm(&alarm);
             lock.Unlock();
-            tt->hasTimerLock = preventReentrancy;
-            if (tt->hasTimerLock) {
+            if (preventReentrancy && (reentrancyScope == REENTRANCY_TIMER)) {
+                tt->hasTimerLock = true;
                 reentrancyLock.Lock();
             }
             alarm->listener->AlarmTriggered(alarm, ER_TIMER_EXITING);
-            if (tt->hasTimerLock) {
-                reentrancyLock.Unlock();
-            }
             lock.Lock();
+            ReleaseReentrancy(tt);
             tt->SetCurrentAlarm(NULL);
         }
     }
@@ -850,10 +1407,9 @@ void Timer::EnableReentrancy()
     Thread* thread = Thread::GetThread();
     if (nameStr == thread->GetName()) {
         TimerThread* tt = static_cast<TimerThread*>(thread);
-        if (tt->hasTimerLock) {
-            tt->hasTimerLock = false;
-            reentrancyLock.Unlock();
-        }
+        lock.Lock();
+        ReleaseReentrancy(tt);
+        lock.Unlock();
     } else {
         QCC_DbgPrintf(("Invalid call to Timer::EnableReentrancy from thread %s; only allowed from %s", Thread::GetThreadName(), nameStr.c_str()));
     }
@@ -46,6 +46,32 @@ int32_t DecrementAndFetch(volatile int32_t* mem)
     return ret;
 }
 
+bool CompareAndExchange(volatile int32_t* mem, int32_t expectedValue, int32_t newValue)
+{
+    bool ret;
+
+    pthread_mutex_lock(&atomicLock);
+    ret = (*mem == expectedValue);
+    if (ret) {
+        *mem = newValue;
+    }
+    pthread_mutex_unlock(&atomicLock);
+    return ret;
+}
+
+bool CompareAndExchangePointer(void* volatile* mem, void* expectedValue, void* newValue)
+{
+    bool ret;
+
+    pthread_mutex_lock(&atomicLock);
+    ret = (*mem == expectedValue);
+    if (ret) {
+        *mem = newValue;
+    }
+    pthread_mutex_unlock(&atomicLock);
+    return ret;
+}
+
 }
 
 #endif
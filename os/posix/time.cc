@@ -82,7 +82,7 @@ uint64_t qcc::GetTimestamp64(void)
         s_clockOffset = ts.tv_sec;
     }
 
-    ret_val = ((uint32_t)(ts.tv_sec - s_clockOffset)) * 1000;
+    ret_val = ((uint64_t)(ts.tv_sec - s_clockOffset)) * 1000;
     ret_val += (uint32_t)ts.tv_nsec / 1000000;
 
     return ret_val;
@@ -94,6 +94,14 @@ void qcc::GetTimeNow(Timespec* ts)
     platform_gettime(&_ts);
     ts->seconds = _ts.tv_sec;
     ts->mseconds = _ts.tv_nsec / 1000000;
+    ts->nseconds = _ts.tv_nsec % 1000000;
+}
+
+uint64_t qcc::GetTimeNowNs(void)
+{
+    struct timespec _ts;
+    platform_gettime(&_ts);
+    return ((uint64_t)_ts.tv_sec * 1000000000) + (uint64_t)_ts.tv_nsec;
 }
 
 qcc::String qcc::UTCTime()
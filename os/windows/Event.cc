@@ -551,5 +551,112 @@ void Event::ResetTime(uint32_t delay, uint32_t period)
     this->period = period;
 }
 
+EventSet::EventSet() : inWait(false)
+{
+}
+
+EventSet::~EventSet()
+{
+}
+
+QStatus EventSet::AddEvent(Event& event, void* context)
+{
+    lock.Lock();
+    registrations.insert(pair<Event*, void*>(&event, context));
+    changeEvent.SetEvent();
+    lock.Unlock();
+    return ER_OK;
+}
+
+QStatus EventSet::RemoveEvent(Event& event, void* context)
+{
+    lock.Lock();
+    pair<multimap<Event*, void*>::iterator, multimap<Event*, void*>::iterator> range = registrations.equal_range(&event);
+    multimap<Event*, void*>::iterator it = range.first;
+    while ((it != range.second) && (it->second != context)) {
+        ++it;
+    }
+    if (it == range.second) {
+        lock.Unlock();
+        return ER_FAIL;
+    }
+    registrations.erase(it);
+
+    /*
+     * A blocked Wait may still reference the event being removed.  Wait for it to rebuild its
+     * set of check events so the caller is free to destroy the event once we return.
+     */
+    if (inWait) {
+        Event waitDone;
+        removeWaiters.push_back(&waitDone);
+        changeEvent.SetEvent();
+        Event::Wait(waitDone, lock);
+    } else {
+        lock.Unlock();
+    }
+    return ER_OK;
+}
+
+QStatus EventSet::Wait(vector<void*>& signaledContexts, uint32_t maxWaitMs)
+{
+    /* A change to the registrations wakes the wait without a context to report, so wait out the remaining time */
+    uint64_t start = GetTimestamp64();
+    for (;;) {
+        uint32_t timeoutMs = maxWaitMs;
+        if (maxWaitMs != Event::WAIT_FOREVER) {
+            uint64_t elapsed = GetTimestamp64() - start;
+            timeoutMs = (elapsed < maxWaitMs) ? static_cast<uint32_t>(maxWaitMs - elapsed) : 0;
+        }
+        QStatus status = WaitOnce(signaledContexts, timeoutMs);
+        if ((status != ER_TIMEOUT) || (timeoutMs == 0)) {
+            return status;
+        }
+        if ((maxWaitMs != Event::WAIT_FOREVER) && ((GetTimestamp64() - start) >= maxWaitMs)) {
+            return status;
+        }
+    }
+}
+
+QStatus EventSet::WaitOnce(vector<void*>& signaledContexts, uint32_t maxWaitMs)
+{
+    vector<Event*> checkEvents;
+    vector<Event*> signaledEvents;
+
+    lock.Lock();
+    checkEvents.push_back(&changeEvent);
+    multimap<Event*, void*>::iterator it = registrations.begin();
+    while (it != registrations.end()) {
+        checkEvents.push_back(it->first);
+        it = registrations.upper_bound(it->first);
+    }
+    inWait = true;
+    lock.Unlock();
+
+    QStatus status = Event::Wait(checkEvents, signaledEvents, maxWaitMs);
+
+    lock.Lock();
+    inWait = false;
+    for (vector<Event*>::iterator w = removeWaiters.begin(); w != removeWaiters.end(); ++w) {
+        (*w)->SetEvent();
+    }
+    removeWaiters.clear();
+    for (vector<Event*>::iterator i = signaledEvents.begin(); i != signaledEvents.end(); ++i) {
+        if (*i == &changeEvent) {
+            changeEvent.ResetEvent();
+            continue;
+        }
+        pair<multimap<Event*, void*>::iterator, multimap<Event*, void*>::iterator> range = registrations.equal_range(*i);
+        for (it = range.first; it != range.second; ++it) {
+            signaledContexts.push_back(it->second);
+        }
+    }
+    lock.Unlock();
+
+    if ((status == ER_OK) || (status == ER_TIMEOUT)) {
+        status = signaledContexts.empty() ? ER_TIMEOUT : ER_OK;
+    }
+    return status;
+}
+
 }  /* namespace */
 
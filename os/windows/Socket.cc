@@ -454,6 +454,32 @@ QStatus Send(SocketFd sockfd, const void* buf, size_t len, size_t& sent)
 }
 
 
+QStatus SendV(SocketFd sockfd, const IOVec* iov, size_t numIov, size_t& sent)
+{
+    QStatus status = ER_OK;
+    DWORD ret = 0;
+
+    QCC_DbgTrace(("SendV(sockfd = %d, iov = <>, numIov = %lu, sent = <>)", sockfd, numIov));
+    assert(iov != NULL);
+
+    /* IOVec matches WSABUF so the list is passed straight through */
+    if (WSASend(static_cast<SOCKET>(sockfd), reinterpret_cast<LPWSABUF>(const_cast<IOVec*>(iov)),
+                static_cast<DWORD>(numIov), &ret, 0, NULL, NULL) == SOCKET_ERROR) {
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
+            sent = 0;
+            status = ER_WOULDBLOCK;
+        } else {
+            status = ER_OS_ERROR;
+            QCC_LogError(status, ("SendV: %s", StrError().c_str()));
+        }
+    } else {
+        sent = static_cast<size_t>(ret);
+        QCC_DbgPrintf(("Sent %u bytes", sent));
+    }
+    return status;
+}
+
+
 QStatus SendTo(SocketFd sockfd, IPAddress& remoteAddr, uint16_t remotePort,
                const void* buf, size_t len, size_t& sent)
 {
@@ -32,6 +32,7 @@
 #include <qcc/Debug.h>
 #include <qcc/Thread.h>
 #include <qcc/Mutex.h>
+#include <qcc/time.h>
 
 #include <Status.h>
 
@@ -77,6 +78,18 @@ QStatus Sleep(uint32_t ms) {
     return ER_OK;
 }
 
+QStatus SleepUntilNs(uint64_t deadline) {
+    /* Sleep for whole milliseconds then yield until the deadline passes */
+    for (uint64_t now = GetTimeNowNs(); now < deadline; now = GetTimeNowNs()) {
+        if ((deadline - now) > 1000000) {
+            ::Sleep(static_cast<DWORD>((deadline - now) / 1000000));
+        } else {
+            SwitchToThread();
+        }
+    }
+    return ER_OK;
+}
+
 Thread* Thread::GetThread()
 {
     Thread* ret = NULL;
@@ -87,6 +87,14 @@ void qcc::GetTimeNow(Timespec* ts)
 
     ts->seconds = timebuffer.time;
     ts->mseconds = timebuffer.millitm;
+    ts->nseconds = 0;
+}
+
+uint64_t qcc::GetTimeNowNs(void)
+{
+    Timespec ts;
+    GetTimeNow(&ts);
+    return ts.GetAbsoluteNanos();
 }
 
 qcc::String qcc::UTCTime()
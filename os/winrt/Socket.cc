@@ -369,6 +369,27 @@ QStatus Send(SocketFd sockfd, const void* buf, size_t len, size_t& sent)
 }
 
 
+QStatus SendV(SocketFd sockfd, const IOVec* iov, size_t numIov, size_t& sent)
+{
+    QStatus status = ER_OK;
+
+    /* The socket wrapper has no gather send so the buffers are sent one at a time */
+    sent = 0;
+    for (size_t i = 0; i < numIov; ++i) {
+        size_t actual = 0;
+        status = Send(sockfd, iov[i].buf, iov[i].len, actual);
+        if (status != ER_OK) {
+            break;
+        }
+        sent += actual;
+        if (actual < iov[i].len) {
+            break;
+        }
+    }
+    return ((status == ER_WOULDBLOCK) && (sent > 0)) ? ER_OK : status;
+}
+
+
 QStatus SendTo(SocketFd sockfd, IPAddress& remoteAddr, uint16_t remotePort,
                const void* buf, size_t len, size_t& sent)
 {
@@ -37,6 +37,7 @@
 #include <qcc/Thread.h>
 #include <qcc/Mutex.h>
 #include <qcc/Event.h>
+#include <qcc/time.h>
 
 #include <Status.h>
 
@@ -84,6 +85,14 @@ QStatus Sleep(uint32_t ms) {
     return ER_OK;
 }
 
+QStatus SleepUntilNs(uint64_t deadline) {
+    /* Sleep for whole milliseconds then poll until the deadline passes */
+    for (uint64_t now = GetTimeNowNs(); now < deadline; now = GetTimeNowNs()) {
+        Sleep(static_cast<uint32_t>((deadline - now) / 1000000));
+    }
+    return ER_OK;
+}
+
 HANDLE GetCurrentThreadWaitableHandle() {
     HANDLE handle = NULL;
     DuplicateHandle(GetCurrentProcess(),
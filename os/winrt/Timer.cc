@@ -22,6 +22,8 @@
 
 #include <qcc/platform.h>
 
+#include <algorithm>
+
 #include <qcc/Debug.h>
 #include <qcc/Timer.h>
 #include <qcc/CountDownLatch.h>
@@ -45,18 +47,18 @@ int32_t qcc::_Alarm::nextId = 0;
 
 namespace qcc {
 
-_Alarm::_Alarm() : listener(NULL), periodMs(0), context(NULL), id(IncrementAndFetch(&nextId))
+_Alarm::_Alarm() : listener(NULL), periodMs(0), slackMs(0), serializationKey(NULL), context(NULL), id(IncrementAndFetch(&nextId))
 {
 }
 
 _Alarm::_Alarm(Timespec absoluteTime, AlarmListener* listener, void* context, uint32_t periodMs)
-    : alarmTime(absoluteTime), listener(listener), periodMs(periodMs), context(context), id(IncrementAndFetch(&nextId))
+    : alarmTime(absoluteTime), listener(listener), periodMs(periodMs), slackMs(0), serializationKey(NULL), context(context), id(IncrementAndFetch(&nextId))
 {
     UpdateComputedTime(alarmTime);
 }
 
 _Alarm::_Alarm(uint32_t relativeTime, AlarmListener* listener, void* context, uint32_t periodMs)
-    : alarmTime(), listener(listener), periodMs(periodMs), context(context), id(IncrementAndFetch(&nextId))
+    : alarmTime(), listener(listener), periodMs(periodMs), slackMs(0), serializationKey(NULL), context(context), id(IncrementAndFetch(&nextId))
 {
     if (relativeTime == WAIT_FOREVER) {
         alarmTime = END_OF_TIME;
@@ -68,7 +70,7 @@ _Alarm::_Alarm(uint32_t relativeTime, AlarmListener* listener, void* context, ui
 }
 
 _Alarm::_Alarm(AlarmListener* listener, void* context)
-    : alarmTime(0, TIME_RELATIVE), listener(listener), periodMs(0), context(context), id(IncrementAndFetch(&nextId))
+    : alarmTime(0, TIME_RELATIVE), listener(listener), periodMs(0), slackMs(0), serializationKey(NULL), context(context), id(IncrementAndFetch(&nextId))
 {
     UpdateComputedTime(alarmTime);
 }
@@ -88,6 +90,26 @@ uint64_t _Alarm::GetAlarmTime() const
     return alarmTime.GetAbsoluteMillis();
 }
 
+void _Alarm::SetSlack(uint32_t slackMs)
+{
+    this->slackMs = slackMs;
+}
+
+uint32_t _Alarm::GetSlack() const
+{
+    return slackMs;
+}
+
+void _Alarm::SetSerializationKey(const void* key)
+{
+    serializationKey = key;
+}
+
+const void* _Alarm::GetSerializationKey() const
+{
+    return serializationKey ? serializationKey : listener;
+}
+
 bool _Alarm::operator<(const _Alarm& other) const
 {
     return (id < other.id);
@@ -110,12 +132,23 @@ void OSAlarm::UpdateComputedTime(Timespec absoluteTime)
     }
 }
 
-Timer::Timer(const char* name, bool expireOnExit, uint32_t concurency, bool preventReentrancy, uint32_t maxAlarms)
+Timer::Timer(const char* name, bool expireOnExit, uint32_t concurency, bool preventReentrancy, uint32_t maxAlarms, bool highResolution, ReentrancyScope reentrancyScope)
     : nameStr(name), expireOnExit(expireOnExit), timerThreads(concurency), isRunning(false), controllerIdx(0),
-    preventReentrancy(preventReentrancy), OSTimer(this), maxAlarms(maxAlarms)
+    preventReentrancy(preventReentrancy), OSTimer(this), maxAlarms(maxAlarms), highResolution(highResolution),
+    reentrancyScope(reentrancyScope), minWorkers(0), maxThreadStartRate(0), threadStartWindow(0), threadStartsInWindow(0),
+    listenerStats(false), statsSince(GetTimestamp64()), virtualClock(NULL)
 {
 }
 
+Timer::Timer(const char* name, VirtualClock& clock, uint32_t maxAlarms)
+    : nameStr(name), expireOnExit(false), timerThreads(1), isRunning(false), controllerIdx(0),
+    preventReentrancy(false), OSTimer(this), maxAlarms(maxAlarms), highResolution(false),
+    reentrancyScope(REENTRANCY_TIMER), minWorkers(0), maxThreadStartRate(0), threadStartWindow(0), threadStartsInWindow(0),
+    listenerStats(false), statsSince(GetTimestamp64()), virtualClock(&clock)
+{
+    // Alarms are always scheduled on system timers which run on the real clock
+}
+
 // WARNING: There are all types of problems with timers if you don't ensure the parent has done the below steps in the destructor
 // StopInternal and Join are already too late in many cases, but done here anyway
 Timer::~Timer()
@@ -231,12 +264,17 @@ void Timer::TimerCallback(void* context)
 
         lock.Unlock();
         // Call the alarm listener associated with this alarm
+        Timespec callbackStart;
+        GetTimeNow(&callbackStart);
         alarm->listener->AlarmTriggered(alarm, ER_OK);
+        Timespec callbackEnd;
+        GetTimeNow(&callbackEnd);
 
         // Decrement the latch value associated with this alarm (work complete)
         alarm->_latch->Decrement();
         // Re-acquire the API lock
         lock.Lock();
+        RecordAlarm(alarm, callbackStart - alarm->alarmTime, callbackEnd - callbackStart);
         // If thread still owns the reentrancyLock, release the reentrancy lock
         if (_reentrancyLockOwner == timerThreadHandle) {
             _reentrancyLockOwner = NULL;
@@ -333,6 +371,9 @@ QStatus Timer::AddAlarm(const Alarm& alarm)
     // Check if timer is running
     if (isRunning) {
         /* Don't allow an infinite number of alarms to exist on this timer */
+        if (maxAlarms && (alarms.size() >= maxAlarms)) {
+            ++stats.maxAlarmsBlocked;
+        }
         while (maxAlarms && (alarms.size() >= maxAlarms) && isRunning) {
             lock.Unlock();
             qcc::Sleep(2);
@@ -360,6 +401,9 @@ QStatus Timer::AddAlarm(const Alarm& alarm)
                 _timersCountdownLatch.Increment();
                 // Add the alarm to the list
                 alarms.insert(a);
+                if (alarms.size() > stats.peakAlarms) {
+                    stats.peakAlarms = alarms.size();
+                }
             } catch (...) {
                 status = ER_FAIL;
             }
@@ -383,6 +427,7 @@ QStatus Timer::AddAlarmNonBlocking(const Alarm& alarm)
     if (isRunning) {
         /* Don't allow an infinite number of alarms to exist on this timer */
         if (maxAlarms && (alarms.size() >= maxAlarms)) {
+            ++stats.maxAlarmsRejected;
             lock.Unlock();
             return ER_TIMER_FULL;
         }
@@ -406,6 +451,9 @@ QStatus Timer::AddAlarmNonBlocking(const Alarm& alarm)
             _timersCountdownLatch.Increment();
             // Add the alarm to the list
             alarms.insert(a);
+            if (alarms.size() > stats.peakAlarms) {
+                stats.peakAlarms = alarms.size();
+            }
         } catch (...) {
             status = ER_FAIL;
         }
@@ -504,6 +552,29 @@ QStatus Timer::ReplaceAlarm(const Alarm& origAlarm, const Alarm& newAlarm, bool
     return status;
 }
 
+QStatus Timer::Rearm(const Alarm& alarm, const Timespec& alarmTime)
+{
+    // Each alarm has its own OS timer, so cancel it and create a new one for the same alarm
+    lock.Lock();
+    RemoveAlarm(alarm, false);
+    Alarm a = (Alarm)alarm;
+    a->alarmTime = alarmTime;
+    a->UpdateComputedTime(alarmTime);
+    QStatus status = AddAlarmNonBlocking(a);
+    lock.Unlock();
+    return status;
+}
+
+QStatus Timer::Rearm(const Alarm& alarm, uint32_t relativeTime)
+{
+    Timespec alarmTime(END_OF_TIME);
+    if (relativeTime != _Alarm::WAIT_FOREVER) {
+        GetTimeNow(&alarmTime);
+        alarmTime += relativeTime;
+    }
+    return Rearm(alarm, alarmTime);
+}
+
 bool Timer::RemoveAlarm(const AlarmListener& listener, Alarm& alarm)
 {
     bool foundOne = false;
@@ -534,6 +605,85 @@ void Timer::RemoveAlarmsWithListener(const AlarmListener& listener)
     // Remove all alarms with listener
     while (RemoveAlarm(listener, a)) {
     }
+    lock.Lock();
+    stats.listeners.erase(&listener);
+    lock.Unlock();
+}
+
+void Timer::RecordAlarm(const Alarm& alarm, int64_t latenessMs, int64_t callbackMs)
+{
+    uint64_t late = (latenessMs > 0) ? latenessMs : 0;
+    size_t bucket = 0;
+    while ((bucket < (TimerStats::LATENESS_BUCKETS - 1)) && (late >= (static_cast<uint64_t>(1) << bucket))) {
+        ++bucket;
+    }
+    ++stats.lateness[bucket];
+    stats.maxLatenessMs = max(stats.maxLatenessMs, late);
+    ++stats.alarmsTriggered;
+
+    uint64_t callback = (callbackMs > 0) ? callbackMs : 0;
+    stats.callbackMs += callback;
+    if (listenerStats) {
+        TimerListenerStats& times = stats.listeners[alarm->listener];
+        ++times.alarms;
+        times.totalMs += callback;
+        times.maxMs = max(times.maxMs, callback);
+    }
+}
+
+QStatus Timer::Advance(uint32_t ms)
+{
+    return ER_NOT_IMPLEMENTED;
+}
+
+QStatus Timer::AdvanceTo(const Timespec& until)
+{
+    return ER_NOT_IMPLEMENTED;
+}
+
+void Timer::GetClockTime(Timespec* now) const
+{
+    GetTimeNow(now);
+}
+
+void Timer::SetMinWorkers(uint32_t minWorkers)
+{
+    // Alarms run on the system thread pool so there are no workers to keep
+    this->minWorkers = minWorkers;
+}
+
+void Timer::SetMaxThreadStartRate(uint32_t startsPerSecond)
+{
+    maxThreadStartRate = startsPerSecond;
+}
+
+void Timer::SetListenerStats(bool enable)
+{
+    lock.Lock();
+    listenerStats = enable;
+    if (!enable) {
+        stats.listeners.clear();
+    }
+    lock.Unlock();
+}
+
+void Timer::GetStats(TimerStats& timerStats)
+{
+    // Alarms run on the system thread pool so there are no timer threads to count
+    lock.Lock();
+    stats.currentAlarms = alarms.size();
+    stats.elapsedMs = GetTimestamp64() - statsSince;
+    timerStats = stats;
+    lock.Unlock();
+}
+
+void Timer::ResetStats()
+{
+    lock.Lock();
+    stats.Reset();
+    stats.peakAlarms = alarms.size();
+    statsSince = GetTimestamp64();
+    lock.Unlock();
 }
 
 bool Timer::HasAlarm(const Alarm& alarm)
@@ -0,0 +1,452 @@
+/**
+ * @file
+ *
+ * Hierarchical timing wheel used by Timer to hold pending alarms
+ */
+
+/******************************************************************************
+ * Copyright 2013, Qualcomm Innovation Center, Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ ******************************************************************************/
+
+#include <qcc/platform.h>
+
+#include <assert.h>
+#include <algorithm>
+
+#include <qcc/Timer.h>
+
+#define QCC_MODULE  "TIMER"
+
+using namespace std;
+using namespace qcc;
+
+/* Number of bits of the alarm time that select the list in level 0, and in each higher level */
+#define LEVEL0_BITS 8
+#define LEVEL_BITS  6
+
+/* Shift of the alarm time that selects the list in a level */
+static inline uint32_t LevelShift(uint32_t level)
+{
+    return LEVEL0_BITS + (level - 1) * LEVEL_BITS;
+}
+
+/* Index of the lowest set bit of a non-zero word */
+static inline uint32_t LowestBit(uint64_t word)
+{
+#if defined(__GNUC__)
+    return static_cast<uint32_t>(__builtin_ctzll(word));
+#else
+    uint32_t bit = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+/* Distance from bit start to the first set bit at or after it, wrapping around, in a non-zero word */
+static inline uint32_t NextBit(uint64_t word, uint32_t start)
+{
+    uint64_t rotated = start ? ((word >> start) | (word << (64 - start))) : word;
+    return LowestBit(rotated);
+}
+
+/*
+ * Time at which an alarm is put in the wheel.  With slack, the alarm time is rounded up to a multiple
+ * of the largest power of two that fits in the slack.  Alarms whose windows share such a multiple end
+ * up in the same level 0 list and so are due in the same wakeup.
+ */
+static inline uint64_t CoalescedTime(uint64_t when, uint32_t slackMs)
+{
+    if (slackMs == 0) {
+        return when;
+    }
+    uint64_t granularity = 1;
+    while ((granularity << 1) <= (static_cast<uint64_t>(slackMs) + 1)) {
+        granularity <<= 1;
+    }
+    if (when > (END_OF_TIME - granularity)) {
+        return when;
+    }
+    return (when + granularity - 1) & ~(granularity - 1);
+}
+
+/* Ordering of alarms that are due: by time, then by id as in _Alarm::operator< */
+static inline bool DueBefore(const AlarmWheelLink& link, int32_t id, const AlarmWheelLink& other, int32_t otherId)
+{
+    if (link.when != other.when) {
+        return link.when < other.when;
+    }
+    if (link.whenNs != other.whenNs) {
+        return link.whenNs < other.whenNs;
+    }
+    return id < otherId;
+}
+
+/* Source of AlarmWheel ids.  Ids are never reused, so a listener that still names a destroyed wheel cannot be mistaken for a new one */
+static volatile int32_t nextWheelId = 0;
+
+AlarmWheel::AlarmWheel() : dueTail(NULL), clock(0), wakeTime(END_OF_TIME), count(0), id(IncrementAndFetch(&nextWheelId))
+{
+    for (uint32_t i = 0; i < NUM_LISTS; ++i) {
+        lists[i] = NULL;
+    }
+    for (uint32_t i = 0; i < 8; ++i) {
+        occupied[i] = 0;
+    }
+    Timespec now;
+    GetTimeNow(&now);
+    clock = now.GetAbsoluteMillis();
+}
+
+AlarmWheel::~AlarmWheel()
+{
+    for (uint32_t i = 0; i < NUM_LISTS; ++i) {
+        while (lists[i]) {
+            _Alarm* head = lists[i];
+            Unlink(head);
+            /* Drop the reference taken by Add */
+            Alarm alarm = Alarm::wrap(head);
+            alarm.DecRef();
+        }
+    }
+}
+
+uint32_t AlarmWheel::ListFor(uint64_t when) const
+{
+    if (when <= clock) {
+        return DUE_LIST;
+    }
+    uint64_t delta = when - clock;
+    if (delta < LEVEL0_SLOTS) {
+        return static_cast<uint32_t>(when & (LEVEL0_SLOTS - 1));
+    }
+    for (uint32_t level = 1; level < NUM_LEVELS; ++level) {
+        if (delta < (static_cast<uint64_t>(1) << (LevelShift(level) + LEVEL_BITS))) {
+            return LEVEL0_SLOTS + (level - 1) * LEVEL_SLOTS + static_cast<uint32_t>((when >> LevelShift(level)) & (LEVEL_SLOTS - 1));
+        }
+    }
+    return OVERFLOW_LIST;
+}
+
+void AlarmWheel::Link(_Alarm* alarm, uint32_t list)
+{
+    AlarmWheelLink& link = alarm->wheelLink;
+    link.wheel = this;
+    link.list = list;
+    if (list == DUE_LIST) {
+        /* Keep the due list ordered. Alarms are nearly always added in order, so search from the back */
+        _Alarm* prev = dueTail;
+        while (prev && DueBefore(link, alarm->id, prev->wheelLink, prev->id)) {
+            prev = prev->wheelLink.prev;
+        }
+        link.prev = prev;
+        link.next = prev ? prev->wheelLink.next : lists[DUE_LIST];
+        if (link.next) {
+            link.next->wheelLink.prev = alarm;
+        } else {
+            dueTail = alarm;
+        }
+        if (prev) {
+            prev->wheelLink.next = alarm;
+        } else {
+            lists[DUE_LIST] = alarm;
+        }
+    } else {
+        link.prev = NULL;
+        link.next = lists[list];
+        if (link.next) {
+            link.next->wheelLink.prev = alarm;
+        }
+        lists[list] = alarm;
+        if (list < OVERFLOW_LIST) {
+            occupied[list / 64] |= static_cast<uint64_t>(1) << (list % 64);
+        }
+    }
+}
+
+void AlarmWheel::Unlink(_Alarm* alarm)
+{
+    AlarmWheelLink& link = alarm->wheelLink;
+    if (link.prev) {
+        link.prev->wheelLink.next = link.next;
+    } else {
+        lists[link.list] = link.next;
+    }
+    if (link.next) {
+        link.next->wheelLink.prev = link.prev;
+    } else if (link.list == DUE_LIST) {
+        dueTail = link.prev;
+    }
+    if ((link.list < OVERFLOW_LIST) && !lists[link.list]) {
+        occupied[link.list / 64] &= ~(static_cast<uint64_t>(1) << (link.list % 64));
+    }
+    link.prev = NULL;
+    link.next = NULL;
+    link.wheel = NULL;
+}
+
+_Alarm** AlarmWheel::ListenerHead(const AlarmListener* listener, bool create)
+{
+    /*
+     * A listener keeps the head of its alarms for the first wheel it has alarms in, so a listener
+     * used with one Timer needs no lookup or allocation.  Wheels of other Timers use listenerAlarms.
+     */
+    AlarmListener* l = const_cast<AlarmListener*>(listener);
+    if (l && (l->wheelId == id)) {
+        return &l->wheelAlarms;
+    }
+    std::map<const AlarmListener*, _Alarm*>::iterator it = listenerAlarms.empty() ? listenerAlarms.end() : listenerAlarms.find(listener);
+    if (it != listenerAlarms.end()) {
+        return &it->second;
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (l && CompareAndExchange(&l->wheelId, 0, id)) {
+        l->wheelAlarms = NULL;
+        return &l->wheelAlarms;
+    }
+    return &listenerAlarms[listener];
+}
+
+void AlarmWheel::LinkListener(_Alarm* alarm)
+{
+    _Alarm*& head = *ListenerHead(alarm->listener, true);
+    alarm->wheelLink.listenerPrev = NULL;
+    alarm->wheelLink.listenerNext = head;
+    if (head) {
+        head->wheelLink.listenerPrev = alarm;
+    }
+    head = alarm;
+}
+
+void AlarmWheel::UnlinkListener(_Alarm* alarm)
+{
+    AlarmWheelLink& link = alarm->wheelLink;
+    if (link.listenerPrev) {
+        link.listenerPrev->wheelLink.listenerNext = link.listenerNext;
+    } else if (link.listenerNext) {
+        *ListenerHead(alarm->listener, false) = link.listenerNext;
+    } else if (alarm->listener && (alarm->listener->wheelId == id)) {
+        /* The last alarm of the listener is gone, let another wheel have the head */
+        alarm->listener->wheelAlarms = NULL;
+        CompareAndExchange(&alarm->listener->wheelId, id, 0);
+    } else {
+        listenerAlarms.erase(alarm->listener);
+    }
+    if (link.listenerNext) {
+        link.listenerNext->wheelLink.listenerPrev = link.listenerPrev;
+    }
+    link.listenerPrev = NULL;
+    link.listenerNext = NULL;
+}
+
+bool AlarmWheel::Add(const Alarm& alarm)
+{
+    _Alarm* a = const_cast<_Alarm*>(alarm.operator->());
+    if (a->wheelLink.wheel) {
+        /* Like a std::set, adding an alarm that is already there does nothing */
+        assert(a->wheelLink.wheel == this);
+        return false;
+    }
+    /* The wheel holds a reference for as long as the alarm is in it */
+    const_cast<Alarm&>(alarm).IncRef();
+    LinkListener(a);
+    ++count;
+    return Place(a);
+}
+
+bool AlarmWheel::Rearm(const Alarm& alarm, const Timespec& alarmTime)
+{
+    _Alarm* a = const_cast<_Alarm*>(alarm.operator->());
+    if (a->wheelLink.wheel != this) {
+        a->alarmTime = alarmTime;
+        return Add(alarm);
+    }
+    /* Only the position in the wheel changes, the reference and listener links are kept */
+    Unlink(a);
+    a->alarmTime = alarmTime;
+    return Place(a);
+}
+
+bool AlarmWheel::Place(_Alarm* alarm)
+{
+    alarm->wheelLink.when = CoalescedTime(alarm->alarmTime.GetAbsoluteMillis(), alarm->slackMs);
+    alarm->wheelLink.whenNs = alarm->slackMs ? 0 : alarm->alarmTime.nseconds;
+    Link(alarm, ListFor(alarm->wheelLink.when));
+
+    bool earlier = alarm->wheelLink.when < wakeTime;
+    if (earlier) {
+        wakeTime = alarm->wheelLink.when;
+    }
+    return earlier;
+}
+
+bool AlarmWheel::Remove(const Alarm& alarm)
+{
+    _Alarm* a = const_cast<_Alarm*>(alarm.operator->());
+    if (a->wheelLink.wheel != this) {
+        return false;
+    }
+    Unlink(a);
+    UnlinkListener(a);
+    --count;
+    /* The caller still holds a reference so this does not free the alarm */
+    const_cast<Alarm&>(alarm).DecRef();
+    return true;
+}
+
+bool AlarmWheel::RemoveListener(const AlarmListener* listener, Alarm& alarm)
+{
+    _Alarm** head = ListenerHead(listener, false);
+    if (!head || !*head) {
+        return false;
+    }
+    alarm = Alarm::wrap(*head);
+    Remove(alarm);
+    return true;
+}
+
+void AlarmWheel::Cascade(uint32_t list)
+{
+    _Alarm* a = lists[list];
+    while (a) {
+        _Alarm* next = a->wheelLink.next;
+        Unlink(a);
+        Link(a, ListFor(a->wheelLink.when));
+        a = next;
+    }
+}
+
+uint64_t AlarmWheel::NextChange() const
+{
+    /* Level 0 lists are exact.  For higher levels the start of the block of the first non-empty
+     * list is early enough: the list is cascaded then and its alarms are looked at again.
+     */
+    uint64_t next = END_OF_TIME;
+    uint32_t current = static_cast<uint32_t>(clock & (LEVEL0_SLOTS - 1));
+    for (uint32_t i = 1; i < LEVEL0_SLOTS;) {
+        uint32_t slot = (current + i) & (LEVEL0_SLOTS - 1);
+        uint32_t span = min(static_cast<uint32_t>(64 - (slot % 64)), LEVEL0_SLOTS - i);
+        uint64_t bits = occupied[slot / 64] >> (slot % 64);
+        if (span < 64) {
+            bits &= (static_cast<uint64_t>(1) << span) - 1;
+        }
+        if (bits) {
+            next = clock + i + LowestBit(bits);
+            break;
+        }
+        i += span;
+    }
+    for (uint32_t level = 1; level < NUM_LEVELS; ++level) {
+        uint64_t bits = occupied[4 + level - 1];
+        if (bits) {
+            uint32_t shift = LevelShift(level);
+            uint32_t position = static_cast<uint32_t>((clock >> shift) & (LEVEL_SLOTS - 1));
+            /* The list of the current block holds alarms a full turn ahead */
+            uint32_t distance = NextBit(bits, (position + 1) & (LEVEL_SLOTS - 1)) + 1;
+            next = min(next, ((clock >> shift) + distance) << shift);
+        }
+    }
+    if (lists[OVERFLOW_LIST]) {
+        uint32_t shift = LevelShift(NUM_LEVELS - 1) + LEVEL_BITS;
+        next = min(next, ((clock >> shift) + 1) << shift);
+    }
+    return next;
+}
+
+void AlarmWheel::Advance(uint64_t now)
+{
+    while (clock < now) {
+        /* Blocks with nothing in them are skipped */
+        uint64_t next = NextChange();
+        if (next > now) {
+            clock = now;
+            break;
+        }
+        clock = next;
+
+        if (!(clock & (LEVEL0_SLOTS - 1))) {
+            /* Cascade the lists of the blocks that start now, top level first */
+            uint32_t level = 1;
+            while ((level < NUM_LEVELS - 1) && !(clock & ((static_cast<uint64_t>(1) << LevelShift(level + 1)) - 1))) {
+                ++level;
+            }
+            if ((level == NUM_LEVELS - 1) && !(clock & ((static_cast<uint64_t>(1) << (LevelShift(level) + LEVEL_BITS)) - 1))) {
+                Cascade(OVERFLOW_LIST);
+            }
+            for (; level > 0; --level) {
+                Cascade(LEVEL0_SLOTS + (level - 1) * LEVEL_SLOTS + static_cast<uint32_t>((clock >> LevelShift(level)) & (LEVEL_SLOTS - 1)));
+            }
+        }
+        Cascade(static_cast<uint32_t>(clock & (LEVEL0_SLOTS - 1)));
+    }
+}
+
+Timespec AlarmWheel::GetNextAlarm(const Timespec& now)
+{
+    Advance(now.GetAbsoluteMillis());
+
+    if (lists[DUE_LIST]) {
+        wakeTime = lists[DUE_LIST]->wheelLink.when;
+    } else {
+        wakeTime = NextChange();
+    }
+    return Timespec(wakeTime);
+}
+
+void AlarmWheel::Park(const Alarm& alarm)
+{
+    _Alarm* a = const_cast<_Alarm*>(alarm.operator->());
+    assert(a->wheelLink.wheel == this);
+    Unlink(a);
+    Link(a, PARKED_LIST);
+}
+
+bool AlarmWheel::Unpark(const void* key)
+{
+    bool unparked = false;
+    _Alarm* a = lists[PARKED_LIST];
+    while (a) {
+        _Alarm* next = a->wheelLink.next;
+        if (a->GetSerializationKey() == key) {
+            Unlink(a);
+            Link(a, DUE_LIST);
+            unparked = true;
+        }
+        a = next;
+    }
+    return unparked;
+}
+
+Alarm AlarmWheel::GetDueAlarm() const
+{
+    assert(lists[DUE_LIST]);
+    return Alarm::wrap(lists[DUE_LIST]);
+}
+
+void AlarmWheel::GetAlarms(std::vector<Alarm>& alarms) const
+{
+    alarms.clear();
+    alarms.reserve(count);
+    for (uint32_t i = 0; i < NUM_LISTS; ++i) {
+        for (_Alarm* a = lists[i]; a; a = a->wheelLink.next) {
+            alarms.push_back(Alarm::wrap(a));
+        }
+    }
+    sort(alarms.begin(), alarms.end());
+}
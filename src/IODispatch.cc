@@ -19,25 +19,63 @@
  *    See the License for the specific language governing permissions and
  *    limitations under the License.
  ******************************************************************************/
+#include <algorithm>
+
 #include <qcc/IODispatch.h>
+#include <qcc/StringUtil.h>
 #define QCC_MODULE "IODISPATCH"
 
 using namespace qcc;
 using namespace std;
 
+/* Number of entries allocated at a time when there are no free entries */
+#define IODISPATCH_SLAB_ENTRIES 64
+
+/* Maximum number of queued buffers gathered into a single write */
+#define IODISPATCH_MAX_WRITE_BUFFERS 64
+
+/* Milliseconds before retrying a read timeout the timer had no room for */
+#define IODISPATCH_DEADLINE_RETRY_MS 100
+
+/*
+ * Index of the dispatchEntries bucket of a stream.  This uses a different multiplier than
+ * GetReactor so that the streams serviced by one event loop spread over all of its buckets.
+ */
+static inline size_t EntryBucket(const Stream* stream, size_t numBuckets)
+{
+    uint32_t hash = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(stream) >> 4) * 0x85EBCA6BU;
+    return static_cast<size_t>((static_cast<uint64_t>(hash) * numBuckets) >> 32);
+}
 
-IODispatch::IODispatch(const char* name, uint32_t concurrency) :
-    timer(name, true, concurrency, false, 50),
-    reload(false),
+/* Number of timer threads given to each event loop */
+static uint32_t ReactorConcurrency(uint32_t concurrency, uint32_t numReactors)
+{
+    numReactors = max(numReactors, static_cast<uint32_t>(1));
+    return max((concurrency + numReactors - 1) / numReactors, static_cast<uint32_t>(1));
+}
+
+IODispatch::IODispatch(const char* name, uint32_t concurrency, uint32_t numReactors) :
+    timer(name, true, ReactorConcurrency(concurrency, numReactors), false, 50),
+    freeEntries(NULL),
+    numEntries(0),
+    nextDeadlineSweep(0),
+    budgetRound(0),
+    callbackBudgetExhausted(0),
+    byteBudgetExhausted(0),
     isRunning(false),
     numAlarmsInProgress(0),
-    crit(false)
+    numRedirects(0)
 {
-
+    /* This IODispatch is event loop 0. Each additional event loop is a single loop IODispatch */
+    for (uint32_t i = 1; i < numReactors; ++i) {
+        qcc::String reactorName(name);
+        reactorName += "-";
+        reactorName += U32ToString(i);
+        reactors.push_back(new IODispatch(reactorName.c_str(), ReactorConcurrency(concurrency, numReactors)));
+    }
 }
 IODispatch::~IODispatch()
 {
-    reload = true;
     Stop();
     Join();
 
@@ -45,7 +83,14 @@ IODispatch::~IODispatch()
      * so, there should be no dispatch entries.
      * Just a sanity check.
      */
-    assert(dispatchEntries.size() == 0);
+    assert(numEntries == 0);
+
+    for (vector<IODispatchEntry*>::iterator it = entrySlabs.begin(); it != entrySlabs.end(); ++it) {
+        delete [] *it;
+    }
+    for (vector<IODispatch*>::iterator it = reactors.begin(); it != reactors.end(); ++it) {
+        delete *it;
+    }
 }
 QStatus IODispatch::Start()
 {
@@ -59,7 +104,55 @@ QStatus IODispatch::Start()
     } else {
         isRunning = true;
         /* Start the main thread */
-        return Thread::Start();
+        status = Thread::Start();
+    }
+
+    /* Start the additional event loops */
+    for (vector<IODispatch*>::iterator it = reactors.begin(); (status == ER_OK) && (it != reactors.end()); ++it) {
+        status = (*it)->Start();
+    }
+    return status;
+}
+
+IODispatch* IODispatch::HashReactor(const Stream* stream)
+{
+    if (reactors.empty()) {
+        return this;
+    }
+    /* Streams are usually heap allocated, so drop the low order bits before hashing */
+    uint32_t hash = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(stream) >> 4) * 2654435761U;
+    uint32_t index = (hash >> 16) % GetNumReactors();
+    return (index == 0) ? this : reactors[index - 1];
+}
+
+IODispatch* IODispatch::GetReactor(const Stream* stream)
+{
+    /*
+     * Only the loop the stream hashes to is asked about an explicit affinity, under its own
+     * lock, and only if it has streams started elsewhere.
+     */
+    IODispatch* reactor = HashReactor(stream);
+    if (reactor->numRedirects) {
+        IODispatch* home = reactor;
+        home->lock.Lock();
+        map<const Stream*, IODispatch*>::iterator it = home->redirects.find(stream);
+        if (it != home->redirects.end()) {
+            reactor = it->second;
+        }
+        home->lock.Unlock();
+    }
+    return reactor;
+}
+
+void IODispatch::RemoveRedirect(const Stream* stream)
+{
+    IODispatch* home = HashReactor(stream);
+    if (home->numRedirects) {
+        home->lock.Lock();
+        if (home->redirects.erase(stream)) {
+            DecrementAndFetch(&home->numRedirects);
+        }
+        home->lock.Unlock();
     }
 }
 
@@ -67,126 +160,421 @@ QStatus IODispatch::Stop()
 {
     lock.Lock();
     isRunning = false;
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.begin();
-    Stream* stream;
-    while (it != dispatchEntries.end()) {
-
-        stream = it->first;
-        lock.Unlock();
-        StopStream(stream);
-        lock.Lock();
-        it = dispatchEntries.upper_bound(stream);
+    /* Entries never move, so the slabs can be walked while the lock is released */
+    for (size_t i = 0; i < entrySlabs.size() * IODISPATCH_SLAB_ENTRIES; ++i) {
+        Stream* stream = entrySlabs[i / IODISPATCH_SLAB_ENTRIES][i % IODISPATCH_SLAB_ENTRIES].stream;
+        if (stream) {
+            lock.Unlock();
+            StopStream(stream);
+            lock.Lock();
+        }
     }
     lock.Unlock();
 
     Thread::Stop();
     timer.Stop();
+
+    for (vector<IODispatch*>::iterator rit = reactors.begin(); rit != reactors.end(); ++rit) {
+        (*rit)->Stop();
+    }
     return ER_OK;
 }
 
 QStatus IODispatch::Join()
 {
     lock.Lock();
-
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.begin();
-    Stream* stream;
-    while (it != dispatchEntries.end()) {
-        stream = it->first;
-        lock.Unlock();
-        JoinStream(stream);
-        lock.Lock();
-        it = dispatchEntries.upper_bound(stream);
+    for (size_t i = 0; i < entrySlabs.size() * IODISPATCH_SLAB_ENTRIES; ++i) {
+        Stream* stream = entrySlabs[i / IODISPATCH_SLAB_ENTRIES][i % IODISPATCH_SLAB_ENTRIES].stream;
+        if (stream) {
+            lock.Unlock();
+            JoinStream(stream);
+            lock.Lock();
+        }
     }
     lock.Unlock();
 
     Thread::Join();
     timer.Join();
+
+    for (vector<IODispatch*>::iterator rit = reactors.begin(); rit != reactors.end(); ++rit) {
+        (*rit)->Join();
+    }
+    lock.Lock();
+    redirects.clear();
+    numRedirects = 0;
+    lock.Unlock();
     return ER_OK;
 }
 
+QStatus IODispatch::StartStream(Stream* stream, IOReadListener* readListener, IOWriteListener* writeListener, IOExitListener* exitListener, bool readEnable, bool writeEnable, uint32_t affinityIndex)
+{
+    uint32_t index = affinityIndex % GetNumReactors();
+    IODispatch* reactor = (index == 0) ? this : reactors[index - 1];
+    IODispatch* home = HashReactor(stream);
+
+    home->lock.Lock();
+    /* A stream must be joined before it can be started again */
+    if (home->redirects.find(stream) != home->redirects.end()) {
+        home->lock.Unlock();
+        return ER_INVALID_STREAM;
+    }
+    if (reactor != home) {
+        home->redirects[stream] = reactor;
+        IncrementAndFetch(&home->numRedirects);
+    }
+    home->lock.Unlock();
+
+    QStatus status = reactor->StartStream(stream, readListener, writeListener, exitListener, readEnable, writeEnable);
+    if ((status != ER_OK) && (reactor != home)) {
+        RemoveRedirect(stream);
+    }
+    return status;
+}
+
 QStatus IODispatch::StartStream(Stream* stream, IOReadListener* readListener, IOWriteListener* writeListener, IOExitListener* exitListener, bool readEnable, bool writeEnable)
 {
     QCC_DbgTrace(("StartStream %p", stream));
 
+    IODispatch* reactor = GetReactor(stream);
+    if (reactor != this) {
+        return reactor->StartStream(stream, readListener, writeListener, exitListener, readEnable, writeEnable);
+    }
+
     lock.Lock();
     /* Dont attempt to register a stream if the IODispatch is shutting down */
     if (!isRunning) {
         lock.Unlock();
         return ER_IODISPATCH_STOPPING;
     }
-    if (dispatchEntries.find(stream) != dispatchEntries.end()) {
+    if (FindEntry(stream)) {
         lock.Unlock();
         return ER_INVALID_STREAM;
 
     }
-    dispatchEntries[stream] = IODispatchEntry(stream, readListener, writeListener, exitListener, readEnable, writeEnable);
-    dispatchEntries[stream].readCtxt = new CallbackContext(stream, IO_READ);
-    dispatchEntries[stream].writeCtxt = new CallbackContext(stream, IO_WRITE);
-    dispatchEntries[stream].writeTimeoutCtxt = new CallbackContext(stream, IO_WRITE_TIMEOUT);
-    dispatchEntries[stream].readTimeoutCtxt = new CallbackContext(stream, IO_READ_TIMEOUT);
-    dispatchEntries[stream].exitCtxt = new CallbackContext(stream, IO_EXIT);
+    IODispatchEntry* entry = AllocateEntry(IODispatchEntry(stream, readListener, writeListener, exitListener, readEnable, writeEnable));
 
-    /* Set reload to false and alert the IODispatch::Run thread */
-    reload = false;
+    /* Register the source and/or sink events with the main thread */
+    UpdateEventSet(stream, *entry);
     lock.Unlock();
 
-    Thread::Alert();
-    /* Dont need to wait for the IODispatch::Run thread to reload
-     * the set of file descriptors since we are adding a new stream.
-     */
     return ER_OK;
 }
 
+void IODispatch::UpdateEventSet(Stream* stream, IODispatchEntry& entry)
+{
+    bool wantRead = (entry.stopping_state == IO_RUNNING) && entry.readEnable && !entry.readInProgress && !entry.readDeferred;
+    bool wantWrite = (entry.stopping_state == IO_RUNNING) &&
+                     ((entry.writeEnable && !entry.writeInProgress && !entry.writeDeferred) || entry.queuedBytes);
+
+    if (wantRead != entry.readRegistered) {
+        if (wantRead) {
+            eventSet.AddEvent(stream->GetSourceEvent(), &entry.readCtxt);
+        } else {
+            /* Once RemoveEvent returns the main thread will no longer report the source event,
+             * so the caller is free to delete it.
+             */
+            eventSet.RemoveEvent(stream->GetSourceEvent(), &entry.readCtxt);
+        }
+        entry.readRegistered = wantRead;
+    }
+    if (wantWrite != entry.writeRegistered) {
+        if (wantWrite) {
+            eventSet.AddEvent(stream->GetSinkEvent(), &entry.writeCtxt);
+        } else {
+            eventSet.RemoveEvent(stream->GetSinkEvent(), &entry.writeCtxt);
+        }
+        entry.writeRegistered = wantWrite;
+    }
+}
+
+
+void IODispatch::SetReadDeadline(IODispatchEntry& entry, uint32_t timeout)
+{
+    if (timeout == 0) {
+        entry.readDeadline = 0;
+        return;
+    }
+    entry.readDeadline = GetTimestamp64() + static_cast<uint64_t>(timeout) * 1000;
+    /* Deadlines usually move later.  The queued deadline is then moved when it comes due, so
+     * only an earlier deadline needs queueing now.
+     */
+    if ((entry.readDeadlineQueued == 0) || (entry.readDeadline < entry.readDeadlineQueued)) {
+        QueueReadDeadline(entry, entry.readDeadline);
+    }
+}
+
+void IODispatch::QueueReadDeadline(IODispatchEntry& entry, uint64_t due)
+{
+    entry.readDeadlineQueued = due;
+    readDeadlines.push(std::make_pair(due, &entry));
+    if ((nextDeadlineSweep == 0) || (due < nextDeadlineSweep)) {
+        nextDeadlineSweep = due;
+        Thread::Alert();
+    }
+}
+
+void IODispatch::SweepReadDeadlines()
+{
+    uint64_t now = GetTimestamp64();
+    int32_t when = 0;
+    AlarmListener* listener = this;
+
+    while (!readDeadlines.empty() && (readDeadlines.top().first <= now)) {
+        uint64_t queued = readDeadlines.top().first;
+        IODispatchEntry& entry = *readDeadlines.top().second;
+        readDeadlines.pop();
+        if (entry.readDeadlineQueued != queued) {
+            /* Superseded by an earlier deadline, or the entry has been freed since */
+            continue;
+        }
+        entry.readDeadlineQueued = 0;
+        if (!entry.stream || !entry.readDeadline) {
+            continue;
+        }
+        if (entry.readDeadline > now) {
+            /* The deadline moved since it was queued */
+            QueueReadDeadline(entry, entry.readDeadline);
+        } else if ((entry.stopping_state == IO_RUNNING) && entry.readEnable && !entry.readInProgress) {
+            void* context = &entry.readTimeoutCtxt;
+            Alarm readAlarm = Alarm(when, listener, context);
+            if (timer.AddAlarmNonBlocking(readAlarm) != ER_OK) {
+                QueueReadDeadline(entry, now + IODISPATCH_DEADLINE_RETRY_MS);
+            } else {
+                entry.readAlarm = readAlarm;
+                entry.readInProgress = true;
+                entry.readDeadline = 0;
+                UpdateEventSet(entry.stream, entry);
+            }
+        } else {
+            /* A read callback in progress sets a new timeout if it wants one */
+            entry.readDeadline = 0;
+        }
+    }
+    nextDeadlineSweep = readDeadlines.empty() ? 0 : readDeadlines.top().first;
+}
+
+bool IODispatch::ChargeCallback(IODispatchEntry& entry)
+{
+    if (entry.budgetRound != budgetRound) {
+        entry.budgetRound = budgetRound;
+        entry.roundCallbacks = 0;
+        entry.roundBytes = 0;
+    }
+    if (entry.maxBytes && (entry.roundBytes >= entry.maxBytes)) {
+        ++byteBudgetExhausted;
+        return false;
+    }
+    if (entry.maxCallbacks && (entry.roundCallbacks >= entry.maxCallbacks)) {
+        ++callbackBudgetExhausted;
+        return false;
+    }
+    ++entry.roundCallbacks;
+    return true;
+}
+
+bool IODispatch::FlushWriteQueue(Stream* stream, IODispatchEntry& entry)
+{
+    /* Only the main thread removes buffers from the queue and the buffers of a deque do not move
+     * when more are queued, so they can be written while the lock is released.
+     */
+    IOVec iov[IODISPATCH_MAX_WRITE_BUFFERS];
+    size_t numIov = 0;
+    size_t offset = entry.writeQueueOffset;
+    for (deque<vector<uint8_t> >::iterator it = entry.writeQueue.begin(); (it != entry.writeQueue.end()) && (numIov < IODISPATCH_MAX_WRITE_BUFFERS); ++it) {
+        iov[numIov].buf = reinterpret_cast<char*>(&(*it)[offset]);
+        iov[numIov].len = it->size() - offset;
+        offset = 0;
+        ++numIov;
+    }
+    /* numAlarmsInProgress keeps an exit alarm added by StopStream during Stop from freeing the
+     * entry, and the buffers iov points into, while the lock is released.
+     */
+    IncrementAndFetch(&numAlarmsInProgress);
+    lock.Unlock();
+    size_t sent = 0;
+    QStatus status = stream->PushBytesV(iov, numIov, sent);
+    lock.Lock();
+    DecrementAndFetch(&numAlarmsInProgress);
+
+    if (status == ER_OK) {
+        entry.queuedBytes -= sent;
+        while (sent) {
+            size_t remaining = entry.writeQueue.front().size() - entry.writeQueueOffset;
+            if (sent < remaining) {
+                entry.writeQueueOffset += sent;
+                break;
+            }
+            sent -= remaining;
+            entry.writeQueue.pop_front();
+            entry.writeQueueOffset = 0;
+        }
+    } else if (status != ER_WOULDBLOCK) {
+        QCC_LogError(status, ("Discarding %u queued bytes", static_cast<uint32_t>(entry.queuedBytes)));
+        entry.writeQueueStatus = status;
+        entry.writeQueue.clear();
+        entry.writeQueueOffset = 0;
+        entry.queuedBytes = 0;
+    }
+    if (entry.aboveHighWatermark && (entry.queuedBytes <= entry.lowWatermark)) {
+        entry.aboveHighWatermark = false;
+    }
+    UpdateEventSet(stream, entry);
+    NotifyWatermark(stream);
+
+    /* The entry is not freed while the main thread is using it, but it may have been stopped */
+    return (entry.stopping_state == IO_RUNNING) && (entry.queuedBytes == 0);
+}
+
+void IODispatch::NotifyWatermark(Stream* stream)
+{
+    IODispatchEntry* entry = FindEntry(stream);
+    while (entry && entry->watermarkListener && !entry->watermarkNotifying &&
+           (entry->aboveHighWatermark != entry->watermarkReported)) {
+        /* Whoever is calling the listener reports any further change once it returns, so that
+         * the listener sees the crossings in order.
+         */
+        IOWatermarkListener* listener = entry->watermarkListener;
+        bool aboveHighWatermark = entry->aboveHighWatermark;
+        entry->watermarkReported = aboveHighWatermark;
+        entry->watermarkNotifying = true;
+        IncrementAndFetch(&numAlarmsInProgress);
+        lock.Unlock();
+        listener->WatermarkCallback(*stream, aboveHighWatermark);
+        DecrementAndFetch(&numAlarmsInProgress);
+        lock.Lock();
+        entry = FindEntry(stream);
+        if (entry) {
+            entry->watermarkNotifying = false;
+        }
+    }
+}
+
+IODispatchEntry* IODispatch::FindEntry(const Stream* stream)
+{
+    if (dispatchEntries.empty()) {
+        return NULL;
+    }
+    IODispatchEntry* entry = dispatchEntries[EntryBucket(stream, dispatchEntries.size())];
+    while (entry && (entry->stream != stream)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+IODispatchEntry* IODispatch::AllocateEntry(const IODispatchEntry& init)
+{
+    if (!freeEntries) {
+        IODispatchEntry* slab = new IODispatchEntry[IODISPATCH_SLAB_ENTRIES];
+        for (size_t i = IODISPATCH_SLAB_ENTRIES; i > 0; --i) {
+            slab[i - 1].next = freeEntries;
+            freeEntries = &slab[i - 1];
+        }
+        entrySlabs.push_back(slab);
+
+        /* Keep one bucket per entry */
+        vector<IODispatchEntry*> buckets(entrySlabs.size() * IODISPATCH_SLAB_ENTRIES, NULL);
+        for (vector<IODispatchEntry*>::iterator it = dispatchEntries.begin(); it != dispatchEntries.end(); ++it) {
+            while (*it) {
+                IODispatchEntry* entry = *it;
+                *it = entry->next;
+                IODispatchEntry*& bucket = buckets[EntryBucket(entry->stream, buckets.size())];
+                entry->next = bucket;
+                bucket = entry;
+            }
+        }
+        dispatchEntries.swap(buckets);
+    }
+    IODispatchEntry* entry = freeEntries;
+    freeEntries = entry->next;
+
+    *entry = init;
+    entry->readCtxt = CallbackContext(init.stream, IO_READ, entry);
+    entry->writeCtxt = CallbackContext(init.stream, IO_WRITE, entry);
+    entry->readTimeoutCtxt = CallbackContext(init.stream, IO_READ_TIMEOUT, entry);
+    entry->writeTimeoutCtxt = CallbackContext(init.stream, IO_WRITE_TIMEOUT, entry);
+    entry->exitCtxt = CallbackContext(init.stream, IO_EXIT, entry);
+
+    IODispatchEntry*& bucket = dispatchEntries[EntryBucket(init.stream, dispatchEntries.size())];
+    entry->next = bucket;
+    bucket = entry;
+    ++numEntries;
+    return entry;
+}
+
+void IODispatch::FreeEntry(IODispatchEntry* entry)
+{
+    IODispatchEntry** link = &dispatchEntries[EntryBucket(entry->stream, dispatchEntries.size())];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    --numEntries;
+
+    /* Contexts held back for the next round must not outlive the entry they are embedded in */
+    if (entry->readDeferred || entry->writeDeferred) {
+        vector<CallbackContext*>::iterator it = deferredContexts.begin();
+        while (it != deferredContexts.end()) {
+            it = ((*it)->entry == entry) ? deferredContexts.erase(it) : it + 1;
+        }
+    }
+
+    /* Drop the alarms so that the references they hold are released now rather than on reuse */
+    *entry = IODispatchEntry();
+    entry->next = freeEntries;
+    freeEntries = entry;
+}
 
 QStatus IODispatch::StopStream(Stream* stream) {
+    IODispatch* reactor = GetReactor(stream);
+    if (reactor != this) {
+        return reactor->StopStream(stream);
+    }
+
     lock.Lock();
     QCC_DbgTrace(("StopStream %p", stream));
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(stream);
+    IODispatchEntry* entry = FindEntry(stream);
 
     /* Check if stream is still present in dispatchEntries. */
-    if (it == dispatchEntries.end()) {
+    if (!entry) {
         lock.Unlock();
         return ER_INVALID_STREAM;
     }
-    if (it->second.stopping_state == IO_STOPPED) {
+    if (entry->stopping_state == IO_STOPPED) {
         lock.Unlock();
         return ER_FAIL;
     }
-    IODispatchEntry dispatchEntry = it->second;
+    bool wasRunning = (entry->stopping_state == IO_RUNNING);
 
     /* Disable further read and writes on this stream */
-    it->second.stopping_state = IO_STOPPING;
+    entry->stopping_state = IO_STOPPING;
+    UpdateEventSet(stream, *entry);
 
-    /* Set reload to false and alert the IODispatch::Run thread */
-    reload = false;
     int when = 0;
     AlarmListener* listener = this;
     if (isRunning) {
-        /* The main thread is running, so we must wait for it to reload the events.
-         * The main thread is responsible for adding the exit alarm in this case.
+        /* The main thread is running, so it is responsible for adding the exit alarm.
+         * The source and sink events have already been removed from the event set, so
+         * there is no need to wait for the main thread.
          */
-        Thread::Alert();
-
-        /* Wait until the IODispatch::Run thread reloads the set of check events */
-        while (!reload && crit && isRunning) {
-            lock.Unlock();
-            Sleep(1);
-            lock.Lock();
+        if (wasRunning) {
+            stoppingStreams.push_back(stream);
         }
         lock.Unlock();
+        Thread::Alert();
     } else {
 
         /* If the main thread has been asked to stopped, it may or may not have
          * added the exit alarm for this stream. The exit alarm makes the exit callback
          * which ensures that the RemoteEndpoint can be joined.
          */
-        if (it->second.stopping_state == IO_STOPPING) {
+        if (entry->stopping_state == IO_STOPPING) {
             /* Add the exit alarm since it has not added by the main IODispatch::Run thread. */
-            it->second.stopping_state = IO_STOPPED;
+            entry->stopping_state = IO_STOPPED;
             /* We dont need to keep track of the exit alarm, since we never remove
              * the exit alarm. Hence it is not a part of IODispatchEntry.
              */
-            Alarm exitAlarm = Alarm(when, listener, it->second.exitCtxt);
+            void* context = &entry->exitCtxt;
+            Alarm exitAlarm = Alarm(when, listener, context);
             lock.Unlock();
             /* At this point, the IODispatch::Run thread will not add any more alarms since it
              * has been told to stop, so it is ok to call the blocking version of AddAlarm
@@ -200,20 +588,29 @@ QStatus IODispatch::StopStream(Stream* stream) {
     return ER_OK;
 }
 QStatus IODispatch::JoinStream(Stream* stream) {
+    IODispatch* reactor = GetReactor(stream);
+    if (reactor != this) {
+        QStatus status = reactor->JoinStream(stream);
+        RemoveRedirect(stream);
+        return status;
+    }
+
     lock.Lock();
     QCC_DbgTrace(("JoinStream %p", stream));
 
     /* Wait until the exit callback is complete and the
-     * entry is removed from the dispatchEntries map
+     * entry is removed from dispatchEntries
      */
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(stream);
-    while (it != dispatchEntries.end()) {
+    IODispatchEntry* entry = FindEntry(stream);
+    while (entry) {
         lock.Unlock();
         qcc::Sleep(10);
         lock.Lock();
-        it = dispatchEntries.find(stream);
+        entry = FindEntry(stream);
     }
     lock.Unlock();
+
+    RemoveRedirect(stream);
     return ER_OK;
 }
 void IODispatch::AlarmTriggered(const Alarm& alarm, QStatus reason)
@@ -236,124 +633,96 @@ void IODispatch::AlarmTriggered(const Alarm& alarm, QStatus reason)
         return;
     }
 
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(stream);
-    if (it == dispatchEntries.end()) {
-        /* If stream is not found(should never happen since the exit alarm ensures that
-         * read and write alarms are removed before deleting the entry from the map)
-         */
-        assert(false);
-    }
-    if (((it->second.stopping_state != IO_RUNNING) && ctxt->type != IO_EXIT)) {
+    /* The exit alarm ensures that read and write alarms are removed before the entry is freed,
+     * so the entry that the context is embedded in still belongs to the stream.
+     */
+    IODispatchEntry* entry = ctxt->entry;
+    assert(entry->stream == stream);
+    if (((entry->stopping_state != IO_RUNNING) && ctxt->type != IO_EXIT)) {
         /* If stream is being stopped and this is not an exit alarm, return.
          */
         lock.Unlock();
         return;
     }
 
-    IODispatchEntry dispatchEntry = it->second;
+    /*
+     * Only what the callback needs is copied out of the entry before the lock is released, the
+     * entry also holds the stream's write queue.
+     */
     switch (ctxt->type) {
     case IO_READ_TIMEOUT:
         /* If this is the read timeout callback, then we must set readInProgress to true
-         * to indicate to the main thread to remove this FD from the set of events it is
-         * waiting for.
-         * Also, we wait for the main thread to return from Event::Wait and/or reload the set
-         * of descriptors.
+         * and remove the source event from the set of events the main thread is waiting for.
          */
-        it->second.readInProgress = true;
-        while (!reload && crit && isRunning) {
-            lock.Unlock();
-            Sleep(1);
-            lock.Lock();
-        }
+        entry->readInProgress = true;
+        UpdateEventSet(stream, *entry);
 
     case IO_READ:
-        IncrementAndFetch(&numAlarmsInProgress);
+        {
+            bool readEnable = entry->readEnable;
+            IOReadListener* readListener = entry->readListener;
+            IncrementAndFetch(&numAlarmsInProgress);
 
-        lock.Unlock();
-        if (dispatchEntry.readEnable) {
-            /* Ensure read has not been disabled */
-            dispatchEntry.readListener->ReadCallback(*stream, ctxt->type == IO_READ_TIMEOUT);
+            lock.Unlock();
+            if (readEnable) {
+                /* Ensure read has not been disabled */
+                readListener->ReadCallback(*stream, ctxt->type == IO_READ_TIMEOUT);
+            }
+            DecrementAndFetch(&numAlarmsInProgress);
         }
-        DecrementAndFetch(&numAlarmsInProgress);
         break;
 
     case IO_WRITE_TIMEOUT:
         /* If this is the write timeout callback, then we must set writeInProgress to true
-         * to indicate to the main thread to remove this FD from the set of events it is
-         * waiting for.
-         * Also, we wait for the main thread to return from Event::Wait and/or reload the set
-         * of descriptors.
+         * and remove the sink event from the set of events the main thread is waiting for.
          */
-        it->second.writeInProgress = true;
-        while (!reload && crit && isRunning) {
-            lock.Unlock();
-            Sleep(1);
-            lock.Lock();
-        }
+        entry->writeInProgress = true;
+        UpdateEventSet(stream, *entry);
 
     case IO_WRITE:
+        {
+            bool writeEnable = entry->writeEnable;
+            IOWriteListener* writeListener = entry->writeListener;
+            IncrementAndFetch(&numAlarmsInProgress);
 
-        IncrementAndFetch(&numAlarmsInProgress);
-
-        lock.Unlock();
+            lock.Unlock();
 
-        /* Make the write callback */
-        if (dispatchEntry.writeEnable) {
-            /* Ensure write has not been disabled */
-            dispatchEntry.writeListener->WriteCallback(*stream, ctxt->type == IO_WRITE_TIMEOUT);
+            /* Make the write callback */
+            if (writeEnable) {
+                /* Ensure write has not been disabled */
+                writeListener->WriteCallback(*stream, ctxt->type == IO_WRITE_TIMEOUT);
+            }
+            DecrementAndFetch(&numAlarmsInProgress);
         }
-        DecrementAndFetch(&numAlarmsInProgress);
         break;
 
     case IO_EXIT:
+        {
+            Alarm readAlarm = entry->readAlarm;
+            Alarm writeAlarm = entry->writeAlarm;
+            IOExitListener* exitListener = entry->exitListener;
 
-        lock.Unlock();
+            lock.Unlock();
 
-        if (isRunning) {
-            /* Timer is running. Remove any pending alarms */
-            timer.RemoveAlarm(dispatchEntry.readAlarm, true /* blocking */);
-            timer.RemoveAlarm(dispatchEntry.writeAlarm, true /* blocking */);
-        }
-        /* If IODispatch has been stopped,
-         * RemoveAlarms may not have successfully removed the alarm.
-         * In that case, wait for any alarms that are in progress to finish.
-         */
-        while (!isRunning && numAlarmsInProgress) {
-            Sleep(2);
-        }
-        /* Make the exit callback */
-        dispatchEntry.exitListener->ExitCallback();
-        /* Find and erase the stream entry */
-        lock.Lock();
-        it = dispatchEntries.find(stream);
-        if (it == dispatchEntries.end()) {
-            /* This should never happen - it means that the entry was deleted
-             * while the exit callback was being made
+            if (isRunning) {
+                /* Timer is running. Remove any pending alarms */
+                timer.RemoveAlarm(readAlarm, true /* blocking */);
+                timer.RemoveAlarm(writeAlarm, true /* blocking */);
+            }
+            /* If IODispatch has been stopped,
+             * RemoveAlarms may not have successfully removed the alarm.
+             * In that case, wait for any alarms that are in progress to finish.
              */
-            assert(false);
-        }
-        if (it->second.readCtxt) {
-            delete it->second.readCtxt;
-            it->second.readCtxt = NULL;
-        }
-        if (it->second.writeCtxt) {
-            delete it->second.writeCtxt;
-            it->second.writeCtxt = NULL;
-        }
-        if (it->second.writeTimeoutCtxt) {
-            delete it->second.writeTimeoutCtxt;
-            it->second.writeTimeoutCtxt = NULL;
-        }
-        if (it->second.exitCtxt) {
-            delete it->second.exitCtxt;
-            it->second.exitCtxt = NULL;
-        }
-        if (it->second.readTimeoutCtxt) {
-            delete it->second.readTimeoutCtxt;
-            it->second.readTimeoutCtxt = NULL;
+            while (!isRunning && numAlarmsInProgress) {
+                Sleep(2);
+            }
+            /* Make the exit callback */
+            exitListener->ExitCallback();
+            /* Free the stream entry */
+            lock.Lock();
+            FreeEntry(entry);
+            lock.Unlock();
         }
-        dispatchEntries.erase(it);
-        lock.Unlock();
         break;
 
     default:
@@ -364,198 +733,279 @@ void IODispatch::AlarmTriggered(const Alarm& alarm, QStatus reason)
 
 ThreadReturn STDCALL IODispatch::Run(void* arg) {
 
-    vector<qcc::Event*> checkEvents, signaledEvents;
+    vector<void*> signaledContexts;
+    vector<CallbackContext*> roundContexts;
     int32_t when =  0;
     AlarmListener* listener = this;
+    bool startRound = false;
+
+    /* The Thread's stop event is registered with its own address as context */
+    eventSet.AddEvent(stopEvent, &stopEvent);
 
     while (!IsStopping()) {
-        checkEvents.clear();
-        signaledEvents.clear();
-        /* Add the Thread's stop event to list of events to check for */
-        checkEvents.push_back(&stopEvent);
+        signaledContexts.clear();
 
-        /* Set reload to true to indicate that this thread is not in the Event::Wait and is
-         * reloading the set of source and sink events
-         */
+        /* Wake up in time for the next read deadline sweep, if any */
+        uint32_t waitMs = Event::WAIT_FOREVER;
         lock.Lock();
-        reload = true;
-        map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.begin();
-        while (it != dispatchEntries.end() && isRunning) {
-            if (it->second.stopping_state == IO_RUNNING) {
-                /* Check this stream only if it has not been stopped */
-                if (it->second.readEnable && !it->second.readInProgress) {
-                    /* If read is enabled and not in progress, add the source event for the stream to the
-                     * set of check events
-                     */
-                    checkEvents.push_back(&it->first->GetSourceEvent());
-                }
-                if (it->second.writeEnable && !it->second.writeInProgress) {
-                    /* If write is enabled and not in progress, add the sink event for the stream to the
-                     * set of check events
-                     */
-                    checkEvents.push_back(&it->first->GetSinkEvent());
-                }
-            }
-            it++;
+        if (!deferredContexts.empty()) {
+            /* Only poll while streams are waiting for the next round */
+            waitMs = 0;
+        } else if (nextDeadlineSweep) {
+            uint64_t now = GetTimestamp64();
+            waitMs = (nextDeadlineSweep > now) ? static_cast<uint32_t>(min(nextDeadlineSweep - now, static_cast<uint64_t>(Event::WAIT_FOREVER - 1))) : 0;
         }
-        crit = true;
         lock.Unlock();
 
-        /* Wait for an event to occur */
-        qcc::Event::Wait(checkEvents, signaledEvents);
+        /* Wait for an event to occur.
+         * The source and sink events are registered with eventSet as streams change state, so
+         * there is no need to rebuild the set of check events on every iteration.
+         */
+        eventSet.Wait(signaledContexts, waitMs);
 
-        lock.Lock();
-        crit = false;
-        reload = true;
+        if (startRound) {
+            /* Every ready stream has had its turn. Start a new round, which resets all budgets, and
+             * service the streams that were held back after those that just became ready.
+             */
+            lock.Lock();
+            ++budgetRound;
+            roundContexts.swap(deferredContexts);
+            for (vector<CallbackContext*>::iterator i = roundContexts.begin(); i != roundContexts.end(); ++i) {
+                /* FreeEntry drops the contexts of stopped streams, so the entry is still in use */
+                IODispatchEntry* entry = (*i)->entry;
+                bool& deferred = ((*i)->type == IO_READ) ? entry->readDeferred : entry->writeDeferred;
+                if (deferred) {
+                    deferred = false;
+                    signaledContexts.push_back(*i);
+                }
+            }
+            roundContexts.clear();
+            lock.Unlock();
+        }
 
-        lock.Unlock();
-        for (vector<qcc::Event*>::iterator i = signaledEvents.begin(); i != signaledEvents.end(); ++i) {
+        bool alerted = false;
+        bool freshWork = false;
+        for (vector<void*>::iterator i = signaledContexts.begin(); i != signaledContexts.end(); ++i) {
             if (*i == &stopEvent) {
-                /* This thread has been alerted or is being stopped. Will check the IsStopping()
-                 * flag when the while condition is encountered.
-                 * Note that the stop event must be reset before adding the exit alarms to ensure that
-                 * exit alarms are added for all streams that are stopped within close duration of each other.
-                 */
-                lock.Lock();
-                stopEvent.ResetEvent();
-
-                it = dispatchEntries.begin();
-                /* Add exit alarms for any streams that are being stopped.
-                 * We dont need to keep track of the exit alarm, since we never remove
-                 * the exit alarm. Hence it is not a part of IODispatchEntry.
+                /* Handle the stop event after the source and sink events of this batch so that
+                 * exit alarms are only added once the contexts reported above are no longer in use.
                  */
-                while (it != dispatchEntries.end() && isRunning) {
-                    if (it->second.stopping_state == IO_STOPPING) {
-                        Alarm exitAlarm = Alarm(when, listener, it->second.exitCtxt);
-                        Stream* lookup = it->first;
+                alerted = true;
+                continue;
+            }
+            lock.Lock();
+            if (!isRunning) {
+                /* Streams may be exiting, so the context may no longer be valid */
+                lock.Unlock();
+                continue;
+            }
+            CallbackContext* ctxt = static_cast<CallbackContext*>(*i);
+            Stream* stream = ctxt->stream;
+            /* A context is only reported while it is registered, so its entry is in use */
+            IODispatchEntry* entry = ctxt->entry;
+            if (entry->budgetRound != budgetRound) {
+                /* This stream has not had its turn in the current round yet */
+                freshWork = true;
+            }
+            if (entry->stopping_state == IO_RUNNING) {
+                if (ctxt->type == IO_READ) {
+
+                    if (entry->readEnable && !entry->readInProgress && !ChargeCallback(*entry)) {
+                        /* The stream has used up its budget, let the other ready streams go first */
+                        entry->readDeferred = true;
+                        UpdateEventSet(stream, *entry);
+                        deferredContexts.push_back(ctxt);
+                    } else if (entry->readEnable && !entry->readInProgress && entry->inlineCallbacks) {
+                        /* Make the read callback from this thread. numAlarmsInProgress keeps
+                         * an exit alarm added by StopStream from completing underneath us.
+                         */
+                        Alarm prevAlarm = entry->readAlarm;
+                        IOReadListener* readListener = entry->readListener;
+                        entry->readInProgress = true;
+                        entry->readDeadline = 0;
+                        UpdateEventSet(stream, *entry);
+                        IncrementAndFetch(&numAlarmsInProgress);
+                        lock.Unlock();
+                        /* Wait for the previous read callback to finish. Read timeouts are deadlines,
+                         * so there is no timeout alarm to remove.
+                         */
+                        timer.RemoveAlarm(prevAlarm, true);
+                        readListener->ReadCallback(*stream, false);
+                        DecrementAndFetch(&numAlarmsInProgress);
+                        lock.Lock();
+                    } else if (entry->readEnable && !entry->readInProgress) {
+                        /* If the source event for a particular stream has been signalled,
+                         * add a readAlarm to fire now, and set readInProgress to true.
+                         */
+                        Alarm prevAlarm = entry->readAlarm;
+                        void* context = &entry->readCtxt;
+                        Alarm readAlarm = Alarm(when, listener, context);
+                        entry->readInProgress = true;
+                        entry->readDeadline = 0;
+                        UpdateEventSet(stream, *entry);
+                        lock.Unlock();
+                        /* Wait for the previous read callback to finish. Read timeouts are deadlines,
+                         * so there is no timeout alarm to remove.
+                         */
+                        timer.RemoveAlarm(prevAlarm, true);
+                        lock.Lock();
                         QStatus status = ER_TIMER_FULL;
-                        while (isRunning && status == ER_TIMER_FULL && it != dispatchEntries.end() && it->second.stopping_state != IO_STOPPED) {
+                        entry = FindEntry(stream);
+
+                        while (isRunning && status == ER_TIMER_FULL && entry && entry->stopping_state == IO_RUNNING) {
                             /* Call the non-blocking version of AddAlarm, while holding the
                              * locks to ensure that the state of the dispatchEntry is valid.
                              */
-                            status = timer.AddAlarmNonBlocking(exitAlarm);
+                            status = timer.AddAlarmNonBlocking(readAlarm);
 
                             if (status == ER_TIMER_FULL) {
                                 lock.Unlock();
                                 qcc::Sleep(2);
                                 lock.Lock();
                             }
-                            it = dispatchEntries.find(lookup);
-                        }
-                        if (status == ER_OK && it != dispatchEntries.end()) {
-                            it->second.stopping_state = IO_STOPPED;
-                            it++;
+
+                            entry = FindEntry(stream);
                         }
+                        if (status == ER_OK && entry) {
+                            entry->readAlarm = readAlarm;
 
-                    } else {
-                        it++;
+                        }
                     }
-                }
-                lock.Unlock();
-                continue;
-            } else {
-                lock.Lock();
-                map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.begin();
-                while (it != dispatchEntries.end()) {
 
-                    Stream* stream = it->first;
+                } else if (ctxt->type == IO_WRITE) {
+                    if (entry->queuedBytes && !FlushWriteQueue(stream, *entry)) {
+                        /* Queued bytes go out before the write listener is asked for more.
+                         * The sink event stays registered until the queue is empty.
+                         */
+                    } else if (entry->writeEnable && !entry->writeInProgress && !ChargeCallback(*entry)) {
+                        entry->writeDeferred = true;
+                        UpdateEventSet(stream, *entry);
+                        deferredContexts.push_back(ctxt);
+                    } else if (entry->writeEnable && !entry->writeInProgress && entry->inlineCallbacks) {
+                        /* Make the write callback from this thread */
+                        Alarm prevAlarm = entry->writeAlarm;
+                        IOWriteListener* writeListener = entry->writeListener;
+                        entry->writeInProgress = true;
+                        UpdateEventSet(stream, *entry);
+                        IncrementAndFetch(&numAlarmsInProgress);
+                        lock.Unlock();
+                        /* Remove the write timeout alarm if any first */
+                        timer.RemoveAlarm(prevAlarm, true);
+                        writeListener->WriteCallback(*stream, false);
+                        DecrementAndFetch(&numAlarmsInProgress);
+                        lock.Lock();
+                    } else if (entry->writeEnable && !entry->writeInProgress) {
+                        /* If the sink event for a particular stream has been signalled,
+                         * add a writeAlarm to fire now, and set writeInProgress to true.
+                         */
+                        Alarm prevAlarm = entry->writeAlarm;
+
+                        void* context = &entry->writeCtxt;
+                        Alarm writeAlarm = Alarm(when, listener, context);
+                        entry->writeInProgress = true;
+                        UpdateEventSet(stream, *entry);
+                        lock.Unlock();
+                        /* Remove the write timeout alarm if any first */
+                        timer.RemoveAlarm(prevAlarm, true);
+                        lock.Lock();
+                        QStatus status = ER_TIMER_FULL;
 
-                    if (it->second.stopping_state == IO_RUNNING) {
-                        if (&stream->GetSourceEvent() == *i) {
+                        entry = FindEntry(stream);
+                        while (isRunning && status == ER_TIMER_FULL &&  entry && entry->stopping_state == IO_RUNNING) {
+                            /* Call the non-blocking version of AddAlarm, while holding the
+                             * locks to ensure that the state of the dispatchEntry is valid.
+                             */
+                            status = timer.AddAlarmNonBlocking(writeAlarm);
 
-                            if (it->second.readEnable && !it->second.readInProgress) {
-                                /* If the source event for a particular stream has been signalled,
-                                 * add a readAlarm to fire now, and set readInProgress to true.
-                                 */
-                                Alarm prevAlarm = it->second.readAlarm;
-                                Alarm readAlarm = Alarm(when, listener, it->second.readCtxt);
-                                it->second.readInProgress = true;
+                            if (status == ER_TIMER_FULL) {
                                 lock.Unlock();
-                                /* Remove the read timeout alarm if any first */
-                                timer.RemoveAlarm(prevAlarm, true);
+                                qcc::Sleep(2);
                                 lock.Lock();
-                                QStatus status = ER_TIMER_FULL;
-                                it = dispatchEntries.find(stream);
-
-                                while (isRunning && status == ER_TIMER_FULL && it != dispatchEntries.end() && it->second.stopping_state == IO_RUNNING) {
-                                    /* Call the non-blocking version of AddAlarm, while holding the
-                                     * locks to ensure that the state of the dispatchEntry is valid.
-                                     */
-                                    status = timer.AddAlarmNonBlocking(readAlarm);
-
-                                    if (status == ER_TIMER_FULL) {
-                                        lock.Unlock();
-                                        qcc::Sleep(2);
-                                        lock.Lock();
-                                    }
-
-                                    it = dispatchEntries.find(stream);
-                                }
-                                if (status == ER_OK && it != dispatchEntries.end()) {
-                                    it->second.readAlarm = readAlarm;
-
-                                }
-
-                                break;
                             }
 
-                        } else if (&stream->GetSinkEvent() == *i) {
-                            if (it->second.writeEnable && !it->second.writeInProgress) {
-                                /* If the sink event for a particular stream has been signalled,
-                                 * add a writeAlarm to fire now, and set writeInProgress to true.
-                                 */
-                                Alarm prevAlarm = it->second.writeAlarm;
-
-                                Alarm writeAlarm = Alarm(when, listener, it->second.writeCtxt);
-                                it->second.writeInProgress = true;
-                                lock.Unlock();
-                                /* Remove the write timeout alarm if any first */
-                                timer.RemoveAlarm(prevAlarm, true);
-                                lock.Lock();
-                                QStatus status = ER_TIMER_FULL;
-
-                                map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(stream);
-                                while (isRunning && status == ER_TIMER_FULL &&  it != dispatchEntries.end() && it->second.stopping_state == IO_RUNNING) {
-                                    /* Call the non-blocking version of AddAlarm, while holding the
-                                     * locks to ensure that the state of the dispatchEntry is valid.
-                                     */
-                                    status = timer.AddAlarmNonBlocking(writeAlarm);
+                            entry = FindEntry(stream);
+                        }
+                        if (status == ER_OK && entry) {
 
-                                    if (status == ER_TIMER_FULL) {
-                                        lock.Unlock();
-                                        qcc::Sleep(2);
-                                        lock.Lock();
-                                    }
+                            entry->writeAlarm = writeAlarm;
+                        }
+                    }
+                }
+            }
+            lock.Unlock();
+        }
 
-                                    it = dispatchEntries.find(stream);
-                                }
-                                if (status == ER_OK && it != dispatchEntries.end()) {
+        lock.Lock();
+        if (isRunning && nextDeadlineSweep && (nextDeadlineSweep <= GetTimestamp64())) {
+            SweepReadDeadlines();
+        }
+        startRound = !deferredContexts.empty() && !freshWork;
+        lock.Unlock();
 
-                                    it->second.writeAlarm = writeAlarm;
-                                }
+        if (alerted) {
+            /* This thread has been alerted or is being stopped. Will check the IsStopping()
+             * flag when the while condition is encountered.
+             * Note that the stop event must be reset before adding the exit alarms to ensure that
+             * exit alarms are added for all streams that are stopped within close duration of each other.
+             */
+            lock.Lock();
+            stopEvent.ResetEvent();
 
-                                break;
-                            }
+            /* Add exit alarms for any streams that are being stopped.
+             * We dont need to keep track of the exit alarm, since we never remove
+             * the exit alarm. Hence it is not a part of IODispatchEntry.
+             */
+            while (!stoppingStreams.empty() && isRunning) {
+                Stream* lookup = stoppingStreams.back();
+                IODispatchEntry* entry = FindEntry(lookup);
+                if (entry && entry->stopping_state == IO_STOPPING) {
+                    void* context = &entry->exitCtxt;
+                    Alarm exitAlarm = Alarm(when, listener, context);
+                    QStatus status = ER_TIMER_FULL;
+                    while (isRunning && status == ER_TIMER_FULL && entry && entry->stopping_state != IO_STOPPED) {
+                        /* Call the non-blocking version of AddAlarm, while holding the
+                         * locks to ensure that the state of the dispatchEntry is valid.
+                         */
+                        status = timer.AddAlarmNonBlocking(exitAlarm);
+
+                        if (status == ER_TIMER_FULL) {
+                            lock.Unlock();
+                            qcc::Sleep(2);
+                            lock.Lock();
                         }
+                        entry = FindEntry(lookup);
+                    }
+                    if (status == ER_OK && entry) {
+                        entry->stopping_state = IO_STOPPED;
                     }
-                    it++;
                 }
-                lock.Unlock();
+                /* StopStream may have added more streams while the lock was released */
+                vector<Stream*>::iterator sit = find(stoppingStreams.begin(), stoppingStreams.end(), lookup);
+                if (sit != stoppingStreams.end()) {
+                    stoppingStreams.erase(sit);
+                }
             }
+            lock.Unlock();
         }
     }
+    eventSet.RemoveEvent(stopEvent, &stopEvent);
     lock.Lock();
-    /* Set isRunning flag and reload flag. */
-    reload = true;
-    QCC_DbgPrintf(("IODispatch::Run exiting"));
+    deferredContexts.clear();
     lock.Unlock();
 
+    QCC_DbgPrintf(("IODispatch::Run exiting"));
+
     return (ThreadReturn) 0;
 }
 
 
 QStatus IODispatch::EnableReadCallback(const Source* source, uint32_t timeout)
 {
+    IODispatch* reactor = GetReactor((Stream*)source);
+    if (reactor != this) {
+        return reactor->EnableReadCallback(source, timeout);
+    }
+
     lock.Lock();
     /* Dont attempt to modify an entry if the IODispatch is shutting down */
     if (!isRunning) {
@@ -563,61 +1013,33 @@ QStatus IODispatch::EnableReadCallback(const Source* source, uint32_t timeout)
         return ER_IODISPATCH_STOPPING;
     }
     Stream* lookup = (Stream*)source;
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(lookup);
+    IODispatchEntry* entry = FindEntry(lookup);
 
     /* Ensure stream is valid and still running */
-    if (it == dispatchEntries.end() || (it->second.stopping_state != IO_RUNNING)) {
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
         lock.Unlock();
         return ER_INVALID_STREAM;
     }
 
-    it->second.readEnable = true;
-
+    entry->readEnable = true;
     if (timeout != 0) {
-        /* If timeout is non-zero, add a timeout alarm */
-        uint32_t temp = timeout * 1000;
-        AlarmListener* listener = this;
-
-        Alarm readAlarm = Alarm(temp, listener, it->second.readTimeoutCtxt);
-        QStatus status = ER_TIMER_FULL;
-        while (isRunning && status == ER_TIMER_FULL &&  it != dispatchEntries.end() && it->second.stopping_state == IO_RUNNING) {
-            /* Call the non-blocking version of AddAlarm, while holding the
-             * locks to ensure that the state of the dispatchEntry is valid.
-             */
-            status = timer.AddAlarmNonBlocking(readAlarm);
-
-            if (status == ER_TIMER_FULL) {
-                lock.Unlock();
-                qcc::Sleep(2);
-                lock.Lock();
-            }
-
-            it = dispatchEntries.find(lookup);
-        }
-        if (status == ER_OK && it != dispatchEntries.end()) {
-            it->second.readAlarm = readAlarm;
-            /* Set readInProgress to false only after adding the alarm
-             * This is to ensure that there is no race condition due to the main thread
-             * trying to remove this alarm before it has been added and assuming
-             * it was successful
-             */
-            it->second.readInProgress = false;
-        }
-    } else {
-        /* Timeout = 0 indicates that no timeout alarm is required for this stream */
-        it->second.readInProgress = false;
+        /* Only the deadline is stored; the main thread sweeps for read timeouts */
+        SetReadDeadline(*entry, timeout);
     }
+    entry->readInProgress = false;
+    UpdateEventSet(lookup, *entry);
     lock.Unlock();
 
-    Thread::Alert();
-    /* Dont need to wait for the IODispatch::Run thread to reload
-     * the set of file descriptors since we're enabling read.
-     */
     return ER_OK;
 }
 
 QStatus IODispatch::EnableTimeoutCallback(const Source* source, uint32_t timeout)
 {
+    IODispatch* reactor = GetReactor((Stream*)source);
+    if (reactor != this) {
+        return reactor->EnableTimeoutCallback(source, timeout);
+    }
+
     lock.Lock();
     /* Dont attempt to modify an entry if the IODispatch is shutting down */
     if (!isRunning) {
@@ -626,9 +1048,9 @@ QStatus IODispatch::EnableTimeoutCallback(const Source* source, uint32_t timeout
     }
 
     Stream* lookup = (Stream*)source;
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(lookup);
+    IODispatchEntry* entry = FindEntry(lookup);
     /* Ensure stream is valid and still running */
-    if (it == dispatchEntries.end() || (it->second.stopping_state != IO_RUNNING)) {
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
         lock.Unlock();
         return ER_INVALID_STREAM;
     }
@@ -636,51 +1058,179 @@ QStatus IODispatch::EnableTimeoutCallback(const Source* source, uint32_t timeout
     /* If a read is in progress, the ReadCallback will take care of adding the
      * timeout callback for this stream.
      */
-    if (it->second.readInProgress) {
+    if (entry->readInProgress) {
         lock.Unlock();
         return ER_OK;
     }
 
-    Alarm prevAlarm = it->second.readAlarm;
-    if (timeout != 0) {
-        /* If timeout is non-zero, add a timeout alarm */
-        uint32_t temp = timeout * 1000;
-        AlarmListener* listener = this;
-        Alarm readAlarm = Alarm(temp, listener, it->second.readTimeoutCtxt);
+    SetReadDeadline(*entry, timeout);
+    lock.Unlock();
+    return ER_OK;
+}
+QStatus IODispatch::SetInlineCallbacks(const Stream* stream, bool inlineCallbacks)
+{
+    IODispatch* reactor = GetReactor(stream);
+    if (reactor != this) {
+        return reactor->SetInlineCallbacks(stream, inlineCallbacks);
+    }
 
-        /* Remove previous read timeout alarm if any */
-        timer.RemoveAlarm(prevAlarm, false);
+    lock.Lock();
+    IODispatchEntry* entry = FindEntry(stream);
+    /* Ensure stream is valid and still running */
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
+        lock.Unlock();
+        return ER_INVALID_STREAM;
+    }
+    entry->inlineCallbacks = inlineCallbacks;
+    lock.Unlock();
+    return ER_OK;
+}
 
-        QStatus status = ER_TIMER_FULL;
-        map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(lookup);
-        while (isRunning && status == ER_TIMER_FULL &&  it != dispatchEntries.end() && !it->second.readInProgress && it->second.stopping_state == IO_RUNNING) {
-            /* Call the non-blocking version of AddAlarm, while holding the
-             * locks to ensure that the state of the dispatchEntry is valid.
-             */
-            status = timer.AddAlarmNonBlocking(readAlarm);
+QStatus IODispatch::SetStreamBudget(const Stream* stream, uint32_t maxCallbacks, uint32_t maxBytes)
+{
+    IODispatch* reactor = GetReactor(stream);
+    if (reactor != this) {
+        return reactor->SetStreamBudget(stream, maxCallbacks, maxBytes);
+    }
 
-            if (status == ER_TIMER_FULL) {
-                lock.Unlock();
-                qcc::Sleep(2);
-                lock.Lock();
-            }
+    lock.Lock();
+    IODispatchEntry* entry = FindEntry(stream);
+    /* Ensure stream is valid and still running */
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
+        lock.Unlock();
+        return ER_INVALID_STREAM;
+    }
+    entry->maxCallbacks = maxCallbacks;
+    entry->maxBytes = maxBytes;
+    lock.Unlock();
+    return ER_OK;
+}
+
+bool IODispatch::ChargeBudget(const Stream* stream, size_t bytes)
+{
+    IODispatch* reactor = GetReactor(stream);
+    if (reactor != this) {
+        return reactor->ChargeBudget(stream, bytes);
+    }
 
-            it = dispatchEntries.find(lookup);
+    bool remaining = true;
+    lock.Lock();
+    IODispatchEntry* entry = FindEntry(stream);
+    if (entry) {
+        if (entry->budgetRound != budgetRound) {
+            entry->budgetRound = budgetRound;
+            entry->roundCallbacks = 0;
+            entry->roundBytes = 0;
         }
-        if (status == ER_OK && it != dispatchEntries.end()) {
-            it->second.readAlarm = readAlarm;
+        entry->roundBytes = static_cast<uint32_t>(min(static_cast<size_t>(entry->roundBytes) + bytes, static_cast<size_t>(0xFFFFFFFF)));
+        remaining = !entry->maxBytes || (entry->roundBytes < entry->maxBytes);
+    }
+    lock.Unlock();
+    return remaining;
+}
+
+void IODispatch::GetBudgetStats(uint64_t& callbackBudgetExhausted, uint64_t& byteBudgetExhausted)
+{
+    lock.Lock();
+    callbackBudgetExhausted = this->callbackBudgetExhausted;
+    byteBudgetExhausted = this->byteBudgetExhausted;
+    lock.Unlock();
+    for (size_t i = 0; i < reactors.size(); ++i) {
+        reactors[i]->lock.Lock();
+        callbackBudgetExhausted += reactors[i]->callbackBudgetExhausted;
+        byteBudgetExhausted += reactors[i]->byteBudgetExhausted;
+        reactors[i]->lock.Unlock();
+    }
+}
+
+QStatus IODispatch::QueueWrite(Sink* sink, const void* buf, size_t numBytes)
+{
+    Stream* lookup = (Stream*)sink;
+    IODispatch* reactor = GetReactor(lookup);
+    if (reactor != this) {
+        return reactor->QueueWrite(sink, buf, numBytes);
+    }
+
+    lock.Lock();
+    /* Dont attempt to modify an entry if the IODispatch is shutting down */
+    if (!isRunning) {
+        lock.Unlock();
+        return ER_IODISPATCH_STOPPING;
+    }
+    IODispatchEntry* entry = FindEntry(lookup);
+    /* Ensure stream is valid and still running */
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
+        lock.Unlock();
+        return ER_INVALID_STREAM;
+    }
+    if (entry->writeQueueStatus != ER_OK) {
+        QStatus status = entry->writeQueueStatus;
+        lock.Unlock();
+        return status;
+    }
+    if (entry->highWatermark && (entry->queuedBytes >= entry->highWatermark)) {
+        lock.Unlock();
+        return ER_WOULDBLOCK;
+    }
+    if (numBytes > 0) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(buf);
+        entry->writeQueue.push_back(vector<uint8_t>());
+        entry->writeQueue.back().assign(bytes, bytes + numBytes);
+        entry->queuedBytes += numBytes;
+        if (entry->highWatermark && (entry->queuedBytes >= entry->highWatermark)) {
+            entry->aboveHighWatermark = true;
         }
+        UpdateEventSet(lookup, *entry);
+        NotifyWatermark(lookup);
+    }
+    lock.Unlock();
+    return ER_OK;
+}
 
-    } else {
-        /* Zero timeout indicates no timeout alarm is required. */
-        timer.RemoveAlarm(prevAlarm, false);
+QStatus IODispatch::SetWriteWatermarks(const Sink* sink, size_t highWatermark, size_t lowWatermark, IOWatermarkListener* listener)
+{
+    Stream* lookup = (Stream*)sink;
+    IODispatch* reactor = GetReactor(lookup);
+    if (reactor != this) {
+        return reactor->SetWriteWatermarks(sink, highWatermark, lowWatermark, listener);
+    }
 
+    lock.Lock();
+    IODispatchEntry* entry = FindEntry(lookup);
+    /* Ensure stream is valid and still running */
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
+        lock.Unlock();
+        return ER_INVALID_STREAM;
     }
+    entry->highWatermark = highWatermark;
+    entry->lowWatermark = min(lowWatermark, highWatermark);
+    entry->watermarkListener = listener;
     lock.Unlock();
     return ER_OK;
 }
+
+size_t IODispatch::GetQueuedBytes(const Sink* sink)
+{
+    Stream* lookup = (Stream*)sink;
+    IODispatch* reactor = GetReactor(lookup);
+    if (reactor != this) {
+        return reactor->GetQueuedBytes(sink);
+    }
+
+    lock.Lock();
+    IODispatchEntry* entry = FindEntry(lookup);
+    size_t queued = entry ? entry->queuedBytes : 0;
+    lock.Unlock();
+    return queued;
+}
+
 QStatus IODispatch::DisableReadCallback(const Source* source)
 {
+    IODispatch* reactor = GetReactor((Stream*)source);
+    if (reactor != this) {
+        return reactor->DisableReadCallback(source);
+    }
+
     lock.Lock();
     /* Dont attempt to modify an entry if the IODispatch is shutting down */
     if (!isRunning) {
@@ -689,26 +1239,26 @@ QStatus IODispatch::DisableReadCallback(const Source* source)
     }
 
     Stream* lookup = (Stream*)source;
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(lookup);
+    IODispatchEntry* entry = FindEntry(lookup);
     /* Ensure stream is valid and still running */
-    if (it == dispatchEntries.end() || (it->second.stopping_state != IO_RUNNING)) {
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
         lock.Unlock();
         return ER_INVALID_STREAM;
     }
-    it->second.readEnable = false;
+    entry->readEnable = false;
+    /* The source event is no longer reported once it has been removed from the event set */
+    UpdateEventSet(lookup, *entry);
     lock.Unlock();
-    Thread::Alert();
-    /* Wait until the IODispatch::Run thread reloads the set of check events
-     * since we are disabling read.
-     */
-    while (!reload && crit && isRunning) {
-        Sleep(10);
-    }
     return ER_OK;
 }
 
 QStatus IODispatch::EnableWriteCallbackNow(Sink* sink)
 {
+    IODispatch* reactor = GetReactor((Stream*)sink);
+    if (reactor != this) {
+        return reactor->EnableWriteCallbackNow(sink);
+    }
+
     lock.Lock();
     /* Dont attempt to modify an entry if the IODispatch is shutting down */
     if (!isRunning) {
@@ -717,40 +1267,46 @@ QStatus IODispatch::EnableWriteCallbackNow(Sink* sink)
     }
 
     Stream* lookup = (Stream*)sink;
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(lookup);
+    IODispatchEntry* entry = FindEntry(lookup);
     /* Ensure stream is valid and still running */
-    if (it == dispatchEntries.end() || (it->second.stopping_state != IO_RUNNING)) {
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
         lock.Unlock();
         return ER_INVALID_STREAM;
     }
-    if (it->second.writeEnable) {
+    if (entry->writeEnable) {
         lock.Unlock();
         return ER_OK;
     }
-    it->second.writeEnable = true;
-    it->second.writeInProgress = true;
+    entry->writeEnable = true;
+    entry->writeInProgress = true;
 
     int32_t when = 0;
     AlarmListener* listener = this;
 
     /* Add a write alarm to fire now, there is data ready to be written */
-    it->second.writeAlarm = Alarm(when, listener, it->second.writeCtxt);
-    Alarm writeAlarm = it->second.writeAlarm;
+    void* context = &entry->writeCtxt;
+    entry->writeAlarm = Alarm(when, listener, context);
+    Alarm writeAlarm = entry->writeAlarm;
     QStatus status = timer.AddAlarmNonBlocking(writeAlarm);
     if (status == ER_TIMER_FULL) {
         /* Since the timer is full, just alert the main thread, so that
          * it can add a write alarm for this stream when possible.
          * Do not block here, since it can create deadlocks.
          */
-        it->second.writeInProgress = false;
-        Thread::Alert();
+        entry->writeInProgress = false;
     }
+    UpdateEventSet(lookup, *entry);
     lock.Unlock();
     return ER_OK;
 }
 
 QStatus IODispatch::EnableWriteCallback(Sink* sink, uint32_t timeout)
 {
+    IODispatch* reactor = GetReactor((Stream*)sink);
+    if (reactor != this) {
+        return reactor->EnableWriteCallback(sink, timeout);
+    }
+
     lock.Lock();
     /* Dont attempt to modify an entry if the IODispatch is shutting down */
     if (!isRunning) {
@@ -759,24 +1315,25 @@ QStatus IODispatch::EnableWriteCallback(Sink* sink, uint32_t timeout)
     }
 
     Stream* lookup = (Stream*)sink;
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(lookup);
-    if (it == dispatchEntries.end() || (it->second.stopping_state != IO_RUNNING)) {
+    IODispatchEntry* entry = FindEntry(lookup);
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
         lock.Unlock();
         return ER_INVALID_STREAM;
     }
 
-    it->second.writeEnable = true;
+    entry->writeEnable = true;
 
     if (timeout != 0) {
         int32_t when = timeout * 1000;
         AlarmListener* listener = this;
 
         /* Add a write alarm to fire by default if there is no sink event after this amount of time */
-        Alarm writeAlarm = Alarm(when, listener, it->second.writeTimeoutCtxt);
+        void* context = &entry->writeTimeoutCtxt;
+        Alarm writeAlarm = Alarm(when, listener, context);
         QStatus status = ER_TIMER_FULL;
 
-        map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(lookup);
-        while (isRunning && status == ER_TIMER_FULL &&  it != dispatchEntries.end() && !it->second.writeInProgress && it->second.stopping_state == IO_RUNNING) {
+        entry = FindEntry(lookup);
+        while (isRunning && status == ER_TIMER_FULL &&  entry && !entry->writeInProgress && entry->stopping_state == IO_RUNNING) {
             /* Call the non-blocking version of AddAlarm, while holding the
              * locks to ensure that the state of the dispatchEntry is valid.
              */
@@ -788,26 +1345,31 @@ QStatus IODispatch::EnableWriteCallback(Sink* sink, uint32_t timeout)
                 lock.Lock();
             }
 
-            it = dispatchEntries.find(lookup);
+            entry = FindEntry(lookup);
         }
-        if (status == ER_OK && it != dispatchEntries.end()) {
+        if (status == ER_OK && entry) {
 
-            it->second.writeAlarm = writeAlarm;
-            it->second.writeInProgress = false;
+            entry->writeAlarm = writeAlarm;
+            entry->writeInProgress = false;
         }
     } else {
-        it->second.writeInProgress = false;
+        entry->writeInProgress = false;
+    }
+    entry = FindEntry(lookup);
+    if (entry) {
+        UpdateEventSet(lookup, *entry);
     }
     lock.Unlock();
-    Thread::Alert();
 
-    /* Dont need to wait for the IODispatch::Run thread to reload
-     * the set of file descriptors, since we are enabling write callback.
-     */
     return ER_OK;
 }
 QStatus IODispatch::DisableWriteCallback(const Sink* sink)
 {
+    IODispatch* reactor = GetReactor((Stream*)sink);
+    if (reactor != this) {
+        return reactor->DisableWriteCallback(sink);
+    }
+
     lock.Lock();
     /* Dont attempt to modify an entry if the IODispatch is shutting down */
     if (!isRunning) {
@@ -816,21 +1378,15 @@ QStatus IODispatch::DisableWriteCallback(const Sink* sink)
     }
 
     Stream* lookup = (Stream*)sink;
-    map<Stream*, IODispatchEntry>::iterator it = dispatchEntries.find(lookup);
-    if (it == dispatchEntries.end() || (it->second.stopping_state != IO_RUNNING)) {
+    IODispatchEntry* entry = FindEntry(lookup);
+    if (!entry || (entry->stopping_state != IO_RUNNING)) {
         lock.Unlock();
         return ER_INVALID_STREAM;
     }
-    it->second.writeEnable = false;
-
+    entry->writeEnable = false;
+    /* The sink event is no longer reported once it has been removed from the event set */
+    UpdateEventSet(lookup, *entry);
     lock.Unlock();
-    Thread::Alert();
-    /* Wait until the IODispatch::Run thread reloads the set of check events
-     * since we are disabling write.
-     */
-    while (!reload && crit && isRunning) {
-        Sleep(10);
-    }
     return ER_OK;
 }
 
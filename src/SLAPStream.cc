@@ -83,6 +83,15 @@ SLAPStream::SLAPStream(Stream* rawStream, Timer& timer, uint16_t maxPacketSize,
     /* Initially m_rxCurrent will only be used for Link Ctrl packets - 32 bytes is sufficient */
     m_rxCurrent = new SLAPReadPacket(32);
     m_txCtrl = new SLAPWritePacket(32);
+
+    /* The alarms are created once and re-armed rather than adding new ones, so scheduling a
+     * timeout neither allocates nor blocks while holding the locks.
+     */
+    AlarmListener* listener = this;
+    m_sendAlarm = Alarm(listener, m_sendDataCtxt);
+    m_resendAlarm = Alarm(listener, m_resendDataCtxt);
+    m_ackAlarm = Alarm(listener, m_ackCtxt);
+    m_ctrlAlarm = Alarm(listener, m_resendControlCtxt);
 }
 
 SLAPStream::~SLAPStream()
@@ -208,7 +217,6 @@ void SLAPStream::ProcessDataSeqNum(uint8_t seq)
         return;
     }
     QStatus status = ER_TIMER_FULL;
-    Alarm ackAlarm;
 
 #ifdef ALWAYS_ACK
     ++m_pendingAcks;
@@ -220,23 +228,14 @@ void SLAPStream::ProcessDataSeqNum(uint8_t seq)
      */
 
     while (m_pendingAcks && !m_timer.HasAlarm(m_ackAlarm) && status == ER_TIMER_FULL) {
-        AlarmListener* listener = this;
         uint32_t when = 0;
-
-        ackAlarm = Alarm(when, listener, m_ackCtxt);
-        /* Call the non-blocking version of AddAlarm, while holding the
-         * locks to ensure that the state of the dispatchEntry is valid.
-         */
-        status = m_timer.AddAlarmNonBlocking(ackAlarm);
+        status = m_timer.Rearm(m_ackAlarm, when);
 
         if (status == ER_TIMER_FULL) {
             m_streamLock.Unlock();
             qcc::Sleep(2);
             m_streamLock.Lock();
         }
-        if (status == ER_OK) {
-            m_ackAlarm = ackAlarm;
-        }
     }
 
 #else
@@ -249,23 +248,14 @@ void SLAPStream::ProcessDataSeqNum(uint8_t seq)
      * period so if this is the first pending ack we need to prime a timer.
      */
     while (m_pendingAcks && !m_timer.HasAlarm(m_ackAlarm) && status == ER_TIMER_FULL) {
-        AlarmListener* listener = this;
         uint32_t when = (m_pendingAcks == m_linkParams.windowSize) ? 0 : m_linkParams.ackTimeout;
-
-        ackAlarm = Alarm(when, listener, m_ackCtxt);
-        /* Call the non-blocking version of AddAlarm, while holding the
-         * locks to ensure that the state of the dispatchEntry is valid.
-         */
-        status = m_timer.AddAlarmNonBlocking(ackAlarm);
+        status = m_timer.Rearm(m_ackAlarm, when);
 
         if (status == ER_TIMER_FULL) {
             m_streamLock.Unlock();
             qcc::Sleep(2);
             m_streamLock.Lock();
         }
-        if (status == ER_OK) {
-            m_ackAlarm = ackAlarm;
-        }
     }
 
 #endif
@@ -280,7 +270,6 @@ void SLAPStream::ProcessDataSeqNum(uint8_t seq)
 void SLAPStream::ProcessAckNum(uint8_t ack)
 {
     SLAPWritePacket* pkt;
-    m_timer.RemoveAlarm(m_resendAlarm, false);
     /* Look through the m_txSent list and remove any data packets that have already been sent out. */
     while (!m_txSent.empty()) {
         pkt = m_txSent.front();
@@ -295,26 +284,20 @@ void SLAPStream::ProcessAckNum(uint8_t ack)
         }
 
     }
-    Alarm resendAlarm;
+    if (m_txSent.empty()) {
+        m_timer.RemoveAlarm(m_resendAlarm, false);
+    }
     QStatus status = ER_TIMER_FULL;
-    while (!m_txSent.empty()  && !m_timer.HasAlarm(m_resendAlarm) && status == ER_TIMER_FULL) {
-        AlarmListener* listener = this;
+    while (!m_txSent.empty() && status == ER_TIMER_FULL) {
         uint32_t when = m_linkParams.resendTimeout;
-
-        resendAlarm = Alarm(when, listener, m_resendDataCtxt);
-        /* Call the non-blocking version of AddAlarm, while holding the
-         * locks to ensure that the state of the dispatchEntry is valid.
-         */
-        status = m_timer.AddAlarmNonBlocking(resendAlarm);
+        /* Push the resend timeout back by re-arming the pending alarm in place */
+        status = m_timer.Rearm(m_resendAlarm, when);
 
         if (status == ER_TIMER_FULL) {
             m_streamLock.Unlock();
             qcc::Sleep(2);
             m_streamLock.Lock();
         }
-        if (status == ER_OK) {
-            m_resendAlarm = resendAlarm;
-        }
     }
 
 
@@ -589,26 +572,16 @@ void SLAPStream::TransmitToLink()
             m_getNextPacket = true;
         }
     }
-    Alarm resendAlarm;
     status = ER_TIMER_FULL;
     while (!m_txSent.empty() && !m_timer.HasAlarm(m_resendAlarm) && status == ER_TIMER_FULL) {
-        AlarmListener* listener = this;
         uint32_t when = m_linkParams.resendTimeout;
-
-        resendAlarm = Alarm(when, listener, m_resendDataCtxt);
-        /* Call the non-blocking version of AddAlarm, while holding the
-         * locks to ensure that the state of the dispatchEntry is valid.
-         */
-        status = m_timer.AddAlarmNonBlocking(resendAlarm);
+        status = m_timer.Rearm(m_resendAlarm, when);
 
         if (status == ER_TIMER_FULL) {
             m_streamLock.Unlock();
             qcc::Sleep(2);
             m_streamLock.Lock();
         }
-        if (status == ER_OK) {
-            m_resendAlarm = resendAlarm;
-        }
     }
 
 
@@ -621,7 +594,6 @@ void SLAPStream::TransmitToLink()
 
 QStatus SLAPStream::ScheduleLinkControlPacket() {
     m_streamLock.Lock(MUTEX_CONTEXT);
-    AlarmListener* listener = this;
     uint32_t when = 10;
     QStatus status = ER_OK;
     bool addCtrlAlarm = false;
@@ -634,8 +606,6 @@ QStatus SLAPStream::ScheduleLinkControlPacket() {
         //assert(!m_timer.HasAlarm(m_ctrlAlarm));
         EnqueueCtrl(CONN_PKT);
         when = CONN_TIMEOUT;
-
-        m_ctrlAlarm = Alarm(when, listener, m_resendControlCtxt);
         addCtrlAlarm = true;
         break;
 
@@ -647,8 +617,6 @@ QStatus SLAPStream::ScheduleLinkControlPacket() {
          */
         EnqueueCtrl(NEGO_PKT, m_configField);
         when = NEGO_TIMEOUT;
-        m_ctrlAlarm = Alarm(when, listener, m_resendControlCtxt);
-
         addCtrlAlarm = true;
         break;
 
@@ -659,26 +627,16 @@ QStatus SLAPStream::ScheduleLinkControlPacket() {
         break;
     }
     if (addCtrlAlarm) {
-        Alarm ctrlAlarm;
         status = ER_TIMER_FULL;
-        while (!m_timer.HasAlarm(m_ctrlAlarm)  && status == ER_TIMER_FULL) {
-            AlarmListener* listener = this;
-
-
-            ctrlAlarm = Alarm(when, listener, m_resendControlCtxt);
-            /* Call the non-blocking version of AddAlarm, while holding the
-             * locks to ensure that the state of the dispatchEntry is valid.
-             */
-            status = m_timer.AddAlarmNonBlocking(ctrlAlarm);
+        while (status == ER_TIMER_FULL) {
+            /* Restart the control packet timeout, moving the alarm if it is still pending */
+            status = m_timer.Rearm(m_ctrlAlarm, when);
 
             if (status == ER_TIMER_FULL) {
                 m_streamLock.Unlock();
                 qcc::Sleep(2);
                 m_streamLock.Lock();
             }
-            if (status == ER_OK) {
-                m_ctrlAlarm = ctrlAlarm;
-            }
         }
 
 
@@ -745,26 +703,16 @@ QStatus SLAPStream::PushBytes(const void* buf, size_t numBytes, size_t& numSent)
         if (m_txFreeList.empty()) {
             m_sinkEvent.ResetEvent();
         }
-        Alarm sendAlarm;
         QStatus status = ER_TIMER_FULL;
         while (queued && (m_txState == TX_IDLE)  && !m_timer.HasAlarm(m_sendAlarm) && status == ER_TIMER_FULL) {
-            AlarmListener* listener = this;
             uint32_t when = 0;
-
-            sendAlarm = Alarm(when, listener, m_sendDataCtxt);
-            /* Call the non-blocking version of AddAlarm, while holding the
-             * locks to ensure that the state of the dispatchEntry is valid.
-             */
-            status = m_timer.AddAlarmNonBlocking(sendAlarm);
+            status = m_timer.Rearm(m_sendAlarm, when);
 
             if (status == ER_TIMER_FULL) {
                 m_streamLock.Unlock();
                 qcc::Sleep(2);
                 m_streamLock.Lock();
             }
-            if (status == ER_OK) {
-                m_sendAlarm = sendAlarm;
-            }
         }
 
 
@@ -805,26 +753,16 @@ void SLAPStream::EnqueueCtrl(ControlPacketType type, uint8_t* config)
 
         m_txQueue.push_front(m_txCtrl);
     }
-    Alarm sendAlarm;
     QStatus status = ER_TIMER_FULL;
     while (!m_timer.HasAlarm(m_sendAlarm) && status == ER_TIMER_FULL) {
-        AlarmListener* listener = this;
         uint32_t when = 0;
-
-        sendAlarm = Alarm(when, listener, m_sendDataCtxt);
-        /* Call the non-blocking version of AddAlarm, while holding the
-         * locks to ensure that the state of the dispatchEntry is valid.
-         */
-        status = m_timer.AddAlarmNonBlocking(sendAlarm);
+        status = m_timer.Rearm(m_sendAlarm, when);
 
         if (status == ER_TIMER_FULL) {
             m_streamLock.Unlock();
             qcc::Sleep(2);
             m_streamLock.Lock();
         }
-        if (status == ER_OK) {
-            m_sendAlarm = sendAlarm;
-        }
     }
 
     m_streamLock.Unlock(MUTEX_CONTEXT);
@@ -248,6 +248,15 @@ QStatus SocketStream::PushBytes(const void* buf, size_t numBytes, size_t& numSen
     return status;
 }
 
+QStatus SocketStream::PushBytesV(const IOVec* iov, size_t numIov, size_t& numSent)
+{
+    numSent = 0;
+    if (!isConnected) {
+        return ER_WRITE_ERROR;
+    }
+    return qcc::SendV(sock, iov, numIov, numSent);
+}
+
 QStatus SocketStream::PushBytesAndFds(const void* buf, size_t numBytes, size_t& numSent, SocketFd* fdList, size_t numFds, uint32_t pid)
 {
     if (numBytes == 0) {
@@ -57,3 +57,22 @@ QStatus Source::GetLine(qcc::String& outStr, uint32_t timeout)
     }
     return ((status == ER_NONE) && hasBytes) ? ER_OK : status;
 }
+
+QStatus Sink::PushBytesV(const IOVec* iov, size_t numIov, size_t& numSent)
+{
+    QStatus status = ER_OK;
+
+    numSent = 0;
+    for (size_t i = 0; i < numIov; ++i) {
+        size_t actual = 0;
+        status = PushBytes(iov[i].buf, iov[i].len, actual);
+        if (status != ER_OK) {
+            break;
+        }
+        numSent += actual;
+        if (actual < iov[i].len) {
+            break;
+        }
+    }
+    return ((status != ER_OK) && (numSent > 0)) ? ER_OK : status;
+}
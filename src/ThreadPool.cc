@@ -1,7 +1,7 @@
 /**
  * @file
  *
- * Simple ThreadPool using Timers and Alarms
+ * Work-stealing ThreadPool
  */
 
 /******************************************************************************
@@ -21,91 +21,285 @@
  ******************************************************************************/
 
 #include <assert.h>
+#include <algorithm>
+
+#include <qcc/atomic.h>
+#include <qcc/Debug.h>
 #include <qcc/ThreadPool.h>
 
 #define QCC_MODULE "THREADPOOL"
 
 namespace qcc {
 
-void Runnable::AlarmTriggered(const Alarm& alarm, QStatus reason)
-{
-    QCC_DbgPrintf(("Runnable::AlarmTriggered()"));
+/**
+ * One of the threads of a ThreadPool.
+ */
+class ThreadPoolWorker : public Thread, public ThreadListener {
+  public:
+
+    ThreadPoolWorker(const char* name, ThreadPool* threadpool, uint32_t index) :
+        Thread(name),
+        m_index(index),
+        m_retired(false),
+        m_threadpool(threadpool)
+    { }
+
+    /**
+     * A worker that stopped for lack of work joins itself, since nobody else
+     * will until the pool is stopped.
+     */
+    void ThreadExit(Thread* thread)
+    {
+        if (m_retired) {
+            Join();
+        }
+    }
 
-    /*
-     * Execute the user's provided run function.  Note that this is done in an
-     * OS-specific context.  For example, on Linux-based systems, this may
-     * happen in the context of a pthread from the Timer; but on Windows systems
-     * it may happen in the context of an asynchronous OS callback.
+    /**
+     * Runnables executed from this thread, per priority.  The thread itself
+     * pushes and pops at the back so the Runnable it queued last runs first,
+     * other threads steal from the front and take the oldest.
      */
-    Run();
+    std::deque<Runnable*> m_tasks[ThreadPool::NUM_PRIORITIES];
 
-    /*
-     * Tell the threadpool that we are done with this runnable object.  This
-     * allows the threadpool to release its reference to the object which may
-     * result in an immediate delete of the object.  So one must never refer to
-     * the underlying runnable after this point.
+    /**
+     * A mutex to protect m_tasks.  There is one per worker so threads that
+     * work off their own deque don't contend with each other.
      */
-    m_threadpool->Release(this);
+    Mutex m_tasksLock;
+
+    /**
+     * Position of this worker in ThreadPool::m_workers.
+     */
+    const uint32_t m_index;
+
+    /**
+     * True if the worker stopped because it had no work for the idle timeout.
+     */
+    bool m_retired;
+
+    /**
+     * Statistics of the Runnables this worker has run, kept per worker so that
+     * the workers don't contend for them.
+     */
+    ThreadPoolStats m_stats;
+
+    /**
+     * A mutex to protect m_stats.
+     */
+    Mutex m_statsLock;
+
+  protected:
+    virtual ThreadReturn STDCALL Run(void* arg);
+
+  private:
+    ThreadPool* m_threadpool;
+};
+
+ThreadReturn STDCALL ThreadPoolWorker::Run(void* arg)
+{
+    QCC_DbgPrintf(("ThreadPoolWorker::Run()"));
+
+    while (!IsStopping()) {
+        Runnable* runnable = m_threadpool->NextRunnable(this);
+        if (!runnable) {
+            /*
+             * Register as idle before looking one last time, so that a Runnable
+             * queued after the look either is found by it or has its submitter
+             * see us in the idle list and alert us.
+             */
+            m_threadpool->m_lock.Lock();
+            m_threadpool->m_idle.push_back(this);
+            IncrementAndFetch(&m_threadpool->m_idleCount);
+            m_threadpool->m_lock.Unlock();
+
+            QStatus status = ER_OK;
+            runnable = m_threadpool->NextRunnable(this);
+            if (!runnable) {
+                QCC_DbgPrintf(("ThreadPoolWorker::Run(): Waiting for work"));
+                uint32_t timeout = (m_index < m_threadpool->m_minThreads) ? Event::WAIT_FOREVER : m_threadpool->m_idleTimeoutMs;
+                status = Event::Wait(Event::neverSet, timeout);
+                stopEvent.ResetEvent();
+            }
+
+            /*
+             * Whoever alerted us has already taken us off the idle list.  If
+             * nobody did and we have been idle for the idle timeout we stop,
+             * but only if we are the last running worker, so that the running
+             * workers stay the first m_active ones.  We have nothing on our
+             * deque since only we put Runnables there.
+             */
+            bool retire = false;
+            m_threadpool->m_lock.Lock();
+            std::vector<ThreadPoolWorker*>::iterator i = std::find(m_threadpool->m_idle.begin(), m_threadpool->m_idle.end(), this);
+            if (i != m_threadpool->m_idle.end()) {
+                m_threadpool->m_idle.erase(i);
+                DecrementAndFetch(&m_threadpool->m_idleCount);
+                if ((status == ER_TIMEOUT) && !m_threadpool->m_stopping &&
+                    (static_cast<int32_t>(m_index) + 1 == m_threadpool->m_active) && (m_index >= m_threadpool->m_minThreads)) {
+                    DecrementAndFetch(&m_threadpool->m_active);
+                    ++m_threadpool->m_stats.threadStops;
+                    retire = true;
+                }
+            }
+            m_threadpool->m_lock.Unlock();
+
+            if (retire) {
+                QCC_DbgPrintf(("ThreadPoolWorker::Run(): Thread %u stopping after being idle", m_index));
+                m_retired = true;
+                return 0;
+            }
+            if (!runnable) {
+                continue;
+            }
+        }
+
+        uint64_t startNs = GetTimeNowNs();
+        uint64_t waitedNs = startNs - runnable->m_queuedNs;
+        m_threadpool->GrowIfBacklogged(waitedNs);
+
+        /*
+         * Execute the user's provided run function, or its expired function if
+         * we got to it too late, and tell the threadpool that we are done with
+         * this runnable object.  This may result in an immediate delete of the
+         * object.
+         */
+        bool expired = false;
+        if (runnable->GetDeadline() != Timespec::Zero) {
+            Timespec now;
+            GetTimeNow(&now);
+            expired = runnable->GetDeadline() < now;
+        }
+        if (expired) {
+            QCC_DbgPrintf(("ThreadPoolWorker::Run(): Runnable missed its deadline"));
+            runnable->Expired();
+        } else {
+            runnable->Run();
+        }
+
+        uint64_t runUs = (GetTimeNowNs() - startNs) / 1000;
+        uint64_t waitedUs = waitedNs / 1000;
+        m_statsLock.Lock();
+        ++m_stats.executed;
+        if (expired) {
+            ++m_stats.expired;
+        }
+        m_stats.waitUs += waitedUs;
+        m_stats.maxWaitUs = std::max(m_stats.maxWaitUs, waitedUs);
+        m_stats.runUs += runUs;
+        m_stats.maxRunUs = std::max(m_stats.maxRunUs, runUs);
+        m_statsLock.Unlock();
+
+        m_threadpool->Release(runnable, expired ? Runnable::STATE_EXPIRED : Runnable::STATE_RUN);
+    }
+    return 0;
 }
 
-ThreadPool::ThreadPool(const char* name, uint32_t poolsize)
-    : m_stopping(false), m_poolsize(poolsize), m_dispatcher(name, false, poolsize)
+ThreadPool::ThreadPool(const char* name, uint32_t poolsize, uint32_t maxQueued)
+    : m_stopping(false), m_poolsize(poolsize), m_capacity(poolsize + maxQueued), m_active(0), m_minThreads(poolsize),
+    m_growThresholdNs(0), m_idleTimeoutMs(30000), m_statsSince(GetTimestamp64()), m_idleCount(0), m_pending(0), m_waiters(0)
 {
     QCC_DbgPrintf(("ThreadPool::ThreadPool()"));
 
-    assert(poolsize && "ThreadPool::ThreadPool(): Empty pools are no good for anyone");
+    for (uint32_t i = 0; i < NUM_PRIORITIES; ++i) {
+        m_injected[i] = 0;
+        m_queued[i] = 0;
+    }
 
-    /*
-     * Start the dispatcher Timer.  The Timer is the code that will cause alarms
-     * to be executed.  It is the alarms that provide the callbacks that the
-     * timer will fire.  Our timer will have a concurrency variable that
-     * corresponds to the poolsize provided.  This means that there will be
-     * <poolsize> theads waiting to dispatch expired alarms (either AllJoyn
-     * created in Posix systems or OS dispatched in Windows systems).  The
-     * concurrent threads in the Timer provide us with the thread pool we
-     * actually use.
-     */
-    m_dispatcher.Start();
+    assert(poolsize && "ThreadPool::ThreadPool(): Empty pools are no good for anyone");
 
     /*
-     * Set the event that callers will ultimately use to sleep on until a thread
-     * becomes available.  We just created a Timer dispatcher which has
-     * concurrency of at least one, so there is definitely a thread available.
+     * Start all of the threads up front.  A thread that finds no work waits
+     * on the idle list until a Runnable is executed, so there is no thread
+     * creation on the path of a Runnable until SetMinThreads() lets threads
+     * stop.
      */
-    m_event.SetEvent();
+    for (uint32_t i = 0; i < poolsize; ++i) {
+        m_workers.push_back(new ThreadPoolWorker(name, this, i));
+    }
+    m_lock.Lock();
+    for (uint32_t i = 0; i < poolsize; ++i) {
+        Grow();
+    }
+    m_lock.Unlock();
 }
 
 ThreadPool::~ThreadPool()
 {
-    QCC_DbgPrintf(("ThreadPool::~ThreadPool(): %d closures remain", m_closures.size()));
+    QCC_DbgPrintf(("ThreadPool::~ThreadPool(): %d closures remain", m_pending));
     Stop();
     Join();
 
-    /*
-     * We have joined the underlying timer, so all of its threads must be
-     * stopped.  That doesn't necessarily mean that they have executed the
-     * AlarmTriggered() function that would take the closure off of the
-     * pending closures list.  In this case, we need to make sure we clear
-     * the closures map so we release the underlying Ptr and free the
-     * runnable.
-     */
-    m_closures.clear();
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        delete m_workers[i];
+    }
+    m_workers.clear();
+
+    for (size_t i = 0; i < m_waitEvents.size(); ++i) {
+        delete m_waitEvents[i];
+    }
+    m_waitEvents.clear();
 }
 
 QStatus ThreadPool::Stop()
 {
     QCC_DbgPrintf(("ThreadPool::Stop()"));
+    m_lock.Lock();
     m_stopping = true;
-    QStatus status = m_dispatcher.Stop();
-    return status;
 
+    /*
+     * Let anyone waiting for room in the pool find out that there won't be
+     * any.  They take themselves off the wait queue when they wake.
+     */
+    for (std::deque<Waiter*>::iterator i = m_waitQueue.begin(); i != m_waitQueue.end(); ++i) {
+        (*i)->event->SetEvent();
+    }
+    m_lock.Unlock();
+
+    QStatus status = ER_OK;
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        QStatus tStatus = m_workers[i]->Stop();
+        status = (status == ER_OK) ? tStatus : status;
+    }
+    return status;
 }
 
 QStatus ThreadPool::Join()
 {
     QCC_DbgPrintf(("ThreadPool::Join()"));
     assert(m_stopping && "ThreadPool::Join(): must have previously Stop()ped");
-    QStatus status = m_dispatcher.Join();
+    QStatus status = ER_OK;
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        QStatus tStatus = m_workers[i]->Join();
+        status = (status == ER_OK) ? tStatus : status;
+    }
+
+    /*
+     * All of the threads are stopped.  That doesn't necessarily mean that
+     * they have run every Runnable that was queued, so we need to release the
+     * ones that are left to free them.
+     */
+    for (uint32_t p = 0; p < NUM_PRIORITIES; ++p) {
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            while (!m_workers[i]->m_tasks[p].empty()) {
+                Runnable* runnable = m_workers[i]->m_tasks[p].front();
+                m_workers[i]->m_tasks[p].pop_front();
+                DecrementAndFetch(&m_queued[p]);
+                Release(runnable, Runnable::STATE_CANCELLED);
+            }
+        }
+        m_lock.Lock();
+        while (!m_injection[p].empty()) {
+            Runnable* runnable = m_injection[p].front();
+            m_injection[p].pop_front();
+            DecrementAndFetch(&m_injected[p]);
+            DecrementAndFetch(&m_queued[p]);
+            m_lock.Unlock();
+            Release(runnable, Runnable::STATE_CANCELLED);
+            m_lock.Lock();
+        }
+        m_lock.Unlock();
+    }
     return status;
 }
 
@@ -118,29 +312,28 @@ QStatus ThreadPool::Join()
 uint32_t ThreadPool::GetN(void)
 {
     QCC_DbgPrintf(("ThreadPool::GetN()"));
+    return m_pending;
+}
 
-    uint32_t n = 0;
-    QCC_DbgPrintf(("ThreadPool::GetN(): Taking lock"));
-    m_lock.Lock();
-    n = m_closures.size();
-    QCC_DbgPrintf(("ThreadPool::GetN(): Giving lock"));
-    m_lock.Unlock();
-    return n;
+ThreadPoolWorker* ThreadPool::GetCurrentWorker(void)
+{
+    Thread* thread = Thread::GetThread();
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        if (m_workers[i] == thread) {
+            return m_workers[i];
+        }
+    }
+    return NULL;
 }
 
-QStatus ThreadPool::Execute(Ptr<Runnable> runnable)
+QStatus ThreadPool::Execute(Ptr<Runnable> runnable, uint32_t timeout)
 {
     QCC_DbgPrintf(("ThreadPool::Execute()"));
 
-    QCC_DbgPrintf(("ThreadPool::Execute(): Taking lock"));
-    m_lock.Lock();
-
     /*
      * Refuse to add any new closures if we're in the process of closing.
      */
     if (m_stopping) {
-        QCC_DbgPrintf(("ThreadPool::Execute(): Giving lock"));
-        m_lock.Unlock();
         QCC_DbgPrintf(("ThreadPool::Execute(): Stopping"));
         return ER_THREADPOOL_STOPPING;
     }
@@ -149,184 +342,655 @@ QStatus ThreadPool::Execute(Ptr<Runnable> runnable)
      * Since AllJoyn is at its heart a distributed network application, and what
      * drives the execution of our threads will be network traffic, we need to
      * be able to apply backpressure to the network to avoid exhausting all
-     * available resources.  This is enabled by returning an error when all of
-     * the threads are in process.  This is a thread pool, not a work queue.
+     * available resources.  This is enabled by bounding the number of
+     * Runnables queued and executing, and either returning an error or putting
+     * the caller to sleep when the bound is reached.
      */
-    if (m_closures.size() == m_poolsize) {
-        QCC_DbgPrintf(("ThreadPool::Execute(): Giving lock"));
-        m_lock.Unlock();
-        QCC_DbgPrintf(("ThreadPool::Execute(): Exhausted"));
-        return ER_THREADPOOL_EXHAUSTED;
+    QStatus status = AcquireSlot(timeout, runnable->m_priority);
+    if (status != ER_OK) {
+        return status;
+    }
+    if (m_stopping) {
+        ReleaseSlot();
+        QCC_DbgPrintf(("ThreadPool::Execute(): Stopping"));
+        return ER_THREADPOOL_STOPPING;
+    }
+
+    Enqueue(&runnable, 1);
+    return ER_OK;
+}
+
+QStatus ThreadPool::ExecuteBatch(Ptr<Runnable>* runnables, size_t count, uint32_t timeout)
+{
+    QCC_DbgPrintf(("ThreadPool::ExecuteBatch(%u)", static_cast<uint32_t>(count)));
+
+    size_t queued = 0;
+    while (queued < count) {
+        if (m_stopping) {
+            QCC_DbgPrintf(("ThreadPool::ExecuteBatch(): Stopping"));
+            return ER_THREADPOOL_STOPPING;
+        }
+
+        /*
+         * Take all the places that are free in one go, and only when there are
+         * none wait for one the way Execute() does.
+         */
+        size_t n = TryAcquireSlots(count - queued);
+        if (n == 0) {
+            QStatus status = AcquireSlot(timeout, runnables[queued]->m_priority);
+            if (status != ER_OK) {
+                return status;
+            }
+            n = 1 + TryAcquireSlots(count - queued - 1);
+        }
+        if (m_stopping) {
+            for (size_t i = 0; i < n; ++i) {
+                ReleaseSlot();
+            }
+            QCC_DbgPrintf(("ThreadPool::ExecuteBatch(): Stopping"));
+            return ER_THREADPOOL_STOPPING;
+        }
+
+        Enqueue(runnables + queued, n);
+        queued += n;
     }
+    return ER_OK;
+}
 
+void ThreadPool::Enqueue(Ptr<Runnable>* runnables, size_t count)
+{
     /*
-     * We need to make sure that the runnable object is kept alive while it is
-     * waiting to be run (and while it is running) so we keep a reference to it
-     * until we don't need it any more.  This also allows us to keep track of
-     * how many pending operations there are.  Note that the map is keyed on the
-     * underlying runnable object pointer, but the smart pointer is saved in the
-     * map in order to hold a reference to the object.
+     * We need to make sure that the runnable objects are kept alive while they
+     * are waiting to be run (and while they are running) so we keep a reference
+     * to each until we don't need it any more.
      */
-    QCC_DbgPrintf(("ThreadPool::Execute(): Schedule runnable"));
-    m_closures[runnable.Peek()] = runnable;
-    QCC_DbgPrintf(("ThreadPool::Execute(): %d closures remain", m_closures.size()));
+    uint64_t nowNs = GetTimeNowNs();
+    for (size_t i = 0; i < count; ++i) {
+        Runnable* r = runnables[i].Peek();
+        r->IncRef();
+        r->SetThreadPool(this);
+        /* A Runnable that is submitted again must not find the event set by its last completion */
+        Event* event = r->m_doneEvent;
+        if (event) {
+            event->ResetEvent();
+        }
+        r->m_state = Runnable::STATE_QUEUED;
+        r->m_queuedNs = nowNs;
+    }
+
+    ThreadPoolWorker* worker = GetCurrentWorker();
+    if (worker) {
+        /*
+         * A Runnable fanning out more work keeps it on its own thread unless
+         * another thread is idle and steals it.
+         */
+        worker->m_tasksLock.Lock();
+        for (size_t i = 0; i < count; ++i) {
+            worker->m_tasks[runnables[i]->m_priority].push_back(runnables[i].Peek());
+        }
+        worker->m_tasksLock.Unlock();
+        for (size_t i = 0; i < count; ++i) {
+            IncrementAndFetch(&m_queued[runnables[i]->m_priority]);
+        }
+        if (m_idleCount) {
+            m_lock.Lock();
+            for (size_t i = 0; (i < count) && !m_idle.empty(); ++i) {
+                WakeWorker();
+            }
+            m_lock.Unlock();
+        } else if ((m_growThresholdNs == 0) && (m_active < static_cast<int32_t>(m_poolsize))) {
+            m_lock.Lock();
+            if (m_idle.empty()) {
+                Grow();
+            }
+            m_lock.Unlock();
+        }
+    } else {
+        m_lock.Lock();
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t priority = runnables[i]->m_priority;
+            m_injection[priority].push_back(runnables[i].Peek());
+            IncrementAndFetch(&m_injected[priority]);
+            IncrementAndFetch(&m_queued[priority]);
+        }
+        for (size_t i = 0; (i < count) && !m_idle.empty(); ++i) {
+            WakeWorker();
+        }
+
+        /*
+         * With no thread idle, grow the pool if the oldest Runnable waiting on
+         * the injection queues has waited too long, or right away if there is
+         * no thread at all since then nobody else would.
+         */
+        if (m_idle.empty() && (m_active < static_cast<int32_t>(m_poolsize))) {
+            uint64_t waitedNs = 0;
+            for (uint32_t p = 0; p < NUM_PRIORITIES; ++p) {
+                if (!m_injection[p].empty()) {
+                    waitedNs = std::max(waitedNs, nowNs - m_injection[p].front()->m_queuedNs);
+                }
+            }
+            if ((waitedNs >= m_growThresholdNs) || (m_active == 0)) {
+                Grow();
+            }
+        }
+        m_lock.Unlock();
+    }
+}
+
+void ThreadPool::Grow(void)
+{
+    if (m_stopping || (m_active >= static_cast<int32_t>(m_poolsize))) {
+        return;
+    }
 
     /*
-     * Tell the runnable object where to contact us when it is done executing.
-     * Since we're not the one that is actually going to dispatch the thread
-     * we need to have whatever thread that goes in there call us us back so
-     * we can know when to release the object.
+     * The worker in the next slot may be one that stopped for lack of work
+     * and hasn't quite finished exiting.  It no longer looks for Runnables
+     * and needs nothing from us to finish, so wait for it rather than leave
+     * the Runnable that made us grow without a thread to run it.
      */
-    runnable->SetThreadPool(this);
+    ThreadPoolWorker* worker = m_workers[m_active];
+    while (worker->IsRunning()) {
+        qcc::Sleep(1);
+    }
+    worker->m_retired = false;
+    IncrementAndFetch(&m_active);
+    QStatus status = worker->Start(NULL, worker);
+    if (status != ER_OK) {
+        DecrementAndFetch(&m_active);
+        QCC_LogError(status, ("ThreadPool::Grow(): Error starting thread %u", worker->m_index));
+        return;
+    }
+    QCC_DbgPrintf(("ThreadPool::Grow(): Started thread %u", worker->m_index));
+    ++m_stats.threadStarts;
+    m_stats.peakThreads = std::max(m_stats.peakThreads, static_cast<uint32_t>(m_active));
+}
+
+void ThreadPool::GrowIfBacklogged(uint64_t waitedNs)
+{
+    if ((waitedNs < m_growThresholdNs) || m_idleCount || (m_active >= static_cast<int32_t>(m_poolsize))) {
+        return;
+    }
+    bool backlog = false;
+    for (uint32_t p = 0; p < NUM_PRIORITIES; ++p) {
+        backlog = backlog || (m_queued[p] > 0);
+    }
+    if (backlog) {
+        m_lock.Lock();
+        if (m_idle.empty()) {
+            Grow();
+        }
+        m_lock.Unlock();
+    }
+}
+
+void ThreadPool::SetMinThreads(uint32_t minThreads)
+{
+    m_lock.Lock();
+    m_minThreads = std::min(minThreads, m_poolsize);
+    while (m_active < static_cast<int32_t>(m_minThreads)) {
+        int32_t active = m_active;
+        Grow();
+        if (m_active == active) {
+            break;
+        }
+    }
 
     /*
-     * The trick here is to add an alarm that expires immediately and executes
-     * the AlarmTriggered method of the provided Runnable object.  This will
-     * call the Run() method of the Runnable.  So although we use Timers and
-     * Alarms, we schedule everthing to happen immediately, and the result looks
-     * like a thread pool that we all know and love.
-     *
-     * Since <runnable> is a smart pointer, we need to get the underlying object
-     * pointer using Peek().  This object pointer is automagically cast to an
-     * AlarmListener which defines which actual callback which the alarm will
-     * call.
+     * Idle workers above the new minimum are waiting without a timeout, wake
+     * them so they wait again with one.
      */
-    uint32_t zero = 0;
-    void* voidptr = NULL;
-    AlarmListener* listener = runnable.Peek();
-    Alarm alarm = Alarm(zero, listener, voidptr, zero);
-    QCC_DbgPrintf(("ThreadPool::Execute(): AddAlarm()"));
-    QStatus status = m_dispatcher.AddAlarm(alarm);
-    QCC_DbgPrintf(("ThreadPool::Execute(): Giving lock"));
+    for (size_t i = 0; i < m_idle.size(); ++i) {
+        if (m_idle[i]->m_index >= m_minThreads) {
+            m_idle[i]->Alert();
+        }
+    }
     m_lock.Unlock();
-    return status;
 }
 
-void ThreadPool::Release(Runnable* runnable)
+void ThreadPool::SetGrowThreshold(uint32_t ms)
 {
-    QCC_DbgPrintf(("ThreadPool::Release()"));
+    m_growThresholdNs = static_cast<uint64_t>(ms) * 1000000;
+}
 
-    /*
-     * After the closure corresponding to the Runnable pointer above has finished
-     * executing, it needs to call us back here and tell us that its heap object is
-     * no longer required; and that we can release our hold on that object.
-     *
-     * We save a smart pointer to the Runnable in our m_closures map, so we need to
-     * erase that entry.  Since the entry is a smart pointer, the act of erasing it
-     * will cause the reference count of the object to be decremented and the
-     * underlying object to be deleted if possible.
-     */
-    QCC_DbgPrintf(("ThreadPool::Release(): Taking lock"));
+void ThreadPool::SetIdleTimeout(uint32_t ms)
+{
+    m_idleTimeoutMs = ms;
+}
+
+void ThreadPool::GetStats(ThreadPoolStats& stats)
+{
     m_lock.Lock();
-    QCC_DbgPrintf(("ThreadPool::Release(): Got lock"));
+    stats = m_stats;
+    stats.threads = m_active;
+    stats.idleThreads = m_idleCount;
+    stats.queueDepth = 0;
+    for (uint32_t p = 0; p < NUM_PRIORITIES; ++p) {
+        int32_t queued = m_queued[p];
+        if (queued > 0) {
+            stats.queueDepth += queued;
+        }
+    }
+    stats.elapsedMs = GetTimestamp64() - m_statsSince;
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        ThreadPoolWorker* worker = m_workers[i];
+        worker->m_statsLock.Lock();
+        stats.executed += worker->m_stats.executed;
+        stats.expired += worker->m_stats.expired;
+        stats.waitUs += worker->m_stats.waitUs;
+        stats.maxWaitUs = std::max(stats.maxWaitUs, worker->m_stats.maxWaitUs);
+        stats.runUs += worker->m_stats.runUs;
+        stats.maxRunUs = std::max(stats.maxRunUs, worker->m_stats.maxRunUs);
+        worker->m_statsLock.Unlock();
+    }
+    m_lock.Unlock();
+}
+
+void ThreadPool::ResetStats()
+{
+    m_lock.Lock();
+    m_stats.Reset();
+    m_stats.peakThreads = m_active;
+    m_statsSince = GetTimestamp64();
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        m_workers[i]->m_statsLock.Lock();
+        m_workers[i]->m_stats.Reset();
+        m_workers[i]->m_statsLock.Unlock();
+    }
+    m_lock.Unlock();
+}
+
+void ThreadPool::WakeWorker(void)
+{
+    if (!m_idle.empty()) {
+        std::vector<ThreadPoolWorker*>::iterator lowest = m_idle.begin();
+        for (std::vector<ThreadPoolWorker*>::iterator i = lowest + 1; i != m_idle.end(); ++i) {
+            if ((*i)->m_index < (*lowest)->m_index) {
+                lowest = i;
+            }
+        }
+        ThreadPoolWorker* worker = *lowest;
+        m_idle.erase(lowest);
+        DecrementAndFetch(&m_idleCount);
+        QStatus status = worker->Alert();
+        if (status != ER_OK) {
+            QCC_LogError(status, ("ThreadPool::WakeWorker(): Error alerting thread %u", worker->m_index));
+        }
+    }
+}
+
+Runnable* ThreadPool::NextRunnable(ThreadPoolWorker* worker)
+{
+    for (uint32_t p = NUM_PRIORITIES; p-- > 0;) {
+        if (m_queued[p]) {
+            Runnable* runnable = NextRunnable(worker, p);
+            if (runnable) {
+                DecrementAndFetch(&m_queued[p]);
+                return runnable;
+            }
+        }
+    }
+    return NULL;
+}
+
+Runnable* ThreadPool::NextRunnable(ThreadPoolWorker* worker, uint32_t priority)
+{
+    Runnable* runnable = NULL;
 
-    RunnableEntry::iterator i = m_closures.find(runnable);
-    assert(i != m_closures.end() && "ThreadPool::Release(): Cannot find closure to release");
-    m_closures.erase(i);
+    worker->m_tasksLock.Lock();
+    if (!worker->m_tasks[priority].empty()) {
+        runnable = worker->m_tasks[priority].back();
+        worker->m_tasks[priority].pop_back();
+    }
+    worker->m_tasksLock.Unlock();
+    if (runnable) {
+        return runnable;
+    }
+
+    if (m_injected[priority]) {
+        m_lock.Lock();
+        if (!m_injection[priority].empty()) {
+            runnable = m_injection[priority].front();
+            m_injection[priority].pop_front();
+            DecrementAndFetch(&m_injected[priority]);
+        }
+        m_lock.Unlock();
+        if (runnable) {
+            return runnable;
+        }
+    }
 
     /*
-     * Release needs to work in conjunction with Execute() and
-     * WaitForAvailableThread() to ensure that no than m_poolSize threads are
-     * dispatched at any one time.  We set an event every time a thread
-     * completes its Run() method which can then wake up an external thread
-     * waiting for an available thread to do its work.
+     * Steal from the other running workers, starting with the next one so
+     * that idle workers don't all go after the same victim.
      */
-    m_event.SetEvent();
+    size_t active = m_active;
+    for (size_t i = 1; !runnable && (i < active); ++i) {
+        ThreadPoolWorker* victim = m_workers[(worker->m_index + i) % active];
+        victim->m_tasksLock.Lock();
+        if (!victim->m_tasks[priority].empty()) {
+            runnable = victim->m_tasks[priority].front();
+            victim->m_tasks[priority].pop_front();
+            QCC_DbgPrintf(("ThreadPool::NextRunnable(): Thread %u stole from thread %u", worker->m_index, victim->m_index));
+        }
+        victim->m_tasksLock.Unlock();
+    }
+    return runnable;
+}
 
-    QCC_DbgPrintf(("ThreadPool::Release(): %d closures remain", m_closures.size()));
+void ThreadPool::Complete(Runnable* runnable, Runnable::State state)
+{
+    /*
+     * The exchange orders the state before the look at the event, which a
+     * waiter creates before it looks at the state, so either we see its event
+     * or it sees our state.
+     */
+    CompareAndExchange(&runnable->m_state, Runnable::STATE_QUEUED, state);
+    Event* event = runnable->m_doneEvent;
+    if (event) {
+        event->SetEvent();
+    }
+}
 
-    QCC_DbgPrintf(("ThreadPool::Release(): Giving lock"));
-    m_lock.Unlock();
+void ThreadPool::Release(Runnable* runnable, Runnable::State state)
+{
+    QCC_DbgPrintf(("ThreadPool::Release()"));
+
+    /*
+     * Give the place back before telling anybody waiting for the Runnable, so
+     * that they find it free.  Releasing our reference to the Runnable may
+     * delete it, so one must never refer to the underlying runnable after
+     * this point.
+     */
+    ReleaseSlot();
+    Complete(runnable, state);
+    runnable->DecRef();
 }
 
-QStatus ThreadPool::WaitForAvailableThread(void)
+size_t ThreadPool::TryAcquireSlots(size_t count)
 {
-    QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread()"));
+    int32_t pending = m_pending;
+    while (count && (pending < static_cast<int32_t>(m_capacity))) {
+        int32_t n = static_cast<int32_t>(std::min(count, static_cast<size_t>(m_capacity - pending)));
+        if (CompareAndExchange(&m_pending, pending, pending + n)) {
+            return n;
+        }
+        pending = m_pending;
+    }
+    return 0;
+}
+
+QStatus ThreadPool::AcquireSlot(uint32_t timeout, uint32_t priority)
+{
+    if (TryAcquireSlots(1) == 1) {
+        return ER_OK;
+    }
+    if (timeout == 0) {
+        QCC_DbgPrintf(("ThreadPool::AcquireSlot(): Exhausted"));
+        return ER_THREADPOOL_EXHAUSTED;
+    }
 
     /*
-     * Our job here is loop until a thread is available to execute a closure.
+     * Count ourselves as a waiter before looking again, so that a Runnable
+     * completing after the look sees us and hands its place over instead of
+     * just giving it back.
      */
-    QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread(): Taking lock"));
     m_lock.Lock();
+    IncrementAndFetch(&m_waiters);
+    if (m_stopping) {
+        DecrementAndFetch(&m_waiters);
+        m_lock.Unlock();
+        return ER_THREADPOOL_STOPPING;
+    }
+    if (TryAcquireSlots(1) == 1) {
+        DecrementAndFetch(&m_waiters);
+        m_lock.Unlock();
+        return ER_OK;
+    }
 
-    for (;;) {
+    Waiter waiter;
+    waiter.granted = false;
+    waiter.priority = priority;
+    if (m_waitEvents.empty()) {
+        waiter.event = new Event();
+    } else {
+        waiter.event = m_waitEvents.back();
+        m_waitEvents.pop_back();
+    }
 
-        /*
-         * We can't have an available thread if we're stopping.
-         */
+    /*
+     * Queue up behind the callers of the same or higher priority, so that a
+     * latency sensitive Runnable doesn't wait for the place of every bulk
+     * Runnable that asked before it.
+     */
+    std::deque<Waiter*>::iterator pos = m_waitQueue.end();
+    while ((pos != m_waitQueue.begin()) && ((*(pos - 1))->priority < priority)) {
+        --pos;
+    }
+    QCC_DbgPrintf(("ThreadPool::AcquireSlot(): Waiting behind %u callers", static_cast<uint32_t>(pos - m_waitQueue.begin())));
+    m_waitQueue.insert(pos, &waiter);
+
+    /*
+     * We are executing in the context of some unknown (to us) thread.  This
+     * thread can be stopped and alerted using its own mechanisms so we have
+     * to play fair with all of that and return any error from the wait to the
+     * caller, unless we were handed a place in the meantime.
+     */
+    QStatus status = Event::Wait(*waiter.event, m_lock, timeout);
+    m_lock.Lock();
+    if (waiter.granted) {
+        status = ER_OK;
+    } else {
+        m_waitQueue.erase(std::find(m_waitQueue.begin(), m_waitQueue.end(), &waiter));
+        DecrementAndFetch(&m_waiters);
         if (m_stopping) {
-            QCC_DbgPrintf(("ThreadPool::WaitforAvailableThread(): Giving lock"));
-            m_lock.Unlock();
-            QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread(): Stopping"));
-            return ER_THREADPOOL_STOPPING;
+            status = ER_THREADPOOL_STOPPING;
+        } else if ((status == ER_OK) || (status == ER_TIMEOUT)) {
+            status = ER_THREADPOOL_EXHAUSTED;
         }
+    }
+    waiter.event->ResetEvent();
+    m_waitEvents.push_back(waiter.event);
+    m_lock.Unlock();
+    return status;
+}
 
-        QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread(): m_closures.size() == %d.", m_closures.size()));
-        QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread(): m_poolsize == %d.", m_poolsize));
-
-        /*
-         * There are no available threads for us to use doing our work, so we
-         * must block until one of them completes.  When one completes, in its
-         * Release() function, it will do a SetEvent() on our wait event to let
-         * us know that it is done.  We reset this event here, with the shared
-         * lock taken.  This ensures that there can be no Release() in progress
-         * and when the next one happens we will be notified.
-         *
-         * This may seem a peculiar place to put this reset, but there is a
-         * method to my madness.  It turns out that SetEvent() is implemented by
-         * a write to an FD.  ResetEvent reads the file and empties it.  If the
-         * Release() function always does a SetEvent(), it writes characters to
-         * the underlying file.  If that file is never read, it eventually
-         * blocks writes and SetEvent() blocks.  So there must be ResetEvent()
-         * calls made to read this file even though we may not need to block and
-         * wait for threads to finish.  Thus, even though the ResetEvent() should
-         * logically go right before the Event::Wait() we do it here to drain
-         * the event file (on Linux).
-         */
-        m_event.ResetEvent();
+void ThreadPool::ReleaseSlot(void)
+{
+    if (!m_waiters) {
+        DecrementAndFetch(&m_pending);
 
         /*
-         * We enter the loop with the mutex that interlocks us with the release
-         * method taken.  Since the lock is taken, the release function must
-         * not change its state so we can look around safely and see whether
-         * or not there is currently an available thread.
-         *
-         * There is a closure on the m_closures map for the duration of time
-         * when a Runnable closure is waiting to be executed and while it is in
-         * process.  So, if the size of the m_closures map is less than the pool
-         * size, it means that not all of our thread pool threads are occupied
-         * and at least one is available, so we return.
+         * A caller may have started waiting after we looked and before the
+         * place was given back, in which case it may have missed it.  Take
+         * the place again for the caller if nobody else has.
          */
-        if (m_closures.size() < m_poolsize) {
-            QCC_DbgPrintf(("ThreadPool::WaitforAvailableThread(): Giving lock"));
+        if (m_waiters) {
+            m_lock.Lock();
+            if (!m_waitQueue.empty() && (TryAcquireSlots(1) == 1)) {
+                GrantSlot();
+            }
             m_lock.Unlock();
-            QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread(): Thread available"));
-            return ER_OK;
         }
+        return;
+    }
 
-        QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread(): Waiting on thread completion event.  Giving lock"));
-        m_lock.Unlock();
+    /*
+     * Hand our place straight to the caller that has waited longest rather
+     * than waking every waiter to race for it.
+     */
+    m_lock.Lock();
+    if (!m_waitQueue.empty()) {
+        GrantSlot();
+    } else {
+        DecrementAndFetch(&m_pending);
+    }
+    m_lock.Unlock();
+}
 
-        /*
-         * We are executing in the context of some unknown (to us) thread.  This
-         * thread can be stopped and alerted using its own mechanisms so we have
-         * to play fair with all of that.  The only return code we are interested
-         * in is ER_OK, which means that we set our event.  Any other error code
-         * should be returned to the caller, who can figure out the right thing
-         * to do.
-         */
-        QStatus status = Event::Wait(m_event, Event::WAIT_FOREVER);
-        if (status != ER_OK) {
-            QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread(): Event::Wait() error"));
-            return status;
+void ThreadPool::GrantSlot(void)
+{
+    Waiter* waiter = m_waitQueue.front();
+    m_waitQueue.pop_front();
+    DecrementAndFetch(&m_waiters);
+    waiter->granted = true;
+    waiter->event->SetEvent();
+}
+
+QStatus ThreadPool::WaitForAvailableThread(void)
+{
+    QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread()"));
+
+    /*
+     * Wait for a place the same way Execute() does and give it right back, to
+     * the next waiter if there is one.
+     */
+    QStatus status = AcquireSlot(Event::WAIT_FOREVER, Runnable::PRIORITY_NORMAL);
+    if (status == ER_OK) {
+        ReleaseSlot();
+    }
+    return status;
+}
+
+QStatus Runnable::Wait(uint32_t timeout)
+{
+    if (m_state == STATE_NEW) {
+        return ER_FAIL;
+    }
+    if (m_state != STATE_QUEUED) {
+        return ER_OK;
+    }
+
+    Event* event = m_doneEvent;
+    if (!event) {
+        event = new Event();
+        if (!CompareAndExchangePointer(reinterpret_cast<void* volatile*>(&m_doneEvent), NULL, event)) {
+            delete event;
+            event = m_doneEvent;
+        }
+    }
+    if (m_state != STATE_QUEUED) {
+        return ER_OK;
+    }
+
+    /*
+     * The event is only ever set when the thread pool is done with us, so
+     * anything but ER_OK from the wait is a timeout or an alert.
+     */
+    return Event::Wait(*event, timeout);
+}
+
+/**
+ * The state of one ThreadPool::ParallelFor(), shared by the calling thread and
+ * the helper Runnables, which may outlive the call when they are only run
+ * after all of the range has been taken.
+ */
+class ParallelForJob : public RefCountBase {
+  public:
+
+    ParallelForJob(size_t begin, size_t end, size_t grain, ParallelForBody& body) :
+        m_begin(begin),
+        m_end(end),
+        m_grain(grain),
+        m_parts(static_cast<int32_t>((end - begin + grain - 1) / grain)),
+        m_next(0),
+        m_done(0),
+        m_body(body)
+    { }
+
+    /**
+     * Run parts of the range until every part has been taken.
+     */
+    void RunParts(void)
+    {
+        for (;;) {
+            int32_t part = IncrementAndFetch(&m_next) - 1;
+            if (part >= m_parts) {
+                return;
+            }
+            size_t begin = m_begin + static_cast<size_t>(part) * m_grain;
+            size_t end = std::min(begin + m_grain, m_end);
+            m_body.Run(begin, end);
+            if (IncrementAndFetch(&m_done) == m_parts) {
+                m_doneEvent.SetEvent();
+            }
         }
+    }
 
-        QCC_DbgPrintf(("ThreadPool::WaitForAvailableThread(): Taking lock"));
-        m_lock.Lock();
+    const size_t m_begin;
+    const size_t m_end;
+    const size_t m_grain;
+    const int32_t m_parts;
+    volatile int32_t m_next;
+    volatile int32_t m_done;
+    Event m_doneEvent;
+
+  private:
+    ParallelForBody& m_body;
+};
+
+/**
+ * A helper of a ThreadPool::ParallelFor() running on a thread of the pool.
+ */
+class ParallelForRunnable : public Runnable {
+  public:
+
+    ParallelForRunnable(ParallelForJob* job) : m_job(job) { m_job->IncRef(); }
+    ~ParallelForRunnable() { m_job->DecRef(); }
+
+    void Run(void) { m_job->RunParts(); }
+
+  private:
+    ParallelForJob* m_job;
+};
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, size_t grain, ParallelForBody& body)
+{
+    QCC_DbgPrintf(("ThreadPool::ParallelFor(%u, %u, %u)", static_cast<uint32_t>(begin), static_cast<uint32_t>(end), static_cast<uint32_t>(grain)));
+
+    if (begin >= end) {
+        return;
+    }
+    size_t range = end - begin;
+    if (grain == 0) {
+        grain = (range + 4 * m_poolsize - 1) / (4 * m_poolsize);
+    }
+
+    /*
+     * Keep the number of parts well inside the counters that hand them out.
+     */
+    const size_t maxParts = 0x40000000;
+    grain = std::max(grain, (range + maxParts - 1) / maxParts);
+
+    ParallelForJob* job = new ParallelForJob(begin, end, grain, body);
+    job->IncRef();
+
+    /*
+     * Only ask for the threads that are free now, the calling thread runs
+     * whatever parts the helpers don't get to.
+     */
+    size_t helpers = std::min(static_cast<size_t>(m_poolsize), static_cast<size_t>(job->m_parts - 1));
+    if (helpers) {
+        Ptr<Runnable>* runnables = new Ptr<Runnable>[helpers];
+        for (size_t i = 0; i < helpers; ++i) {
+            runnables[i] = Ptr<Runnable>(new ParallelForRunnable(job));
+        }
+        ExecuteBatch(runnables, helpers);
+        delete [] runnables;
     }
 
-    assert(false && "ThreadPool::WaitForAvailableThread(): Can't happen");
-    return ER_FAIL;
+    job->RunParts();
+
+    /*
+     * The helpers refer to the body until they finish the parts they took, so
+     * we can't give up on them even if the calling thread is alerted.
+     */
+    while (job->m_done != job->m_parts) {
+        if (Event::Wait(job->m_doneEvent) != ER_OK) {
+            qcc::Sleep(1);
+        }
+    }
+    job->DecRef();
 }
 
 } // namespace qcc
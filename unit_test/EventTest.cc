@@ -0,0 +1,374 @@
+/******************************************************************************
+ * Copyright 2013, Qualcomm Innovation Center, Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ ******************************************************************************/
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <qcc/Event.h>
+#include <qcc/Socket.h>
+#include <qcc/SocketStream.h>
+#include <qcc/Thread.h>
+#include <qcc/time.h>
+#include <Status.h>
+
+using namespace std;
+using namespace qcc;
+
+static bool Contains(const vector<Event*>& events, Event* evt)
+{
+    return find(events.begin(), events.end(), evt) != events.end();
+}
+
+static bool Contains(const vector<void*>& contexts, void* context)
+{
+    return find(contexts.begin(), contexts.end(), context) != contexts.end();
+}
+
+TEST(EventTest, SetAndReset) {
+    Event evt;
+    EXPECT_FALSE(evt.IsSet());
+    EXPECT_EQ(ER_TIMEOUT, Event::Wait(evt, 0));
+
+    /* Setting twice needs a single reset */
+    EXPECT_EQ(ER_OK, evt.SetEvent());
+    EXPECT_EQ(ER_OK, evt.SetEvent());
+    EXPECT_TRUE(evt.IsSet());
+    EXPECT_EQ(ER_OK, Event::Wait(evt, 0));
+    EXPECT_EQ(ER_OK, Event::Wait(evt, 0));
+
+    EXPECT_EQ(ER_OK, evt.ResetEvent());
+    EXPECT_FALSE(evt.IsSet());
+    EXPECT_EQ(ER_TIMEOUT, Event::Wait(evt, 0));
+
+    /* Many set/reset cycles must not leave the event set or fill its descriptor */
+    for (uint32_t i = 0; i < 10000; ++i) {
+        evt.SetEvent();
+        evt.ResetEvent();
+    }
+    EXPECT_FALSE(evt.IsSet());
+    EXPECT_EQ(ER_OK, evt.SetEvent());
+    EXPECT_TRUE(evt.IsSet());
+}
+
+TEST(EventTest, WaitTimeout) {
+    Event evt;
+    Timespec start;
+    GetTimeNow(&start);
+    EXPECT_EQ(ER_TIMEOUT, Event::Wait(evt, 50));
+    Timespec end;
+    GetTimeNow(&end);
+    EXPECT_LE(45U, end - start);
+
+    vector<Event*> checkEvents;
+    vector<Event*> signaledEvents;
+    checkEvents.push_back(&evt);
+    GetTimeNow(&start);
+    EXPECT_EQ(ER_TIMEOUT, Event::Wait(checkEvents, signaledEvents, 50));
+    GetTimeNow(&end);
+    EXPECT_LE(45U, end - start);
+    EXPECT_TRUE(signaledEvents.empty());
+}
+
+class SetterThread : public Thread {
+  public:
+    SetterThread(Event& evt, uint32_t delay) : Thread("SetterThread"), evt(evt), delay(delay) { }
+
+  protected:
+    ThreadReturn STDCALL Run(void* arg)
+    {
+        qcc::Sleep(delay);
+        evt.SetEvent();
+        return 0;
+    }
+
+  private:
+    Event& evt;
+    uint32_t delay;
+};
+
+TEST(EventTest, WaitMultiple) {
+    Event evt1;
+    Event evt2;
+    Event timed(20, 0);
+    vector<Event*> checkEvents;
+    vector<Event*> signaledEvents;
+    checkEvents.push_back(&evt1);
+    checkEvents.push_back(&evt2);
+    checkEvents.push_back(&timed);
+
+    /* The timed event fires on its own */
+    EXPECT_EQ(ER_OK, Event::Wait(checkEvents, signaledEvents, 1000));
+    ASSERT_EQ(1U, signaledEvents.size());
+    EXPECT_EQ(&timed, signaledEvents[0]);
+
+    /* Only the events that are set are reported */
+    checkEvents.pop_back();
+    signaledEvents.clear();
+    evt2.SetEvent();
+    EXPECT_EQ(ER_OK, Event::Wait(checkEvents, signaledEvents, 0));
+    ASSERT_EQ(1U, signaledEvents.size());
+    EXPECT_EQ(&evt2, signaledEvents[0]);
+
+    signaledEvents.clear();
+    evt1.SetEvent();
+    EXPECT_EQ(ER_OK, Event::Wait(checkEvents, signaledEvents, 0));
+    EXPECT_EQ(2U, signaledEvents.size());
+    EXPECT_TRUE(Contains(signaledEvents, &evt1));
+    EXPECT_TRUE(Contains(signaledEvents, &evt2));
+
+    /* A wait is woken by another thread setting an event */
+    evt1.ResetEvent();
+    evt2.ResetEvent();
+    signaledEvents.clear();
+    SetterThread setter(evt1, 20);
+    ASSERT_EQ(ER_OK, setter.Start());
+    EXPECT_EQ(ER_OK, Event::Wait(checkEvents, signaledEvents, 5000));
+    ASSERT_EQ(1U, signaledEvents.size());
+    EXPECT_EQ(&evt1, signaledEvents[0]);
+    setter.Join();
+}
+
+class TogglerThread : public Thread {
+  public:
+    TogglerThread(Event& go, Event& evt, uint32_t count) : Thread("TogglerThread"), go(go), evt(evt), count(count) { }
+
+  protected:
+    ThreadReturn STDCALL Run(void* arg)
+    {
+        Event::Wait(go);
+        for (uint32_t i = 0; i < count; ++i) {
+            evt.SetEvent();
+            evt.ResetEvent();
+        }
+        return 0;
+    }
+
+  private:
+    Event& go;
+    Event& evt;
+    uint32_t count;
+};
+
+/*
+ * A ResetEvent that claims the event just before another thread sets it again must not consume
+ * both writes, or the event is left signaled with nothing to wake a waiter and the next reset
+ * never completes.
+ */
+TEST(EventTest, ConcurrentSetAndReset) {
+    Event go;
+    Event evt;
+    TogglerThread* togglers[4];
+    for (uint32_t i = 0; i < 4; ++i) {
+        togglers[i] = new TogglerThread(go, evt, 100000);
+    }
+    for (uint32_t i = 0; i < 4; ++i) {
+        ASSERT_EQ(ER_OK, togglers[i]->Start());
+    }
+    go.SetEvent();
+    for (uint32_t i = 0; i < 4; ++i) {
+        togglers[i]->Join();
+        delete togglers[i];
+    }
+
+    /* Whatever state the race left the event in, waiting must agree with it */
+    EXPECT_EQ(evt.IsSet(), ER_OK == Event::Wait(evt, 0));
+
+    /* And it must still be usable */
+    EXPECT_EQ(ER_OK, evt.ResetEvent());
+    EXPECT_FALSE(evt.IsSet());
+    EXPECT_EQ(ER_TIMEOUT, Event::Wait(evt, 0));
+    EXPECT_EQ(ER_OK, evt.SetEvent());
+    EXPECT_TRUE(evt.IsSet());
+    EXPECT_EQ(ER_OK, Event::Wait(evt, 0));
+    EXPECT_EQ(ER_OK, evt.ResetEvent());
+    EXPECT_EQ(ER_TIMEOUT, Event::Wait(evt, 0));
+}
+
+TEST(EventTest, WaitIO) {
+    SocketFd fds[2];
+    ASSERT_EQ(ER_OK, SocketPair(fds));
+    SocketStream local(fds[0]);
+    SocketStream peer(fds[1]);
+
+    /* The source and sink events share a descriptor but are reported separately */
+    Event& readEvent = local.GetSourceEvent();
+    Event& writeEvent = local.GetSinkEvent();
+    vector<Event*> checkEvents;
+    vector<Event*> signaledEvents;
+    checkEvents.push_back(&readEvent);
+    checkEvents.push_back(&writeEvent);
+    EXPECT_EQ(ER_OK, Event::Wait(checkEvents, signaledEvents, 0));
+    ASSERT_EQ(1U, signaledEvents.size());
+    EXPECT_EQ(&writeEvent, signaledEvents[0]);
+
+    size_t sent = 0;
+    ASSERT_EQ(ER_OK, peer.PushBytes("hello", 5, sent));
+    signaledEvents.clear();
+    EXPECT_EQ(ER_OK, Event::Wait(checkEvents, signaledEvents, 1000));
+    EXPECT_EQ(2U, signaledEvents.size());
+    EXPECT_TRUE(Contains(signaledEvents, &readEvent));
+    EXPECT_TRUE(Contains(signaledEvents, &writeEvent));
+    EXPECT_EQ(ER_OK, Event::Wait(readEvent, 0));
+
+    char buf[8];
+    size_t received = 0;
+    ASSERT_EQ(ER_OK, local.PullBytes(buf, sizeof(buf), received));
+    EXPECT_EQ(5U, received);
+    EXPECT_EQ(ER_TIMEOUT, Event::Wait(readEvent, 0));
+}
+
+TEST(EventTest, EventSet) {
+    Event evt1;
+    Event evt2;
+    int ctx1 = 1;
+    int ctx2 = 2;
+    int ctx3 = 3;
+    EventSet set;
+    vector<void*> signaled;
+
+    EXPECT_EQ(ER_TIMEOUT, set.Wait(signaled, 0));
+    EXPECT_TRUE(signaled.empty());
+
+    /* The same event can be added with several contexts */
+    ASSERT_EQ(ER_OK, set.AddEvent(evt1, &ctx1));
+    ASSERT_EQ(ER_OK, set.AddEvent(evt1, &ctx3));
+    ASSERT_EQ(ER_OK, set.AddEvent(evt2, &ctx2));
+    EXPECT_EQ(ER_TIMEOUT, set.Wait(signaled, 20));
+    EXPECT_TRUE(signaled.empty());
+
+    evt1.SetEvent();
+    EXPECT_EQ(ER_OK, set.Wait(signaled, 0));
+    EXPECT_EQ(2U, signaled.size());
+    EXPECT_TRUE(Contains(signaled, &ctx1));
+    EXPECT_TRUE(Contains(signaled, &ctx3));
+
+    /* A removed registration is no longer reported, the others still are */
+    ASSERT_EQ(ER_OK, set.RemoveEvent(evt1, &ctx3));
+    signaled.clear();
+    EXPECT_EQ(ER_OK, set.Wait(signaled, 0));
+    ASSERT_EQ(1U, signaled.size());
+    EXPECT_EQ(&ctx1, signaled[0]);
+
+    /* A reset event stops being reported */
+    evt1.ResetEvent();
+    evt2.SetEvent();
+    signaled.clear();
+    EXPECT_EQ(ER_OK, set.Wait(signaled, 0));
+    ASSERT_EQ(1U, signaled.size());
+    EXPECT_EQ(&ctx2, signaled[0]);
+
+    ASSERT_EQ(ER_OK, set.RemoveEvent(evt2, &ctx2));
+    signaled.clear();
+    EXPECT_EQ(ER_TIMEOUT, set.Wait(signaled, 0));
+
+    /* A wait is woken by an event set from another thread */
+    SetterThread setter(evt1, 20);
+    ASSERT_EQ(ER_OK, setter.Start());
+    EXPECT_EQ(ER_OK, set.Wait(signaled, 5000));
+    ASSERT_EQ(1U, signaled.size());
+    EXPECT_EQ(&ctx1, signaled[0]);
+    setter.Join();
+    ASSERT_EQ(ER_OK, set.RemoveEvent(evt1, &ctx1));
+}
+
+TEST(EventTest, EventSetTimedAndIO) {
+    SocketFd fds[2];
+    ASSERT_EQ(ER_OK, SocketPair(fds));
+    SocketStream local(fds[0]);
+    SocketStream peer(fds[1]);
+    int readCtx = 1;
+    int timedCtx = 2;
+    EventSet set;
+    vector<void*> signaled;
+
+    ASSERT_EQ(ER_OK, set.AddEvent(local.GetSourceEvent(), &readCtx));
+    EXPECT_EQ(ER_TIMEOUT, set.Wait(signaled, 20));
+
+    size_t sent = 0;
+    ASSERT_EQ(ER_OK, peer.PushBytes("x", 1, sent));
+    EXPECT_EQ(ER_OK, set.Wait(signaled, 1000));
+    ASSERT_EQ(1U, signaled.size());
+    EXPECT_EQ(&readCtx, signaled[0]);
+
+    /* Readiness is reported again until the data has been read */
+    signaled.clear();
+    EXPECT_EQ(ER_OK, set.Wait(signaled, 0));
+    EXPECT_EQ(1U, signaled.size());
+    char buf[4];
+    size_t received = 0;
+    ASSERT_EQ(ER_OK, local.PullBytes(buf, sizeof(buf), received));
+    signaled.clear();
+    EXPECT_EQ(ER_TIMEOUT, set.Wait(signaled, 0));
+
+    Event timed(30, 0);
+    ASSERT_EQ(ER_OK, set.AddEvent(timed, &timedCtx));
+    Timespec start;
+    GetTimeNow(&start);
+    EXPECT_EQ(ER_OK, set.Wait(signaled, 1000));
+    Timespec end;
+    GetTimeNow(&end);
+    EXPECT_LE(25U, end - start);
+    ASSERT_EQ(1U, signaled.size());
+    EXPECT_EQ(&timedCtx, signaled[0]);
+
+    ASSERT_EQ(ER_OK, set.RemoveEvent(timed, &timedCtx));
+    ASSERT_EQ(ER_OK, set.RemoveEvent(local.GetSourceEvent(), &readCtx));
+}
+
+class RemoverThread : public Thread {
+  public:
+    RemoverThread(EventSet& set, Event& evt, void* context) : Thread("RemoverThread"), status(ER_FAIL), set(set), evt(evt), context(context) { }
+    QStatus status;
+
+  protected:
+    ThreadReturn STDCALL Run(void* arg)
+    {
+        qcc::Sleep(20);
+        status = set.RemoveEvent(evt, context);
+        evt.SetEvent();
+        return 0;
+    }
+
+  private:
+    EventSet& set;
+    Event& evt;
+    void* context;
+};
+
+TEST(EventTest, EventSetRemoveWhileWaiting) {
+    Event evt;
+    Event other;
+    int ctx = 1;
+    int otherCtx = 2;
+    EventSet set;
+    ASSERT_EQ(ER_OK, set.AddEvent(evt, &ctx));
+    ASSERT_EQ(ER_OK, set.AddEvent(other, &otherCtx));
+
+    /* Once RemoveEvent returns the removed context is never reported */
+    RemoverThread remover(set, evt, &ctx);
+    ASSERT_EQ(ER_OK, remover.Start());
+    vector<void*> signaled;
+    QStatus status = set.Wait(signaled, 200);
+    EXPECT_TRUE((status == ER_OK) || (status == ER_TIMEOUT));
+    EXPECT_FALSE(Contains(signaled, &ctx));
+    remover.Join();
+    EXPECT_EQ(ER_OK, remover.status);
+
+    signaled.clear();
+    EXPECT_EQ(ER_TIMEOUT, set.Wait(signaled, 0));
+    ASSERT_EQ(ER_OK, set.RemoveEvent(other, &otherCtx));
+}
@@ -0,0 +1,425 @@
+/******************************************************************************
+ * Copyright 2013, Qualcomm Innovation Center, Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ ******************************************************************************/
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <qcc/IODispatch.h>
+#include <qcc/Socket.h>
+#include <qcc/SocketStream.h>
+#include <qcc/StringUtil.h>
+#include <qcc/Thread.h>
+#include <Status.h>
+
+using namespace std;
+using namespace qcc;
+
+/* Reads everything that arrives on a stream and remembers which thread made the callbacks */
+class TestStreamListener : public IOReadListener, public IOWriteListener, public IOExitListener, public IOWatermarkListener {
+  public:
+    TestStreamListener(IODispatch& iodisp, SocketStream& stream) :
+        iodisp(iodisp), stream(stream), bytesRead(0), thread(NULL), readTimeout(0), readSize(256), chargeBudget(false), numWrites(0), numExits(0), numTimeouts(0), numHighWatermarks(0), numLowWatermarks(0) { }
+
+    QStatus ReadCallback(Source& source, bool isTimedOut)
+    {
+        char buf[256];
+        size_t actual = 0;
+        if (isTimedOut) {
+            IncrementAndFetch(&numTimeouts);
+        } else if (stream.PullBytes(buf, readSize, actual, 0) == ER_OK) {
+            if (chargeBudget) {
+                iodisp.ChargeBudget(&stream, actual);
+            }
+            lock.Lock();
+            bytesRead += actual;
+            threadName = Thread::GetThreadName();
+            thread = Thread::GetThread();
+            lock.Unlock();
+        }
+        iodisp.EnableReadCallback(&stream, readTimeout);
+        return ER_OK;
+    }
+
+    QStatus WriteCallback(Sink& sink, bool isTimedOut)
+    {
+        IncrementAndFetch(&numWrites);
+        iodisp.DisableWriteCallback(&stream);
+        return ER_OK;
+    }
+
+    void ExitCallback()
+    {
+        IncrementAndFetch(&numExits);
+    }
+
+    void WatermarkCallback(Sink& sink, bool aboveHighWatermark)
+    {
+        IncrementAndFetch(aboveHighWatermark ? &numHighWatermarks : &numLowWatermarks);
+    }
+
+    size_t GetBytesRead()
+    {
+        lock.Lock();
+        size_t ret = bytesRead;
+        lock.Unlock();
+        return ret;
+    }
+
+    qcc::String GetThreadName()
+    {
+        lock.Lock();
+        qcc::String ret = threadName;
+        lock.Unlock();
+        return ret;
+    }
+
+    Thread* GetThread()
+    {
+        lock.Lock();
+        Thread* ret = thread;
+        lock.Unlock();
+        return ret;
+    }
+
+    IODispatch& iodisp;
+    SocketStream& stream;
+    Mutex lock;
+    size_t bytesRead;
+    qcc::String threadName;
+    Thread* thread;
+    uint32_t readTimeout;
+    size_t readSize;
+    bool chargeBudget;
+    int32_t numWrites;
+    int32_t numExits;
+    int32_t numTimeouts;
+    int32_t numHighWatermarks;
+    int32_t numLowWatermarks;
+};
+
+class IODispatchTest : public testing::Test {
+  public:
+    IODispatchTest() : iodisp(NULL) { }
+
+    /* Create numStreams connected stream pairs and start one end of each with iodisp */
+    void StartStreams(size_t numStreams, bool useAffinity)
+    {
+        for (size_t i = 0; i < numStreams; ++i) {
+            SocketFd fds[2];
+            ASSERT_EQ(ER_OK, SocketPair(fds));
+            SocketStream* local = new SocketStream(fds[0]);
+            peers.push_back(new SocketStream(fds[1]));
+            streams.push_back(local);
+            listeners.push_back(new TestStreamListener(*iodisp, *local));
+            if (useAffinity) {
+                ASSERT_EQ(ER_OK, iodisp->StartStream(local, listeners[i], listeners[i], listeners[i], true, false, i));
+            } else {
+                ASSERT_EQ(ER_OK, iodisp->StartStream(local, listeners[i], listeners[i], listeners[i], true, false));
+            }
+        }
+    }
+
+    /* Send len bytes to each stream and wait until they have all been read */
+    void SendAndWait(size_t len)
+    {
+        char buf[64];
+        memset(buf, 'x', sizeof(buf));
+        for (size_t i = 0; i < peers.size(); ++i) {
+            size_t sent = 0;
+            ASSERT_EQ(ER_OK, peers[i]->PushBytes(buf, len, sent));
+            ASSERT_EQ(len, sent);
+        }
+        for (size_t i = 0; i < listeners.size(); ++i) {
+            for (uint32_t waited = 0; (listeners[i]->GetBytesRead() < len) && (waited < 5000); waited += 5) {
+                qcc::Sleep(5);
+            }
+            EXPECT_EQ(len, listeners[i]->GetBytesRead());
+        }
+    }
+
+    virtual void TearDown()
+    {
+        for (size_t i = 0; i < streams.size(); ++i) {
+            EXPECT_EQ(ER_OK, iodisp->StopStream(streams[i]));
+        }
+        for (size_t i = 0; i < streams.size(); ++i) {
+            EXPECT_EQ(ER_OK, iodisp->JoinStream(streams[i]));
+            EXPECT_EQ(1, listeners[i]->numExits);
+        }
+        iodisp->Stop();
+        iodisp->Join();
+        for (size_t i = 0; i < streams.size(); ++i) {
+            delete streams[i];
+            delete peers[i];
+            delete listeners[i];
+        }
+        delete iodisp;
+    }
+
+    IODispatch* iodisp;
+    vector<SocketStream*> streams;
+    vector<SocketStream*> peers;
+    vector<TestStreamListener*> listeners;
+};
+
+TEST_F(IODispatchTest, ReadAndWriteCallbacks)
+{
+    iodisp = new IODispatch("iodisp", 4);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+    EXPECT_EQ(1U, iodisp->GetNumReactors());
+
+    StartStreams(16, false);
+    SendAndWait(10);
+
+    for (size_t i = 0; i < streams.size(); ++i) {
+        EXPECT_EQ(ER_OK, iodisp->EnableWriteCallback(streams[i]));
+    }
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        for (uint32_t waited = 0; (listeners[i]->numWrites == 0) && (waited < 5000); waited += 5) {
+            qcc::Sleep(5);
+        }
+        EXPECT_EQ(1, listeners[i]->numWrites);
+    }
+}
+
+TEST_F(IODispatchTest, MultipleReactors)
+{
+    iodisp = new IODispatch("iodisp", 4, 4);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+    EXPECT_EQ(4U, iodisp->GetNumReactors());
+
+    StartStreams(64, false);
+    SendAndWait(40);
+
+    /* A stream cannot be started twice, whichever event loop it was pinned to */
+    EXPECT_EQ(ER_INVALID_STREAM, iodisp->StartStream(streams[0], listeners[0], listeners[0], listeners[0], true, false));
+}
+
+TEST_F(IODispatchTest, ReactorAffinity)
+{
+    iodisp = new IODispatch("iodisp", 4, 4);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+
+    StartStreams(8, true);
+    SendAndWait(20);
+
+    /* Stream i was pinned to event loop i % 4 whose callbacks are made by its own timer */
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        qcc::String expected = "iodisp";
+        if ((i % 4) != 0) {
+            expected += "-";
+            expected += U32ToString(i % 4);
+        }
+        EXPECT_STREQ(expected.c_str(), listeners[i]->GetThreadName().c_str());
+    }
+
+    /* Nor can a pinned stream be started again, on any event loop */
+    for (uint32_t i = 0; i < 4; ++i) {
+        EXPECT_EQ(ER_INVALID_STREAM, iodisp->StartStream(streams[1], listeners[1], listeners[1], listeners[1], true, false, i));
+    }
+    EXPECT_EQ(ER_INVALID_STREAM, iodisp->StartStream(streams[1], listeners[1], listeners[1], listeners[1], true, false));
+}
+
+TEST_F(IODispatchTest, InlineCallbacks)
+{
+    iodisp = new IODispatch("iodisp", 4, 2);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+
+    /* Even streams are serviced by event loop 0, which is the iodisp thread itself */
+    StartStreams(8, true);
+    for (size_t i = 0; i < streams.size(); ++i) {
+        EXPECT_EQ(ER_OK, iodisp->SetInlineCallbacks(streams[i]));
+    }
+    SendAndWait(20);
+
+    /* Inline read callbacks are made by the event loop thread of the stream rather than by a timer thread */
+    Thread* loop1 = listeners[1]->GetThread();
+    EXPECT_TRUE(loop1 != NULL);
+    EXPECT_TRUE(loop1 != static_cast<Thread*>(iodisp));
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        if ((i % 2) == 0) {
+            EXPECT_EQ(static_cast<Thread*>(iodisp), listeners[i]->GetThread());
+        } else {
+            EXPECT_EQ(loop1, listeners[i]->GetThread());
+        }
+    }
+}
+
+TEST_F(IODispatchTest, RestartStreams)
+{
+    iodisp = new IODispatch("iodisp", 4, 2);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+
+    /* Entries of joined streams are reused, so restarting streams must not mix up their state */
+    StartStreams(100, false);
+    for (size_t round = 0; round < 3; ++round) {
+        for (size_t i = 0; i < streams.size(); i += 2) {
+            EXPECT_EQ(ER_OK, iodisp->StopStream(streams[i]));
+        }
+        for (size_t i = 0; i < streams.size(); i += 2) {
+            EXPECT_EQ(ER_OK, iodisp->JoinStream(streams[i]));
+            EXPECT_EQ(1, listeners[i]->numExits);
+            listeners[i]->numExits = 0;
+            EXPECT_EQ(ER_OK, iodisp->StartStream(streams[i], listeners[i], listeners[i], listeners[i], true, false));
+        }
+    }
+    SendAndWait(30);
+}
+
+TEST_F(IODispatchTest, ReadTimeouts)
+{
+    iodisp = new IODispatch("iodisp", 4);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+
+    StartStreams(2, false);
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        listeners[i]->readTimeout = 1;
+        EXPECT_EQ(ER_OK, iodisp->EnableTimeoutCallback(streams[i], 1));
+    }
+
+    /* Keep stream 1 busy so that its deadline keeps moving while stream 0 stays idle */
+    char buf[4] = { 'x', 'x', 'x', 'x' };
+    for (uint32_t elapsed = 0; elapsed < 2500; elapsed += 250) {
+        size_t sent = 0;
+        EXPECT_EQ(ER_OK, peers[1]->PushBytes(buf, sizeof(buf), sent));
+        qcc::Sleep(250);
+    }
+
+    /* Stream 0 has timed out once per second, stream 1 never has */
+    EXPECT_LE(2, listeners[0]->numTimeouts);
+    EXPECT_GE(3, listeners[0]->numTimeouts);
+    EXPECT_EQ(0, listeners[1]->numTimeouts);
+    EXPECT_EQ(40U, listeners[1]->GetBytesRead());
+}
+
+TEST_F(IODispatchTest, StreamBudgets)
+{
+    iodisp = new IODispatch("iodisp", 4);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+
+    StartStreams(4, false);
+    EXPECT_EQ(ER_INVALID_STREAM, iodisp->SetStreamBudget(peers[0], 1, 0));
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        listeners[i]->readSize = 4;
+    }
+
+    /* Stream 0 may read 8 bytes per round, so every third callback waits for the next round */
+    uint64_t callbackBudgetExhausted = 0;
+    uint64_t byteBudgetExhausted = 0;
+    EXPECT_EQ(ER_OK, iodisp->SetStreamBudget(streams[0], 0, 8));
+    listeners[0]->chargeBudget = true;
+    SendAndWait(64);
+    iodisp->GetBudgetStats(callbackBudgetExhausted, byteBudgetExhausted);
+    EXPECT_EQ(0U, callbackBudgetExhausted);
+    EXPECT_LT(0U, byteBudgetExhausted);
+
+    /* Stream 1 may have one callback per round */
+    EXPECT_EQ(ER_OK, iodisp->SetStreamBudget(streams[0], 0, 0));
+    EXPECT_EQ(ER_OK, iodisp->SetStreamBudget(streams[1], 1, 0));
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        listeners[i]->bytesRead = 0;
+    }
+    SendAndWait(64);
+    iodisp->GetBudgetStats(callbackBudgetExhausted, byteBudgetExhausted);
+    EXPECT_LT(0U, callbackBudgetExhausted);
+}
+
+TEST_F(IODispatchTest, StopDeferredStreams)
+{
+    iodisp = new IODispatch("iodisp", 4);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+
+    /* Streams stopped while they wait for the next round must not be serviced after their entries are freed or reused */
+    StartStreams(8, false);
+    char buf[64];
+    memset(buf, 'x', sizeof(buf));
+    for (size_t round = 0; round < 5; ++round) {
+        for (size_t i = 0; i < streams.size(); ++i) {
+            listeners[i]->readSize = 1;
+            EXPECT_EQ(ER_OK, iodisp->SetStreamBudget(streams[i], 1, 0));
+            size_t sent = 0;
+            EXPECT_EQ(ER_OK, peers[i]->PushBytes(buf, sizeof(buf), sent));
+        }
+        qcc::Sleep(2);
+        for (size_t i = 0; i < streams.size(); ++i) {
+            EXPECT_EQ(ER_OK, iodisp->StopStream(streams[i]));
+        }
+        for (size_t i = 0; i < streams.size(); ++i) {
+            EXPECT_EQ(ER_OK, iodisp->JoinStream(streams[i]));
+            EXPECT_EQ(1, listeners[i]->numExits);
+            listeners[i]->numExits = 0;
+            EXPECT_EQ(ER_OK, iodisp->StartStream(streams[i], listeners[i], listeners[i], listeners[i], true, false));
+        }
+    }
+    uint64_t callbackBudgetExhausted = 0;
+    uint64_t byteBudgetExhausted = 0;
+    iodisp->GetBudgetStats(callbackBudgetExhausted, byteBudgetExhausted);
+    EXPECT_LT(0U, callbackBudgetExhausted);
+
+    /* Drain what is left and check that the restarted streams still work */
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        listeners[i]->readSize = 256;
+    }
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        for (uint32_t waited = 0; (listeners[i]->GetBytesRead() < 5 * sizeof(buf)) && (waited < 5000); waited += 5) {
+            qcc::Sleep(5);
+        }
+        listeners[i]->bytesRead = 0;
+    }
+    SendAndWait(10);
+}
+
+TEST_F(IODispatchTest, WriteQueue)
+{
+    iodisp = new IODispatch("iodisp", 4);
+    ASSERT_EQ(ER_OK, iodisp->Start());
+
+    StartStreams(1, false);
+    EXPECT_EQ(ER_OK, iodisp->SetWriteWatermarks(streams[0], 64 * 1024, 16 * 1024, listeners[0]));
+
+    /* The peer is not reading, so the queue fills up once the socket buffers are full */
+    char buf[4096];
+    size_t queued = 0;
+    QStatus status = ER_OK;
+    while ((status == ER_OK) && (queued < 64 * 1024 * 1024)) {
+        memset(buf, static_cast<int>(queued / sizeof(buf)), sizeof(buf));
+        status = iodisp->QueueWrite(streams[0], buf, sizeof(buf));
+        if (status == ER_OK) {
+            queued += sizeof(buf);
+        }
+    }
+    EXPECT_EQ(ER_WOULDBLOCK, status);
+    EXPECT_EQ(1, listeners[0]->numHighWatermarks);
+    EXPECT_LE(static_cast<size_t>(64 * 1024), iodisp->GetQueuedBytes(streams[0]));
+
+    /* Everything arrives in order once the peer reads, and the queue reports having drained */
+    size_t received = 0;
+    while (received < queued) {
+        size_t actual = 0;
+        ASSERT_EQ(ER_OK, peers[0]->PullBytes(buf, sizeof(buf), actual, 5000));
+        for (size_t i = 0; i < actual; ++i) {
+            ASSERT_EQ(static_cast<char>((received + i) / sizeof(buf)), buf[i]);
+        }
+        received += actual;
+    }
+    EXPECT_EQ(queued, received);
+    for (uint32_t waited = 0; (listeners[0]->numLowWatermarks == 0) && (waited < 5000); waited += 5) {
+        qcc::Sleep(5);
+    }
+    EXPECT_EQ(1, listeners[0]->numLowWatermarks);
+    EXPECT_EQ(0U, iodisp->GetQueuedBytes(streams[0]));
+    EXPECT_EQ(ER_OK, iodisp->QueueWrite(streams[0], buf, sizeof(buf)));
+}
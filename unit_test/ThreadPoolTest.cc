@@ -0,0 +1,509 @@
+/******************************************************************************
+ * Copyright 2013, Qualcomm Innovation Center, Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ ******************************************************************************/
+#include <gtest/gtest.h>
+
+#include <set>
+#include <vector>
+
+#include <qcc/atomic.h>
+#include <qcc/Thread.h>
+#include <qcc/ThreadPool.h>
+#include <qcc/time.h>
+#include <Status.h>
+
+using namespace std;
+using namespace qcc;
+
+class CountingRunnable : public Runnable {
+  public:
+    CountingRunnable(volatile int32_t& count) : count(count) { }
+    void Run(void)
+    {
+        IncrementAndFetch(&count);
+    }
+    volatile int32_t& count;
+};
+
+TEST(ThreadPoolTest, TestExecute) {
+    ThreadPool pool("testPool", 4);
+    EXPECT_EQ(4U, pool.GetConcurrency());
+
+    volatile int32_t count = 0;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        Ptr<Runnable> runnable(new CountingRunnable(count));
+        QStatus status = pool.Execute(runnable);
+        while (status == ER_THREADPOOL_EXHAUSTED) {
+            ASSERT_EQ(ER_OK, pool.WaitForAvailableThread());
+            status = pool.Execute(runnable);
+        }
+        ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    }
+    for (uint32_t i = 0; (i < 500) && (pool.GetN() != 0); ++i) {
+        qcc::Sleep(10);
+    }
+    EXPECT_EQ(0U, pool.GetN());
+    EXPECT_EQ(1000, count);
+
+    EXPECT_EQ(ER_OK, pool.Stop());
+    EXPECT_EQ(ER_OK, pool.Join());
+    Ptr<Runnable> runnable(new CountingRunnable(count));
+    EXPECT_EQ(ER_THREADPOOL_STOPPING, pool.Execute(runnable));
+}
+
+class ChildRunnable : public Runnable {
+  public:
+    ChildRunnable(Mutex& lock, std::set<Thread*>& threads, volatile int32_t& done) : lock(lock), threads(threads), done(done) { }
+    void Run(void)
+    {
+        lock.Lock();
+        threads.insert(Thread::GetThread());
+        lock.Unlock();
+        qcc::Sleep(20);
+        IncrementAndFetch(&done);
+    }
+    Mutex& lock;
+    std::set<Thread*>& threads;
+    volatile int32_t& done;
+};
+
+class ParentRunnable : public Runnable {
+  public:
+    ParentRunnable(ThreadPool& pool, uint32_t children) : pool(pool), children(children), done(0), executed(0), self(NULL) { }
+    void Run(void)
+    {
+        self = Thread::GetThread();
+        for (uint32_t i = 0; i < children; ++i) {
+            Ptr<Runnable> child(new ChildRunnable(lock, threads, done));
+            if (pool.Execute(child) == ER_OK) {
+                ++executed;
+            }
+        }
+        /* Keep this thread busy so the children have to be stolen by the other threads */
+        for (uint32_t i = 0; (i < 500) && (done != static_cast<int32_t>(executed)); ++i) {
+            qcc::Sleep(10);
+        }
+    }
+    ThreadPool& pool;
+    uint32_t children;
+    Mutex lock;
+    std::set<Thread*> threads;
+    volatile int32_t done;
+    uint32_t executed;
+    Thread* self;
+};
+
+TEST(ThreadPoolTest, TestWorkStealing) {
+    ThreadPool pool("testPool", 4);
+
+    /* The parent fans out to its own deque and the idle threads steal the children */
+    ParentRunnable* parent = new ParentRunnable(pool, 3);
+    Ptr<Runnable> runnable(parent);
+    ASSERT_EQ(ER_OK, pool.Execute(runnable));
+    for (uint32_t i = 0; (i < 500) && (pool.GetN() != 0); ++i) {
+        qcc::Sleep(10);
+    }
+    ASSERT_EQ(0U, pool.GetN());
+    EXPECT_EQ(3U, parent->executed);
+    EXPECT_EQ(3, parent->done);
+    EXPECT_EQ(3U, parent->threads.size());
+    EXPECT_EQ(0U, parent->threads.count(parent->self));
+
+    EXPECT_EQ(ER_OK, pool.Stop());
+    EXPECT_EQ(ER_OK, pool.Join());
+}
+
+class GatedRunnable : public Runnable {
+  public:
+    GatedRunnable(Event& gate, volatile int32_t& count) : gate(gate), count(count) { }
+    void Run(void)
+    {
+        Event::Wait(gate, 5000);
+        IncrementAndFetch(&count);
+    }
+    Event& gate;
+    volatile int32_t& count;
+};
+
+class SubmitThread : public Thread {
+  public:
+    SubmitThread(ThreadPool& pool, Ptr<Runnable> runnable) : Thread("SubmitThread"), pool(pool), runnable(runnable), status(ER_FAIL), done(0) { }
+    ThreadPool& pool;
+    Ptr<Runnable> runnable;
+    QStatus status;
+    volatile int32_t done;
+
+  protected:
+    ThreadReturn STDCALL Run(void* arg)
+    {
+        status = pool.Execute(runnable, Event::WAIT_FOREVER);
+        IncrementAndFetch(&done);
+        return 0;
+    }
+};
+
+TEST(ThreadPoolTest, TestBoundedQueue) {
+    ThreadPool pool("testPool", 2, 2);
+    Event gate;
+    volatile int32_t count = 0;
+
+    /* Two Runnables hold the threads and two more wait in the queue */
+    for (uint32_t i = 0; i < 4; ++i) {
+        Ptr<Runnable> runnable(new GatedRunnable(gate, count));
+        ASSERT_EQ(ER_OK, pool.Execute(runnable));
+    }
+    EXPECT_EQ(4U, pool.GetN());
+
+    Ptr<Runnable> runnable(new GatedRunnable(gate, count));
+    EXPECT_EQ(ER_THREADPOOL_EXHAUSTED, pool.Execute(runnable));
+    Timespec start;
+    GetTimeNow(&start);
+    EXPECT_EQ(ER_THREADPOOL_EXHAUSTED, pool.Execute(runnable, 100));
+    Timespec end;
+    GetTimeNow(&end);
+    EXPECT_LE(90U, end - start);
+
+    /* A blocking submitter sleeps until a Runnable completes */
+    SubmitThread submitter(pool, runnable);
+    ASSERT_EQ(ER_OK, submitter.Start());
+    qcc::Sleep(50);
+    EXPECT_EQ(0, submitter.done);
+
+    gate.SetEvent();
+    EXPECT_EQ(ER_OK, submitter.Join());
+    EXPECT_EQ(ER_OK, submitter.status);
+    for (uint32_t i = 0; (i < 500) && (pool.GetN() != 0); ++i) {
+        qcc::Sleep(10);
+    }
+    EXPECT_EQ(0U, pool.GetN());
+    EXPECT_EQ(5, count);
+
+    /* A burst queues up behind the threads rather than failing */
+    count = 0;
+    for (uint32_t i = 0; i < 200; ++i) {
+        Ptr<Runnable> counting(new CountingRunnable(count));
+        ASSERT_EQ(ER_OK, pool.Execute(counting, Event::WAIT_FOREVER));
+    }
+    for (uint32_t i = 0; (i < 500) && (pool.GetN() != 0); ++i) {
+        qcc::Sleep(10);
+    }
+    EXPECT_EQ(200, count);
+
+    /* Stopping the pool wakes a blocked submitter */
+    gate.ResetEvent();
+    for (uint32_t i = 0; i < 4; ++i) {
+        Ptr<Runnable> gated(new GatedRunnable(gate, count));
+        ASSERT_EQ(ER_OK, pool.Execute(gated));
+    }
+    SubmitThread stopped(pool, runnable);
+    ASSERT_EQ(ER_OK, stopped.Start());
+    qcc::Sleep(50);
+    EXPECT_EQ(ER_OK, pool.Stop());
+    EXPECT_EQ(ER_OK, stopped.Join());
+    EXPECT_EQ(ER_THREADPOOL_STOPPING, stopped.status);
+    gate.SetEvent();
+    EXPECT_EQ(ER_OK, pool.Join());
+}
+
+class OrderedRunnable : public Runnable {
+  public:
+    OrderedRunnable(Mutex& lock, std::vector<int>& order, int id) : lock(lock), order(order), id(id) { }
+    void Run(void)
+    {
+        lock.Lock();
+        order.push_back(id);
+        lock.Unlock();
+    }
+    void Expired(void)
+    {
+        lock.Lock();
+        order.push_back(-id);
+        lock.Unlock();
+    }
+    Mutex& lock;
+    std::vector<int>& order;
+    int id;
+};
+
+TEST(ThreadPoolTest, TestPriorityAndDeadline) {
+    ThreadPool pool("testPool", 1, 8);
+    Event gate;
+    volatile int32_t count = 0;
+    Mutex lock;
+    std::vector<int> order;
+
+    /* Hold the only thread while the others queue up */
+    Ptr<Runnable> gated(new GatedRunnable(gate, count));
+    ASSERT_EQ(ER_OK, pool.Execute(gated));
+
+    Runnable::Priority priorities[] = { Runnable::PRIORITY_LOW, Runnable::PRIORITY_NORMAL, Runnable::PRIORITY_HIGH, Runnable::PRIORITY_LOW, Runnable::PRIORITY_HIGH };
+    for (int i = 0; i < 5; ++i) {
+        Ptr<Runnable> runnable(new OrderedRunnable(lock, order, i + 1));
+        runnable->SetPriority(priorities[i]);
+        if (i == 3) {
+            runnable->SetDeadline(Timespec(10, TIME_RELATIVE));
+        } else {
+            runnable->SetDeadline(Timespec(60000, TIME_RELATIVE));
+        }
+        ASSERT_EQ(ER_OK, pool.Execute(runnable));
+    }
+    qcc::Sleep(50);
+    gate.SetEvent();
+    for (uint32_t i = 0; (i < 500) && (pool.GetN() != 0); ++i) {
+        qcc::Sleep(10);
+    }
+    ASSERT_EQ(0U, pool.GetN());
+
+    /* Highest priority first, in order within a priority, and the late one expired */
+    ASSERT_EQ(5U, order.size());
+    EXPECT_EQ(3, order[0]);
+    EXPECT_EQ(5, order[1]);
+    EXPECT_EQ(2, order[2]);
+    EXPECT_EQ(1, order[3]);
+    EXPECT_EQ(-4, order[4]);
+
+    EXPECT_EQ(ER_OK, pool.Stop());
+    EXPECT_EQ(ER_OK, pool.Join());
+}
+
+class SleepingRunnable : public Runnable {
+  public:
+    SleepingRunnable(uint32_t ms) : ms(ms), result(0) { }
+    void Run(void)
+    {
+        qcc::Sleep(ms);
+        result = ms;
+    }
+    uint32_t ms;
+    uint32_t result;
+};
+
+TEST(ThreadPoolTest, TestCompletionAndBatch) {
+    ThreadPool pool("testPool", 4, 4);
+
+    SleepingRunnable* sleeping = new SleepingRunnable(100);
+    Ptr<Runnable> runnable(sleeping);
+    EXPECT_EQ(Runnable::STATE_NEW, runnable->GetState());
+    EXPECT_EQ(ER_FAIL, runnable->Wait(0));
+    ASSERT_EQ(ER_OK, pool.Execute(runnable));
+    EXPECT_EQ(ER_TIMEOUT, runnable->Wait(10));
+    EXPECT_EQ(ER_OK, runnable->Wait());
+    EXPECT_EQ(Runnable::STATE_RUN, runnable->GetState());
+    EXPECT_EQ(100U, sleeping->result);
+
+    /* Submitted again, Wait waits for the new run rather than returning for the old one */
+    sleeping->result = 0;
+    ASSERT_EQ(ER_OK, pool.Execute(runnable));
+    EXPECT_EQ(ER_TIMEOUT, runnable->Wait(10));
+    EXPECT_EQ(ER_OK, runnable->Wait());
+    EXPECT_EQ(Runnable::STATE_RUN, runnable->GetState());
+    EXPECT_EQ(100U, sleeping->result);
+
+    /* A batch bigger than the pool queues as room frees up */
+    const size_t count = 64;
+    Ptr<Runnable> batch[count];
+    for (size_t i = 0; i < count; ++i) {
+        batch[i] = Ptr<Runnable>(new SleepingRunnable(i % 4));
+    }
+    ASSERT_EQ(ER_OK, pool.ExecuteBatch(batch, count, Event::WAIT_FOREVER));
+    for (size_t i = 0; i < count; ++i) {
+        EXPECT_EQ(ER_OK, batch[i]->Wait());
+        EXPECT_EQ(Runnable::STATE_RUN, batch[i]->GetState());
+        EXPECT_EQ(i % 4, static_cast<SleepingRunnable*>(batch[i].Peek())->result);
+    }
+
+    /* Without waiting only the ones there is room for are accepted */
+    Event gate;
+    volatile int32_t ran = 0;
+    Ptr<Runnable> gated[count];
+    for (size_t i = 0; i < count; ++i) {
+        gated[i] = Ptr<Runnable>(new GatedRunnable(gate, ran));
+    }
+    EXPECT_EQ(ER_THREADPOOL_EXHAUSTED, pool.ExecuteBatch(gated, count));
+    EXPECT_EQ(Runnable::STATE_QUEUED, gated[7]->GetState());
+    EXPECT_EQ(Runnable::STATE_NEW, gated[8]->GetState());
+    gate.SetEvent();
+    for (size_t i = 0; i < 8; ++i) {
+        EXPECT_EQ(ER_OK, gated[i]->Wait());
+    }
+    EXPECT_EQ(8, ran);
+
+    EXPECT_EQ(ER_OK, pool.Stop());
+    EXPECT_EQ(ER_OK, pool.Join());
+}
+
+class SquareBody : public ParallelForBody {
+  public:
+    SquareBody(std::vector<uint64_t>& squares) : squares(squares), calls(0) { }
+    void Run(size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i) {
+            squares[i] = static_cast<uint64_t>(i) * i;
+        }
+        IncrementAndFetch(&calls);
+    }
+    std::vector<uint64_t>& squares;
+    volatile int32_t calls;
+};
+
+class ParallelForRunner : public Runnable {
+  public:
+    ParallelForRunner(ThreadPool& pool, SquareBody& body) : pool(pool), body(body) { }
+    void Run(void)
+    {
+        pool.ParallelFor(0, body.squares.size(), 10, body);
+    }
+    ThreadPool& pool;
+    SquareBody& body;
+};
+
+TEST(ThreadPoolTest, TestParallelFor) {
+    ThreadPool pool("testPool", 4);
+
+    std::vector<uint64_t> squares(10000, 0);
+    SquareBody body(squares);
+    pool.ParallelFor(0, squares.size(), 100, body);
+    EXPECT_EQ(100, body.calls);
+    for (size_t i = 0; i < squares.size(); ++i) {
+        ASSERT_EQ(static_cast<uint64_t>(i) * i, squares[i]);
+    }
+
+    /* The default grain gives each thread a few parts */
+    std::vector<uint64_t> more(1001, 0);
+    SquareBody moreBody(more);
+    pool.ParallelFor(0, more.size(), 0, moreBody);
+    EXPECT_EQ(16, moreBody.calls);
+    EXPECT_EQ(1000000U, more[1000]);
+
+    /* Nested in a Runnable of a full pool it completes on the calling thread */
+    std::vector<uint64_t> nested(1000, 0);
+    SquareBody nestedBody(nested);
+    Ptr<Runnable> runners[4];
+    for (size_t i = 0; i < 4; ++i) {
+        runners[i] = Ptr<Runnable>(new ParallelForRunner(pool, nestedBody));
+    }
+    ASSERT_EQ(ER_OK, pool.ExecuteBatch(runners, 4, Event::WAIT_FOREVER));
+    for (size_t i = 0; i < 4; ++i) {
+        EXPECT_EQ(ER_OK, runners[i]->Wait(5000));
+    }
+    EXPECT_EQ(400, nestedBody.calls);
+    EXPECT_EQ(998001U, nested[999]);
+
+    EXPECT_EQ(ER_OK, pool.Stop());
+    EXPECT_EQ(ER_OK, pool.Join());
+}
+
+TEST(ThreadPoolTest, TestAdaptiveSize) {
+    ThreadPool pool("testPool", 4, 4);
+    ThreadPoolStats stats;
+    pool.GetStats(stats);
+    EXPECT_EQ(4U, stats.threads);
+    EXPECT_EQ(4U, stats.threadStarts);
+
+    /* The threads above the minimum stop once they have been idle */
+    pool.SetIdleTimeout(20);
+    pool.SetMinThreads(1);
+    for (uint32_t i = 0; (i < 500) && (stats.threads != 1); ++i) {
+        qcc::Sleep(10);
+        pool.GetStats(stats);
+    }
+    EXPECT_EQ(1U, stats.threads);
+    EXPECT_EQ(3U, stats.threadStops);
+
+    /* Runnables that wait too long for a thread grow the pool */
+    pool.ResetStats();
+    pool.SetGrowThreshold(100);
+    Event gate;
+    volatile int32_t count = 0;
+    for (uint32_t i = 0; i < 2; ++i) {
+        Ptr<Runnable> runnable(new GatedRunnable(gate, count));
+        ASSERT_EQ(ER_OK, pool.Execute(runnable));
+    }
+    qcc::Sleep(150);
+    pool.GetStats(stats);
+    EXPECT_EQ(1U, stats.threads);
+    EXPECT_EQ(1U, stats.queueDepth);
+
+    Ptr<Runnable> late(new GatedRunnable(gate, count));
+    ASSERT_EQ(ER_OK, pool.Execute(late));
+    pool.GetStats(stats);
+    EXPECT_EQ(2U, stats.threads);
+    EXPECT_EQ(1U, stats.threadStarts);
+
+    /* Without a threshold a thread is started whenever none is idle */
+    pool.SetGrowThreshold(0);
+    Ptr<Runnable> another(new GatedRunnable(gate, count));
+    ASSERT_EQ(ER_OK, pool.Execute(another));
+    qcc::Sleep(50);
+    pool.GetStats(stats);
+    EXPECT_EQ(4U, stats.threads);
+    EXPECT_EQ(4U, stats.peakThreads);
+    EXPECT_EQ(0U, stats.queueDepth);
+
+    gate.SetEvent();
+    EXPECT_EQ(ER_OK, late->Wait());
+    EXPECT_EQ(ER_OK, another->Wait());
+    for (uint32_t i = 0; (i < 500) && (pool.GetN() != 0); ++i) {
+        qcc::Sleep(10);
+    }
+    pool.GetStats(stats);
+    EXPECT_EQ(4U, stats.executed);
+    EXPECT_LE(100000U, stats.maxWaitUs);
+    EXPECT_LE(stats.maxWaitUs, stats.waitUs);
+    EXPECT_LE(stats.maxRunUs, stats.runUs);
+    EXPECT_LT(0U, stats.runUs);
+
+    /* And the pool shrinks back once the burst is over */
+    for (uint32_t i = 0; (i < 500) && (stats.threads != 1); ++i) {
+        qcc::Sleep(10);
+        pool.GetStats(stats);
+    }
+    EXPECT_EQ(1U, stats.threads);
+
+    EXPECT_EQ(ER_OK, pool.Stop());
+    EXPECT_EQ(ER_OK, pool.Join());
+}
+
+TEST(ThreadPoolTest, TestShrinkToZero) {
+    ThreadPool pool("testPool", 4, 4);
+    ThreadPoolStats stats;
+    pool.SetIdleTimeout(50);
+    pool.SetGrowThreshold(20);
+    pool.SetMinThreads(0);
+    pool.GetStats(stats);
+    for (uint32_t i = 0; (i < 500) && (stats.threads != 0); ++i) {
+        qcc::Sleep(10);
+        pool.GetStats(stats);
+    }
+    EXPECT_EQ(0U, stats.threads);
+
+    /* With no thread left the threshold doesn't apply, nobody would grow the pool */
+    Ptr<Runnable> runnable(new SleepingRunnable(1));
+    ASSERT_EQ(ER_OK, pool.Execute(runnable));
+    EXPECT_EQ(ER_OK, runnable->Wait(2000));
+
+    /* Runnables queued while the last thread is stopping are still run */
+    pool.SetIdleTimeout(1);
+    pool.SetGrowThreshold(0);
+    for (uint32_t i = 0; i < 200; ++i) {
+        qcc::Sleep(i % 4);
+        Ptr<Runnable> runnable(new SleepingRunnable(0));
+        ASSERT_EQ(ER_OK, pool.Execute(runnable));
+        ASSERT_EQ(ER_OK, runnable->Wait(2000));
+    }
+
+    EXPECT_EQ(ER_OK, pool.Stop());
+    EXPECT_EQ(ER_OK, pool.Join());
+}
@@ -15,7 +15,9 @@
  ******************************************************************************/
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <deque>
+#include <vector>
 
 #include <qcc/Timer.h>
 #include <Status.h>
@@ -198,3 +200,866 @@ TEST(TimerTest, TestReplaceTimer) {
 
     ASSERT_TRUE(testNextAlarm(ts + 5000, 0));
 }
+
+TEST(TimerTest, AlarmWheelOrder) {
+    MyAlarmListener alarmListener(0);
+    AlarmListener* al = &alarmListener;
+    AlarmWheel wheel;
+
+    Timespec ts;
+    GetTimeNow(&ts);
+    uint64_t base = ts.GetAbsoluteMillis();
+
+    /* Offsets that land in every level of the wheel, on and around block boundaries, and in the overflow list */
+    const uint64_t offsets[] = {
+        0, 1, 2, 255, 256, 257, 300, 16383, 16384, 16385, 20000, 1048575, 1048576, 1048577, 5000000,
+        67108863, 67108864, 67108865, 100000000, 4294967295ULL, 4294967296ULL, 4294967297ULL, 10000000000ULL
+    };
+    const size_t numOffsets = sizeof(offsets) / sizeof(offsets[0]);
+
+    /* Add every offset twice, once in reverse, so equal times have to come out in id order */
+    std::vector<Alarm> expected;
+    std::vector<Alarm> removed;
+    for (size_t i = 0; i < 2 * numOffsets; ++i) {
+        size_t n = (i < numOffsets) ? i : (2 * numOffsets - 1 - i);
+        Timespec when(base + offsets[n]);
+        void* context = reinterpret_cast<void*>(i + 1);
+        Alarm alarm(when, al, context);
+        wheel.Add(alarm);
+        /* Drop every fifth alarm again */
+        if ((i % 5) == 3) {
+            removed.push_back(alarm);
+        } else {
+            expected.push_back(alarm);
+        }
+    }
+    for (size_t i = 0; i < removed.size(); ++i) {
+        ASSERT_TRUE(wheel.Remove(removed[i]));
+        ASSERT_FALSE(wheel.Contains(removed[i]));
+        ASSERT_FALSE(wheel.Remove(removed[i]));
+    }
+    ASSERT_EQ(expected.size(), wheel.Size());
+    std::sort(expected.begin(), expected.end());
+
+    std::vector<Alarm> snapshot;
+    wheel.GetAlarms(snapshot);
+    ASSERT_EQ(expected.size(), snapshot.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_TRUE(snapshot[i] == expected[i]);
+    }
+
+    /* Step time forward the way TimerThread does and check that no alarm is skipped or late */
+    Timespec now(base);
+    size_t next = 0;
+    while (!wheel.IsEmpty()) {
+        Timespec wake = wheel.GetNextAlarm(now);
+        ASSERT_LE(wake.GetAbsoluteMillis(), expected[next]->GetAlarmTime());
+        if (wake <= now) {
+            Alarm due = wheel.GetDueAlarm();
+            ASSERT_TRUE(due == expected[next]);
+            ASSERT_TRUE(wheel.Remove(due));
+            ++next;
+        } else {
+            now = wake;
+        }
+    }
+    ASSERT_EQ(expected.size(), next);
+    ASSERT_EQ(END_OF_TIME, wheel.GetNextAlarm(now).GetAbsoluteMillis());
+}
+
+TEST(TimerTest, AlarmWheelRemoveListener) {
+    MyAlarmListener listener1(0);
+    MyAlarmListener listener2(0);
+    MyAlarmListener listener3(0);
+    AlarmListener* al1 = &listener1;
+    AlarmListener* al2 = &listener2;
+    AlarmListener* al3 = &listener3;
+    AlarmWheel wheel;
+
+    Timespec ts;
+    GetTimeNow(&ts);
+    uint64_t base = ts.GetAbsoluteMillis();
+
+    /* Interleave the alarms of two listeners over all levels of the wheel */
+    std::vector<Alarm> alarms1;
+    std::vector<Alarm> alarms2;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        Timespec when(base + (static_cast<uint64_t>(i) * 104729) % 100000000);
+        Alarm alarm1(when, al1);
+        Alarm alarm2(when, al2);
+        wheel.Add(alarm1);
+        wheel.Add(alarm2);
+        alarms1.push_back(alarm1);
+        alarms2.push_back(alarm2);
+    }
+    Alarm alarm;
+    ASSERT_FALSE(wheel.RemoveListener(al3, alarm));
+
+    /* Removing alarms directly must keep the listener index consistent */
+    for (size_t i = 0; i < alarms1.size(); i += 2) {
+        ASSERT_TRUE(wheel.Remove(alarms1[i]));
+    }
+    size_t removed = 0;
+    while (wheel.RemoveListener(al1, alarm)) {
+        ASSERT_FALSE(wheel.Contains(alarm));
+        ++removed;
+    }
+    ASSERT_EQ(alarms1.size() / 2, removed);
+    ASSERT_EQ(alarms2.size(), wheel.Size());
+    for (size_t i = 0; i < alarms2.size(); ++i) {
+        ASSERT_TRUE(wheel.Contains(alarms2[i]));
+    }
+
+    /* A listener whose alarms have all been removed can be added again */
+    Timespec soon(base + 10);
+    Alarm again(soon, al1);
+    wheel.Add(again);
+    ASSERT_TRUE(wheel.RemoveListener(al1, alarm));
+    ASSERT_TRUE(alarm == again);
+    ASSERT_FALSE(wheel.RemoveListener(al1, alarm));
+
+    /* Alarms that become due are still found through their listener */
+    Timespec now(base + 100000000);
+    wheel.GetNextAlarm(now);
+    removed = 0;
+    while (wheel.RemoveListener(al2, alarm)) {
+        ++removed;
+    }
+    ASSERT_EQ(alarms2.size(), removed);
+    ASSERT_TRUE(wheel.IsEmpty());
+}
+
+TEST(TimerTest, AlarmWheelListenerInTwoWheels) {
+    MyAlarmListener listener(0);
+    AlarmListener* al = &listener;
+    AlarmWheel first;
+    AlarmWheel second;
+
+    Timespec ts;
+    GetTimeNow(&ts);
+    uint64_t base = ts.GetAbsoluteMillis();
+
+    /* Each wheel finds only its own alarms of a listener that has alarms in both */
+    std::vector<Alarm> alarms1;
+    std::vector<Alarm> alarms2;
+    for (uint32_t i = 0; i < 100; ++i) {
+        Timespec when(base + 1000 + i * 7919);
+        Alarm alarm1(when, al);
+        Alarm alarm2(when, al);
+        first.Add(alarm1);
+        second.Add(alarm2);
+        alarms1.push_back(alarm1);
+        alarms2.push_back(alarm2);
+    }
+    Alarm alarm;
+    size_t removed = 0;
+    while (first.RemoveListener(al, alarm)) {
+        ASSERT_FALSE(first.Contains(alarm));
+        ASSERT_FALSE(second.Contains(alarm));
+        ++removed;
+    }
+    ASSERT_EQ(alarms1.size(), removed);
+    ASSERT_EQ(alarms2.size(), second.Size());
+
+    /* With the first wheel empty, new alarms in it are found alongside those of the second wheel */
+    for (size_t i = 0; i < 10; ++i) {
+        first.Add(alarms1[i]);
+    }
+    removed = 0;
+    while (second.RemoveListener(al, alarm)) {
+        ASSERT_FALSE(second.Contains(alarm));
+        ++removed;
+    }
+    ASSERT_EQ(alarms2.size(), removed);
+    removed = 0;
+    while (first.RemoveListener(al, alarm)) {
+        ++removed;
+    }
+    ASSERT_EQ(10U, removed);
+    ASSERT_TRUE(first.IsEmpty());
+    ASSERT_TRUE(second.IsEmpty());
+}
+
+TEST(TimerTest, TestManyAlarms) {
+    MyAlarmListener alarmListener(0);
+    AlarmListener* al = &alarmListener;
+    QStatus status;
+    Timer t4("testTimer");
+    status = t4.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* Add lots of alarms and cancel all but a few of them, as is done with timeouts */
+    Timespec ts;
+    GetTimeNow(&ts);
+    std::vector<Alarm> alarms;
+    for (uint32_t i = 0; i < 10000; ++i) {
+        uint32_t timeout = 500 + (i * 7919) % 1500;
+        void* context = reinterpret_cast<void*>(static_cast<uintptr_t>(i % 1000 == 0 ? timeout : 0));
+        Alarm alarm(timeout, al, context);
+        status = t4.AddAlarm(alarm);
+        ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+        alarms.push_back(alarm);
+    }
+    uint32_t longTimeout = 3600000;
+    Alarm longAlarm(longTimeout, al);
+    status = t4.AddAlarm(longAlarm);
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    std::vector<uint32_t> timeouts;
+    for (uint32_t i = 0; i < alarms.size(); ++i) {
+        if (alarms[i]->GetContext()) {
+            timeouts.push_back(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(alarms[i]->GetContext())));
+        } else {
+            ASSERT_TRUE(t4.RemoveAlarm(alarms[i]));
+            ASSERT_FALSE(t4.HasAlarm(alarms[i]));
+        }
+    }
+    std::sort(timeouts.begin(), timeouts.end());
+
+    for (size_t i = 0; i < timeouts.size(); ++i) {
+        ASSERT_TRUE(testNextAlarm(ts + timeouts[i], reinterpret_cast<void*>(static_cast<uintptr_t>(timeouts[i]))));
+    }
+    ASSERT_TRUE(t4.HasAlarm(longAlarm));
+    ASSERT_TRUE(t4.RemoveAlarm(longAlarm));
+
+    status = t4.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t4.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+}
+
+class SlackAlarmListener : public AlarmListener {
+  public:
+    SlackAlarmListener() : AlarmListener(), lateAlarms(0), earlyAlarms(0), numAlarms(0) { }
+    void AlarmTriggered(const Alarm& alarm, QStatus reason)
+    {
+        Timespec now;
+        GetTimeNow(&now);
+        uint64_t nowMs = now.GetAbsoluteMillis();
+        lock.Lock();
+        if (nowMs < alarm->GetAlarmTime()) {
+            ++earlyAlarms;
+        } else if (nowMs > (alarm->GetAlarmTime() + alarm->GetSlack() + 100)) {
+            ++lateAlarms;
+        }
+        ++numAlarms;
+        lock.Unlock();
+    }
+    Mutex lock;
+    uint32_t lateAlarms;
+    uint32_t earlyAlarms;
+    uint32_t numAlarms;
+};
+
+TEST(TimerTest, TestAlarmSlack) {
+    SlackAlarmListener alarmListener;
+    AlarmListener* al = &alarmListener;
+
+    /* Alarms with overlapping slack windows are due at the same time in the wheel */
+    AlarmWheel wheel;
+    Timespec ts;
+    GetTimeNow(&ts);
+    uint64_t base = ts.GetAbsoluteMillis() + 1000;
+    base -= base % 64;
+    std::vector<Alarm> alarms;
+    for (uint32_t i = 0; i < 20; ++i) {
+        Timespec when(base + 1 + i);
+        Alarm alarm(when, al);
+        alarm->SetSlack(100);
+        wheel.Add(alarm);
+        alarms.push_back(alarm);
+    }
+    Timespec now(base + 64);
+    ASSERT_TRUE(wheel.GetNextAlarm(now) == now);
+    for (uint32_t i = 0; i < alarms.size(); ++i) {
+        ASSERT_TRUE(wheel.Remove(wheel.GetDueAlarm()));
+        ASSERT_TRUE(wheel.IsEmpty() || (wheel.GetNextAlarm(now) == now));
+    }
+    ASSERT_TRUE(wheel.IsEmpty());
+
+    /* A timer fires every alarm with slack within its window */
+    Timer t5("testTimer", true, 3);
+    QStatus status = t5.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    for (uint32_t i = 0; i < 200; ++i) {
+        uint32_t timeout = 200 + i;
+        Alarm alarm(timeout, al);
+        alarm->SetSlack((i % 2) ? 50 : 0);
+        status = t5.AddAlarm(alarm);
+        ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    }
+    for (uint32_t i = 0; (i < 200) && (alarmListener.numAlarms < 200); ++i) {
+        qcc::Sleep(10);
+    }
+    alarmListener.lock.Lock();
+    EXPECT_EQ(200U, alarmListener.numAlarms);
+    EXPECT_EQ(0U, alarmListener.earlyAlarms);
+    EXPECT_EQ(0U, alarmListener.lateAlarms);
+    alarmListener.lock.Unlock();
+
+    status = t5.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t5.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+}
+
+class CountingAlarmListener : public AlarmListener {
+  public:
+    CountingAlarmListener() : AlarmListener(), numAlarms(0) { }
+    void AlarmTriggered(const Alarm& alarm, QStatus reason)
+    {
+        if (reason == ER_OK) {
+            IncrementAndFetch(&numAlarms);
+        }
+    }
+    volatile int32_t numAlarms;
+};
+
+struct AlarmAdderArg {
+    Timer* timer;
+    AlarmListener* listener;
+    volatile int32_t* numKept;
+};
+
+static ThreadReturn STDCALL AddAlarms(void* arg)
+{
+    AlarmAdderArg* adder = reinterpret_cast<AlarmAdderArg*>(arg);
+    for (uint32_t i = 0; i < 2000; ++i) {
+        uint32_t timeout = i % 50;
+        Alarm alarm(timeout, adder->listener);
+        if (adder->timer->AddAlarm(alarm) != ER_OK) {
+            return reinterpret_cast<ThreadReturn>(1);
+        }
+        /* Cancel every other alarm, it may already have gone off */
+        if ((i % 2) || !adder->timer->RemoveAlarm(alarm, false)) {
+            IncrementAndFetch(adder->numKept);
+        }
+    }
+    return 0;
+}
+
+TEST(TimerTest, TestConcurrentAddAlarm) {
+    CountingAlarmListener alarmListener;
+    volatile int32_t numKept = 0;
+    Timer t6("testTimer", false, 3);
+    QStatus status = t6.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* Threads add alarms, which does not take the timer lock, while the timer threads run them */
+    AlarmAdderArg arg = { &t6, &alarmListener, &numKept };
+    std::vector<Thread*> adders;
+    for (uint32_t i = 0; i < 4; ++i) {
+        adders.push_back(new Thread("adder", AddAlarms));
+        status = adders.back()->Start(&arg);
+        ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    }
+    for (uint32_t i = 0; i < adders.size(); ++i) {
+        adders[i]->Join();
+        EXPECT_EQ(0, reinterpret_cast<intptr_t>(adders[i]->GetExitValue()));
+        delete adders[i];
+    }
+
+    /* A single alarm added to an idle timer still goes off in time */
+    for (uint32_t i = 0; (i < 500) && (alarmListener.numAlarms != numKept); ++i) {
+        qcc::Sleep(10);
+    }
+    ASSERT_EQ(numKept, alarmListener.numAlarms);
+    Timespec ts;
+    GetTimeNow(&ts);
+    MyAlarmListener timedListener(0);
+    AlarmListener* al = &timedListener;
+    uint32_t timeout = 300;
+    Alarm alarm(timeout, al);
+    status = t6.AddAlarm(alarm);
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    ASSERT_TRUE(testNextAlarm(ts + timeout, 0));
+
+    status = t6.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t6.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+}
+
+static ThreadReturn STDCALL AddAlarmsNonBlocking(void* arg)
+{
+    AlarmAdderArg* adder = reinterpret_cast<AlarmAdderArg*>(arg);
+    for (uint32_t i = 0; i < 100; ++i) {
+        uint32_t timeout = 60000;
+        Alarm alarm(timeout, adder->listener);
+        if (adder->timer->AddAlarmNonBlocking(alarm) == ER_OK) {
+            IncrementAndFetch(adder->numKept);
+        }
+    }
+    return 0;
+}
+
+TEST(TimerTest, TestBoundedConcurrentAddAlarm) {
+    CountingAlarmListener alarmListener;
+    volatile int32_t numKept = 0;
+    Timer t8("testTimer", false, 3, false, 50);
+    QStatus status = t8.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* Bounded timers take alarms without the timer lock too, and still never hold more than maxAlarms */
+    AlarmAdderArg arg = { &t8, &alarmListener, &numKept };
+    std::vector<Thread*> adders;
+    for (uint32_t i = 0; i < 4; ++i) {
+        adders.push_back(new Thread("adder", AddAlarmsNonBlocking));
+        status = adders.back()->Start(&arg);
+        ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    }
+    for (uint32_t i = 0; i < adders.size(); ++i) {
+        adders[i]->Join();
+        delete adders[i];
+    }
+    adders.clear();
+    EXPECT_EQ(50, numKept);
+    TimerStats stats;
+    t8.GetStats(stats);
+    EXPECT_EQ(50U, stats.currentAlarms);
+    EXPECT_EQ(350U, stats.maxAlarmsRejected);
+    t8.RemoveAlarmsWithListener(alarmListener);
+
+    /* Blocking adds wait for room as the alarms go off */
+    numKept = 0;
+    for (uint32_t i = 0; i < 4; ++i) {
+        adders.push_back(new Thread("adder", AddAlarms));
+    }
+    for (uint32_t i = 0; i < 4; ++i) {
+        status = adders[i]->Start(&arg);
+        ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    }
+    for (uint32_t i = 0; i < adders.size(); ++i) {
+        adders[i]->Join();
+        EXPECT_EQ(0, reinterpret_cast<intptr_t>(adders[i]->GetExitValue()));
+        delete adders[i];
+    }
+    for (uint32_t i = 0; (i < 500) && (alarmListener.numAlarms != numKept); ++i) {
+        qcc::Sleep(10);
+    }
+    EXPECT_EQ(numKept, alarmListener.numAlarms);
+    t8.GetStats(stats);
+    EXPECT_GE(50U, stats.peakAlarms);
+
+    status = t8.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t8.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+}
+
+TEST(TimerTest, TestStats) {
+    MyAlarmListener alarmListener(20);
+    AlarmListener* al = &alarmListener;
+    Timer t7("testTimer", false, 1, false, 2);
+    t7.SetListenerStats(true);
+    QStatus status = t7.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    Timespec ts;
+    GetTimeNow(&ts);
+    uint32_t timeout = 50;
+    Alarm a1(timeout, al);
+    Alarm a2(timeout, al);
+    Alarm a3(timeout, al);
+    ASSERT_EQ(ER_OK, t7.AddAlarm(a1));
+    ASSERT_EQ(ER_OK, t7.AddAlarm(a2));
+    ASSERT_EQ(ER_TIMER_FULL, t7.AddAlarmNonBlocking(a3));
+
+    /* The single timer thread runs the second alarm after the first one's callback */
+    ASSERT_TRUE(testNextAlarm(ts + timeout, 0));
+    ASSERT_TRUE(testNextAlarm(ts + timeout, 0));
+    qcc::Sleep(50);
+
+    TimerStats stats;
+    t7.GetStats(stats);
+    EXPECT_EQ(2U, stats.alarmsTriggered);
+    EXPECT_EQ(0U, stats.currentAlarms);
+    EXPECT_EQ(2U, stats.peakAlarms);
+    EXPECT_EQ(1U, stats.maxAlarmsRejected);
+    EXPECT_EQ(0U, stats.maxAlarmsBlocked);
+    uint64_t histogramAlarms = 0;
+    for (size_t i = 0; i < TimerStats::LATENESS_BUCKETS; ++i) {
+        histogramAlarms += stats.lateness[i];
+    }
+    EXPECT_EQ(2U, histogramAlarms);
+    EXPECT_LE(15U, stats.maxLatenessMs);
+    EXPECT_LE(38U, stats.callbackMs);
+    EXPECT_LT(0U, stats.idleMs);
+    ASSERT_EQ(1U, stats.listeners.size());
+    EXPECT_EQ(2U, stats.listeners[al].alarms);
+    EXPECT_LE(38U, stats.listeners[al].totalMs);
+    EXPECT_LE(19U, stats.listeners[al].maxMs);
+
+    t7.RemoveAlarmsWithListener(alarmListener);
+    t7.GetStats(stats);
+    EXPECT_EQ(0U, stats.listeners.size());
+    t7.ResetStats();
+    t7.GetStats(stats);
+    EXPECT_EQ(0U, stats.alarmsTriggered);
+    EXPECT_EQ(0U, stats.maxAlarmsRejected);
+
+    /* Without listener statistics only the totals are collected */
+    t7.SetListenerStats(false);
+    MyAlarmListener quickListener(0);
+    AlarmListener* ql = &quickListener;
+    GetTimeNow(&ts);
+    Alarm a4(timeout, ql);
+    ASSERT_EQ(ER_OK, t7.AddAlarm(a4));
+    ASSERT_TRUE(testNextAlarm(ts + timeout, 0));
+    qcc::Sleep(10);
+    t7.GetStats(stats);
+    EXPECT_EQ(1U, stats.alarmsTriggered);
+    EXPECT_EQ(0U, stats.listeners.size());
+
+    status = t7.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t7.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+}
+
+class HighResolutionAlarmListener : public AlarmListener {
+  public:
+    HighResolutionAlarmListener() : AlarmListener() { }
+    void AlarmTriggered(const Alarm& alarm, QStatus reason)
+    {
+        uint64_t now = GetTimeNowNs();
+        triggeredAlarmsLock.Lock();
+        indices.push_back(reinterpret_cast<uintptr_t>(alarm->GetContext()));
+        triggerTimes.push_back(now);
+        triggeredAlarmsLock.Unlock();
+    }
+    std::vector<uintptr_t> indices;
+    std::vector<uint64_t> triggerTimes;
+};
+
+TEST(TimerTest, TestHighResolution) {
+    Timespec ts(1999);
+    ts.AddNanos(1500000);
+    ASSERT_EQ(2U, ts.seconds);
+    ASSERT_EQ(0U, ts.mseconds);
+    ASSERT_EQ(500000U, ts.nseconds);
+    ASSERT_EQ(2000500000ULL, ts.GetAbsoluteNanos());
+    ASSERT_TRUE(Timespec(2000) < ts);
+    ASSERT_TRUE(ts < Timespec(2001));
+    ASSERT_EQ(0, ts - Timespec(2000));
+
+    HighResolutionAlarmListener listener;
+    AlarmListener* al = &listener;
+    Timer t8("testTimer", false, 1, false, 0, true);
+    QStatus status = t8.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* Several alarms within each millisecond, added out of order */
+    const uint32_t numAlarms = 40;
+    Timespec base;
+    GetTimeNow(&base);
+    base += 20;
+    std::vector<uint64_t> deadlines;
+    for (uint32_t i = 0; i < numAlarms; ++i) {
+        Timespec when = base;
+        when.AddNanos(static_cast<uint64_t>((i * 7) % numAlarms) * 250000);
+        deadlines.push_back(when.GetAbsoluteNanos());
+        void* context = reinterpret_cast<void*>(static_cast<uintptr_t>(i));
+        Alarm alarm(when, al, context);
+        status = t8.AddAlarm(alarm);
+        ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    }
+    qcc::Sleep(100);
+
+    triggeredAlarmsLock.Lock();
+    ASSERT_EQ(numAlarms, listener.indices.size());
+    for (uint32_t i = 0; i < numAlarms; ++i) {
+        /* Never early and in time order even within a millisecond */
+        EXPECT_LE(deadlines[listener.indices[i]], listener.triggerTimes[i]);
+        if (i > 0) {
+            EXPECT_LT(deadlines[listener.indices[i - 1]], deadlines[listener.indices[i]]);
+        }
+    }
+    triggeredAlarmsLock.Unlock();
+
+    status = t8.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t8.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+}
+
+TEST(TimerTest, TestRearm) {
+    MyAlarmListener alarmListener(0);
+    AlarmListener* al = &alarmListener;
+    Timer t9("testTimer");
+    QStatus status = t9.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* Pull a pending alarm in and push it back out, it stays the one alarm in the timer */
+    uint32_t timeout = 100000;
+    Alarm alarm(timeout, al);
+    ASSERT_EQ(ER_OK, t9.AddAlarm(alarm));
+    for (uint32_t i = 0; i < 1000; ++i) {
+        ASSERT_EQ(ER_OK, t9.Rearm(alarm, timeout - i));
+    }
+    ASSERT_TRUE(t9.HasAlarm(alarm));
+    TimerStats stats;
+    t9.GetStats(stats);
+    EXPECT_EQ(1U, stats.currentAlarms);
+
+    Timespec ts;
+    GetTimeNow(&ts);
+    timeout = 50;
+    ASSERT_EQ(ER_OK, t9.Rearm(alarm, timeout));
+    ASSERT_TRUE(testNextAlarm(ts + timeout, 0));
+    ASSERT_FALSE(t9.HasAlarm(alarm));
+
+    /* An alarm that has triggered is added again */
+    GetTimeNow(&ts);
+    ASSERT_EQ(ER_OK, t9.Rearm(alarm, ts + timeout));
+    ASSERT_TRUE(t9.HasAlarm(alarm));
+    ASSERT_TRUE(testNextAlarm(ts + timeout, 0));
+
+    status = t9.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t9.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    ASSERT_EQ(ER_TIMER_EXITING, t9.Rearm(alarm, timeout));
+}
+
+TEST(TimerTest, TestAlarmOnTwoTimers) {
+    MyAlarmListener alarmListener(0);
+    AlarmListener* al = &alarmListener;
+    Timer first("testTimer");
+    Timer second("testTimer", false, 1, false, 10);
+    ASSERT_EQ(ER_OK, first.Start());
+    ASSERT_EQ(ER_OK, second.Start());
+
+    /* An alarm pending on one timer is refused by another rather than silently dropped */
+    uint32_t timeout = 100000;
+    Alarm alarm(timeout, al);
+    ASSERT_EQ(ER_OK, first.AddAlarm(alarm));
+    ASSERT_TRUE(first.HasAlarm(alarm));
+    EXPECT_EQ(ER_INVALID_DATA, second.AddAlarm(alarm));
+    EXPECT_EQ(ER_INVALID_DATA, second.AddAlarmNonBlocking(alarm));
+    EXPECT_EQ(ER_INVALID_DATA, second.Rearm(alarm, timeout));
+    EXPECT_FALSE(second.HasAlarm(alarm));
+    EXPECT_TRUE(first.HasAlarm(alarm));
+
+    /* Once removed from the first timer it can be added to the second */
+    ASSERT_TRUE(first.RemoveAlarm(alarm));
+    EXPECT_EQ(ER_OK, second.AddAlarm(alarm));
+    EXPECT_TRUE(second.HasAlarm(alarm));
+    EXPECT_EQ(ER_INVALID_DATA, first.AddAlarm(alarm));
+
+    first.Stop();
+    second.Stop();
+    first.Join();
+    second.Join();
+}
+
+class SerializedAlarmListener : public AlarmListener {
+  public:
+    SerializedAlarmListener(volatile int32_t& timerActive, volatile int32_t& maxTimerActive) :
+        AlarmListener(), numAlarms(0), active(0), maxActive(0), timerActive(timerActive), maxTimerActive(maxTimerActive) { }
+    void AlarmTriggered(const Alarm& alarm, QStatus reason)
+    {
+        if (reason != ER_OK) {
+            return;
+        }
+        int32_t nowActive = IncrementAndFetch(&active);
+        int32_t nowTimerActive = IncrementAndFetch(&timerActive);
+        triggeredAlarmsLock.Lock();
+        if (nowActive > maxActive) {
+            maxActive = nowActive;
+        }
+        if (nowTimerActive > maxTimerActive) {
+            maxTimerActive = nowTimerActive;
+        }
+        triggeredAlarmsLock.Unlock();
+        qcc::Sleep(20);
+        DecrementAndFetch(&timerActive);
+        DecrementAndFetch(&active);
+        IncrementAndFetch(&numAlarms);
+    }
+    volatile int32_t numAlarms;
+    volatile int32_t active;
+    volatile int32_t maxActive;
+    volatile int32_t& timerActive;
+    volatile int32_t& maxTimerActive;
+};
+
+TEST(TimerTest, TestListenerReentrancy) {
+    volatile int32_t timerActive = 0;
+    volatile int32_t maxTimerActive = 0;
+    SerializedAlarmListener listener1(timerActive, maxTimerActive);
+    SerializedAlarmListener listener2(timerActive, maxTimerActive);
+    AlarmListener* al1 = &listener1;
+    AlarmListener* al2 = &listener2;
+    Timer t10("testTimer", false, 4, true, 0, false, REENTRANCY_LISTENER);
+    QStatus status = t10.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* All alarms are due together, the callbacks of each listener run one at a time */
+    Timespec ts;
+    GetTimeNow(&ts);
+    ts += 10;
+    for (uint32_t i = 0; i < 8; ++i) {
+        Alarm alarm1(ts, al1);
+        ASSERT_EQ(ER_OK, t10.AddAlarm(alarm1));
+        Alarm alarm2(ts, al2);
+        ASSERT_EQ(ER_OK, t10.AddAlarm(alarm2));
+    }
+    for (uint32_t i = 0; (i < 500) && ((listener1.numAlarms + listener2.numAlarms) < 16); ++i) {
+        qcc::Sleep(10);
+    }
+    EXPECT_EQ(8, listener1.numAlarms);
+    EXPECT_EQ(8, listener2.numAlarms);
+    EXPECT_EQ(1, listener1.maxActive);
+    EXPECT_EQ(1, listener2.maxActive);
+    /* The two listeners did not hold each other up */
+    EXPECT_EQ(2, maxTimerActive);
+
+    status = t10.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t10.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+}
+
+TEST(TimerTest, TestWarmWorkers) {
+    volatile int32_t active = 0;
+    volatile int32_t maxActive = 0;
+    SerializedAlarmListener listener(active, maxActive);
+    AlarmListener* al = &listener;
+    Timer t11("testTimer", false, 4);
+    t11.SetMinWorkers(2);
+    QStatus status = t11.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* Bursts further apart than the worker idle time are run by the same warm workers */
+    for (uint32_t i = 0; i < 5; ++i) {
+        Timespec ts;
+        GetTimeNow(&ts);
+        ts += 5;
+        Alarm alarm1(ts, al);
+        ASSERT_EQ(ER_OK, t11.AddAlarm(alarm1));
+        Alarm alarm2(ts, al);
+        ASSERT_EQ(ER_OK, t11.AddAlarm(alarm2));
+        qcc::Sleep(100);
+    }
+    for (uint32_t i = 0; (i < 500) && (listener.numAlarms < 10); ++i) {
+        qcc::Sleep(10);
+    }
+    EXPECT_EQ(10, listener.numAlarms);
+    TimerStats stats;
+    t11.GetStats(stats);
+    EXPECT_EQ(2U, stats.threadStarts);
+    EXPECT_EQ(0U, stats.threadStops);
+    EXPECT_LE(500U, stats.elapsedMs);
+
+    status = t11.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t11.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* With the start rate capped alarms are run by the threads already there */
+    SerializedAlarmListener listener2(active, maxActive);
+    al = &listener2;
+    Timer t12("testTimer", false, 4);
+    t12.SetMaxThreadStartRate(1);
+    status = t12.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    Timespec ts;
+    GetTimeNow(&ts);
+    ts += 5;
+    for (uint32_t i = 0; i < 4; ++i) {
+        Alarm alarm(ts, al);
+        ASSERT_EQ(ER_OK, t12.AddAlarm(alarm));
+    }
+    for (uint32_t i = 0; (i < 500) && (listener2.numAlarms < 4); ++i) {
+        qcc::Sleep(10);
+    }
+    EXPECT_EQ(4, listener2.numAlarms);
+    t12.GetStats(stats);
+    EXPECT_EQ(1U, stats.peakThreadStartsPerSecond);
+    EXPECT_LE(1U, stats.threadStartsThrottled);
+
+    status = t12.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t12.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+}
+
+class VirtualTimeAlarmListener : public AlarmListener {
+  public:
+    VirtualTimeAlarmListener(Timer& timer) : AlarmListener(), timer(timer), numAlarms(0), outOfOrder(0), offTime(0), lastTime(0) { }
+    void AlarmTriggered(const Alarm& alarm, QStatus reason)
+    {
+        if (reason != ER_OK) {
+            return;
+        }
+        Timespec now;
+        timer.GetClockTime(&now);
+        if (now.GetAbsoluteMillis() != alarm->GetAlarmTime()) {
+            ++offTime;
+        }
+        if (alarm->GetAlarmTime() < lastTime) {
+            ++outOfOrder;
+        }
+        lastTime = alarm->GetAlarmTime();
+        ++numAlarms;
+    }
+    Timer& timer;
+    uint32_t numAlarms;
+    uint32_t outOfOrder;
+    uint32_t offTime;
+    uint64_t lastTime;
+};
+
+TEST(TimerTest, TestVirtualClock) {
+    VirtualClock clock;
+    Timer t13("testTimer", clock);
+    VirtualTimeAlarmListener listener(t13);
+    AlarmListener* al = &listener;
+    CountingAlarmListener periodicListener;
+    AlarmListener* pal = &periodicListener;
+    QStatus status = t13.Start();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+
+    /* An hour of alarms in random order and a periodic alarm go off without any waiting */
+    Timespec start;
+    t13.GetClockTime(&start);
+    const uint32_t hour = 3600 * 1000;
+    for (uint32_t i = 0; i < 10000; ++i) {
+        Timespec when = start + static_cast<uint32_t>((static_cast<uint64_t>(i) * 7919) % hour);
+        Alarm alarm(when, al);
+        ASSERT_EQ(ER_OK, t13.AddAlarm(alarm));
+    }
+    Timespec first = start + 60000;
+    void* context = NULL;
+    uint32_t period = 60000;
+    Alarm periodic(first, pal, context, period);
+    ASSERT_EQ(ER_OK, t13.AddAlarm(periodic));
+
+    uint64_t realStart = GetTimestamp64();
+    ASSERT_EQ(ER_OK, t13.Advance(hour));
+    EXPECT_GT(static_cast<uint64_t>(10000), GetTimestamp64() - realStart);
+    EXPECT_EQ(10000U, listener.numAlarms);
+    EXPECT_EQ(0U, listener.outOfOrder);
+    EXPECT_EQ(0U, listener.offTime);
+    EXPECT_EQ(60, periodicListener.numAlarms);
+    Timespec now;
+    t13.GetClockTime(&now);
+    EXPECT_EQ(start.GetAbsoluteMillis() + hour, now.GetAbsoluteMillis());
+
+    /* Rearm is relative to the virtual clock */
+    ASSERT_EQ(ER_OK, t13.Rearm(periodic, 10));
+    ASSERT_EQ(ER_OK, t13.Advance(9));
+    EXPECT_EQ(60, periodicListener.numAlarms);
+    ASSERT_EQ(ER_OK, t13.Advance(1));
+    EXPECT_EQ(61, periodicListener.numAlarms);
+
+    status = t13.Stop();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    status = t13.Join();
+    ASSERT_EQ(ER_OK, status) << "Status: " << QCC_StatusText(status);
+    EXPECT_EQ(ER_TIMER_EXITING, t13.Advance(1));
+
+    Timer t14("testTimer");
+    EXPECT_EQ(ER_FAIL, t14.Advance(1));
+}